@@ -10,6 +10,7 @@
  */
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <cheri/cherireg.h>
@@ -51,6 +52,11 @@ typedef union aarch64_thunk_reloc_data thunk_reloc_data_t;
 #define THUNK_REL_INITIALIZER(rtype, rpos)  \
         { .type = (THUNK_REL_##rtype), .addr = (rpos) }
 
+/**
+ * L1 cache line size used for thunk object layout (Neoverse N1).
+ */
+#define THUNK_CACHE_LINE_SIZE 64
+
 /**
  * Internal helper to wrap thunk a capability into a thunk_object_t.
  *
@@ -62,6 +68,37 @@ thunk_arch_seal_object(uintptr_t obj_ptr)
         return ((void *)cheri_sentry_create(obj_ptr | 1));
 }
 
+/**
+ * Internal helper to seal shared thunk code with a runtime otype.
+ *
+ * As for thunk_arch_seal_object(), the branch must enable cap-mode.
+ */
+static inline void *
+thunk_arch_seal_code(uintptr_t code_ptr, void *sealcap)
+{
+        return (cheri_seal((void *)(code_ptr | 1), sealcap));
+}
+
+/**
+ * Internal helper to recover the object address from a sealed thunk object.
+ *
+ * This strips the cap-mode bit set by thunk_arch_seal_object().
+ */
+static inline ptraddr_t
+thunk_arch_object_addr(void *obj)
+{
+        return (cheri_address_get(obj) & ~(ptraddr_t)1);
+}
+
+/**
+ * Internal helper to check that a thunk object is sealed.
+ */
+static inline bool
+thunk_arch_object_sealed(void *obj)
+{
+        return (cheri_is_sealed(obj));
+}
+
 #ifdef THUNK_AUTH_MODE_PERMS
 /**
  * Software-defined permission bit that identifies trusted thunks.
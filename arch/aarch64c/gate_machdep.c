@@ -25,12 +25,106 @@ THUNK_DECL_PATCH_POINT(gate, token_base_48);
 #endif
 THUNK_DECL_PATCH_POINT(gate, data_offset);
 
+THUNK_DECL_TEMPLATE(gate_split);
+THUNK_DECL_PATCH_POINT(gate_split, token_base_0);
+THUNK_DECL_PATCH_POINT(gate_split, token_base_16);
+THUNK_DECL_PATCH_POINT(gate_split, token_base_32);
+#ifdef THUNK_LARGE_TOKEN_SPACE
+THUNK_DECL_PATCH_POINT(gate_split, token_base_48);
+#endif
+THUNK_DECL_PATCH_POINT(gate_split, data_offset);
+THUNK_DECL_PATCH_POINT(gate_split, data_size_0);
+THUNK_DECL_PATCH_POINT(gate_split, data_size_16);
+
+THUNK_DECL_TEMPLATE(gate_instr);
+THUNK_DECL_PATCH_POINT(gate_instr, token_base_0);
+THUNK_DECL_PATCH_POINT(gate_instr, token_base_16);
+THUNK_DECL_PATCH_POINT(gate_instr, token_base_32);
+#ifdef THUNK_LARGE_TOKEN_SPACE
+THUNK_DECL_PATCH_POINT(gate_instr, token_base_48);
+#endif
+THUNK_DECL_PATCH_POINT(gate_instr, data_offset);
+THUNK_DECL_PATCH_POINT(gate_instr, stats_offset);
+THUNK_DECL_PATCH_POINT(gate_instr, hist_shift);
+
+THUNK_DECL_TEMPLATE(gate_gen);
+THUNK_DECL_PATCH_POINT(gate_gen, token_base_0);
+THUNK_DECL_PATCH_POINT(gate_gen, token_base_16);
+THUNK_DECL_PATCH_POINT(gate_gen, token_base_32);
+#ifdef THUNK_LARGE_TOKEN_SPACE
+THUNK_DECL_PATCH_POINT(gate_gen, token_base_48);
+#endif
+THUNK_DECL_PATCH_POINT(gate_gen, data_offset);
+THUNK_DECL_PATCH_POINT(gate_gen, gen_shift);
+THUNK_DECL_PATCH_POINT(gate_gen, gen_offset);
+THUNK_DECL_PATCH_POINT(gate_gen, data_size_0);
+THUNK_DECL_PATCH_POINT(gate_gen, data_size_16);
+
+THUNK_DECL_TEMPLATE(gate_replica);
+THUNK_DECL_PATCH_POINT(gate_replica, token_base_0);
+THUNK_DECL_PATCH_POINT(gate_replica, token_base_16);
+THUNK_DECL_PATCH_POINT(gate_replica, token_base_32);
+#ifdef THUNK_LARGE_TOKEN_SPACE
+THUNK_DECL_PATCH_POINT(gate_replica, token_base_48);
+#endif
+THUNK_DECL_PATCH_POINT(gate_replica, data_offset);
+THUNK_DECL_PATCH_POINT(gate_replica, replica_shift);
+
+THUNK_DECL_TEMPLATE(gate_pair);
+THUNK_DECL_PATCH_POINT(gate_pair, token_base_0);
+THUNK_DECL_PATCH_POINT(gate_pair, token_base_16);
+THUNK_DECL_PATCH_POINT(gate_pair, token_base_32);
+#ifdef THUNK_LARGE_TOKEN_SPACE
+THUNK_DECL_PATCH_POINT(gate_pair, token_base_48);
+#endif
+
 #ifdef THUNK_LARGE_TOKEN_SPACE
 #define THUNK_GATE_NRELOCS 5
 #else
 #define THUNK_GATE_NRELOCS 4
 #endif
 
+/*
+ * The split gate shares the relocation layout of the gate,
+ * with the data size relocations appended.
+ */
+#define THUNK_GATE_RELOC_DATA_SIZE THUNK_GATE_NRELOCS
+#define THUNK_GATE_SPLIT_NRELOCS (THUNK_GATE_NRELOCS + 2)
+
+/*
+ * The instrumented gate shares the relocation layout of the gate,
+ * with the stats relocations appended.
+ */
+#define THUNK_GATE_RELOC_STATS THUNK_GATE_NRELOCS
+#define THUNK_GATE_RELOC_HIST_SHIFT (THUNK_GATE_NRELOCS + 1)
+#define THUNK_GATE_INSTR_NRELOCS (THUNK_GATE_NRELOCS + 2)
+
+/*
+ * The generation gate also shares the relocation layout of the gate,
+ * with the generation and data size relocations appended.
+ */
+#define THUNK_GATE_RELOC_GEN_SHIFT THUNK_GATE_NRELOCS
+#define THUNK_GATE_RELOC_GEN_OFFSET (THUNK_GATE_NRELOCS + 1)
+#define THUNK_GATE_RELOC_GEN_DATA_SIZE (THUNK_GATE_NRELOCS + 2)
+#define THUNK_GATE_GEN_NRELOCS (THUNK_GATE_NRELOCS + 4)
+
+/*
+ * The replicated gate also shares the relocation layout of the gate,
+ * with the replica shift appended.
+ */
+#define THUNK_GATE_RELOC_REPLICA_SHIFT THUNK_GATE_NRELOCS
+#define THUNK_GATE_REPLICA_NRELOCS (THUNK_GATE_NRELOCS + 1)
+
+/* Must match GATE_REPLICAS_SHIFT in gate_thunk.S */
+static_assert(THUNK_GATE_REPLICAS == 16,
+    "Gate replicas out of sync with the gate_replica template");
+
+/* Must match GATE_STATS_BUCKETS in gate_thunk.S */
+static_assert(THUNK_GATE_STATS_BUCKETS == 16,
+    "Gate stats buckets out of sync with the gate_instr template");
+static_assert(offsetof(struct thunk_gate_stats, histogram) ==
+    sizeof(uint64_t), "Unexpected gate stats layout");
+
 /**
  * Thunk gate metaclass, uses C-style structure inheritance.
  */
@@ -67,6 +161,212 @@ static struct thunk_gate_metaclass thunk_gate_meta_storage = {
 
 struct thunk_gate_metaclass *thunk_gate_meta = &thunk_gate_meta_storage;
 
+/**
+ * Split thunk gate metaclass.
+ */
+struct thunk_gate_split_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_SPLIT_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_split_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid split gate metaclass relocs offset");
+
+/**
+ * Static descriptor for the split thunk gate metaclass.
+ */
+static struct thunk_gate_split_metaclass thunk_gate_split_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_split),
+        .template_end = THUNK_TEMPLATE_END(gate_split),
+        .relocs_count = THUNK_GATE_SPLIT_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_split, token_base_0)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_split, token_base_16)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_split, token_base_32)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_split, data_offset)),
+#ifdef THUNK_LARGE_TOKEN_SPACE
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_split, token_base_48)),
+#endif
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_split, data_size_0)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_split, data_size_16)),
+        },
+};
+
+struct thunk_gate_split_metaclass *thunk_gate_split_meta =
+    &thunk_gate_split_meta_storage;
+
+/**
+ * Instrumented thunk gate metaclass.
+ */
+struct thunk_gate_instr_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_INSTR_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_instr_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid instrumented gate metaclass relocs offset");
+
+/**
+ * Static descriptor for the instrumented thunk gate metaclass.
+ */
+static struct thunk_gate_instr_metaclass thunk_gate_instr_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_instr),
+        .template_end = THUNK_TEMPLATE_END(gate_instr),
+        .relocs_count = THUNK_GATE_INSTR_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_instr, token_base_0)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_instr, token_base_16)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_instr, token_base_32)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_instr, data_offset)),
+#ifdef THUNK_LARGE_TOKEN_SPACE
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_instr, token_base_48)),
+#endif
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_instr, stats_offset)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_instr, hist_shift)),
+        },
+};
+
+struct thunk_gate_instr_metaclass *thunk_gate_instr_meta =
+    &thunk_gate_instr_meta_storage;
+
+/**
+ * Thunk gate with generations metaclass.
+ */
+struct thunk_gate_gen_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_GEN_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_gen_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid generation gate metaclass relocs offset");
+
+/**
+ * Static descriptor for the thunk gate with generations metaclass.
+ */
+static struct thunk_gate_gen_metaclass thunk_gate_gen_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_gen),
+        .template_end = THUNK_TEMPLATE_END(gate_gen),
+        .relocs_count = THUNK_GATE_GEN_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_gen, token_base_0)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_gen, token_base_16)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_gen, token_base_32)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_gen, data_offset)),
+#ifdef THUNK_LARGE_TOKEN_SPACE
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_gen, token_base_48)),
+#endif
+                THUNK_REL_INITIALIZER(MOV_IMM, THUNK_PP(gate_gen, gen_shift)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_gen, gen_offset)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_gen, data_size_0)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_gen, data_size_16)),
+        },
+};
+
+struct thunk_gate_gen_metaclass *thunk_gate_gen_meta =
+    &thunk_gate_gen_meta_storage;
+
+/**
+ * Replicated thunk gate metaclass.
+ */
+struct thunk_gate_replica_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_REPLICA_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_replica_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid replicated gate metaclass relocs offset");
+
+/**
+ * Static descriptor for the replicated thunk gate metaclass.
+ */
+static struct thunk_gate_replica_metaclass thunk_gate_replica_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_replica),
+        .template_end = THUNK_TEMPLATE_END(gate_replica),
+        .relocs_count = THUNK_GATE_REPLICA_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_replica, token_base_0)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_replica, token_base_16)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_replica, token_base_32)),
+                THUNK_REL_INITIALIZER(ADR,
+                    THUNK_PP(gate_replica, data_offset)),
+#ifdef THUNK_LARGE_TOKEN_SPACE
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_replica, token_base_48)),
+#endif
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_replica, replica_shift)),
+        },
+};
+
+struct thunk_gate_replica_metaclass *thunk_gate_replica_meta =
+    &thunk_gate_replica_meta_storage;
+
+/*
+ * The shared code gate only has the token space relocations,
+ * in the gate order.
+ */
+#define THUNK_GATE_PAIR_NRELOCS (THUNK_GATE_NRELOCS - 1)
+
+/**
+ * Shared code thunk gate metaclass.
+ */
+struct thunk_gate_pair_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_PAIR_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_pair_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid shared code gate metaclass relocs offset");
+
+/**
+ * Static descriptor for the shared code thunk gate metaclass.
+ */
+static struct thunk_gate_pair_metaclass thunk_gate_pair_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_pair),
+        .template_end = THUNK_TEMPLATE_END(gate_pair),
+        .relocs_count = THUNK_GATE_PAIR_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_pair, token_base_0)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_pair, token_base_16)),
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_pair, token_base_32)),
+#ifdef THUNK_LARGE_TOKEN_SPACE
+                THUNK_REL_INITIALIZER(MOV_IMM,
+                    THUNK_PP(gate_pair, token_base_48)),
+#endif
+        },
+};
+
+struct thunk_gate_pair_metaclass *thunk_gate_pair_meta =
+    &thunk_gate_pair_meta_storage;
+
 void
 thunk_arch_gate_reloc_token_space(struct thunk_class *gate,
     thunk_token_t token_space)
@@ -88,3 +388,68 @@ thunk_arch_gate_reloc_data_offset(struct thunk_class *gate, size_t offset)
 {
         gate->reloc_data[3].u32 = offset;
 }
+
+void
+thunk_arch_gate_reloc_data_size(struct thunk_class *gate, size_t size)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_split_meta &&
+            "Data size relocations on non-split gate");
+        assert(size <= UINT32_MAX && "Split gate data too large");
+
+        gate->reloc_data[THUNK_GATE_RELOC_DATA_SIZE].u16 = size & 0xffff;
+        gate->reloc_data[THUNK_GATE_RELOC_DATA_SIZE + 1].u16 = size >> 16;
+}
+
+void
+thunk_arch_gate_reloc_stats(struct thunk_class *gate, ptraddr_t offset,
+    unsigned int hist_shift)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_instr_meta &&
+            "Stats relocations on non-instrumented gate");
+
+        gate->reloc_data[THUNK_GATE_RELOC_STATS].u32 = offset;
+        gate->reloc_data[THUNK_GATE_RELOC_HIST_SHIFT].u16 = hist_shift;
+}
+
+void
+thunk_arch_gate_reloc_generation(struct thunk_class *gate, ptraddr_t offset,
+    unsigned int gen_shift, size_t size)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_gen_meta &&
+            "Generation relocations on non-generation gate");
+        assert(size <= UINT32_MAX && "Generation gate data too large");
+
+        gate->reloc_data[THUNK_GATE_RELOC_GEN_SHIFT].u16 = gen_shift;
+        gate->reloc_data[THUNK_GATE_RELOC_GEN_OFFSET].u32 = offset;
+        gate->reloc_data[THUNK_GATE_RELOC_GEN_DATA_SIZE].u16 = size & 0xffff;
+        gate->reloc_data[THUNK_GATE_RELOC_GEN_DATA_SIZE + 1].u16 = size >> 16;
+}
+
+void
+thunk_arch_gate_reloc_replica(struct thunk_class *gate,
+    unsigned int replica_shift)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_replica_meta &&
+            "Replica relocations on non-replicated gate");
+
+        gate->reloc_data[THUNK_GATE_RELOC_REPLICA_SHIFT].u16 = replica_shift;
+}
+
+void
+thunk_arch_gate_reloc_pair(struct thunk_class *gate,
+    thunk_token_t token_space)
+{
+        ptraddr_t tk_space_base = (ptraddr_t)token_space;
+
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_pair_meta &&
+            "Pair relocations on non-shared code gate");
+
+        gate->reloc_data[0].u16 = tk_space_base & 0xffff;
+        gate->reloc_data[1].u16 = (tk_space_base >> 16) & 0xffff;
+        gate->reloc_data[2].u16 = (tk_space_base >> 32) & 0xffff;
+#ifdef THUNK_LARGE_TOKEN_SPACE
+        gate->reloc_data[3].u16 = tk_space_base >> 48;
+#else
+        assert((tk_space_base >> 48) == 0 && "Invalid token space base");
+#endif
+}
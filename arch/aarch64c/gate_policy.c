@@ -0,0 +1,333 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Gate template generator for access policies.
+ *
+ * The generated template is stitched together from the assembler
+ * fragments in gate_policy.S, so that we do not need to hand-encode
+ * the Morello instructions. Policy constants are materialised with
+ * movz/movn/movk sequences emitted here.
+ * The relocations follow the gate template conventions: token space
+ * base movz/movk followed by the data offset ADR.
+ */
+#include <cheriintrin.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <cheri/cherireg.h>
+
+#include "thunk-gate.h"
+#include "arch/thunk-patch.h"
+
+THUNK_DECL_TEMPLATE(gate_frag_check_tag);
+THUNK_DECL_TEMPLATE(gate_frag_token_offset);
+THUNK_DECL_TEMPLATE(gate_frag_token_len);
+THUNK_DECL_TEMPLATE(gate_frag_token_perms);
+THUNK_DECL_TEMPLATE(gate_frag_check_range);
+THUNK_DECL_TEMPLATE(gate_frag_token_end);
+THUNK_DECL_TEMPLATE(gate_frag_check_limit);
+THUNK_DECL_TEMPLATE(gate_frag_data);
+THUNK_DECL_TEMPLATE(gate_frag_select_range);
+THUNK_DECL_TEMPLATE(gate_frag_select_limit);
+THUNK_DECL_TEMPLATE(gate_frag_add_offset);
+THUNK_DECL_TEMPLATE(gate_frag_bounds);
+THUNK_DECL_TEMPLATE(gate_frag_mask_perms);
+THUNK_DECL_TEMPLATE(gate_frag_clear_perms);
+THUNK_DECL_TEMPLATE(gate_frag_clear_perms_fixed);
+THUNK_DECL_TEMPLATE(gate_frag_ret);
+
+/* Fragment register assignments, see gate_policy.S */
+#define REG_TOKEN_BASE 10
+#define REG_LENGTH 12
+#define REG_PERMS 13
+#define REG_MASK 14
+#define REG_SPACE_SIZE 15
+
+/* A64 wide immediate move encodings */
+#define A64_MOVN 0x92800000
+#define A64_MOVZ 0xd2800000
+#define A64_MOVK 0xf2800000
+#define A64_MOV_WIDE(op, reg, imm, hw)                          \
+        ((op) | ((uint32_t)(hw) << 21) |                        \
+         ((uint32_t)((imm) & 0xffff) << 5) | (reg))
+
+#define GATE_POLICY_STORE_PERMS                                 \
+        (CHERI_PERM_STORE | CHERI_PERM_STORE_CAP |              \
+         CHERI_PERM_STORE_LOCAL_CAP)
+#define GATE_POLICY_LOAD_PERMS                                  \
+        (CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP | CHERI_PERM_MUTABLE_LOAD)
+
+/* Token space base and data offset */
+#define GATE_EMIT_MAX_RELOCS 5
+
+/**
+ * Template emitter state.
+ *
+ * The emitter runs twice, first without a code buffer to size the
+ * template, then to fill the buffer.
+ */
+struct gate_emitter {
+        uint32_t *code;
+        size_t ninsns;
+        unsigned int nrelocs;
+        enum aarch64_thunk_reloc_type reloc_type[GATE_EMIT_MAX_RELOCS];
+        size_t reloc_insn[GATE_EMIT_MAX_RELOCS];
+};
+
+/**
+ * Generated gate metaclass.
+ */
+struct thunk_gate_policy_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[GATE_EMIT_MAX_RELOCS];
+        /* Template buffer allocation */
+        uint32_t *code;
+};
+
+static_assert(offsetof(struct thunk_gate_policy_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid policy gate metaclass relocs offset");
+
+static void
+emit_insn(struct gate_emitter *e, uint32_t insn)
+{
+        if (e->code != NULL)
+                e->code[e->ninsns] = insn;
+        e->ninsns++;
+}
+
+/**
+ * Mark the next instruction as a patch point.
+ */
+static void
+emit_reloc(struct gate_emitter *e, enum aarch64_thunk_reloc_type type)
+{
+        assert(e->nrelocs < GATE_EMIT_MAX_RELOCS && "Too many relocations");
+        e->reloc_type[e->nrelocs] = type;
+        e->reloc_insn[e->nrelocs] = e->ninsns;
+        e->nrelocs++;
+}
+
+static void
+emit_frag(struct gate_emitter *e, thunk_template_t start,
+    thunk_template_t end)
+{
+        thunk_template_t insn;
+
+        for (insn = start; insn < end; insn++)
+                emit_insn(e, *insn);
+}
+
+#define EMIT_FRAG(e, name)                                      \
+        emit_frag(e, THUNK_TEMPLATE(gate_frag_##name),          \
+            THUNK_TEMPLATE_END(gate_frag_##name))
+
+/**
+ * Materialise a 64-bit constant in a register with the shortest
+ * movz/movn + movk sequence.
+ */
+static void
+emit_mov_imm(struct gate_emitter *e, unsigned int reg, uint64_t value)
+{
+        unsigned int zero = 0, ones = 0;
+        uint16_t fill, chunk;
+        bool first = true;
+        int hw;
+
+        for (hw = 0; hw < 4; hw++) {
+                chunk = value >> (hw * 16);
+                zero += (chunk == 0);
+                ones += (chunk == 0xffff);
+        }
+        fill = (ones > zero) ? 0xffff : 0;
+
+        for (hw = 0; hw < 4; hw++) {
+                chunk = value >> (hw * 16);
+                if (chunk == fill)
+                        continue;
+                if (first && fill == 0)
+                        emit_insn(e, A64_MOV_WIDE(A64_MOVZ, reg, chunk, hw));
+                else if (first)
+                        emit_insn(e, A64_MOV_WIDE(A64_MOVN, reg, ~chunk, hw));
+                else
+                        emit_insn(e, A64_MOV_WIDE(A64_MOVK, reg, chunk, hw));
+                first = false;
+        }
+        /* All chunks are the fill value */
+        if (first) {
+                if (fill == 0)
+                        emit_insn(e, A64_MOV_WIDE(A64_MOVZ, reg, 0, 0));
+                else
+                        emit_insn(e, A64_MOV_WIDE(A64_MOVN, reg, 0, 0));
+        }
+}
+
+/**
+ * Emit the token space base movz/movk sequence, patched at class
+ * creation as in the gate template.
+ */
+static void
+emit_token_base(struct gate_emitter *e)
+{
+        emit_reloc(e, THUNK_REL_MOV_IMM);
+        emit_insn(e, A64_MOV_WIDE(A64_MOVZ, REG_TOKEN_BASE, 0, 0));
+        emit_reloc(e, THUNK_REL_MOV_IMM);
+        emit_insn(e, A64_MOV_WIDE(A64_MOVK, REG_TOKEN_BASE, 0, 1));
+        emit_reloc(e, THUNK_REL_MOV_IMM);
+        emit_insn(e, A64_MOV_WIDE(A64_MOVK, REG_TOKEN_BASE, 0, 2));
+#ifdef THUNK_LARGE_TOKEN_SPACE
+        emit_reloc(e, THUNK_REL_MOV_IMM);
+        emit_insn(e, A64_MOV_WIDE(A64_MOVK, REG_TOKEN_BASE, 0, 3));
+#endif
+}
+
+static void
+emit_gate(struct gate_emitter *e, const struct thunk_gate_policy *policy,
+    size_t size)
+{
+        bool check = policy->flags & THUNK_GATE_POLICY_CHECK_SPACE;
+        bool fixed_bounds = policy->flags & THUNK_GATE_POLICY_FIXED_BOUNDS;
+        bool fixed_perms = policy->flags & THUNK_GATE_POLICY_FIXED_PERMS;
+        uint64_t mask = policy->perms & THUNK_TOKEN_MAX_PERMS;
+
+        if (policy->flags & THUNK_GATE_POLICY_READ_ONLY)
+                mask &= ~(uint64_t)GATE_POLICY_STORE_PERMS;
+        if (policy->flags & THUNK_GATE_POLICY_WRITE_ONLY)
+                mask &= ~(uint64_t)GATE_POLICY_LOAD_PERMS;
+
+        if (check) {
+                EMIT_FRAG(e, check_tag);
+                emit_token_base(e);
+                EMIT_FRAG(e, token_offset);
+        }
+        if (!fixed_bounds)
+                EMIT_FRAG(e, token_len);
+        if (!fixed_perms)
+                EMIT_FRAG(e, token_perms);
+        /*
+         * With fixed bounds the token bounds never reach scbndse,
+         * check the token offset against the token space instead.
+         * Otherwise check that the token base and limit are in the
+         * token space, PCC would let them reach the object code.
+         */
+        if (check && fixed_bounds) {
+                emit_mov_imm(e, REG_SPACE_SIZE, size);
+                EMIT_FRAG(e, check_range);
+        } else if (check) {
+                emit_mov_imm(e, REG_SPACE_SIZE, size);
+                EMIT_FRAG(e, token_end);
+                EMIT_FRAG(e, check_limit);
+        }
+
+        /* The fixed bounds offset is folded in the ADR relocation */
+        emit_reloc(e, THUNK_REL_ADR);
+        EMIT_FRAG(e, data);
+        if (check && fixed_bounds)
+                EMIT_FRAG(e, select_range);
+        else if (check)
+                EMIT_FRAG(e, select_limit);
+
+        if (fixed_bounds)
+                emit_mov_imm(e, REG_LENGTH, policy->length);
+        else
+                EMIT_FRAG(e, add_offset);
+        EMIT_FRAG(e, bounds);
+
+        if (fixed_perms) {
+                emit_mov_imm(e, REG_PERMS, ~mask);
+                EMIT_FRAG(e, clear_perms_fixed);
+        } else {
+                /* Tokens never carry more than THUNK_TOKEN_MAX_PERMS */
+                if (mask != THUNK_TOKEN_MAX_PERMS) {
+                        emit_mov_imm(e, REG_MASK, mask);
+                        EMIT_FRAG(e, mask_perms);
+                }
+                EMIT_FRAG(e, clear_perms);
+        }
+        EMIT_FRAG(e, ret);
+}
+
+struct thunk_metaclass *
+thunk_arch_gate_policy_emit(const struct thunk_gate_policy *policy,
+    size_t size)
+{
+        struct thunk_gate_policy_metaclass *mc;
+        struct gate_emitter e = { 0 };
+        uint32_t *code;
+        size_t ninsns;
+        unsigned int i;
+
+        emit_gate(&e, policy, size);
+        ninsns = e.ninsns;
+
+        mc = thunk_level_malloc(sizeof(*mc), THUNK_LEVEL_PRIVATE);
+        if (mc == NULL)
+                return (NULL);
+        mc->code = thunk_level_malloc(ninsns * sizeof(uint32_t),
+            THUNK_LEVEL_PRIVATE);
+        if (mc->code == NULL) {
+                thunk_level_free(mc);
+                return (NULL);
+        }
+        /* thunk_code_size() expects exact template bounds */
+        code = cheri_bounds_set_exact(mc->code, ninsns * sizeof(uint32_t));
+
+        e = (struct gate_emitter){ .code = code };
+        emit_gate(&e, policy, size);
+        assert(e.ninsns == ninsns && "Unstable gate emitter output");
+
+        mc->template = cheri_perms_and(code, CHERI_PERM_GLOBAL |
+            CHERI_PERM_LOAD);
+        mc->template_end = mc->template + ninsns;
+        mc->entries = NULL;
+        mc->entries_count = 0;
+        mc->relocs_count = e.nrelocs;
+        for (i = 0; i < e.nrelocs; i++) {
+                mc->relocs[i].type = e.reloc_type[i];
+                mc->relocs[i].addr = (ptraddr_t)(code + e.reloc_insn[i]);
+        }
+
+        return ((struct thunk_metaclass *)mc);
+}
+
+void
+thunk_arch_gate_policy_free(struct thunk_metaclass *mc)
+{
+        struct thunk_gate_policy_metaclass *pmc =
+            (struct thunk_gate_policy_metaclass *)mc;
+
+        thunk_level_free(pmc->code);
+        thunk_level_free(pmc);
+}
+
+void
+thunk_arch_gate_reloc_policy(struct thunk_class *gate,
+    thunk_token_t token_space, ptraddr_t data_offset)
+{
+        ptraddr_t tk_space_base = (ptraddr_t)token_space;
+        unsigned int shift = 0;
+        unsigned int i;
+
+#ifndef THUNK_LARGE_TOKEN_SPACE
+        assert((tk_space_base >> 48) == 0 && "Invalid token space base");
+#endif
+        /* The token base relocations are emitted lowest chunk first */
+        for (i = 0; i < gate->mc->relocs_count; i++) {
+                if (gate->mc->relocs[i].type == THUNK_REL_ADR) {
+                        gate->reloc_data[i].u32 = data_offset;
+                } else {
+                        gate->reloc_data[i].u16 =
+                            (tk_space_base >> shift) & 0xffff;
+                        shift += 16;
+                }
+        }
+}
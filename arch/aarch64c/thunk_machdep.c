@@ -15,6 +15,26 @@
 #include <string.h>
 
 #include "thunk.h"
+#include "arch/thunk-patch.h"
+
+THUNK_DECL_TEMPLATE(lazy_stub);
+THUNK_DECL_PATCH_POINT(lazy_stub, entry);
+THUNK_DECL_PATCH_POINT(lazy_stub, retry);
+
+/* Unconditional branch, imm26 is the word offset from the branch */
+#define AARCH64_B 0x14000000
+#define AARCH64_B_IMM_MASK 0x3ffffff
+
+/**
+ * Literal slots at the start of the lazy stub, see thunk_lazy.S.
+ */
+struct lazy_stub_literals {
+        void (*trampoline)(void);
+        struct thunk_class *tc;
+};
+
+void thunk_lazy_trampoline(void);
+void *thunk_arch_lazy_enter(const struct lazy_stub_literals *lit);
 
 static inline thunk_jit_t
 patch_point(const struct thunk_metaclass *mc, thunk_jit_t code_buf, int index)
@@ -37,6 +57,14 @@ patch_point(const struct thunk_metaclass *mc, thunk_jit_t code_buf, int index)
 
 int
 thunk_compile(thunk_jit_t code_buf, const struct thunk_class *tc)
+{
+        return (thunk_compile_at(code_buf,
+            (ptraddr_t)code_buf + tc->data_offset, tc));
+}
+
+int
+thunk_compile_at(thunk_jit_t code_buf, ptraddr_t data_addr,
+    const struct thunk_class *tc)
 {
         const struct thunk_metaclass *mc = tc->mc;
         const size_t code_size = thunk_code_size(mc);
@@ -56,9 +84,17 @@ thunk_compile(thunk_jit_t code_buf, const struct thunk_class *tc)
                         break;
                 }
                 case THUNK_REL_ADR: {
-                        // XXX assert representable distance
-                        uint32_t value = (ptraddr_t)code_buf + (
-                            tc->reloc_data[index].u32 - (ptraddr_t)pp);
+                        /*
+                         * The relocation is an offset from the start of
+                         * the object, rebase it on the data location.
+                         */
+                        ptraddr_t target = data_addr +
+                            (tc->reloc_data[index].u32 - tc->data_offset);
+                        int64_t disp = target - (ptraddr_t)pp;
+                        uint32_t value = disp;
+
+                        assert(disp >= -(1 << 20) && disp < (1 << 20) &&
+                            "ADR relocation out of range");
                         value = ((value & 0x3) << 29) |
                             ((value & 0x1ffffc) << 3);
                         *pp |= value;
@@ -71,6 +107,123 @@ thunk_compile(thunk_jit_t code_buf, const struct thunk_class *tc)
                 }
                 index++;
         }
+        /* The code buffer may be recycled, e.g. from an arena */
+        __builtin___clear_cache((char *)code_buf,
+            (char *)code_buf + code_size);
 
         return (0);
 }
+
+static inline uint32_t
+branch_insn(ptraddr_t from, ptraddr_t to)
+{
+        int64_t disp = (int64_t)(to - from) / (int64_t)sizeof(uint32_t);
+
+        return (AARCH64_B | ((uint32_t)disp & AARCH64_B_IMM_MASK));
+}
+
+/**
+ * Offset of the lazy stub within the object, the stub literals
+ * must be capability-aligned.
+ */
+static inline size_t
+lazy_stub_offset(const struct thunk_metaclass *mc)
+{
+        return (cheri_align_up(thunk_code_size(mc),
+            sizeof(void *)));
+}
+
+size_t
+thunk_arch_lazy_code_size(const struct thunk_metaclass *mc)
+{
+        size_t stub_size = (uintptr_t)THUNK_TEMPLATE_END(lazy_stub) -
+            (uintptr_t)THUNK_TEMPLATE(lazy_stub);
+
+        return (lazy_stub_offset(mc) + stub_size);
+}
+
+void
+thunk_arch_lazy_install(struct thunk_class *tc, void *obj)
+{
+        const ptraddr_t template = (ptraddr_t)THUNK_TEMPLATE(lazy_stub);
+        const size_t stub_offset = lazy_stub_offset(tc->mc);
+        const size_t code_size = thunk_arch_lazy_code_size(tc->mc);
+        struct lazy_stub_literals *lit;
+        thunk_jit_t code = obj;
+        uint8_t *stub = (uint8_t *)obj + stub_offset;
+        size_t retry;
+
+        assert(cheri_length_get(obj) >= code_size &&
+            "Lazy object too small for the stub");
+        memcpy(stub, THUNK_TEMPLATE(lazy_stub), code_size - stub_offset);
+        lit = (struct lazy_stub_literals *)stub;
+        lit->trampoline = thunk_lazy_trampoline;
+        lit->tc = tc;
+
+        retry = stub_offset + (THUNK_PP(lazy_stub, retry) - template);
+        code[retry / sizeof(uint32_t)] |= branch_insn(retry, 0) &
+            AARCH64_B_IMM_MASK;
+        code[0] = branch_insn(0, stub_offset +
+            (THUNK_PP(lazy_stub, entry) - template));
+
+        /* The code buffer may be recycled, e.g. from an arena */
+        __builtin___clear_cache((char *)code, (char *)code + code_size);
+}
+
+/**
+ * Called by thunk_lazy_trampoline() with the stub literals, derived
+ * from the object PCC. Returns the object entry.
+ */
+void *
+thunk_arch_lazy_enter(const struct lazy_stub_literals *lit)
+{
+        struct thunk_class *tc;
+
+        /* Another thread may have published the code meanwhile */
+        tc = __atomic_load_n(&lit->tc, __ATOMIC_ACQUIRE);
+        if (tc != NULL)
+                thunk_lazy_resolve(tc, cheri_base_get(lit));
+
+        return ((void *)cheri_address_set(lit, cheri_base_get(lit)));
+}
+
+bool
+thunk_arch_lazy_pending(const struct thunk_class *tc, const void *obj)
+{
+        const ptraddr_t template = (ptraddr_t)THUNK_TEMPLATE(lazy_stub);
+        const uint32_t *code = obj;
+
+        return (__atomic_load_n(&code[0], __ATOMIC_ACQUIRE) ==
+            branch_insn(0, lazy_stub_offset(tc->mc) +
+            (THUNK_PP(lazy_stub, entry) - template)));
+}
+
+void
+thunk_arch_lazy_commit(const struct thunk_class *tc, void *obj,
+    thunk_template_t compiled)
+{
+        const size_t code_size = thunk_code_size(tc->mc);
+        struct lazy_stub_literals *lit;
+        thunk_jit_t code = obj;
+
+        /*
+         * Other threads may be branching through the first instruction
+         * concurrently, publish the rest of the code before replacing
+         * the branch to the stub.
+         * XXX-AM: The architecture only guarantees atomic concurrent
+         * modification between branches and a few other instructions,
+         * a thread may still fetch the branch and go through the stub
+         * once more, the cleared literals send it to the object entry.
+         */
+        memcpy(code + 1, compiled + 1, code_size - sizeof(uint32_t));
+        __builtin___clear_cache((char *)(code + 1),
+            (char *)code + code_size);
+        __atomic_store_n(&code[0], compiled[0], __ATOMIC_RELEASE);
+        __builtin___clear_cache((char *)code, (char *)(code + 1));
+
+        /* Do not leave runtime capabilities in the object */
+        lit = (struct lazy_stub_literals *)((uint8_t *)obj +
+            lazy_stub_offset(tc->mc));
+        __atomic_store_n(&lit->trampoline, NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&lit->tc, NULL, __ATOMIC_RELEASE);
+}
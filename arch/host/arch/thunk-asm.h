@@ -0,0 +1,76 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+#include "arch/thunk-patch.h"
+
+/* Templates are never run in place, see THUNK() */
+        .section .note.GNU-stack, "", %progbits
+
+/*
+ * Host templates are copied into thunk objects and never run in place,
+ * they live with the relocated data because the entry stubs embed the
+ * absolute address of their handler.
+ */
+#define	THUNK(tname)                                        \
+        .section .data.rel.ro;                              \
+        .p2align 4;                                         \
+        .globl _THUNK_SYM(tname);                           \
+        .type _THUNK_SYM(tname),%object; _THUNK_SYM(tname):
+
+#define	ENDTHUNK(tname)                                  \
+        .global _THUNK_END_SYM(tname);                   \
+        .type _THUNK_END_SYM(tname),%object;             \
+        .size _THUNK_END_SYM(tname), 1;                  \
+        _THUNK_END_SYM(tname):                           \
+        .size _THUNK_SYM(tname), . - _THUNK_SYM(tname)
+
+#define	THUNK_PP_LABEL(tname, label)                     \
+        .globl _THUNK_PATCH(tname, label);               \
+        .type _THUNK_PATCH(tname, label),%object;        \
+        .size _THUNK_PATCH(tname, label), 8;             \
+        _THUNK_PATCH(tname, label):
+
+/*
+ * Entry stub, see struct thunk_host_stub.
+ * Tail call the handler with the stub address in the second argument
+ * register.
+ */
+#if defined(__x86_64__)
+#define	THUNK_HOST_ENTRY(handler)                        \
+        1: leaq 1b(%rip), %rsi;                          \
+        jmp *2f(%rip);                                   \
+        .p2align 3, 0xcc;                                \
+        2: .quad handler
+#elif defined(__aarch64__)
+#define	THUNK_HOST_ENTRY(handler)                        \
+        1: adr x1, 1b;                                   \
+        ldr x16, 2f;                                     \
+        br x16;                                          \
+        .p2align 3;                                      \
+        2: .quad handler
+#else
+#error "Unsupported host architecture"
+#endif
+
+/* Patched literal slot */
+#define	THUNK_HOST_LITERAL .quad 0
+
+/*
+ * Entry that returns the data at the patched ADR literal that follows,
+ * see struct thunk_host_data_code.
+ */
+#define	THUNK_HOST_DATA_ENTRY(tname, label, perms)       \
+        3: THUNK_HOST_ENTRY(thunk_host_data_entry);      \
+        THUNK_PP_LABEL(tname, label)                     \
+        THUNK_HOST_LITERAL;                              \
+        .quad (perms);                                   \
+        .quad 3b - _THUNK_SYM(tname)
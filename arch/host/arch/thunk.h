@@ -0,0 +1,173 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+/*
+ * Host simulation backend.
+ *
+ * This runs the runtime on plain 64-bit Linux, with the software
+ * capability model in include/cheriintrin.h. Templates are native entry
+ * stubs that jump to a C handler, followed by the patched literals the
+ * handler reads, see THUNK_HOST_ENTRY() in arch/thunk-asm.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <cheri/cherireg.h>
+
+struct thunk_class;
+
+/**
+ * Machine-dependent types that represents thunk code buffers.
+ */
+typedef uint8_t const * thunk_template_t;
+typedef uint8_t* thunk_jit_t;
+
+enum host_thunk_reloc_type {
+        /* 64-bit literal */
+        THUNK_REL_IMM = 0,
+        /* 64-bit displacement from the patch point to the data */
+        THUNK_REL_ADR = 1,
+        THUNK_REL_LAST
+};
+
+/**
+ * Thunk template patch point descriptors.
+ */
+struct host_thunk_reloc {
+        enum host_thunk_reloc_type type;
+        ptraddr_t addr;
+};
+
+typedef struct host_thunk_reloc thunk_reloc_t;
+
+/**
+ * Resolved data associated to a patch point descriptor.
+ */
+union host_thunk_reloc_data {
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+};
+
+typedef union host_thunk_reloc_data thunk_reloc_data_t;
+
+#define THUNK_REL_INITIALIZER(rtype, rpos)  \
+        { .type = (THUNK_REL_##rtype), .addr = (rpos) }
+
+/**
+ * L1 cache line size used for thunk object layout.
+ */
+#define THUNK_CACHE_LINE_SIZE 64
+
+/**
+ * Entry stub at the start of every host template.
+ *
+ * The stub passes its own address as the second argument of the handler,
+ * the first and third arguments are passed through.
+ */
+struct thunk_host_stub {
+        uint8_t code[16];
+        void *(*handler)(void *, const struct thunk_host_stub *, void *);
+};
+
+/**
+ * Resolve an ADR literal to the data it refers to.
+ */
+static inline void *
+thunk_host_adr(const int64_t *literal)
+{
+        return ((char *)literal + *literal);
+}
+
+/**
+ * Literals of the templates that use thunk_host_data_entry(), see
+ * THUNK_HOST_DATA_ENTRY() in arch/thunk-asm.h.
+ */
+struct thunk_host_data_code {
+        struct thunk_host_stub stub;
+        int64_t data;
+        uint64_t clear_perms;
+        uint64_t entry_offset;
+};
+
+/**
+ * Generic handler that returns the data referenced by the ADR literal
+ * following the stub.
+ *
+ * As the PCC-relative data capability on CHERI, the data is bounded to
+ * the rest of the object that holds the entry and the permissions in
+ * the clear_perms literal are removed.
+ */
+void *thunk_host_data_entry(void *arg, const struct thunk_host_stub *stub,
+    void *arg2);
+
+/**
+ * Internal helper to wrap thunk a capability into a thunk_object_t.
+ *
+ * Host sentries are unsealed, see thunk_arch_object_sealed().
+ */
+static inline void *
+thunk_arch_seal_object(uintptr_t obj_ptr)
+{
+        return ((void *)cheri_sentry_create(obj_ptr));
+}
+
+/**
+ * Internal helper to seal shared thunk code with a runtime otype.
+ */
+static inline void *
+thunk_arch_seal_code(uintptr_t code_ptr, void *sealcap)
+{
+        return (cheri_seal((void *)code_ptr, sealcap));
+}
+
+/**
+ * Internal helper to recover the object address from a sealed thunk object.
+ */
+static inline ptraddr_t
+thunk_arch_object_addr(void *obj)
+{
+        return (cheri_address_get(obj));
+}
+
+/**
+ * Internal helper to check that a thunk object is sealed.
+ *
+ * Host objects must stay callable, so they can not carry an otype.
+ */
+static inline bool
+thunk_arch_object_sealed(void *obj)
+{
+        return (cheri_tag_get(obj));
+}
+
+#ifdef THUNK_AUTH_MODE_PERMS
+/**
+ * Software-defined permission bit that identifies trusted thunks.
+ *
+ * The host backend does not preload the malloc hooks that strip it,
+ * so this does not authenticate anything.
+ */
+#define CHERI_PERM_SW_THUNK CHERI_PERM_SW2
+#else
+#error "Invalid thunk auth mode"
+#endif
+
+/**
+ * Define the maximum permission allowed on the root thunk token.
+ */
+#define THUNK_TOKEN_MAX_PERMS                             \
+        (CHERI_PERM_GLOBAL | CHERI_PERM_STORE_LOCAL_CAP | \
+         CHERI_PERM_LOAD | CHERI_PERM_STORE |             \
+         CHERI_PERM_LOAD_CAP | CHERI_PERM_STORE_CAP |     \
+         CHERI_PERM_MUTABLE_LOAD)
@@ -0,0 +1,337 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * FreeBSD and CheriBSD interfaces used by the runtime, for the host
+ * backend. See the headers in include/.
+ */
+#include <cheriintrin.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <machine/param.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+
+#undef mmap
+#undef malloc
+#undef calloc
+#undef realloc
+
+/*
+ * Capability metadata table, see cheriintrin.h.
+ *
+ * The table is open addressed on the capability bits and entries are
+ * never removed, metadata is rewritten in place under the entry
+ * sequence counter so that readers never observe a torn update.
+ * Sealed pointers share the entry of their address.
+ * Keys live within CAP_TABLE_PROBES slots of their hash, capabilities
+ * derived once the probe window is full are not recorded and keep the
+ * default metadata.
+ * XXX-AM: Entries are not dropped when the memory is freed, long running
+ * programs that derive many distinct pointers lose bounds emulation.
+ */
+#define CAP_TABLE_SHIFT 23
+#define CAP_TABLE_SIZE ((size_t)1 << CAP_TABLE_SHIFT)
+#define CAP_TABLE_PROBES 256
+
+struct cap_entry {
+        uintptr_t key;
+        uint32_t seq;
+        uint32_t perms;
+        ptraddr_t base;
+        size_t length;
+};
+
+static struct cap_entry cap_table[CAP_TABLE_SIZE];
+static bool cap_table_full;
+
+static inline uintptr_t
+cap_key(uintptr_t c)
+{
+        if (c & CHERI_HOST_RESERVED)
+                return (c);
+        return (c & CHERI_HOST_ADDR_MASK);
+}
+
+static inline size_t
+cap_hash(uintptr_t key)
+{
+        return ((key * 0x9e3779b97f4a7c15UL) >> (64 - CAP_TABLE_SHIFT));
+}
+
+static struct cap_entry *
+cap_find(uintptr_t key, bool insert)
+{
+        struct cap_entry *e;
+        uintptr_t cur;
+        size_t i, n;
+
+        i = cap_hash(key);
+        for (n = 0; n < CAP_TABLE_PROBES; n++) {
+                e = &cap_table[(i + n) & (CAP_TABLE_SIZE - 1)];
+                cur = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+                if (cur == key)
+                        return (e);
+                if (cur != 0)
+                        continue;
+                if (!insert)
+                        return (NULL);
+                if (__atomic_compare_exchange_n(&e->key, &cur, key, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || cur == key)
+                        return (e);
+        }
+        if (insert && !__atomic_exchange_n(&cap_table_full, true,
+            __ATOMIC_RELAXED))
+                fprintf(stderr, "host capability table full, "
+                    "using default metadata\n");
+
+        return (NULL);
+}
+
+void
+__cheri_host_meta_get(uintptr_t c, struct cheri_host_meta *meta)
+{
+        struct cap_entry *e = NULL;
+        uint32_t seq;
+
+        if (c != 0)
+                e = cap_find(cap_key(c), false);
+        if (e == NULL) {
+                meta->base = c & CHERI_HOST_ADDR_MASK;
+                meta->length = CHERI_HOST_ADDR_MASK + 1 - meta->base;
+                meta->perms = CHERI_HOST_PERMS_ALL;
+                return;
+        }
+        do {
+                seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+                meta->base = __atomic_load_n(&e->base, __ATOMIC_RELAXED);
+                meta->length = __atomic_load_n(&e->length, __ATOMIC_RELAXED);
+                meta->perms = __atomic_load_n(&e->perms, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) != 0 ||
+            seq != __atomic_load_n(&e->seq, __ATOMIC_RELAXED));
+}
+
+static void
+cap_record(uintptr_t key, const struct cheri_host_meta *meta)
+{
+        struct cap_entry *e = cap_find(key, true);
+        uint32_t seq;
+
+        if (e == NULL)
+                return;
+        /* Odd sequence numbers lock out other writers */
+        seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+        do {
+                while ((seq & 1) != 0)
+                        seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+        } while (!__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, true,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&e->base, meta->base, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->length, meta->length, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->perms, meta->perms, __ATOMIC_RELAXED);
+        __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Fingerprint the metadata of a reservation capability, it goes in the
+ * bits above the address.
+ */
+static uintptr_t
+cap_fingerprint(const struct cheri_host_meta *meta)
+{
+        uint64_t h;
+
+        h = (meta->base ^ (meta->length << 17) ^ (meta->perms << 40)) *
+            0x9e3779b97f4a7c15UL;
+        h >>= 64 - (63 - CHERI_HOST_ADDR_BITS);
+
+        return (CHERI_HOST_RESERVED | (h << CHERI_HOST_ADDR_BITS));
+}
+
+uintptr_t
+__cheri_host_derive(uintptr_t c, const struct cheri_host_meta *meta)
+{
+        if (c & CHERI_HOST_RESERVED)
+                c = cap_fingerprint(meta) | (c & CHERI_HOST_ADDR_MASK);
+        cap_record(cap_key(c), meta);
+
+        return (c);
+}
+
+uintptr_t
+__cheri_host_address_set(uintptr_t c, ptraddr_t addr)
+{
+        struct cheri_host_meta meta;
+        uintptr_t n;
+
+        n = (c & ~CHERI_HOST_ADDR_MASK) | (addr & CHERI_HOST_ADDR_MASK);
+        if (c == 0 || n == c)
+                return (n);
+        /* Pointers that were never derived keep the default metadata */
+        if ((c & CHERI_HOST_RESERVED) == 0 &&
+            cap_find(cap_key(c), false) == NULL)
+                return (n);
+        __cheri_host_meta_get(c, &meta);
+        cap_record(cap_key(n), &meta);
+
+        return (n);
+}
+
+/**
+ * Build a reservation capability for the given range.
+ */
+static uintptr_t
+cap_reserve(ptraddr_t base, size_t length)
+{
+        struct cheri_host_meta meta = {
+                .base = base,
+                .length = length,
+                .perms = CHERI_HOST_PERMS_ALL,
+        };
+
+        return (__cheri_host_derive(CHERI_HOST_RESERVED | base, &meta));
+}
+
+void *
+thunk_host_malloc(size_t size)
+{
+        void *ptr = malloc(size);
+
+        return (cheri_bounds_set_exact(ptr, size));
+}
+
+void *
+thunk_host_calloc(size_t nmemb, size_t size)
+{
+        void *ptr = calloc(nmemb, size);
+
+        return (cheri_bounds_set_exact(ptr, nmemb * size));
+}
+
+void *
+thunk_host_realloc(void *ptr, size_t size)
+{
+        ptr = realloc(ptr, size);
+
+        return (cheri_bounds_set_exact(ptr, size));
+}
+
+void *
+thunk_host_mmap(void *addr, size_t len, int prot, int flags, int fd,
+    off_t offset)
+{
+        void *mem;
+
+        mem = mmap(addr, len, prot, flags & ~MAP_HOST_GUARD, fd, offset);
+        if (mem == MAP_FAILED || (flags & MAP_HOST_GUARD) == 0)
+                return (mem);
+
+        return ((void *)cap_reserve((ptraddr_t)mem, len));
+}
+
+int
+sysctlbyname(const char *name, void *oldp, size_t *oldlenp,
+    const void *newp, size_t newlen)
+{
+        void *sealroot;
+
+        if (strcmp(name, "security.cheri.sealcap") != 0 || newp != NULL) {
+                errno = ENOENT;
+                return (-1);
+        }
+        sealroot = (void *)cap_reserve(CHERI_OTYPE_USER_MIN,
+            CHERI_OTYPE_USER_MAX + 1 - CHERI_OTYPE_USER_MIN);
+        if (oldp != NULL) {
+                if (*oldlenp < sizeof(sealroot)) {
+                        errno = ENOMEM;
+                        return (-1);
+                }
+                memcpy(oldp, &sealroot, sizeof(sealroot));
+        }
+        *oldlenp = sizeof(sealroot);
+
+        return (0);
+}
+
+int
+getpagesizes(size_t *sizes, int nelem)
+{
+        if (sizes == NULL)
+                return (1);
+        if (nelem < 1) {
+                errno = EINVAL;
+                return (-1);
+        }
+        sizes[0] = PAGE_SIZE;
+
+        return (1);
+}
+
+int
+thunk_host_shm_open(const char *path, int flags, mode_t mode)
+{
+        if (path != SHM_ANON) {
+                errno = EINVAL;
+                return (-1);
+        }
+
+        return (memfd_create("thunk", MFD_CLOEXEC));
+}
+
+static void
+merge(char *base, char *tmp, size_t lo, size_t mid, size_t hi, size_t size,
+    int (*compar)(const void *, const void *))
+{
+        size_t i = lo, j = mid, k = lo;
+
+        while (i < mid && j < hi) {
+                /* Take from the left run on ties, keeps the sort stable */
+                if (compar(base + j * size, base + i * size) < 0)
+                        memcpy(tmp + k++ * size, base + j++ * size, size);
+                else
+                        memcpy(tmp + k++ * size, base + i++ * size, size);
+        }
+        memcpy(tmp + k * size, base + i * size, (mid - i) * size);
+        k += mid - i;
+        memcpy(tmp + k * size, base + j * size, (hi - j) * size);
+        memcpy(base + lo * size, tmp + lo * size, (hi - lo) * size);
+}
+
+int
+mergesort(void *base, size_t nmemb, size_t size,
+    int (*compar)(const void *, const void *))
+{
+        size_t width, lo;
+        char *tmp;
+
+        if (nmemb < 2)
+                return (0);
+        tmp = malloc(nmemb * size);
+        if (tmp == NULL)
+                return (-1);
+        for (width = 1; width < nmemb; width *= 2) {
+                for (lo = 0; lo + width < nmemb; lo += 2 * width) {
+                        merge(base, tmp, lo, lo + width,
+                            lo + 2 * width < nmemb ? lo + 2 * width : nmemb,
+                            size, compar);
+                }
+        }
+        free(tmp);
+
+        return (0);
+}
@@ -0,0 +1,472 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+#include <cheriintrin.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "thunk-gate.h"
+#include "arch/thunk-patch.h"
+
+THUNK_DECL_TEMPLATE(gate);
+THUNK_DECL_PATCH_POINT(gate, token_base);
+THUNK_DECL_PATCH_POINT(gate, data_offset);
+
+THUNK_DECL_TEMPLATE(gate_split);
+THUNK_DECL_PATCH_POINT(gate_split, token_base);
+THUNK_DECL_PATCH_POINT(gate_split, data_offset);
+THUNK_DECL_PATCH_POINT(gate_split, data_size);
+
+THUNK_DECL_TEMPLATE(gate_instr);
+THUNK_DECL_PATCH_POINT(gate_instr, token_base);
+THUNK_DECL_PATCH_POINT(gate_instr, data_offset);
+THUNK_DECL_PATCH_POINT(gate_instr, stats_offset);
+THUNK_DECL_PATCH_POINT(gate_instr, hist_shift);
+
+THUNK_DECL_TEMPLATE(gate_gen);
+THUNK_DECL_PATCH_POINT(gate_gen, token_base);
+THUNK_DECL_PATCH_POINT(gate_gen, data_offset);
+THUNK_DECL_PATCH_POINT(gate_gen, gen_shift);
+THUNK_DECL_PATCH_POINT(gate_gen, gen_offset);
+THUNK_DECL_PATCH_POINT(gate_gen, data_size);
+
+THUNK_DECL_TEMPLATE(gate_replica);
+THUNK_DECL_PATCH_POINT(gate_replica, token_base);
+THUNK_DECL_PATCH_POINT(gate_replica, data_offset);
+THUNK_DECL_PATCH_POINT(gate_replica, replica_shift);
+
+THUNK_DECL_TEMPLATE(gate_pair);
+THUNK_DECL_PATCH_POINT(gate_pair, token_base);
+
+#define THUNK_GATE_NRELOCS 2
+
+/*
+ * The split, instrumented and generation gates share the relocation
+ * layout of the gate, with their relocations appended.
+ */
+#define THUNK_GATE_RELOC_DATA_SIZE THUNK_GATE_NRELOCS
+#define THUNK_GATE_SPLIT_NRELOCS (THUNK_GATE_NRELOCS + 1)
+
+#define THUNK_GATE_RELOC_STATS THUNK_GATE_NRELOCS
+#define THUNK_GATE_RELOC_HIST_SHIFT (THUNK_GATE_NRELOCS + 1)
+#define THUNK_GATE_INSTR_NRELOCS (THUNK_GATE_NRELOCS + 2)
+
+#define THUNK_GATE_RELOC_GEN_SHIFT THUNK_GATE_NRELOCS
+#define THUNK_GATE_RELOC_GEN_OFFSET (THUNK_GATE_NRELOCS + 1)
+#define THUNK_GATE_RELOC_GEN_DATA_SIZE (THUNK_GATE_NRELOCS + 2)
+#define THUNK_GATE_GEN_NRELOCS (THUNK_GATE_NRELOCS + 3)
+
+#define THUNK_GATE_RELOC_REPLICA_SHIFT THUNK_GATE_NRELOCS
+#define THUNK_GATE_REPLICA_NRELOCS (THUNK_GATE_NRELOCS + 1)
+
+#define THUNK_GATE_PAIR_NRELOCS (THUNK_GATE_NRELOCS - 1)
+
+/**
+ * Template literals, see gate_thunk.S.
+ */
+struct gate_code {
+        struct thunk_host_stub stub;
+        uint64_t token_base;
+        int64_t data;
+};
+
+struct gate_split_code {
+        struct gate_code gate;
+        uint64_t data_size;
+};
+
+struct gate_instr_code {
+        struct gate_code gate;
+        int64_t stats;
+        uint64_t hist_shift;
+};
+
+struct gate_gen_code {
+        struct gate_code gate;
+        uint64_t gen_shift;
+        int64_t gen;
+        uint64_t data_size;
+};
+
+struct gate_replica_code {
+        struct gate_code gate;
+        uint64_t replica_shift;
+};
+
+struct gate_pair_code {
+        struct thunk_host_stub stub;
+        uint64_t token_base;
+};
+
+struct thunk_gate_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid gate metaclass relocs offset");
+
+static struct thunk_gate_metaclass thunk_gate_meta_storage = {
+        .template = THUNK_TEMPLATE(gate),
+        .template_end = THUNK_TEMPLATE_END(gate),
+        .relocs_count = THUNK_GATE_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate, token_base)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate, data_offset)),
+        },
+};
+
+struct thunk_gate_metaclass *thunk_gate_meta = &thunk_gate_meta_storage;
+
+struct thunk_gate_split_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_SPLIT_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_split_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid split gate metaclass relocs offset");
+
+static struct thunk_gate_split_metaclass thunk_gate_split_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_split),
+        .template_end = THUNK_TEMPLATE_END(gate_split),
+        .relocs_count = THUNK_GATE_SPLIT_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_split, token_base)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_split, data_offset)),
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_split, data_size)),
+        },
+};
+
+struct thunk_gate_split_metaclass *thunk_gate_split_meta =
+    &thunk_gate_split_meta_storage;
+
+struct thunk_gate_instr_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_INSTR_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_instr_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid instrumented gate metaclass relocs offset");
+
+static struct thunk_gate_instr_metaclass thunk_gate_instr_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_instr),
+        .template_end = THUNK_TEMPLATE_END(gate_instr),
+        .relocs_count = THUNK_GATE_INSTR_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_instr, token_base)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_instr, data_offset)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_instr, stats_offset)),
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_instr, hist_shift)),
+        },
+};
+
+struct thunk_gate_instr_metaclass *thunk_gate_instr_meta =
+    &thunk_gate_instr_meta_storage;
+
+struct thunk_gate_gen_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_GEN_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_gen_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid generation gate metaclass relocs offset");
+
+static struct thunk_gate_gen_metaclass thunk_gate_gen_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_gen),
+        .template_end = THUNK_TEMPLATE_END(gate_gen),
+        .relocs_count = THUNK_GATE_GEN_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_gen, token_base)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_gen, data_offset)),
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_gen, gen_shift)),
+                THUNK_REL_INITIALIZER(ADR, THUNK_PP(gate_gen, gen_offset)),
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_gen, data_size)),
+        },
+};
+
+struct thunk_gate_gen_metaclass *thunk_gate_gen_meta =
+    &thunk_gate_gen_meta_storage;
+
+struct thunk_gate_replica_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_REPLICA_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_replica_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid replicated gate metaclass relocs offset");
+
+static struct thunk_gate_replica_metaclass thunk_gate_replica_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_replica),
+        .template_end = THUNK_TEMPLATE_END(gate_replica),
+        .relocs_count = THUNK_GATE_REPLICA_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_replica, token_base)),
+                THUNK_REL_INITIALIZER(ADR,
+                    THUNK_PP(gate_replica, data_offset)),
+                THUNK_REL_INITIALIZER(IMM,
+                    THUNK_PP(gate_replica, replica_shift)),
+        },
+};
+
+struct thunk_gate_replica_metaclass *thunk_gate_replica_meta =
+    &thunk_gate_replica_meta_storage;
+
+struct thunk_gate_pair_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[THUNK_GATE_PAIR_NRELOCS];
+};
+
+static_assert(offsetof(struct thunk_gate_pair_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid shared code gate metaclass relocs offset");
+
+static struct thunk_gate_pair_metaclass thunk_gate_pair_meta_storage = {
+        .template = THUNK_TEMPLATE(gate_pair),
+        .template_end = THUNK_TEMPLATE_END(gate_pair),
+        .relocs_count = THUNK_GATE_PAIR_NRELOCS,
+        .relocs = {
+                THUNK_REL_INITIALIZER(IMM, THUNK_PP(gate_pair, token_base)),
+        },
+};
+
+struct thunk_gate_pair_metaclass *thunk_gate_pair_meta =
+    &thunk_gate_pair_meta_storage;
+
+/**
+ * Narrow the data pointer to the token bounds and permissions, as the
+ * scbndse and clrperm of the aarch64c gates. The bounds must be within
+ * the region the data was derived from, the object for the gates.
+ */
+static inline void *
+gate_data_bounds(uintptr_t region, char *data, void *tok)
+{
+        struct cheri_host_meta meta, limit;
+
+        __cheri_host_meta_get(region, &limit);
+        __cheri_host_meta_get((uintptr_t)tok, &meta);
+        meta.base = cheri_address_get(data);
+        if (meta.base < limit.base || meta.length > limit.length ||
+            meta.base - limit.base > limit.length - meta.length)
+                return (NULL);
+
+        return ((void *)__cheri_host_derive((uintptr_t)data, &meta));
+}
+
+/**
+ * The gate, see gate_thunk.S.
+ *
+ * Untagged tokens return NULL, the token offset from the token space
+ * is applied to the data.
+ */
+void *
+thunk_host_gate_entry(void *tok, const struct thunk_host_stub *stub,
+    void *arg2)
+{
+        const struct gate_code *code = (const struct gate_code *)stub;
+
+        if (!cheri_tag_get(tok))
+                return (NULL);
+
+        return (gate_data_bounds((uintptr_t)stub,
+            (char *)thunk_host_adr(&code->data) +
+            (cheri_base_get(tok) - code->token_base), tok));
+}
+
+/**
+ * The split gate, tokens out of the data size return NULL rather than
+ * reaching the slots of other objects covered by the object bounds.
+ */
+void *
+thunk_host_gate_split_entry(void *tok, const struct thunk_host_stub *stub,
+    void *arg2)
+{
+        const struct gate_split_code *code =
+            (const struct gate_split_code *)stub;
+        uint64_t offset = cheri_base_get(tok) - code->gate.token_base;
+        size_t length = cheri_length_get(tok);
+
+        if (!cheri_tag_get(tok) || offset > code->data_size ||
+            length > code->data_size - offset)
+                return (NULL);
+
+        return (gate_data_bounds((uintptr_t)stub,
+            (char *)thunk_host_adr(&code->gate.data) + offset, tok));
+}
+
+/**
+ * The instrumented gate, accounts the invocation before running the gate.
+ */
+void *
+thunk_host_gate_instr_entry(void *tok, const struct thunk_host_stub *stub,
+    void *arg2)
+{
+        const struct gate_instr_code *code =
+            (const struct gate_instr_code *)stub;
+        struct thunk_gate_stats *stats = thunk_host_adr(&code->stats);
+        uint64_t bucket;
+
+        bucket = (cheri_base_get(tok) - code->gate.token_base) >>
+            code->hist_shift;
+        if (bucket >= THUNK_GATE_STATS_BUCKETS)
+                bucket = THUNK_GATE_STATS_BUCKETS - 1;
+        __atomic_fetch_add(&stats->invocations, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->histogram[bucket], 1, __ATOMIC_RELAXED);
+
+        return (thunk_host_gate_entry(tok, stub, arg2));
+}
+
+/**
+ * The gate with generations, tokens for a stale generation return NULL.
+ */
+void *
+thunk_host_gate_gen_entry(void *tok, const struct thunk_host_stub *stub,
+    void *arg2)
+{
+        const struct gate_gen_code *code = (const struct gate_gen_code *)stub;
+        const uint64_t *gen = thunk_host_adr(&code->gen);
+        uint64_t offset = cheri_base_get(tok) - code->gate.token_base;
+        uint64_t tok_gen = offset >> code->gen_shift;
+        size_t length = cheri_length_get(tok);
+
+        offset -= tok_gen << code->gen_shift;
+        if (!cheri_tag_get(tok) ||
+            tok_gen != __atomic_load_n(gen, __ATOMIC_RELAXED) ||
+            offset > code->data_size || length > code->data_size - offset)
+                return (NULL);
+
+        return (gate_data_bounds((uintptr_t)stub,
+            (char *)thunk_host_adr(&code->gate.data) + offset, tok));
+}
+
+/**
+ * The replicated gate, the replica is picked from the thread pointer
+ * with the hash of the aarch64c template.
+ */
+void *
+thunk_host_gate_replica_entry(void *tok, const struct thunk_host_stub *stub,
+    void *arg2)
+{
+        const struct gate_replica_code *code =
+            (const struct gate_replica_code *)stub;
+        uint32_t replica;
+
+        if (!cheri_tag_get(tok))
+                return (NULL);
+
+        replica = (uint32_t)(uintptr_t)__builtin_thread_pointer() *
+            0x9e3779b1U;
+        replica >>= 32 - flsl(THUNK_GATE_REPLICAS - 1);
+
+        return (gate_data_bounds((uintptr_t)stub,
+            (char *)thunk_host_adr(&code->gate.data) +
+            (cheri_base_get(tok) - code->gate.token_base) +
+            ((uint64_t)replica << code->replica_shift), tok));
+}
+
+/**
+ * The shared code gate, the data comes from the gate pair.
+ */
+void *
+thunk_host_gate_pair_entry(void *tok, const struct thunk_host_stub *stub,
+    void *data)
+{
+        const struct gate_pair_code *code =
+            (const struct gate_pair_code *)stub;
+
+        if (!cheri_tag_get(tok))
+                return (NULL);
+
+        return (gate_data_bounds((uintptr_t)data, (char *)data +
+            (cheri_base_get(tok) - code->token_base), tok));
+}
+
+void
+thunk_arch_gate_reloc_token_space(struct thunk_class *gate,
+    thunk_token_t token_space)
+{
+        gate->reloc_data[0].u64 = cheri_address_get(token_space);
+}
+
+void
+thunk_arch_gate_reloc_data_offset(struct thunk_class *gate, size_t offset)
+{
+        gate->reloc_data[1].u32 = offset;
+}
+
+void
+thunk_arch_gate_reloc_data_size(struct thunk_class *gate, size_t size)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_split_meta &&
+            "Data size relocations on non-split gate");
+
+        gate->reloc_data[THUNK_GATE_RELOC_DATA_SIZE].u64 = size;
+}
+
+void
+thunk_arch_gate_reloc_stats(struct thunk_class *gate, ptraddr_t offset,
+    unsigned int hist_shift)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_instr_meta &&
+            "Stats relocations on non-instrumented gate");
+
+        gate->reloc_data[THUNK_GATE_RELOC_STATS].u32 = offset;
+        gate->reloc_data[THUNK_GATE_RELOC_HIST_SHIFT].u64 = hist_shift;
+}
+
+void
+thunk_arch_gate_reloc_generation(struct thunk_class *gate, ptraddr_t offset,
+    unsigned int gen_shift, size_t size)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_gen_meta &&
+            "Generation relocations on non-generation gate");
+
+        gate->reloc_data[THUNK_GATE_RELOC_GEN_SHIFT].u64 = gen_shift;
+        gate->reloc_data[THUNK_GATE_RELOC_GEN_OFFSET].u32 = offset;
+        gate->reloc_data[THUNK_GATE_RELOC_GEN_DATA_SIZE].u64 = size;
+}
+
+void
+thunk_arch_gate_reloc_replica(struct thunk_class *gate,
+    unsigned int replica_shift)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_replica_meta &&
+            "Replica relocations on non-replicated gate");
+
+        gate->reloc_data[THUNK_GATE_RELOC_REPLICA_SHIFT].u64 = replica_shift;
+}
+
+void
+thunk_arch_gate_reloc_pair(struct thunk_class *gate,
+    thunk_token_t token_space)
+{
+        assert(gate->mc == (struct thunk_metaclass *)thunk_gate_pair_meta &&
+            "Pair relocations on non-shared code gate");
+
+        gate->reloc_data[0].u64 = cheri_address_get(token_space);
+}
+
+void *
+thunk_arch_gatepair_invoke(thunk_token_t tok, void *code, void *data)
+{
+        void *(*entry)(thunk_token_t, void *, void *);
+
+        /* The pair is unsealed by the branch on CHERI */
+        entry = (void *(*)(thunk_token_t, void *, void *))(uintptr_t)
+            cheri_address_get(code);
+
+        return (entry(tok, NULL, (void *)(uintptr_t)cheri_address_get(data)));
+}
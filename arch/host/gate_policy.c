@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Gate template generator for access policies.
+ *
+ * The host template is a copy of the gate_policy template in
+ * gate_policy.S, with the policy constants stored in its literals.
+ * The handler interprets the policy as the aarch64c generated code:
+ * it checks the token against the token space and narrows the data to
+ * the token or fixed bounds and permissions.
+ * The relocations follow the gate template conventions: token space
+ * base followed by the data offset.
+ */
+#include <cheriintrin.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cheri/cherireg.h>
+
+#include "thunk-gate.h"
+#include "arch/thunk-patch.h"
+
+THUNK_DECL_TEMPLATE(gate_policy);
+THUNK_DECL_PATCH_POINT(gate_policy, token_base);
+THUNK_DECL_PATCH_POINT(gate_policy, data_offset);
+
+#define GATE_POLICY_NRELOCS 2
+
+#define GATE_POLICY_STORE_PERMS                                 \
+        (CHERI_PERM_STORE | CHERI_PERM_STORE_CAP |              \
+         CHERI_PERM_STORE_LOCAL_CAP)
+#define GATE_POLICY_LOAD_PERMS                                  \
+        (CHERI_PERM_LOAD | CHERI_PERM_LOAD_CAP | CHERI_PERM_MUTABLE_LOAD)
+
+/**
+ * Template literals, see gate_policy.S.
+ */
+struct gate_policy_code {
+        struct thunk_host_stub stub;
+        uint64_t token_base;
+        int64_t data;
+        uint64_t flags;
+        uint64_t space_size;
+        uint64_t length;
+        uint64_t perms;
+};
+
+/**
+ * Generated gate metaclass.
+ */
+struct thunk_gate_policy_metaclass {
+        THUNK_METACLASS_HEADER;
+        thunk_reloc_t relocs[GATE_POLICY_NRELOCS];
+        /* Template buffer allocation */
+        struct gate_policy_code *code;
+};
+
+static_assert(offsetof(struct thunk_gate_policy_metaclass, relocs) ==
+    offsetof(struct thunk_metaclass, relocs),
+    "Invalid policy gate metaclass relocs offset");
+
+/**
+ * Narrow the data pointer to the given bounds and permissions, as the
+ * gate_data_bounds() of the gates. The bounds must be within the object.
+ */
+static inline void *
+gate_policy_bounds(uintptr_t region, char *data, size_t length,
+    size_t perms)
+{
+        struct cheri_host_meta meta, limit;
+
+        __cheri_host_meta_get(region, &limit);
+        meta.base = cheri_address_get(data);
+        meta.length = length;
+        meta.perms = limit.perms & perms;
+        if (meta.base < limit.base || meta.length > limit.length ||
+            meta.base - limit.base > limit.length - meta.length)
+                return (NULL);
+
+        return ((void *)__cheri_host_derive((uintptr_t)data, &meta));
+}
+
+/**
+ * The policy gate, see gate_policy.S.
+ *
+ * Bounds come from the token, or from the policy with fixed bounds.
+ * Permissions are the token permissions masked by the policy, or the
+ * policy permissions with fixed permissions.
+ * With fixed bounds the policy offset is folded in the data literal.
+ */
+void *
+thunk_host_gate_policy_entry(void *tok, const struct thunk_host_stub *stub,
+    void *arg2)
+{
+        const struct gate_policy_code *code =
+            (const struct gate_policy_code *)stub;
+        bool check = code->flags & THUNK_GATE_POLICY_CHECK_SPACE;
+        bool fixed_bounds = code->flags & THUNK_GATE_POLICY_FIXED_BOUNDS;
+        bool fixed_perms = code->flags & THUNK_GATE_POLICY_FIXED_PERMS;
+        uint64_t offset = cheri_base_get(tok) - code->token_base;
+        size_t length = cheri_length_get(tok);
+        size_t perms = code->perms;
+        char *data = thunk_host_adr(&code->data);
+
+        if (check && !cheri_tag_get(tok))
+                return (NULL);
+        if (check && fixed_bounds && offset >= code->space_size)
+                return (NULL);
+        if (check && !fixed_bounds && (offset > code->space_size ||
+            length > code->space_size - offset))
+                return (NULL);
+        if (fixed_bounds)
+                length = code->length;
+        else
+                data += offset;
+        if (!fixed_perms)
+                perms &= cheri_perms_get(tok);
+
+        return (gate_policy_bounds((uintptr_t)stub, data, length, perms));
+}
+
+struct thunk_metaclass *
+thunk_arch_gate_policy_emit(const struct thunk_gate_policy *policy,
+    size_t size)
+{
+        struct thunk_gate_policy_metaclass *mc;
+        const size_t code_size = (uintptr_t)THUNK_TEMPLATE_END(gate_policy) -
+            (uintptr_t)THUNK_TEMPLATE(gate_policy);
+        struct gate_policy_code *code;
+
+        assert(code_size == sizeof(*code) && "Unexpected policy template");
+        mc = thunk_level_malloc(sizeof(*mc), THUNK_LEVEL_PRIVATE);
+        if (mc == NULL)
+                return (NULL);
+        mc->code = thunk_level_malloc(code_size, THUNK_LEVEL_PRIVATE);
+        if (mc->code == NULL) {
+                thunk_level_free(mc);
+                return (NULL);
+        }
+        code = mc->code;
+        memcpy(code, THUNK_TEMPLATE(gate_policy), code_size);
+        code->flags = policy->flags;
+        code->space_size = size;
+        code->length = policy->length;
+        code->perms = policy->perms & THUNK_TOKEN_MAX_PERMS;
+        if (policy->flags & THUNK_GATE_POLICY_READ_ONLY)
+                code->perms &= ~(uint64_t)GATE_POLICY_STORE_PERMS;
+        if (policy->flags & THUNK_GATE_POLICY_WRITE_ONLY)
+                code->perms &= ~(uint64_t)GATE_POLICY_LOAD_PERMS;
+
+        mc->template = (thunk_template_t)code;
+        mc->template_end = mc->template + code_size;
+        mc->entries = NULL;
+        mc->entries_count = 0;
+        mc->relocs_count = GATE_POLICY_NRELOCS;
+        mc->relocs[0] = (thunk_reloc_t)THUNK_REL_INITIALIZER(IMM,
+            (ptraddr_t)&code->token_base);
+        mc->relocs[1] = (thunk_reloc_t)THUNK_REL_INITIALIZER(ADR,
+            (ptraddr_t)&code->data);
+
+        return ((struct thunk_metaclass *)mc);
+}
+
+void
+thunk_arch_gate_policy_free(struct thunk_metaclass *mc)
+{
+        struct thunk_gate_policy_metaclass *pmc =
+            (struct thunk_gate_policy_metaclass *)mc;
+
+        thunk_level_free(pmc->code);
+        thunk_level_free(pmc);
+}
+
+void
+thunk_arch_gate_reloc_policy(struct thunk_class *gate,
+    thunk_token_t token_space, ptraddr_t data_offset)
+{
+        gate->reloc_data[0].u64 = cheri_address_get(token_space);
+        gate->reloc_data[1].u32 = data_offset;
+}
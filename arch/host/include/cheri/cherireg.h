@@ -0,0 +1,49 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+/*
+ * Capability permission and object type constants for the host backend.
+ *
+ * The permission bits follow the Morello layout, so that permission
+ * masks computed by the runtime have the same values, see cheriintrin.h
+ * for what the host model does with them.
+ */
+
+#define CHERI_PERM_GLOBAL               (1 << 0)
+#define CHERI_PERM_EXECUTIVE            (1 << 1)
+#define CHERI_PERM_SW0                  (1 << 2)
+#define CHERI_PERM_SW1                  (1 << 3)
+#define CHERI_PERM_SW2                  (1 << 4)
+#define CHERI_PERM_SW3                  (1 << 5)
+#define CHERI_PERM_MUTABLE_LOAD         (1 << 6)
+#define CHERI_PERM_COMPARTMENT_ID       (1 << 7)
+#define CHERI_PERM_BRANCH_SEALED_PAIR   (1 << 8)
+#define CHERI_PERM_INVOKE               CHERI_PERM_BRANCH_SEALED_PAIR
+#define CHERI_PERM_SYSTEM               (1 << 9)
+#define CHERI_PERM_UNSEAL               (1 << 10)
+#define CHERI_PERM_SEAL                 (1 << 11)
+#define CHERI_PERM_STORE_LOCAL_CAP      (1 << 12)
+#define CHERI_PERM_STORE_CAP            (1 << 13)
+#define CHERI_PERM_LOAD_CAP             (1 << 14)
+#define CHERI_PERM_EXECUTE              (1 << 15)
+#define CHERI_PERM_STORE                (1 << 16)
+#define CHERI_PERM_LOAD                 (1 << 17)
+
+#define CHERI_PERM_SW_VMEM              CHERI_PERM_SW0
+
+#define CHERI_HOST_PERMS_ALL            ((1 << 18) - 1)
+
+#define CHERI_OTYPE_UNSEALED            0L
+#define CHERI_OTYPE_SENTRY              1L
+/* User object types, also see sysctlbyname() in sys/sysctl.h */
+#define CHERI_OTYPE_USER_MIN            4L
+#define CHERI_OTYPE_USER_MAX            ((1L << 15) - 1)
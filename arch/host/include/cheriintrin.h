@@ -0,0 +1,212 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+/*
+ * Software capability model for the host backend.
+ *
+ * Capabilities are plain pointers, so that they can be dereferenced and
+ * called as on CHERI. Bounds and permissions live in a side table keyed
+ * by the capability bits, see compat.c. Nothing is enforced on access,
+ * the model only reports what the runtime derived:
+ *  - A capability is tagged if it is not NULL, clearing the tag loses
+ *    the address.
+ *  - Capabilities that were never derived span from their address to
+ *    the top of the user address space with all permissions.
+ *  - Pointers share the metadata of their address, the last capability
+ *    derived at an address wins. Pointer arithmetic drops the metadata.
+ *  - Capabilities to MAP_GUARD reservations and sealing capabilities
+ *    are never dereferenced, they carry a fingerprint of their metadata
+ *    in the top address bits so that capabilities to the same address
+ *    with different bounds or permissions are told apart.
+ *  - Inexact bounds are not narrowed on pointers, CHERI may round them
+ *    up and the runtime only requests them for code at the start of an
+ *    object, which must keep the object bounds.
+ *  - Capabilities sealed with an object type keep the otype in the top
+ *    address bits, they are never dereferenced while sealed. Object
+ *    types that do not fit seal to an untagged capability.
+ *  - Sentries must stay callable, they are unsealed capabilities.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cheri/cherireg.h>
+
+typedef uint64_t ptraddr_t;
+
+#define CHERI_HOST_ADDR_BITS 48
+#define CHERI_HOST_ADDR_MASK (((uintptr_t)1 << CHERI_HOST_ADDR_BITS) - 1)
+/* Reservation capability, the top bits hold the metadata fingerprint */
+#define CHERI_HOST_RESERVED ((uintptr_t)1 << 63)
+
+/**
+ * Bounds and permissions of a host capability.
+ */
+struct cheri_host_meta {
+        ptraddr_t base;
+        size_t length;
+        size_t perms;
+};
+
+void __cheri_host_meta_get(uintptr_t c, struct cheri_host_meta *meta);
+uintptr_t __cheri_host_derive(uintptr_t c,
+    const struct cheri_host_meta *meta);
+uintptr_t __cheri_host_address_set(uintptr_t c, ptraddr_t addr);
+
+static inline long
+__cheri_host_type(uintptr_t c)
+{
+        uintptr_t otype = c >> CHERI_HOST_ADDR_BITS;
+
+        if (c & CHERI_HOST_RESERVED)
+                return (CHERI_OTYPE_UNSEALED);
+
+        return (otype == 0 ? CHERI_OTYPE_UNSEALED : (long)otype);
+}
+
+static inline uintptr_t
+__cheri_host_seal(uintptr_t c, uintptr_t sealcap)
+{
+        uintptr_t otype = sealcap & CHERI_HOST_ADDR_MASK;
+
+        /* Reservations have no room for the otype */
+        if (c == 0 || (c & ~CHERI_HOST_ADDR_MASK) != 0 ||
+            otype < CHERI_OTYPE_USER_MIN || otype > CHERI_OTYPE_USER_MAX)
+                return (0);
+
+        return (c | (otype << CHERI_HOST_ADDR_BITS));
+}
+
+static inline uintptr_t
+__cheri_host_unseal(uintptr_t c, uintptr_t sealcap)
+{
+        if (__cheri_host_type(c) != (long)(sealcap & CHERI_HOST_ADDR_MASK))
+                return (0);
+
+        return (c & CHERI_HOST_ADDR_MASK);
+}
+
+static inline struct cheri_host_meta
+__cheri_host_meta(uintptr_t c)
+{
+        struct cheri_host_meta meta;
+
+        __cheri_host_meta_get(c, &meta);
+        return (meta);
+}
+
+static inline uintptr_t
+__cheri_host_bounds_set(uintptr_t c, size_t length)
+{
+        struct cheri_host_meta meta;
+
+        if (c == 0)
+                return (0);
+        __cheri_host_meta_get(c, &meta);
+        meta.base = c & CHERI_HOST_ADDR_MASK;
+        meta.length = length;
+
+        return (__cheri_host_derive(c, &meta));
+}
+
+static inline uintptr_t
+__cheri_host_perms_and(uintptr_t c, size_t perms)
+{
+        struct cheri_host_meta meta;
+
+        if (c == 0)
+                return (0);
+        __cheri_host_meta_get(c, &meta);
+        meta.perms &= perms;
+
+        return (__cheri_host_derive(c, &meta));
+}
+
+static inline bool
+__cheri_host_is_subset(uintptr_t a, uintptr_t b)
+{
+        struct cheri_host_meta ma, mb;
+
+        if (a == 0 || b == 0)
+                return (false);
+        __cheri_host_meta_get(a, &ma);
+        __cheri_host_meta_get(b, &mb);
+
+        return (mb.base >= ma.base &&
+            mb.base + mb.length <= ma.base + ma.length &&
+            (mb.perms & ~ma.perms) == 0);
+}
+
+#define __cheri_host_retype(c, v) ((__typeof__(c))(uintptr_t)(v))
+
+/* Address and bounds */
+#define cheri_address_get(c)                                    \
+        ((ptraddr_t)((uintptr_t)(c) & CHERI_HOST_ADDR_MASK))
+#define cheri_address_set(c, a)                                 \
+        __cheri_host_retype(c,                                  \
+            __cheri_host_address_set((uintptr_t)(c), (ptraddr_t)(a)))
+#define cheri_base_get(c) (__cheri_host_meta((uintptr_t)(c)).base)
+#define cheri_length_get(c) (__cheri_host_meta((uintptr_t)(c)).length)
+#define cheri_offset_get(c)                                     \
+        ((size_t)(cheri_address_get(c) - cheri_base_get(c)))
+#define cheri_offset_set(c, o)                                  \
+        cheri_address_set(c, cheri_base_get(c) + (size_t)(o))
+#define cheri_bounds_set(c, l)                                  \
+        __cheri_host_retype(c, ((uintptr_t)(c) & CHERI_HOST_RESERVED) ? \
+            __cheri_host_bounds_set((uintptr_t)(c), (size_t)(l)) :     \
+            ((void)(l), (uintptr_t)(c)))
+#define cheri_bounds_set_exact(c, l)                            \
+        __cheri_host_retype(c,                                  \
+            __cheri_host_bounds_set((uintptr_t)(c), (size_t)(l)))
+#define cheri_representable_length(l) ((size_t)(l))
+#define cheri_representable_alignment_mask(l) ((void)(l), ~(size_t)0)
+
+#define cheri_align_up(x, a)                                    \
+        __cheri_host_retype(x,                                  \
+            ((uintptr_t)(x) + ((a) - 1)) & ~(uintptr_t)((a) - 1))
+#define cheri_align_down(x, a)                                  \
+        __cheri_host_retype(x, (uintptr_t)(x) & ~(uintptr_t)((a) - 1))
+#define cheri_is_aligned(x, a)                                  \
+        (((uintptr_t)(x) & (uintptr_t)((a) - 1)) == 0)
+
+/* Permissions */
+#define cheri_perms_get(c) (__cheri_host_meta((uintptr_t)(c)).perms)
+#define cheri_perms_and(c, p)                                   \
+        __cheri_host_retype(c,                                  \
+            __cheri_host_perms_and((uintptr_t)(c), (size_t)(p)))
+#define cheri_perms_clear(c, p)                                 \
+        __cheri_host_retype(c,                                  \
+            __cheri_host_perms_and((uintptr_t)(c), ~(size_t)(p)))
+
+/* Tag */
+#define cheri_tag_get(c) ((uintptr_t)(c) != 0)
+#define cheri_tag_clear(c) ((void)(c), (__typeof__(c))0)
+#define cheri_is_valid(c) cheri_tag_get(c)
+#define cheri_is_subset(a, b)                                   \
+        __cheri_host_is_subset((uintptr_t)(a), (uintptr_t)(b))
+#define cheri_is_equal_exact(a, b) ((uintptr_t)(a) == (uintptr_t)(b))
+
+/* Sealing */
+#define cheri_type_get(c) __cheri_host_type((uintptr_t)(c))
+#define cheri_is_sealed(c)                                      \
+        (cheri_type_get(c) != CHERI_OTYPE_UNSEALED)
+#define cheri_is_unsealed(c) (!cheri_is_sealed(c))
+#define cheri_is_sentry(c) ((void)(c), false)
+#define cheri_sentry_create(c) (c)
+#define cheri_seal(c, s)                                        \
+        __cheri_host_retype(c, __cheri_host_seal((uintptr_t)(c), \
+            (uintptr_t)(s)))
+#define cheri_unseal(c, s)                                      \
+        __cheri_host_retype(c, __cheri_host_unseal((uintptr_t)(c), \
+            (uintptr_t)(s)))
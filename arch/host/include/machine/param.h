@@ -0,0 +1,20 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+/*
+ * Machine parameters for the host backend.
+ */
+#include <unistd.h>
+
+#define PAGE_SIZE ((size_t)getpagesize())
+/* Only the base page size is reported, see getpagesizes() */
+#define MAXPAGESIZES 2
@@ -0,0 +1,28 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+#include_next <stdlib.h>
+
+int mergesort(void *base, size_t nmemb, size_t size,
+    int (*compar)(const void *, const void *));
+
+/*
+ * Heap allocations are bounded to their size as on CheriBSD,
+ * see cheriintrin.h.
+ */
+#define malloc(size) thunk_host_malloc(size)
+#define calloc(nmemb, size) thunk_host_calloc(nmemb, size)
+#define realloc(ptr, size) thunk_host_realloc(ptr, size)
+
+void *thunk_host_malloc(size_t size);
+void *thunk_host_calloc(size_t nmemb, size_t size);
+void *thunk_host_realloc(void *ptr, size_t size);
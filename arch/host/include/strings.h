@@ -0,0 +1,20 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+#include_next <strings.h>
+
+static inline int
+flsl(long mask)
+{
+        return (mask == 0 ? 0 :
+            (int)(sizeof(mask) * 8) - __builtin_clzl((unsigned long)mask));
+}
@@ -0,0 +1,42 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+/*
+ * FreeBSD mmap extensions for the host backend.
+ */
+#include_next <sys/mman.h>
+
+/*
+ * Reserve address space, no access is ever granted to the mapping.
+ * The reservation is returned as a capability that is never dereferenced,
+ * see cheriintrin.h, MAP_HOST_GUARD is not passed to the kernel.
+ */
+#define MAP_HOST_GUARD 0x01000000
+#define MAP_GUARD \
+        (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HOST_GUARD)
+/* Alignment requests are not honoured, see cheri_representable_length() */
+#define MAP_ALIGNED(n) 0
+#define MAP_ALIGNED_SUPER 0
+#define PROT_MAX(prot) 0
+#define PROT_CAP 0
+
+/* Anonymous shared memory objects, backed by memfd_create() */
+#define SHM_ANON ((const char *)1)
+#define shm_open(path, flags, mode) thunk_host_shm_open(path, flags, mode)
+
+#define mmap(addr, len, prot, flags, fd, offset) \
+        thunk_host_mmap(addr, len, prot, flags, fd, offset)
+
+void *thunk_host_mmap(void *addr, size_t len, int prot, int flags, int fd,
+    off_t offset);
+int thunk_host_shm_open(const char *path, int flags, mode_t mode);
+int getpagesizes(size_t *sizes, int nelem);
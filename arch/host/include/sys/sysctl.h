@@ -0,0 +1,21 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+/*
+ * The host backend only serves the sysctl nodes read by the runtime:
+ *  - security.cheri.sealcap, a sealing root capability for the user
+ *    object types, see cheri/cherireg.h.
+ */
+#include <stddef.h>
+
+int sysctlbyname(const char *name, void *oldp, size_t *oldlenp,
+    const void *newp, size_t newlen);
@@ -0,0 +1,149 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+#include <assert.h>
+#include <cheriintrin.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thunk.h"
+#include "arch/thunk-patch.h"
+
+/* Must match THUNK_HOST_ENTRY() in arch/thunk-asm.h */
+static_assert(sizeof(struct thunk_host_stub) == 24,
+    "Host entry stub out of sync with THUNK_HOST_ENTRY");
+static_assert(offsetof(struct thunk_host_stub, handler) == 16,
+    "Host entry stub out of sync with THUNK_HOST_ENTRY");
+
+static inline uint64_t *
+patch_point(const struct thunk_metaclass *mc, thunk_jit_t code_buf, int index)
+{
+        const thunk_reloc_t *r = &mc->relocs[index];
+        size_t offset;
+
+        // Check that the patch point is legal
+        // Note that the patch address is a label within the template
+        assert(r->addr >= (ptraddr_t)mc->template &&
+            r->addr - (ptraddr_t)mc->template + sizeof(uint64_t) <=
+            thunk_code_size(mc) && "Illegal patch point for relocation");
+        offset = r->addr - (ptraddr_t)mc->template;
+
+        // Literal slots are aligned within the template
+        assert(offset % sizeof(uint64_t) == 0 && "Misaligned patch");
+
+        return ((uint64_t *)(code_buf + offset));
+}
+
+int
+thunk_compile(thunk_jit_t code_buf, const struct thunk_class *tc)
+{
+        return (thunk_compile_at(code_buf,
+            (ptraddr_t)code_buf + tc->data_offset, tc));
+}
+
+int
+thunk_compile_at(thunk_jit_t code_buf, ptraddr_t data_addr,
+    const struct thunk_class *tc)
+{
+        const struct thunk_metaclass *mc = tc->mc;
+        const size_t code_size = thunk_code_size(mc);
+        int index = 0;
+
+        memcpy(code_buf, mc->template, code_size);
+
+        while (index < mc->relocs_count) {
+                uint64_t *pp = patch_point(mc, code_buf, index);
+
+                switch (mc->relocs[index].type) {
+                case THUNK_REL_IMM:
+                        *pp = tc->reloc_data[index].u64;
+                        break;
+                case THUNK_REL_ADR: {
+                        /*
+                         * The relocation is an offset from the start of
+                         * the object, rebase it on the data location.
+                         */
+                        ptraddr_t target = data_addr +
+                            (tc->reloc_data[index].u32 - tc->data_offset);
+
+                        *pp = (int64_t)(target - (ptraddr_t)pp);
+                        break;
+                }
+                default:
+                        assert(0 && "Unsupported thunk relocation");
+                        memset(code_buf, 0, code_size);
+                        return (1);
+                }
+                index++;
+        }
+        /* The code buffer may be recycled, e.g. from an arena */
+        __builtin___clear_cache((char *)code_buf,
+            (char *)code_buf + code_size);
+
+        return (0);
+}
+
+void *
+thunk_host_data_entry(void *arg, const struct thunk_host_stub *stub,
+    void *arg2)
+{
+        const struct thunk_host_data_code *code =
+            (const struct thunk_host_data_code *)stub;
+        char *data = thunk_host_adr(&code->data);
+        struct cheri_host_meta meta;
+
+        __cheri_host_meta_get((uintptr_t)stub - code->entry_offset, &meta);
+        meta.length = meta.base + meta.length - cheri_address_get(data);
+        meta.base = cheri_address_get(data);
+        meta.perms &= ~code->clear_perms;
+
+        return ((void *)__cheri_host_derive((uintptr_t)data, &meta));
+}
+
+/*
+ * Host stubs can not replay the original call after resolving the
+ * object, lazy objects are compiled when they are installed.
+ */
+
+size_t
+thunk_arch_lazy_code_size(const struct thunk_metaclass *mc)
+{
+        return (thunk_code_size(mc));
+}
+
+void
+thunk_arch_lazy_install(struct thunk_class *tc, void *obj)
+{
+        if (tc->image_code != NULL) {
+                memcpy(obj, tc->image_code, thunk_code_size(tc->mc));
+                __builtin___clear_cache((char *)obj,
+                    (char *)obj + thunk_code_size(tc->mc));
+        } else if (thunk_compile(obj, tc)) {
+                abort();
+        }
+}
+
+bool
+thunk_arch_lazy_pending(const struct thunk_class *tc, const void *obj)
+{
+        return (false);
+}
+
+void
+thunk_arch_lazy_commit(const struct thunk_class *tc, void *obj,
+    thunk_template_t compiled)
+{
+        const size_t code_size = thunk_code_size(tc->mc);
+
+        memcpy(obj, compiled, code_size);
+        __builtin___clear_cache((char *)obj, (char *)obj + code_size);
+}
@@ -0,0 +1,100 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Latency samples collected by a benchmark run.
+ */
+struct bench_samples {
+        uint64_t *ns;
+        size_t count;
+        size_t size;
+};
+
+static inline uint64_t
+bench_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec);
+}
+
+static inline void
+bench_samples_init(struct bench_samples *s, size_t size)
+{
+        s->ns = malloc(size * sizeof(uint64_t));
+        if (s->ns == NULL) {
+                fprintf(stderr, "Failed to allocate benchmark samples\n");
+                abort();
+        }
+        s->count = 0;
+        s->size = size;
+}
+
+static inline void
+bench_samples_fini(struct bench_samples *s)
+{
+        free(s->ns);
+        s->ns = NULL;
+}
+
+static inline void
+bench_samples_add(struct bench_samples *s, uint64_t ns)
+{
+        if (s->count < s->size)
+                s->ns[s->count++] = ns;
+}
+
+static inline int
+bench_cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+
+        return ((x > y) - (x < y));
+}
+
+static inline uint64_t
+bench_percentile(const struct bench_samples *s, double p)
+{
+        size_t index;
+
+        if (s->count == 0)
+                return (0);
+        index = (size_t)(p * (s->count - 1));
+        return (s->ns[index]);
+}
+
+/**
+ * Sort the samples and print a single result line.
+ */
+static inline void
+bench_samples_report(struct bench_samples *s, const char *name)
+{
+        uint64_t total = 0;
+        size_t i;
+
+        qsort(s->ns, s->count, sizeof(uint64_t), bench_cmp_u64);
+        for (i = 0; i < s->count; i++)
+                total += s->ns[i];
+
+        printf("%-32s n=%-8zu mean=%-8lu p50=%-8lu p99=%-8lu p999=%-8lu "
+            "max=%lu (ns)\n", name, s->count,
+            s->count ? total / s->count : 0,
+            bench_percentile(s, 0.5), bench_percentile(s, 0.99),
+            bench_percentile(s, 0.999), bench_percentile(s, 1.0));
+}
@@ -0,0 +1,156 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Object creation with a non-trivial constructor, thunk_malloc()
+ * compiles the code and runs the constructor for every object while
+ * thunk_clone() copies an initialised prototype.
+ *
+ * The class reuses the hello metaclass in an arena, the constructor
+ * builds a CRC32 lookup table in the object data.
+ *
+ * usage: bench_clone [-n objects] [-s]
+ */
+#include <cheriintrin.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hello/hello.h"
+#include "bench.h"
+
+struct crc_data {
+        uint32_t table[256];
+};
+
+static void
+crc_ctor(void *obj_data)
+{
+        struct crc_data *data = obj_data;
+        uint32_t c;
+        int i, k;
+
+        for (i = 0; i < 256; i++) {
+                c = i;
+                for (k = 0; k < 8; k++)
+                        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                data->table[i] = c;
+        }
+}
+
+static struct thunk_class *
+crc_class(unsigned int arena_flags)
+{
+        struct thunk_metaclass *mc = hello_class->mc;
+        struct thunk_class *tc;
+
+        tc = thunk_level_malloc(sizeof(*tc) +
+            mc->relocs_count * sizeof(thunk_reloc_data_t),
+            THUNK_LEVEL_PRIVATE);
+        if (tc == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        tc->mc = mc;
+        tc->ctor = crc_ctor;
+        tc->dtor = NULL;
+        tc->pool = NULL;
+        tc->arena = NULL;
+        tc->image_code = NULL;
+        thunk_class_layout(tc, sizeof(struct crc_data), 0);
+        tc->reloc_data[0].u32 = tc->data_offset;
+        if (thunk_class_use_arena(tc, arena_flags) != 0) {
+                fprintf(stderr, "Failed to set up the arena\n");
+                exit(1);
+        }
+
+        return (tc);
+}
+
+static void
+run(const char *name, unsigned int arena_flags, size_t n)
+{
+        struct thunk_class *tc = crc_class(arena_flags);
+        thunk_object_t proto, *objs;
+        uint64_t start, malloc_ns, clone_ns;
+        size_t i;
+
+        objs = calloc(n, sizeof(*objs));
+        if (objs == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+
+        /* Warm up the arena chunks for both runs */
+        for (i = 0; i < n; i++)
+                objs[i] = thunk_malloc(tc);
+        for (i = 0; i < n; i++)
+                thunk_free(tc, objs[i]);
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                objs[i] = thunk_malloc(tc);
+        malloc_ns = bench_now_ns() - start;
+        for (i = 0; i < n; i++)
+                thunk_free(tc, objs[i]);
+
+        proto = thunk_malloc(tc);
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                objs[i] = thunk_clone(tc, proto);
+        clone_ns = bench_now_ns() - start;
+        for (i = 0; i < n; i++) {
+                if (thunk_object_unwrap(objs[i]) == NULL) {
+                        fprintf(stderr, "Failed to clone object\n");
+                        exit(1);
+                }
+                thunk_free(tc, objs[i]);
+        }
+        thunk_free(tc, proto);
+
+        printf("%-24s objects=%-8zu ns/object malloc=%.0f clone=%.0f "
+            "speedup=%.2fx\n", name, n, (double)malloc_ns / n,
+            (double)clone_ns / n, (double)malloc_ns / clone_ns);
+
+        free(objs);
+        thunk_level_free(tc);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t n = 10000;
+        int split = 0;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:s")) != -1) {
+                switch (opt) {
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 's':
+                        split = 1;
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n objects] [-s]\n",
+                            argv[0]);
+                        return (1);
+                }
+        }
+
+        run("clone/arena", 0, n);
+        if (split)
+                run("clone/split", THUNK_ARENA_SPLIT, n);
+
+        return (0);
+}
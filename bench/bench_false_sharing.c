@@ -0,0 +1,164 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Threads write through pointers returned by separate gate objects of
+ * the same class, with and without cache line padding of the objects.
+ *
+ * The gates are allocated from a split arena, where the data slots of
+ * consecutive objects are adjacent, so that the packed counters share
+ * cache lines while the padded counters have lines of their own.
+ *
+ * usage: bench_false_sharing [-t threads] [-n writes per thread]
+ */
+#include <cheriintrin.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+#define MAX_THREADS 64
+
+struct counter {
+        volatile long value;
+};
+
+struct worker {
+        pthread_t thread;
+        pthread_barrier_t *barrier;
+        thunk_gate_t gate;
+        thunk_token_t token;
+        size_t n;
+};
+
+static void *
+worker_main(void *arg)
+{
+        struct worker *w = arg;
+        struct counter *c;
+        size_t i;
+
+        c = thunk_gate_invoke(w->gate, w->token);
+        pthread_barrier_wait(w->barrier);
+        for (i = 0; i < w->n; i++)
+                c->value++;
+
+        return (NULL);
+}
+
+/**
+ * Check whether the counters of neighbouring workers share cache lines
+ * as expected by the run.
+ */
+static bool
+check_sharing(struct worker *workers, int nthreads, bool shared)
+{
+        ptraddr_t line, next;
+        int i;
+
+        for (i = 0; i + 1 < nthreads; i += 2) {
+                line = cheri_address_get(thunk_gate_invoke(workers[i].gate,
+                    workers[i].token)) / THUNK_CACHE_LINE_SIZE;
+                next = cheri_address_get(thunk_gate_invoke(
+                    workers[i + 1].gate, workers[i + 1].token)) /
+                    THUNK_CACHE_LINE_SIZE;
+                if ((line == next) != shared)
+                        return (false);
+        }
+
+        return (true);
+}
+
+static void
+run(const char *name, unsigned int flags, bool shared, int nthreads,
+    size_t n)
+{
+        struct worker workers[MAX_THREADS];
+        pthread_barrier_t barrier;
+        thunk_gate_class_t gc;
+        thunk_token_t token;
+        uint64_t start, elapsed;
+        int i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct counter), flags);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        token = thunk_gateclass_token(gc);
+        pthread_barrier_init(&barrier, NULL, nthreads + 1);
+
+        /* Consecutive allocations land in neighbouring arena slots */
+        for (i = 0; i < nthreads; i++) {
+                workers[i].barrier = &barrier;
+                workers[i].gate = thunk_gate_alloc(gc);
+                workers[i].token = token;
+                workers[i].n = n;
+        }
+        if (!check_sharing(workers, nthreads, shared)) {
+                fprintf(stderr, "%s: counters %s cache lines\n", name,
+                    shared ? "do not share" : "share");
+                exit(1);
+        }
+        for (i = 0; i < nthreads; i++)
+                pthread_create(&workers[i].thread, NULL, worker_main,
+                    &workers[i]);
+
+        pthread_barrier_wait(&barrier);
+        start = bench_now_ns();
+        for (i = 0; i < nthreads; i++)
+                pthread_join(workers[i].thread, NULL);
+        elapsed = bench_now_ns() - start;
+
+        printf("%-24s threads=%-4d writes/s=%.0f\n", name, nthreads,
+            (double)nthreads * n * 1e9 / elapsed);
+
+        for (i = 0; i < nthreads; i++)
+                thunk_gate_free(gc, workers[i].gate);
+        pthread_barrier_destroy(&barrier);
+}
+
+int
+main(int argc, char *argv[])
+{
+        int nthreads = 4;
+        size_t n = 100000000;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+                switch (opt) {
+                case 't':
+                        nthreads = atoi(optarg);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-t threads] [-n writes]\n",
+                            argv[0]);
+                        return (1);
+                }
+        }
+        if (nthreads < 1 || nthreads > MAX_THREADS) {
+                fprintf(stderr, "Invalid number of threads\n");
+                return (1);
+        }
+
+        run("write/packed", THUNK_GATE_SPLIT, true, nthreads, n);
+        run("write/padded", THUNK_GATE_SPLIT | THUNK_GATE_PAD_DATA, false,
+            nthreads, n);
+
+        return (0);
+}
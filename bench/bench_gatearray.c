@@ -0,0 +1,201 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Compare a table of N records protected by N separate gate objects
+ * with the same table protected by a single gate array object.
+ *
+ * Memory is reported as the growth of the maximum resident set size
+ * while the table is built, so each mode should be run in a fresh
+ * process with -m for accurate numbers.
+ *
+ * usage: bench_gatearray [-e elements] [-n invocations] [-m mode|all]
+ */
+#include <cheriintrin.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+struct record {
+        long key;
+        long value;
+};
+
+static long
+maxrss_kb(void)
+{
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_maxrss);
+}
+
+static uint32_t *
+make_order(size_t nelems, size_t n)
+{
+        uint32_t *order;
+        size_t i;
+
+        order = malloc(n * sizeof(*order));
+        if (order == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        /* Pre-compute the access pattern to keep random() out of the loop */
+        srandom(42);
+        for (i = 0; i < n; i++)
+                order[i] = random() % nelems;
+
+        return (order);
+}
+
+static void
+run_objects(size_t nelems, size_t n)
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t *gates;
+        thunk_token_t token;
+        struct record *r;
+        uint32_t *order;
+        uint64_t start, elapsed;
+        long rss;
+        size_t i;
+        long sum = 0;
+
+        order = make_order(nelems, n);
+        gates = malloc(nelems * sizeof(*gates));
+        if (gates == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+
+        rss = maxrss_kb();
+        gc = thunk_gateclass_create(sizeof(struct record));
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        token = thunk_gateclass_token(gc);
+        for (i = 0; i < nelems; i++) {
+                gates[i] = thunk_gate_alloc(gc);
+                r = thunk_gate_invoke(gates[i], token);
+                r->key = i;
+        }
+        rss = maxrss_kb() - rss;
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++) {
+                r = thunk_gate_invoke(gates[order[i]], token);
+                sum += r->key;
+        }
+        elapsed = bench_now_ns() - start;
+
+        printf("%-20s elements=%-8zu rss-kb=%-8ld ns/invoke=%.2f (%ld)\n",
+            "table/objects", nelems, rss, (double)elapsed / n, sum);
+
+        for (i = 0; i < nelems; i++)
+                thunk_gate_free(gc, gates[i]);
+        thunk_gateclass_destroy(gc);
+        free(gates);
+        free(order);
+}
+
+static void
+run_array(size_t nelems, size_t n)
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        thunk_token_t root_token, *tokens;
+        struct record *r;
+        uint32_t *order;
+        uint64_t start, elapsed;
+        long rss;
+        size_t i;
+        long sum = 0;
+
+        order = make_order(nelems, n);
+        tokens = malloc(nelems * sizeof(*tokens));
+        if (tokens == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+
+        rss = maxrss_kb();
+        gc = thunk_gatearray_create(sizeof(struct record), nelems, 0);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate array class\n");
+                exit(1);
+        }
+        gate = thunk_gate_alloc(gc);
+        root_token = thunk_gateclass_token(gc);
+        for (i = 0; i < nelems; i++) {
+                /* Clients hold element tokens rather than the root token */
+                tokens[i] = thunk_token_for_index(struct record, i,
+                    root_token);
+                r = thunk_gate_invoke(gate, tokens[i]);
+                r->key = i;
+        }
+        rss = maxrss_kb() - rss;
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++) {
+                r = thunk_gate_invoke(gate, tokens[order[i]]);
+                sum += r->key;
+        }
+        elapsed = bench_now_ns() - start;
+
+        printf("%-20s elements=%-8zu rss-kb=%-8ld ns/invoke=%.2f (%ld)\n",
+            "table/array", nelems, rss, (double)elapsed / n, sum);
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+        free(tokens);
+        free(order);
+}
+
+int
+main(int argc, char *argv[])
+{
+        const char *mode = "all";
+        size_t nelems = 65536;
+        size_t n = 10000000;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "e:n:m:")) != -1) {
+                switch (opt) {
+                case 'e':
+                        nelems = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 'm':
+                        mode = optarg;
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-e elements] [-n invokes] "
+                            "[-m objects|array|all]\n", argv[0]);
+                        return (1);
+                }
+        }
+
+        if (strcmp(mode, "objects") == 0 || strcmp(mode, "all") == 0)
+                run_objects(nelems, n);
+        if (strcmp(mode, "array") == 0 || strcmp(mode, "all") == 0)
+                run_array(nelems, n);
+
+        return (0);
+}
@@ -0,0 +1,112 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Cost of the gate class handle authentication.
+ *
+ * Time thunk_gate_alloc() and thunk_gate_free() pairs and root token
+ * fetches, which only authenticate the handle, with an increasing number
+ * of live gate classes. The cost should not depend on the number of
+ * classes.
+ *
+ * usage: bench_gateauth [-c max classes] [-n iterations]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+static void
+run(thunk_gate_class_t *classes, size_t nclasses, size_t n)
+{
+        thunk_gate_class_t gc = classes[nclasses - 1];
+        thunk_gate_t gate;
+        uint64_t start, alloc_ns, token_ns;
+        size_t i;
+        long sum = 0;
+
+        /* Warm up the class arena */
+        gate = thunk_gate_alloc(gc);
+        thunk_gate_free(gc, gate);
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++) {
+                gate = thunk_gate_alloc(gc);
+                thunk_gate_free(gc, gate);
+        }
+        alloc_ns = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                sum += cheri_length_get(thunk_gateclass_token(
+                    classes[i % nclasses]));
+        token_ns = bench_now_ns() - start;
+
+        printf("classes=%-8zu ns/alloc+free=%-8.1f ns/token=%.2f (%ld)\n",
+            nclasses, (double)alloc_ns / n, (double)token_ns / n, sum);
+}
+
+int
+main(int argc, char *argv[])
+{
+        thunk_gate_class_t *classes;
+        size_t max_classes = 4096;
+        size_t n = 1000000;
+        size_t nclasses, i;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+                switch (opt) {
+                case 'c':
+                        max_classes = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-c classes] "
+                            "[-n iterations]\n", argv[0]);
+                        return (1);
+                }
+        }
+        if (max_classes == 0) {
+                fprintf(stderr, "Invalid number of classes\n");
+                return (1);
+        }
+
+        classes = calloc(max_classes, sizeof(*classes));
+        if (classes == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return (1);
+        }
+        nclasses = 0;
+        for (i = 1; i <= max_classes; i *= 8) {
+                for (; nclasses < i; nclasses++) {
+                        classes[nclasses] = thunk_gateclass_create(
+                            sizeof(long) * (nclasses % 8 + 1));
+                        if (classes[nclasses].class == NULL) {
+                                fprintf(stderr, "Failed to create gate "
+                                    "class\n");
+                                return (1);
+                        }
+                }
+                run(classes, nclasses, n);
+        }
+
+        for (i = 0; i < nclasses; i++)
+                thunk_gateclass_destroy(classes[i]);
+        free(classes);
+
+        return (0);
+}
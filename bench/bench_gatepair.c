@@ -0,0 +1,195 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Compare N gate objects, each with its own copy of the gate code,
+ * with N gate pairs of a shared code class.
+ *
+ * Memory is reported as the growth of the maximum resident set size
+ * while the objects are allocated, so each mode should be run in a
+ * fresh process with -m for accurate numbers.
+ *
+ * usage: bench_gatepair [-g gates] [-n invocations] [-m mode|all]
+ */
+#include <cheriintrin.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+struct bench_data {
+        long value[4];
+};
+
+static long
+maxrss_kb(void)
+{
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_maxrss);
+}
+
+static uint32_t *
+make_order(size_t ngates, size_t n)
+{
+        uint32_t *order;
+        size_t i;
+
+        order = malloc(n * sizeof(*order));
+        if (order == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        /* Pre-compute the access pattern to keep random() out of the loop */
+        srandom(42);
+        for (i = 0; i < n; i++)
+                order[i] = random() % ngates;
+
+        return (order);
+}
+
+static void
+run_objects(size_t ngates, size_t n)
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t *gates;
+        thunk_token_t token;
+        uint32_t *order;
+        uint64_t start, elapsed;
+        size_t i;
+        long rss;
+        long sum = 0;
+
+        gates = malloc(ngates * sizeof(*gates));
+        if (gates == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        order = make_order(ngates, n);
+
+        rss = maxrss_kb();
+        gc = thunk_gateclass_create(sizeof(struct bench_data));
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        token = thunk_gateclass_token(gc);
+        for (i = 0; i < ngates; i++) {
+                gates[i] = thunk_gate_alloc(gc);
+                sum += *(long *)thunk_gate_invoke(gates[i], token);
+        }
+        rss = maxrss_kb() - rss;
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                sum += *(long *)thunk_gate_invoke(gates[order[i]], token);
+        elapsed = bench_now_ns() - start;
+
+        printf("%-16s gates=%-8zu rss-kb=%-8ld ns/invoke=%.2f (%ld)\n",
+            "gate/objects", ngates, rss, (double)elapsed / n, sum);
+
+        for (i = 0; i < ngates; i++)
+                thunk_gate_free(gc, gates[i]);
+        thunk_gateclass_destroy(gc);
+        free(order);
+        free(gates);
+}
+
+static void
+run_pairs(size_t ngates, size_t n)
+{
+        thunk_gate_class_t gc;
+        thunk_gatepair_t *pairs;
+        thunk_token_t token;
+        uint32_t *order;
+        uint64_t start, elapsed;
+        size_t i;
+        long rss;
+        long sum = 0;
+
+        pairs = malloc(ngates * sizeof(*pairs));
+        if (pairs == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        order = make_order(ngates, n);
+
+        rss = maxrss_kb();
+        gc = thunk_gateclass_create_flags(sizeof(struct bench_data),
+            THUNK_GATE_SHARED_CODE);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        token = thunk_gateclass_token(gc);
+        for (i = 0; i < ngates; i++) {
+                pairs[i] = thunk_gatepair_alloc(gc);
+                sum += *(long *)thunk_gatepair_invoke(pairs[i], token);
+        }
+        rss = maxrss_kb() - rss;
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                sum += *(long *)thunk_gatepair_invoke(pairs[order[i]], token);
+        elapsed = bench_now_ns() - start;
+
+        printf("%-16s gates=%-8zu rss-kb=%-8ld ns/invoke=%.2f (%ld)\n",
+            "gate/pairs", ngates, rss, (double)elapsed / n, sum);
+
+        for (i = 0; i < ngates; i++)
+                thunk_gatepair_free(gc, &pairs[i]);
+        thunk_gateclass_destroy(gc);
+        free(order);
+        free(pairs);
+}
+
+int
+main(int argc, char *argv[])
+{
+        const char *mode = "all";
+        size_t ngates = 100000;
+        size_t n = 10000000;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "g:n:m:")) != -1) {
+                switch (opt) {
+                case 'g':
+                        ngates = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 'm':
+                        mode = optarg;
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-g gates] [-n invokes] "
+                            "[-m objects|pairs|all]\n", argv[0]);
+                        return (1);
+                }
+        }
+        if (ngates == 0) {
+                fprintf(stderr, "Invalid number of gates\n");
+                return (1);
+        }
+
+        if (strcmp(mode, "objects") == 0 || strcmp(mode, "all") == 0)
+                run_objects(ngates, n);
+        if (strcmp(mode, "pairs") == 0 || strcmp(mode, "all") == 0)
+                run_pairs(ngates, n);
+
+        return (0);
+}
@@ -0,0 +1,161 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Cost of rehydrating delegated tokens from a table of token handles
+ * against loading them from a table of stored tokens.
+ *
+ * The tables hold one element token per gate array element and are
+ * walked in a random order, each token is used for a gate invocation.
+ * The load rows only fetch the token, the invoke rows also invoke the
+ * gate with it.
+ *
+ * usage: bench_handle [-n tokens] [-r rounds]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15UL;
+
+static uint64_t
+rng_next(void)
+{
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 7;
+        rng_state ^= rng_state << 17;
+        return (rng_state);
+}
+
+static void
+report(const char *name, size_t table_size, size_t n, uint64_t elapsed,
+    unsigned long sum)
+{
+        printf("%-24s lookups=%-10zu table_kb=%-8zu ns/token=%.2f (%lu)\n",
+            name, n, table_size / 1024, (double)elapsed / n, sum);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t ntokens = 1 << 20;
+        int rounds = 4;
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        thunk_token_t *tokens;
+        thunk_token_handle_t *handles;
+        size_t *order;
+        uint64_t start, elapsed;
+        size_t i, j, n, tmp;
+        unsigned long sum;
+        int opt, r;
+
+        while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        ntokens = strtoul(optarg, NULL, 0);
+                        break;
+                case 'r':
+                        rounds = atoi(optarg);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n tokens] [-r rounds]\n",
+                            argv[0]);
+                        return (1);
+                }
+        }
+
+        gc = thunk_gatearray_create(sizeof(long), ntokens, 0);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate array class\n");
+                return (1);
+        }
+        gate = thunk_gate_alloc(gc);
+        tokens = malloc(ntokens * sizeof(*tokens));
+        handles = malloc(ntokens * sizeof(*handles));
+        order = malloc(ntokens * sizeof(*order));
+        if (tokens == NULL || handles == NULL || order == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return (1);
+        }
+        for (i = 0; i < ntokens; i++) {
+                tokens[i] = thunk_gatearray_token(gc, i);
+                handles[i] = thunk_token_handle(gc, tokens[i]);
+                if (handles[i] == THUNK_NULL_TOKEN_HANDLE) {
+                        fprintf(stderr, "Failed to encode token handle\n");
+                        return (1);
+                }
+                *(long *)thunk_gate_invoke(gate, tokens[i]) = i;
+                order[i] = i;
+        }
+        for (i = ntokens - 1; i > 0; i--) {
+                j = rng_next() % (i + 1);
+                tmp = order[i];
+                order[i] = order[j];
+                order[j] = tmp;
+        }
+        n = ntokens * rounds;
+
+        sum = 0;
+        start = bench_now_ns();
+        for (r = 0; r < rounds; r++) {
+                for (i = 0; i < ntokens; i++)
+                        sum += cheri_address_get(tokens[order[i]]);
+        }
+        elapsed = bench_now_ns() - start;
+        report("handle/load-token", ntokens * sizeof(*tokens), n, elapsed,
+            sum);
+
+        sum = 0;
+        start = bench_now_ns();
+        for (r = 0; r < rounds; r++) {
+                for (i = 0; i < ntokens; i++)
+                        sum += cheri_address_get(thunk_token_rehydrate(gc,
+                            handles[order[i]]));
+        }
+        elapsed = bench_now_ns() - start;
+        report("handle/rehydrate", ntokens * sizeof(*handles), n, elapsed,
+            sum);
+
+        sum = 0;
+        start = bench_now_ns();
+        for (r = 0; r < rounds; r++) {
+                for (i = 0; i < ntokens; i++)
+                        sum += *(long *)thunk_gate_invoke(gate,
+                            tokens[order[i]]);
+        }
+        elapsed = bench_now_ns() - start;
+        report("handle/invoke-token", ntokens * sizeof(*tokens), n, elapsed,
+            sum);
+
+        sum = 0;
+        start = bench_now_ns();
+        for (r = 0; r < rounds; r++) {
+                for (i = 0; i < ntokens; i++)
+                        sum += *(long *)thunk_gate_invoke(gate,
+                            thunk_token_rehydrate(gc, handles[order[i]]));
+        }
+        elapsed = bench_now_ns() - start;
+        report("handle/invoke-rehydrate", ntokens * sizeof(*handles), n,
+            elapsed, sum);
+
+        free(order);
+        free(handles);
+        free(tokens);
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+
+        return (0);
+}
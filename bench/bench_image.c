@@ -0,0 +1,185 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Startup time of many thunk classes built at runtime (cold) and loaded
+ * from a class image (warm).
+ *
+ * Each class reuses the hello metaclass with a different data size.
+ * Startup includes the class setup and the first object of each class.
+ *
+ * usage: bench_image [-c classes] [-f image path]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hello/hello.h"
+#include "bench.h"
+
+#define NAME_SIZE 32
+/* Data size of the i-th class, mixes small and multi-line objects */
+#define CLASS_DATA_SIZE(i) (16 * ((i) % 64 + 1))
+
+static struct thunk_class **
+classes_alloc(size_t nclasses)
+{
+        struct thunk_class **classes;
+        struct thunk_metaclass *mc = hello_class->mc;
+        size_t i;
+
+        classes = calloc(nclasses, sizeof(*classes));
+        if (classes == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        for (i = 0; i < nclasses; i++) {
+                classes[i] = thunk_level_malloc(sizeof(*classes[i]) +
+                    mc->relocs_count * sizeof(thunk_reloc_data_t),
+                    THUNK_LEVEL_PRIVATE);
+                classes[i]->mc = mc;
+                classes[i]->ctor = NULL;
+                classes[i]->dtor = NULL;
+                classes[i]->pool = NULL;
+                classes[i]->arena = NULL;
+                classes[i]->image_code = NULL;
+        }
+
+        return (classes);
+}
+
+static void
+classes_free(struct thunk_class **classes, thunk_object_t *objs,
+    size_t nclasses)
+{
+        size_t i;
+
+        for (i = 0; i < nclasses; i++) {
+                thunk_free(classes[i], objs[i]);
+                thunk_level_free(classes[i]);
+        }
+        free(classes);
+}
+
+static uint64_t
+run_cold(struct thunk_class **classes, thunk_object_t *objs, size_t nclasses)
+{
+        uint64_t start;
+        size_t i;
+
+        start = bench_now_ns();
+        for (i = 0; i < nclasses; i++) {
+                thunk_class_layout(classes[i], CLASS_DATA_SIZE(i), 0);
+#if defined(__aarch64__)
+                classes[i]->reloc_data[0].u32 = classes[i]->data_offset;
+#endif
+                objs[i] = thunk_malloc(classes[i]);
+        }
+
+        return (bench_now_ns() - start);
+}
+
+static uint64_t
+run_warm(const char *path, struct thunk_class **classes, thunk_object_t *objs,
+    size_t nclasses)
+{
+        struct thunk_image *img;
+        char name[NAME_SIZE];
+        uint64_t start, elapsed;
+        size_t i;
+
+        start = bench_now_ns();
+        img = thunk_image_open(path);
+        if (img == NULL) {
+                fprintf(stderr, "Failed to open class image\n");
+                exit(1);
+        }
+        for (i = 0; i < nclasses; i++) {
+                snprintf(name, sizeof(name), "class%zu", i);
+                if (thunk_image_load_class(img, name, classes[i],
+                    CLASS_DATA_SIZE(i), 0) != 0) {
+                        fprintf(stderr, "Failed to load %s\n", name);
+                        exit(1);
+                }
+                objs[i] = thunk_malloc(classes[i]);
+        }
+        elapsed = bench_now_ns() - start;
+        thunk_image_close(img);
+
+        return (elapsed);
+}
+
+int
+main(int argc, char *argv[])
+{
+        const char *path = "/tmp/bench_image.img";
+        struct thunk_class **classes;
+        thunk_object_t *objs;
+        char (*names)[NAME_SIZE];
+        const char **name_ptrs;
+        uint64_t cold, warm;
+        size_t nclasses = 1000;
+        size_t i;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "c:f:")) != -1) {
+                switch (opt) {
+                case 'c':
+                        nclasses = strtoul(optarg, NULL, 0);
+                        break;
+                case 'f':
+                        path = optarg;
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-c classes] "
+                            "[-f image path]\n", argv[0]);
+                        return (1);
+                }
+        }
+
+        objs = calloc(nclasses, sizeof(*objs));
+        names = calloc(nclasses, sizeof(*names));
+        name_ptrs = calloc(nclasses, sizeof(*name_ptrs));
+        if (objs == NULL || names == NULL || name_ptrs == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return (1);
+        }
+        for (i = 0; i < nclasses; i++) {
+                snprintf(names[i], NAME_SIZE, "class%zu", i);
+                name_ptrs[i] = names[i];
+        }
+
+        classes = classes_alloc(nclasses);
+        cold = run_cold(classes, objs, nclasses);
+        if (thunk_image_save(path, name_ptrs, classes, nclasses) != 0) {
+                fprintf(stderr, "Failed to save class image\n");
+                return (1);
+        }
+        classes_free(classes, objs, nclasses);
+
+        classes = classes_alloc(nclasses);
+        warm = run_warm(path, classes, objs, nclasses);
+        classes_free(classes, objs, nclasses);
+        unlink(path);
+
+        printf("startup/cold classes=%-8zu us=%.1f us/class=%.3f\n", nclasses,
+            cold / 1e3, cold / 1e3 / nclasses);
+        printf("startup/warm classes=%-8zu us=%.1f us/class=%.3f\n", nclasses,
+            warm / 1e3, warm / 1e3 / nclasses);
+
+        free(name_ptrs);
+        free(names);
+        free(objs);
+
+        return (0);
+}
@@ -0,0 +1,131 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Invoke many gate objects at random, comparing gate objects allocated
+ * from base page arenas and from superpage arenas, with the gate code
+ * next to its data or packed in split arenas.
+ *
+ * This reports the mean time per invoke; iTLB misses should be collected
+ * by running each mode under hwpmc, e.g.
+ * pmcstat -p ITLB_WALK -p CPU_CYCLES bench_itlb -m superpage
+ *
+ * usage: bench_itlb [-g gates] [-n invocations] [-m mode|all]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+struct bench_data {
+        long value[4];
+};
+
+static const struct {
+        const char *mode;
+        const char *name;
+        unsigned int flags;
+} modes[] = {
+        { "base", "invoke/base-pages", 0 },
+        { "superpage", "invoke/superpages", THUNK_GATE_SUPERPAGE },
+        { "split", "invoke/split-base-pages", THUNK_GATE_SPLIT },
+        { "split-superpage", "invoke/split-superpages",
+          THUNK_GATE_SPLIT | THUNK_GATE_SUPERPAGE },
+};
+
+static void
+run(const char *name, unsigned int flags, size_t ngates, size_t n)
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t *gates;
+        thunk_token_t token;
+        uint32_t *order;
+        uint64_t start, elapsed;
+        size_t i;
+        long sum = 0;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct bench_data), flags);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        token = thunk_gateclass_token(gc);
+
+        gates = malloc(ngates * sizeof(*gates));
+        order = malloc(n * sizeof(*order));
+        if (gates == NULL || order == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        for (i = 0; i < ngates; i++)
+                gates[i] = thunk_gate_alloc(gc);
+        /* Pre-compute the access pattern to keep random() out of the loop */
+        srandom(42);
+        for (i = 0; i < n; i++)
+                order[i] = random() % ngates;
+
+        /* Warm up */
+        for (i = 0; i < ngates; i++)
+                sum += *(long *)thunk_gate_invoke(gates[i], token);
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                sum += *(long *)thunk_gate_invoke(gates[order[i]], token);
+        elapsed = bench_now_ns() - start;
+
+        printf("%-24s gates=%-8zu invokes=%-10zu ns/invoke=%.2f (%ld)\n",
+            name, ngates, n, (double)elapsed / n, sum);
+
+        for (i = 0; i < ngates; i++)
+                thunk_gate_free(gc, gates[i]);
+        free(order);
+        free(gates);
+}
+
+int
+main(int argc, char *argv[])
+{
+        const char *mode = "all";
+        size_t ngates = 16384;
+        size_t n = 10000000;
+        size_t i;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "g:n:m:")) != -1) {
+                switch (opt) {
+                case 'g':
+                        ngates = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 'm':
+                        mode = optarg;
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-g gates] [-n invokes] "
+                            "[-m mode|all]\n", argv[0]);
+                        return (1);
+                }
+        }
+
+        for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+                if (strcmp(mode, modes[i].mode) == 0 ||
+                    strcmp(mode, "all") == 0)
+                        run(modes[i].name, modes[i].flags, ngates, n);
+        }
+
+        return (0);
+}
@@ -0,0 +1,110 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Compare gate objects compiled at allocation (eager) with gate objects
+ * compiled on the first invocation (lazy).
+ *
+ * This reports the mean allocation time, the mean latency of the first
+ * invocation of each object and the steady-state invocation latency.
+ *
+ * usage: bench_lazy [-g gates] [-n invocations]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+struct bench_data {
+        long value[4];
+};
+
+static void
+run(const char *name, unsigned int flags, size_t ngates, size_t n)
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t *gates;
+        thunk_token_t token;
+        uint64_t start, alloc_ns, first_ns, steady_ns;
+        size_t i;
+        long sum = 0;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct bench_data), flags);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        token = thunk_gateclass_token(gc);
+        gates = malloc(ngates * sizeof(*gates));
+        if (gates == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+
+        start = bench_now_ns();
+        for (i = 0; i < ngates; i++)
+                gates[i] = thunk_gate_alloc(gc);
+        alloc_ns = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        for (i = 0; i < ngates; i++)
+                sum += *(long *)thunk_gate_invoke(gates[i], token);
+        first_ns = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                sum += *(long *)thunk_gate_invoke(gates[i % ngates], token);
+        steady_ns = bench_now_ns() - start;
+
+        printf("%-12s gates=%-8zu ns/alloc=%-8.1f ns/first-invoke=%-8.1f "
+            "ns/invoke=%.2f (%ld)\n", name, ngates, (double)alloc_ns / ngates,
+            (double)first_ns / ngates, (double)steady_ns / n, sum);
+
+        for (i = 0; i < ngates; i++)
+                thunk_gate_free(gc, gates[i]);
+        thunk_gateclass_destroy(gc);
+        free(gates);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t ngates = 16384;
+        size_t n = 10000000;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "g:n:")) != -1) {
+                switch (opt) {
+                case 'g':
+                        ngates = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-g gates] [-n invokes]\n",
+                            argv[0]);
+                        return (1);
+                }
+        }
+        if (ngates == 0) {
+                fprintf(stderr, "Invalid number of gates\n");
+                return (1);
+        }
+
+        run("gate/eager", 0, ngates, n);
+        run("gate/lazy", THUNK_GATE_LAZY, ngates, n);
+
+        return (0);
+}
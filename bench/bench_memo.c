@@ -0,0 +1,108 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Invoke cost of memoised gate invocations against a gate invocation,
+ * for a single hot token and for more tokens than memo cache entries.
+ *
+ * usage: bench_memo [-n invocations]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+/* More field tokens than memo cache entries */
+#define BENCH_TOKENS 1024
+
+struct bench_data {
+        long value[BENCH_TOKENS];
+};
+
+enum bench_mode {
+        BENCH_DIRECT,
+        BENCH_CACHED,
+};
+
+static void
+run_invoke(const char *name, enum bench_mode mode, size_t ntokens, size_t n)
+{
+        thunk_token_t tokens[BENCH_TOKENS];
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        thunk_token_t root;
+        uint64_t start, elapsed;
+        size_t i;
+        long sum = 0;
+
+        gc = thunk_gateclass_create(sizeof(struct bench_data));
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        gate = thunk_gate_alloc(gc);
+        root = thunk_gateclass_token(gc);
+        for (i = 0; i < ntokens; i++) {
+                tokens[i] = cheri_bounds_set_exact(cheri_offset_set(root,
+                    i * sizeof(long)), sizeof(long));
+        }
+
+        /* Warm up */
+        for (i = 0; i < ntokens; i++)
+                sum += *(long *)thunk_gate_invoke_cached(gc, gate, tokens[i]);
+
+        start = bench_now_ns();
+        if (mode == BENCH_DIRECT) {
+                for (i = 0; i < n; i++)
+                        sum += *(long *)thunk_gate_invoke(gate,
+                            tokens[i % ntokens]);
+        } else {
+                for (i = 0; i < n; i++)
+                        sum += *(long *)thunk_gate_invoke_cached(gc, gate,
+                            tokens[i % ntokens]);
+        }
+        elapsed = bench_now_ns() - start;
+
+        printf("%-24s invokes=%-10zu ns/invoke=%.2f (%ld)\n", name, n,
+            (double)elapsed / n, sum);
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+        thunk_gate_memo_flush();
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t n = 100000000;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n invokes]\n", argv[0]);
+                        return (1);
+                }
+        }
+
+        run_invoke("invoke/gate", BENCH_DIRECT, 1, n);
+        run_invoke("invoke/memo-hit", BENCH_CACHED, 1, n);
+        run_invoke("invoke/gate-spread", BENCH_DIRECT, BENCH_TOKENS, n);
+        run_invoke("invoke/memo-spread", BENCH_CACHED, BENCH_TOKENS, n);
+
+        return (0);
+}
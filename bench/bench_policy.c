@@ -0,0 +1,118 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Instruction count and invoke cost of gate templates generated from
+ * access policies, against the generic gate template.
+ *
+ * usage: bench_policy [-n invocations]
+ */
+#include <cheriintrin.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cheri/cherireg.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+struct bench_data {
+        long key;
+        long value[3];
+};
+
+static const struct {
+        const char *name;
+        struct thunk_gate_policy policy;
+} policies[] = {
+        { "invoke/policy-generic", {
+                .flags = THUNK_GATE_POLICY_CHECK_SPACE,
+                .perms = THUNK_TOKEN_MAX_PERMS } },
+        { "invoke/policy-read-only", {
+                .flags = THUNK_GATE_POLICY_CHECK_SPACE |
+                    THUNK_GATE_POLICY_READ_ONLY,
+                .perms = THUNK_TOKEN_MAX_PERMS } },
+        { "invoke/policy-fixed-field", {
+                .flags = THUNK_GATE_POLICY_CHECK_SPACE |
+                    THUNK_GATE_POLICY_FIXED_BOUNDS |
+                    THUNK_GATE_POLICY_FIXED_PERMS,
+                .perms = CHERI_PERM_GLOBAL | CHERI_PERM_LOAD,
+                .offset = offsetof(struct bench_data, key),
+                .length = sizeof(long) } },
+        { "invoke/policy-unchecked", {
+                .flags = THUNK_GATE_POLICY_FIXED_BOUNDS |
+                    THUNK_GATE_POLICY_FIXED_PERMS,
+                .perms = CHERI_PERM_GLOBAL | CHERI_PERM_LOAD,
+                .offset = offsetof(struct bench_data, key),
+                .length = sizeof(long) } },
+};
+
+static void
+run(const char *name, thunk_gate_class_t gc, size_t n)
+{
+        thunk_gate_t gate;
+        thunk_token_t token;
+        uint64_t start, elapsed;
+        size_t i;
+        long sum = 0;
+
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        gate = thunk_gate_alloc(gc);
+        token = thunk_gateclass_token(gc);
+
+        /* Warm up */
+        sum += *(long *)thunk_gate_invoke(gate, token);
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                sum += *(long *)thunk_gate_invoke(gate, token);
+        elapsed = bench_now_ns() - start;
+
+        printf("%-28s insns=%-4zu invokes=%-10zu ns/invoke=%.2f (%ld)\n",
+            name, thunk_gateclass_code_size(gc) / sizeof(uint32_t), n,
+            (double)elapsed / n, sum);
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t n = 100000000;
+        size_t i;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n invokes]\n", argv[0]);
+                        return (1);
+                }
+        }
+
+        run("invoke/gate", thunk_gateclass_create(sizeof(struct bench_data)),
+            n);
+        for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+                run(policies[i].name, thunk_gateclass_create_policy(
+                    sizeof(struct bench_data), &policies[i].policy, 0), n);
+        }
+
+        return (0);
+}
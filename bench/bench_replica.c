@@ -0,0 +1,150 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Threads bump a counter through a gate, with a single shared gate
+ * object against a replicated gate object, for increasing numbers of
+ * threads. The replicated counter is summed with thunk_gate_reduce().
+ *
+ * usage: bench_replica [-t max threads] [-n updates per thread]
+ */
+#include <cheriintrin.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+#define MAX_THREADS 64
+
+struct counter {
+        long value;
+};
+
+struct worker {
+        pthread_t thread;
+        pthread_barrier_t *barrier;
+        thunk_gate_t gate;
+        thunk_token_t token;
+        size_t n;
+};
+
+static void *
+worker_main(void *arg)
+{
+        struct worker *w = arg;
+        struct counter *c;
+        size_t i;
+
+        pthread_barrier_wait(w->barrier);
+        for (i = 0; i < w->n; i++) {
+                c = thunk_gate_invoke(w->gate, w->token);
+                __atomic_fetch_add(&c->value, 1, __ATOMIC_RELAXED);
+        }
+
+        return (NULL);
+}
+
+static void
+counter_sum(void *replica, void *arg)
+{
+        *(long *)arg += __atomic_load_n(&((struct counter *)replica)->value,
+            __ATOMIC_RELAXED);
+}
+
+static void
+run(const char *name, unsigned int flags, int nthreads, size_t n)
+{
+        struct worker workers[MAX_THREADS];
+        pthread_barrier_t barrier;
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        thunk_token_t token;
+        uint64_t start, elapsed;
+        long total = 0;
+        int i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct counter), flags);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        gate = thunk_gate_alloc(gc);
+        token = thunk_gateclass_token(gc);
+        pthread_barrier_init(&barrier, NULL, nthreads + 1);
+        for (i = 0; i < nthreads; i++) {
+                workers[i].barrier = &barrier;
+                workers[i].gate = gate;
+                workers[i].token = token;
+                workers[i].n = n;
+                pthread_create(&workers[i].thread, NULL, worker_main,
+                    &workers[i]);
+        }
+
+        pthread_barrier_wait(&barrier);
+        start = bench_now_ns();
+        for (i = 0; i < nthreads; i++)
+                pthread_join(workers[i].thread, NULL);
+        elapsed = bench_now_ns() - start;
+
+        if (flags & THUNK_GATE_REPLICATED)
+                thunk_gate_reduce(gc, gate, token, counter_sum, &total);
+        else
+                counter_sum(thunk_gate_invoke(gate, token), &total);
+        if (total != (long)(nthreads * n)) {
+                fprintf(stderr, "Lost counter updates\n");
+                exit(1);
+        }
+
+        printf("%-24s threads=%-4d updates/s=%.0f\n", name, nthreads,
+            (double)nthreads * n * 1e9 / elapsed);
+
+        pthread_barrier_destroy(&barrier);
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+int
+main(int argc, char *argv[])
+{
+        int max_threads = 8;
+        size_t n = 10000000;
+        int nthreads, opt;
+
+        while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+                switch (opt) {
+                case 't':
+                        max_threads = atoi(optarg);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-t threads] [-n updates]\n",
+                            argv[0]);
+                        return (1);
+                }
+        }
+        if (max_threads < 1 || max_threads > MAX_THREADS) {
+                fprintf(stderr, "Invalid number of threads\n");
+                return (1);
+        }
+
+        for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+                /* Keep the shared counter off the gate code lines too */
+                run("update/shared", THUNK_GATE_PAD_DATA, nthreads, n);
+                run("update/replicated", THUNK_GATE_REPLICATED, nthreads, n);
+        }
+
+        return (0);
+}
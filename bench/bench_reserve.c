@@ -0,0 +1,99 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Gate object allocation latency with and without a reserved pool.
+ *
+ * usage: bench_reserve [-n allocations] [-s object size]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+static void
+run(const char *name, size_t size, size_t n,
+    const struct thunk_pool_config *config)
+{
+        struct bench_samples samples;
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        uint64_t start;
+        size_t i;
+
+        gc = thunk_gateclass_create(size);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        if (config != NULL && thunk_gateclass_reserve_config(gc, config)) {
+                fprintf(stderr, "Failed to reserve gate objects\n");
+                exit(1);
+        }
+
+        bench_samples_init(&samples, n);
+        for (i = 0; i < n; i++) {
+                start = bench_now_ns();
+                gate = thunk_gate_alloc(gc);
+                bench_samples_add(&samples, bench_now_ns() - start);
+                if (thunk_object_unwrap(gate.obj) == NULL) {
+                        fprintf(stderr, "Failed to allocate gate object\n");
+                        exit(1);
+                }
+        }
+        bench_samples_report(&samples, name);
+        bench_samples_fini(&samples);
+
+        if (config != NULL)
+                thunk_gateclass_reserve_trim(gc, 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+        struct thunk_pool_config config;
+        size_t n = 10000;
+        size_t size = 64;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 's':
+                        size = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n allocs] [-s size]\n",
+                            argv[0]);
+                        return (1);
+                }
+        }
+
+        run("alloc/no-reserve", size, n, NULL);
+
+        config.low_watermark = 0;
+        config.high_watermark = n;
+        config.background = false;
+        run("alloc/reserve", size, n, &config);
+
+        /* Smaller pool kept topped up by the refill thread */
+        config.low_watermark = n / 8;
+        config.high_watermark = n / 4;
+        config.background = true;
+        run("alloc/reserve-background", size, n, &config);
+
+        return (0);
+}
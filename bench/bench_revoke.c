@@ -0,0 +1,118 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Invoke cost of the gate template with token generations against the
+ * plain gate template, and the latency of a token revocation.
+ *
+ * usage: bench_revoke [-n invocations]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+struct bench_data {
+        long value[4];
+};
+
+static void
+run_invoke(const char *name, unsigned int flags, size_t n)
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        thunk_token_t token;
+        uint64_t start, elapsed;
+        size_t i;
+        long sum = 0;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct bench_data), flags);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        gate = thunk_gate_alloc(gc);
+        token = thunk_gate_token(gc, gate);
+
+        /* Warm up */
+        sum += *(long *)thunk_gate_invoke(gate, token);
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                sum += *(long *)thunk_gate_invoke(gate, token);
+        elapsed = bench_now_ns() - start;
+
+        printf("%-24s invokes=%-10zu ns/invoke=%.2f (%ld)\n", name, n,
+            (double)elapsed / n, sum);
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+static void
+run_revoke(void)
+{
+        struct bench_samples samples;
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        uint64_t start;
+        size_t i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct bench_data),
+            THUNK_GATE_GENERATION);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class\n");
+                exit(1);
+        }
+        gate = thunk_gate_alloc(gc);
+
+        bench_samples_init(&samples, THUNK_GATE_GENERATIONS - 1);
+        for (i = 0; i < THUNK_GATE_GENERATIONS - 1; i++) {
+                start = bench_now_ns();
+                if (thunk_gate_revoke(gc, gate)) {
+                        fprintf(stderr, "Failed to revoke gate tokens\n");
+                        exit(1);
+                }
+                bench_samples_add(&samples, bench_now_ns() - start);
+        }
+        bench_samples_report(&samples, "revoke/generation");
+        bench_samples_fini(&samples);
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t n = 100000000;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n invokes]\n", argv[0]);
+                        return (1);
+                }
+        }
+
+        run_invoke("invoke/gate", 0, n);
+        run_invoke("invoke/gate-generation", THUNK_GATE_GENERATION, n);
+        run_revoke();
+
+        return (0);
+}
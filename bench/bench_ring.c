@@ -0,0 +1,322 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Producer to consumer record throughput and latency through the gate
+ * ring buffer, where records are filled and read in place, against a
+ * queue with the same slot protocol that copies records in and out.
+ *
+ * usage: bench_ring [-n records] [-s record size] [-d ring slots]
+ */
+#include <cheriintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "thunk-ring.h"
+#include "bench.h"
+
+/* Sample the latency of one record every LATENCY_STRIDE */
+#define LATENCY_STRIDE 16
+
+struct record {
+        uint64_t stamp;
+        uint64_t payload[];
+};
+
+/**
+ * Copying queue, with the slot protocol of the gate ring.
+ */
+struct copy_queue {
+        uint64_t *seq;
+        char *buf;
+        size_t rec_size;
+        uint64_t mask;
+        char pad0[64];
+        uint64_t tail;
+        char pad1[64];
+        uint64_t head;
+        char pad2[64];
+};
+
+enum bench_mode {
+        BENCH_RING,
+        BENCH_COPY,
+};
+
+struct stage {
+        pthread_t thread;
+        pthread_barrier_t *barrier;
+        enum bench_mode mode;
+        struct thunk_ring *ring;
+        struct copy_queue *queue;
+        size_t rec_size;
+        size_t n;
+        struct bench_samples samples;
+        uint64_t sum;
+};
+
+static struct copy_queue *
+copy_queue_create(size_t rec_size, size_t nslots)
+{
+        struct copy_queue *q;
+        size_t i;
+
+        q = calloc(1, sizeof(*q));
+        if (q != NULL) {
+                q->seq = malloc(nslots * sizeof(*q->seq));
+                q->buf = malloc(nslots * rec_size);
+        }
+        if (q == NULL || q->seq == NULL || q->buf == NULL) {
+                fprintf(stderr, "Failed to allocate copy queue\n");
+                exit(1);
+        }
+        q->rec_size = rec_size;
+        q->mask = nslots - 1;
+        for (i = 0; i < nslots; i++)
+                q->seq[i] = i;
+
+        return (q);
+}
+
+static void
+copy_queue_destroy(struct copy_queue *q)
+{
+        free(q->buf);
+        free(q->seq);
+        free(q);
+}
+
+static char *
+copy_queue_claim(struct copy_queue *q, uint64_t *pos, uint64_t lag,
+    uint64_t **seqp)
+{
+        uint64_t cur, seq;
+
+        cur = __atomic_load_n(pos, __ATOMIC_RELAXED);
+        for (;;) {
+                seq = __atomic_load_n(&q->seq[cur & q->mask], __ATOMIC_ACQUIRE);
+                if (seq == cur + lag) {
+                        if (__atomic_compare_exchange_n(pos, &cur, cur + 1,
+                            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                                *seqp = &q->seq[cur & q->mask];
+                                return (q->buf + (cur & q->mask) * q->rec_size);
+                        }
+                } else if ((int64_t)(seq - (cur + lag)) < 0) {
+                        return (NULL);
+                } else {
+                        cur = __atomic_load_n(pos, __ATOMIC_RELAXED);
+                }
+        }
+}
+
+static bool
+copy_queue_push(struct copy_queue *q, const void *rec)
+{
+        uint64_t *seq;
+        char *slot;
+
+        slot = copy_queue_claim(q, &q->tail, 0, &seq);
+        if (slot == NULL)
+                return (false);
+        memcpy(slot, rec, q->rec_size);
+        __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+
+        return (true);
+}
+
+static bool
+copy_queue_pop(struct copy_queue *q, void *rec)
+{
+        uint64_t *seq;
+        char *slot;
+
+        slot = copy_queue_claim(q, &q->head, 1, &seq);
+        if (slot == NULL)
+                return (false);
+        memcpy(rec, slot, q->rec_size);
+        __atomic_store_n(seq, *seq + q->mask, __ATOMIC_RELEASE);
+
+        return (true);
+}
+
+static void
+record_fill(struct record *r, size_t rec_size, size_t i)
+{
+        size_t k;
+
+        for (k = 0; k < (rec_size - sizeof(*r)) / sizeof(uint64_t); k++)
+                r->payload[k] = i + k;
+        r->stamp = bench_now_ns();
+}
+
+static uint64_t
+record_read(struct stage *s, const struct record *r, size_t i)
+{
+        uint64_t sum = 0;
+        size_t k;
+
+        for (k = 0; k < (s->rec_size - sizeof(*r)) / sizeof(uint64_t); k++)
+                sum += r->payload[k];
+        if (i % LATENCY_STRIDE == 0)
+                bench_samples_add(&s->samples, bench_now_ns() - r->stamp);
+
+        return (sum);
+}
+
+static void *
+producer_main(void *arg)
+{
+        struct stage *s = arg;
+        thunk_gate_t gate;
+        thunk_token_t slot;
+        struct record *local;
+        size_t i;
+
+        local = malloc(s->rec_size);
+        pthread_barrier_wait(s->barrier);
+        for (i = 0; i < s->n; i++) {
+                if (s->mode == BENCH_RING) {
+                        gate = thunk_ring_gate(s->ring);
+                        while ((slot = thunk_ring_produce(s->ring)) == NULL)
+                                sched_yield();
+                        record_fill(thunk_gate_invoke(gate, slot),
+                            s->rec_size, i);
+                        thunk_ring_publish(s->ring, slot);
+                } else {
+                        record_fill(local, s->rec_size, i);
+                        while (!copy_queue_push(s->queue, local))
+                                sched_yield();
+                }
+        }
+        free(local);
+
+        return (NULL);
+}
+
+static void *
+consumer_main(void *arg)
+{
+        struct stage *s = arg;
+        thunk_gate_t gate;
+        thunk_token_t slot;
+        struct record *local;
+        size_t i;
+
+        local = malloc(s->rec_size);
+        pthread_barrier_wait(s->barrier);
+        for (i = 0; i < s->n; i++) {
+                if (s->mode == BENCH_RING) {
+                        gate = thunk_ring_gate(s->ring);
+                        while ((slot = thunk_ring_consume(s->ring)) == NULL)
+                                sched_yield();
+                        s->sum += record_read(s,
+                            thunk_gate_invoke(gate, slot), i);
+                        thunk_ring_release(s->ring, slot);
+                } else {
+                        while (!copy_queue_pop(s->queue, local))
+                                sched_yield();
+                        s->sum += record_read(s, local, i);
+                }
+        }
+        free(local);
+
+        return (NULL);
+}
+
+static void
+run(const char *name, enum bench_mode mode, size_t rec_size, size_t depth,
+    size_t n)
+{
+        struct stage producer, consumer;
+        pthread_barrier_t barrier;
+        char label[64];
+        uint64_t start, elapsed;
+
+        memset(&producer, 0, sizeof(producer));
+        producer.barrier = &barrier;
+        producer.mode = mode;
+        producer.rec_size = rec_size;
+        producer.n = n;
+        if (mode == BENCH_RING) {
+                producer.ring = thunk_ring_create(rec_size, depth, 0);
+                if (producer.ring == NULL) {
+                        fprintf(stderr, "Failed to create ring\n");
+                        exit(1);
+                }
+        } else {
+                producer.queue = copy_queue_create(rec_size, depth);
+        }
+        consumer = producer;
+        bench_samples_init(&consumer.samples, n / LATENCY_STRIDE + 1);
+        pthread_barrier_init(&barrier, NULL, 3);
+
+        pthread_create(&producer.thread, NULL, producer_main, &producer);
+        pthread_create(&consumer.thread, NULL, consumer_main, &consumer);
+        pthread_barrier_wait(&barrier);
+        start = bench_now_ns();
+        pthread_join(producer.thread, NULL);
+        pthread_join(consumer.thread, NULL);
+        elapsed = bench_now_ns() - start;
+
+        printf("%-24s records=%-10zu size=%-6zu records/s=%.0f (%lu)\n", name,
+            n, rec_size, (double)n * 1e9 / elapsed, consumer.sum);
+        snprintf(label, sizeof(label), "%s/latency", name);
+        bench_samples_report(&consumer.samples, label);
+
+        bench_samples_fini(&consumer.samples);
+        pthread_barrier_destroy(&barrier);
+        if (mode == BENCH_RING)
+                thunk_ring_destroy(producer.ring);
+        else
+                copy_queue_destroy(producer.queue);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t n = 10000000;
+        size_t rec_size = 256;
+        size_t depth = 256;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:s:d:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 's':
+                        rec_size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'd':
+                        depth = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n records] "
+                            "[-s record size] [-d ring slots]\n", argv[0]);
+                        return (1);
+                }
+        }
+        if (rec_size < sizeof(struct record) || rec_size % sizeof(uint64_t) ||
+            depth == 0 || (depth & (depth - 1)) != 0) {
+                fprintf(stderr, "Invalid record size or ring depth\n");
+                return (1);
+        }
+
+        run("ring/zero-copy", BENCH_RING, rec_size, depth, n);
+        run("ring/copy", BENCH_COPY, rec_size, depth, n);
+
+        return (0);
+}
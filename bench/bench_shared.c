@@ -0,0 +1,237 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Throughput of handing a table of records to a forked worker, either
+ * in place through a shared gate array or by copying the records
+ * through a pipe.
+ *
+ * The parent rewrites the table and hands it to the worker, which sums
+ * the records, for the given number of rounds.
+ *
+ * usage: bench_shared [-e records] [-r rounds]
+ */
+#include <cheriintrin.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+struct record {
+        long key;
+        long value[7];
+};
+
+static void
+xwrite(int fd, const void *buf, size_t len)
+{
+        const char *p = buf;
+        ssize_t n;
+
+        while (len > 0) {
+                n = write(fd, p, len);
+                if (n <= 0) {
+                        perror("write");
+                        exit(1);
+                }
+                p += n;
+                len -= n;
+        }
+}
+
+static void
+xread(int fd, void *buf, size_t len)
+{
+        char *p = buf;
+        ssize_t n;
+
+        while (len > 0) {
+                n = read(fd, p, len);
+                if (n <= 0) {
+                        perror("read");
+                        exit(1);
+                }
+                p += n;
+                len -= n;
+        }
+}
+
+static long
+sum_records(const struct record *r, size_t nelems)
+{
+        long sum = 0;
+        size_t i;
+
+        for (i = 0; i < nelems; i++)
+                sum += r[i].key + r[i].value[0];
+
+        return (sum);
+}
+
+static void
+fill_records(struct record *r, size_t nelems, size_t round)
+{
+        size_t i;
+
+        for (i = 0; i < nelems; i++) {
+                r[i].key = i;
+                r[i].value[0] = round;
+        }
+}
+
+static void
+report(const char *name, size_t nelems, size_t rounds, uint64_t elapsed)
+{
+        printf("%-20s records=%-8zu rounds=%-6zu MB/s=%.1f\n", name, nelems,
+            rounds, (double)nelems * sizeof(struct record) * rounds * 1e3 /
+            elapsed);
+}
+
+static void
+wait_child(pid_t pid)
+{
+        int status;
+
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "Worker failed\n");
+                exit(1);
+        }
+}
+
+/*
+ * The parent and the worker ping-pong over a pair of pipes, only
+ * one byte travels per round, the records stay in place.
+ */
+static void
+run_shared(size_t nelems, size_t rounds)
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        thunk_token_t token;
+        struct record *table;
+        int to_child[2], to_parent[2];
+        uint64_t start;
+        size_t i;
+        long sum;
+        char c = 0;
+        pid_t pid;
+
+        gc = thunk_gatearray_create(sizeof(struct record), nelems,
+            THUNK_GATE_SHARED);
+        if (gc.class == NULL) {
+                fprintf(stderr, "Failed to create shared gate array\n");
+                exit(1);
+        }
+        gate = thunk_gate_alloc(gc);
+        token = thunk_gateclass_token(gc);
+        if (pipe(to_child) != 0 || pipe(to_parent) != 0) {
+                perror("pipe");
+                exit(1);
+        }
+
+        pid = fork();
+        if (pid == 0) {
+                table = thunk_gate_invoke(gate, token);
+                for (i = 0; i < rounds; i++) {
+                        xread(to_child[0], &c, 1);
+                        sum = sum_records(table, nelems);
+                        xwrite(to_parent[1], &sum, sizeof(sum));
+                }
+                _exit(0);
+        }
+
+        table = thunk_gate_invoke(gate, token);
+        start = bench_now_ns();
+        for (i = 0; i < rounds; i++) {
+                fill_records(table, nelems, i);
+                xwrite(to_child[1], &c, 1);
+                xread(to_parent[0], &sum, sizeof(sum));
+        }
+        report("handoff/shared", nelems, rounds, bench_now_ns() - start);
+        wait_child(pid);
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+static void
+run_pipe(size_t nelems, size_t rounds)
+{
+        struct record *table;
+        int to_child[2], to_parent[2];
+        uint64_t start;
+        size_t i;
+        long sum;
+        pid_t pid;
+
+        table = malloc(nelems * sizeof(*table));
+        if (table == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        if (pipe(to_child) != 0 || pipe(to_parent) != 0) {
+                perror("pipe");
+                exit(1);
+        }
+
+        pid = fork();
+        if (pid == 0) {
+                for (i = 0; i < rounds; i++) {
+                        xread(to_child[0], table, nelems * sizeof(*table));
+                        sum = sum_records(table, nelems);
+                        xwrite(to_parent[1], &sum, sizeof(sum));
+                }
+                _exit(0);
+        }
+
+        start = bench_now_ns();
+        for (i = 0; i < rounds; i++) {
+                fill_records(table, nelems, i);
+                xwrite(to_child[1], table, nelems * sizeof(*table));
+                xread(to_parent[0], &sum, sizeof(sum));
+        }
+        report("handoff/pipe", nelems, rounds, bench_now_ns() - start);
+        wait_child(pid);
+
+        free(table);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t nelems = 4096;
+        size_t rounds = 1000;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "e:r:")) != -1) {
+                switch (opt) {
+                case 'e':
+                        nelems = strtoul(optarg, NULL, 0);
+                        break;
+                case 'r':
+                        rounds = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-e records] [-r rounds]\n",
+                            argv[0]);
+                        return (1);
+                }
+        }
+
+        run_shared(nelems, rounds);
+        run_pipe(nelems, rounds);
+
+        return (0);
+}
@@ -0,0 +1,178 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Object memory of a spread of payload sizes allocated with a fixed
+ * class data size, sized for the largest payload, against per-object
+ * data sizes with thunk_malloc_size().
+ *
+ * Both runs reuse the hello metaclass, object sizes are the layout
+ * sizes, excluding the rounding of the thunk_xmalloc() hook.
+ *
+ * usage: bench_sized [-n objects]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hello/hello.h"
+#include "bench.h"
+
+/**
+ * Payload size spread, each bucket is picked with the given weight
+ * out of 100 and sizes are uniform within the bucket.
+ */
+struct spread {
+        const char *name;
+        size_t max_size;
+        struct {
+                unsigned int weight;
+                size_t min;
+                size_t max;
+        } buckets[3];
+};
+
+static const struct spread spreads[] = {
+        /* Short names and keys, some messages and a few long lines */
+        { "strings", 256, {
+            { 60, 4, 24 }, { 30, 25, 96 }, { 10, 97, 256 } } },
+        /* Small headers, typical rows and a tail of large records */
+        { "records", 1024, {
+            { 50, 32, 128 }, { 35, 129, 512 }, { 15, 513, 1024 } } },
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15UL;
+
+static uint64_t
+rng_next(void)
+{
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 7;
+        rng_state ^= rng_state << 17;
+        return (rng_state);
+}
+
+static size_t
+spread_size(const struct spread *sp)
+{
+        unsigned int pick = rng_next() % 100;
+        int i;
+
+        for (i = 0; i < 2 && pick >= sp->buckets[i].weight; i++)
+                pick -= sp->buckets[i].weight;
+
+        return (sp->buckets[i].min +
+            rng_next() % (sp->buckets[i].max - sp->buckets[i].min + 1));
+}
+
+static struct thunk_class *
+spread_class(const struct spread *sp)
+{
+        struct thunk_metaclass *mc = hello_class->mc;
+        struct thunk_class *tc;
+
+        tc = thunk_level_malloc(sizeof(*tc) +
+            mc->relocs_count * sizeof(thunk_reloc_data_t),
+            THUNK_LEVEL_PRIVATE);
+        if (tc == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        tc->mc = mc;
+        tc->ctor = NULL;
+        tc->dtor = NULL;
+        tc->pool = NULL;
+        tc->arena = NULL;
+        tc->image_code = NULL;
+        thunk_class_layout(tc, sp->max_size, 0);
+        tc->reloc_data[0].u32 = tc->data_offset;
+
+        return (tc);
+}
+
+static void
+run(const struct spread *sp, size_t n)
+{
+        struct thunk_class *tc = spread_class(sp);
+        thunk_object_t *objs;
+        size_t *sizes;
+        size_t fixed = 0, sized = 0;
+        uint64_t start, fixed_ns, sized_ns;
+        char name[64];
+        size_t i;
+
+        objs = calloc(n, sizeof(*objs));
+        sizes = calloc(n, sizeof(*sizes));
+        if (objs == NULL || sizes == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        for (i = 0; i < n; i++)
+                sizes[i] = spread_size(sp);
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                objs[i] = thunk_malloc(tc);
+        fixed_ns = bench_now_ns() - start;
+        for (i = 0; i < n; i++) {
+                fixed += tc->object_size;
+                thunk_free(tc, objs[i]);
+        }
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+                objs[i] = thunk_malloc_size(tc, sizes[i], NULL);
+        sized_ns = bench_now_ns() - start;
+        for (i = 0; i < n; i++) {
+                if (thunk_object_unwrap(objs[i]) == NULL) {
+                        fprintf(stderr, "Failed to allocate sized object\n");
+                        exit(1);
+                }
+                sized += thunk_class_object_size(tc, sizes[i]);
+                thunk_free(tc, objs[i]);
+        }
+
+        snprintf(name, sizeof(name), "sized/%s", sp->name);
+        printf("%-24s objects=%-8zu fixed=%-10zu sized=%-10zu "
+            "saved=%.1f%% ns/alloc fixed=%.0f sized=%.0f\n", name, n,
+            fixed, sized, 100.0 * (fixed - sized) / fixed,
+            (double)fixed_ns / n, (double)sized_ns / n);
+
+        free(sizes);
+        free(objs);
+        thunk_level_free(tc);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t n = 10000;
+        size_t i;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:")) != -1) {
+                switch (opt) {
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-n objects]\n", argv[0]);
+                        return (1);
+                }
+        }
+
+        for (i = 0; i < sizeof(spreads) / sizeof(spreads[0]); i++)
+                run(&spreads[i], n);
+
+        return (0);
+}
@@ -0,0 +1,390 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Multi-threaded stress test of the gate lifecycle.
+ *
+ * Each thread runs a random mix of gate class creations, gate object
+ * allocations, invocations through derived field tokens and frees, in
+ * the given ratios. The run is repeated for 1, 2, 4... up to the given
+ * number of threads to report the throughput scaling.
+ *
+ * Every gate object carries the signature of its owner, which is
+ * checked on each invocation and before the object is freed, so that
+ * objects handed out twice or corrupted under contention abort the run.
+ *
+ * Lock wait times are only reported when the runtime is built with
+ * the LOCK_STATS option.
+ *
+ * usage: bench_stress [-t max threads] [-n ops per thread]
+ *                     [-r create:alloc:invoke:free]
+ */
+#include <cheriintrin.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thunk-gate.h"
+#include "bench.h"
+
+#define MAX_THREADS 64
+#define MAX_CLASSES 8
+#define MAX_LIVE 1024
+
+#define stress_cap_ok(cap, len)                                 \
+        (cheri_tag_get(cap) && cheri_length_get(cap) == (len))
+
+enum stress_op {
+        OP_CREATE,
+        OP_ALLOC,
+        OP_INVOKE,
+        OP_FREE,
+        OP_COUNT
+};
+
+static const size_t class_sizes[] = { 16, 48, 200, 1000 };
+
+struct stress_gate {
+        int class_index;
+        thunk_gate_t gate;
+        uint64_t signature;
+};
+
+struct stress_class {
+        thunk_gate_class_t gc;
+        size_t size;
+};
+
+struct worker {
+        pthread_t thread;
+        pthread_barrier_t *barrier;
+        unsigned int id;
+        uint64_t rng;
+        size_t n;
+        const unsigned int *ratios;
+        uint64_t seq;
+        struct stress_class classes[MAX_CLASSES];
+        int nclasses;
+        struct stress_gate live[MAX_LIVE];
+        size_t nlive;
+        uint64_t ops[OP_COUNT];
+};
+
+static void
+stress_fail(struct worker *w, const char *msg)
+{
+        fprintf(stderr, "thread %u: %s\n", w->id, msg);
+        abort();
+}
+
+static uint64_t
+stress_random(struct worker *w)
+{
+        /* xorshift64, keeps the libc random() lock out of the way */
+        w->rng ^= w->rng << 13;
+        w->rng ^= w->rng >> 7;
+        w->rng ^= w->rng << 17;
+        return (w->rng);
+}
+
+/**
+ * Fetch the object data through the root token and check its bounds.
+ */
+static uint64_t *
+stress_data(struct worker *w, struct stress_gate *g)
+{
+        struct stress_class *c = &w->classes[g->class_index];
+        uint64_t *data;
+
+        data = thunk_gate_invoke(g->gate, thunk_gateclass_token(c->gc));
+        if (!stress_cap_ok(data, c->size))
+                stress_fail(w, "Invalid gate object data capability");
+
+        return (data);
+}
+
+static void
+stress_check(struct worker *w, struct stress_gate *g)
+{
+        struct stress_class *c = &w->classes[g->class_index];
+        uint64_t *data = stress_data(w, g);
+
+        if (data[0] != g->signature ||
+            data[c->size / sizeof(uint64_t) - 1] != g->signature)
+                stress_fail(w, "Gate object signature mismatch");
+}
+
+static void
+stress_free(struct worker *w, size_t index)
+{
+        struct stress_gate *g = &w->live[index];
+
+        stress_check(w, g);
+        thunk_gate_free(w->classes[g->class_index].gc, g->gate);
+        w->live[index] = w->live[--w->nlive];
+        w->ops[OP_FREE]++;
+}
+
+static void
+stress_create(struct worker *w)
+{
+        struct stress_class *c;
+        int index;
+        size_t i;
+
+        if (w->nclasses < MAX_CLASSES) {
+                index = w->nclasses++;
+        } else {
+                /* Recycle a class slot, dropping its objects first */
+                index = stress_random(w) % MAX_CLASSES;
+                for (i = 0; i < w->nlive; ) {
+                        if (w->live[i].class_index == index)
+                                stress_free(w, i);
+                        else
+                                i++;
+                }
+                thunk_gateclass_destroy(w->classes[index].gc);
+        }
+
+        c = &w->classes[index];
+        c->size = class_sizes[stress_random(w) %
+            (sizeof(class_sizes) / sizeof(class_sizes[0]))];
+        c->gc = thunk_gateclass_create(c->size);
+        if (c->gc.class == NULL)
+                stress_fail(w, "Failed to create gate class");
+        if (!stress_cap_ok(thunk_gateclass_token(c->gc), c->size))
+                stress_fail(w, "Invalid root token length");
+        w->ops[OP_CREATE]++;
+}
+
+static void
+stress_alloc(struct worker *w)
+{
+        struct stress_gate *g;
+        struct stress_class *c;
+        uint64_t *data;
+        size_t i;
+
+        if (w->nclasses == 0) {
+                stress_create(w);
+                return;
+        }
+        if (w->nlive == MAX_LIVE) {
+                stress_free(w, stress_random(w) % w->nlive);
+                return;
+        }
+
+        g = &w->live[w->nlive];
+        g->class_index = stress_random(w) % w->nclasses;
+        c = &w->classes[g->class_index];
+        g->gate = thunk_gate_alloc(c->gc);
+        if (!thunk_gate_auth(g->gate))
+                stress_fail(w, "Failed to allocate gate object");
+
+        /* Freed objects must have been scrubbed */
+        data = stress_data(w, g);
+        for (i = 0; i < c->size / sizeof(uint64_t); i++) {
+                if (data[i] != 0)
+                        stress_fail(w, "Stale data in new gate object");
+        }
+        g->signature = ((uint64_t)w->id << 48) | ++w->seq;
+        data[0] = g->signature;
+        data[c->size / sizeof(uint64_t) - 1] = g->signature;
+        w->nlive++;
+        w->ops[OP_ALLOC]++;
+}
+
+static void
+stress_invoke(struct worker *w)
+{
+        struct stress_gate *g;
+        struct stress_class *c;
+        thunk_token_t token;
+        uint64_t *field;
+        size_t offset;
+
+        if (w->nlive == 0) {
+                stress_alloc(w);
+                return;
+        }
+
+        g = &w->live[stress_random(w) % w->nlive];
+        c = &w->classes[g->class_index];
+        /* Derive a token for a random word in the object */
+        offset = (stress_random(w) % (c->size / sizeof(uint64_t))) *
+            sizeof(uint64_t);
+        token = thunk_gateclass_token(c->gc);
+        token = cheri_bounds_set_exact(cheri_offset_set(token, offset),
+            sizeof(uint64_t));
+
+        field = thunk_gate_invoke(g->gate, token);
+        if (!stress_cap_ok(field, sizeof(uint64_t)))
+                stress_fail(w, "Invalid field token result");
+        if (offset == 0 && *field != g->signature)
+                stress_fail(w, "Gate object signature mismatch");
+        stress_check(w, g);
+        w->ops[OP_INVOKE]++;
+}
+
+static void *
+worker_main(void *arg)
+{
+        struct worker *w = arg;
+        unsigned int total = 0;
+        unsigned int pick;
+        size_t i;
+        int op;
+
+        for (op = 0; op < OP_COUNT; op++)
+                total += w->ratios[op];
+
+        pthread_barrier_wait(w->barrier);
+        for (i = 0; i < w->n; i++) {
+                pick = stress_random(w) % total;
+                for (op = 0; pick >= w->ratios[op]; op++)
+                        pick -= w->ratios[op];
+
+                switch (op) {
+                case OP_CREATE:
+                        stress_create(w);
+                        break;
+                case OP_ALLOC:
+                        stress_alloc(w);
+                        break;
+                case OP_INVOKE:
+                        stress_invoke(w);
+                        break;
+                case OP_FREE:
+                        if (w->nlive > 0)
+                                stress_free(w, stress_random(w) % w->nlive);
+                        break;
+                }
+        }
+        while (w->nlive > 0)
+                stress_free(w, w->nlive - 1);
+
+        return (NULL);
+}
+
+static double
+run(int nthreads, size_t n, const unsigned int *ratios, double base)
+{
+        struct thunk_lock_stats lock_stats;
+        struct worker *workers;
+        pthread_barrier_t barrier;
+        uint64_t start, elapsed;
+        uint64_t ops[OP_COUNT] = { 0 };
+        double throughput;
+        int i, j, op;
+
+        workers = calloc(nthreads, sizeof(*workers));
+        if (workers == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        pthread_barrier_init(&barrier, NULL, nthreads + 1);
+        for (i = 0; i < nthreads; i++) {
+                workers[i].barrier = &barrier;
+                workers[i].id = i;
+                workers[i].rng = 0x9e3779b97f4a7c15UL * (i + 1);
+                workers[i].n = n;
+                workers[i].ratios = ratios;
+                pthread_create(&workers[i].thread, NULL, worker_main,
+                    &workers[i]);
+        }
+
+        thunk_lock_stats_reset();
+        pthread_barrier_wait(&barrier);
+        start = bench_now_ns();
+        for (i = 0; i < nthreads; i++)
+                pthread_join(workers[i].thread, NULL);
+        elapsed = bench_now_ns() - start;
+
+        for (i = 0; i < nthreads; i++) {
+                for (op = 0; op < OP_COUNT; op++)
+                        ops[op] += workers[i].ops[op];
+        }
+        throughput = (double)nthreads * n * 1e9 / elapsed;
+        printf("threads=%-4d ops/s=%-12.0f speedup=%-6.2f create=%-6lu "
+            "alloc=%-8lu invoke=%-10lu free=%-8lu", nthreads, throughput,
+            base > 0 ? throughput / base : 1.0, ops[OP_CREATE],
+            ops[OP_ALLOC], ops[OP_INVOKE], ops[OP_FREE]);
+        if (thunk_lock_stats_read(&lock_stats) == 0) {
+                printf(" locks=%lu contended=%lu wait-ms=%.2f",
+                    lock_stats.acquisitions, lock_stats.contended,
+                    lock_stats.wait_ns / 1e6);
+        }
+        printf("\n");
+
+        for (i = 0; i < nthreads; i++) {
+                for (j = 0; j < workers[i].nclasses; j++)
+                        thunk_gateclass_destroy(workers[i].classes[j].gc);
+        }
+        pthread_barrier_destroy(&barrier);
+        free(workers);
+
+        return (throughput);
+}
+
+int
+main(int argc, char *argv[])
+{
+        unsigned int ratios[OP_COUNT] = { 1, 20, 100, 19 };
+        int max_threads = 8;
+        size_t n = 1000000;
+        double base = 0;
+        int nthreads;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "t:n:r:")) != -1) {
+                switch (opt) {
+                case 't':
+                        max_threads = atoi(optarg);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 'r':
+                        if (sscanf(optarg, "%u:%u:%u:%u", &ratios[OP_CREATE],
+                            &ratios[OP_ALLOC], &ratios[OP_INVOKE],
+                            &ratios[OP_FREE]) != OP_COUNT) {
+                                fprintf(stderr, "Invalid ratios\n");
+                                return (1);
+                        }
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-t threads] [-n ops] "
+                            "[-r create:alloc:invoke:free]\n", argv[0]);
+                        return (1);
+                }
+        }
+        if (max_threads < 1 || max_threads > MAX_THREADS) {
+                fprintf(stderr, "Invalid number of threads\n");
+                return (1);
+        }
+        if (ratios[OP_CREATE] + ratios[OP_ALLOC] + ratios[OP_INVOKE] +
+            ratios[OP_FREE] == 0) {
+                fprintf(stderr, "Invalid ratios\n");
+                return (1);
+        }
+
+        for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+                if (nthreads == 1)
+                        base = run(nthreads, n, ratios, 0);
+                else
+                        run(nthreads, n, ratios, base);
+                if (nthreads < max_threads && nthreads * 2 > max_threads)
+                        run(max_threads, n, ratios, base);
+        }
+
+        return (0);
+}
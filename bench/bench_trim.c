@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Resident memory over time for a bursty workload: each burst
+ * allocates a batch of arena objects and frees them all, followed by
+ * an idle period. One sample is reported per idle tick.
+ *
+ * Runs with trimming off, with a budget policy that trims chunks as
+ * they empty beyond a quarter of the burst footprint, and with an idle
+ * policy applied by a thunk_trim() call on every tick.
+ * The rss column is only available where /proc/self/statm exists,
+ * arena is the chunk memory that the runtime did not trim.
+ *
+ * usage: bench_trim [-b bursts] [-n objects] [-t ticks] [-i tick_ms]
+ */
+#include <cheriintrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hello/hello.h"
+#include "bench.h"
+
+#define OBJECT_DATA_SIZE 2048
+
+enum trim_mode {
+        TRIM_OFF,
+        TRIM_BUDGET,
+        TRIM_IDLE,
+};
+
+static const char *trim_mode_names[] = { "off", "budget", "idle" };
+
+/**
+ * Resident set size in bytes, 0 if not available.
+ */
+static size_t
+rss_bytes(void)
+{
+        unsigned long size, resident;
+        FILE *fp;
+
+        fp = fopen("/proc/self/statm", "r");
+        if (fp == NULL)
+                return (0);
+        if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+                resident = 0;
+        fclose(fp);
+
+        return (resident * sysconf(_SC_PAGESIZE));
+}
+
+static struct thunk_class *
+trim_class(void)
+{
+        struct thunk_metaclass *mc = hello_class->mc;
+        struct thunk_class *tc;
+
+        tc = thunk_level_malloc(sizeof(*tc) +
+            mc->relocs_count * sizeof(thunk_reloc_data_t),
+            THUNK_LEVEL_PRIVATE);
+        if (tc == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        tc->mc = mc;
+        tc->ctor = NULL;
+        tc->dtor = NULL;
+        tc->pool = NULL;
+        tc->arena = NULL;
+        tc->image_code = NULL;
+        thunk_class_layout(tc, OBJECT_DATA_SIZE, 0);
+        tc->reloc_data[0].u32 = tc->data_offset;
+        if (thunk_class_use_arena(tc, 0) != 0) {
+                fprintf(stderr, "Failed to set up the arena\n");
+                exit(1);
+        }
+
+        return (tc);
+}
+
+static void
+run(struct thunk_class *tc, enum trim_mode mode, int bursts, size_t n,
+    int ticks, unsigned int tick_ms)
+{
+        struct thunk_trim_policy policy = { 0, 0 };
+        struct timespec tick = { tick_ms / 1000, (tick_ms % 1000) * 1000000 };
+        thunk_object_t *objs;
+        uint64_t start;
+        size_t peak = 0, rss;
+        char name[64];
+        size_t i;
+        int b, t;
+
+        objs = calloc(n, sizeof(*objs));
+        if (objs == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        /* Start every run from a trimmed arena */
+        thunk_trim_policy_set(&policy);
+        thunk_trim();
+        /* Keep a quarter of the burst footprint resident */
+        if (mode == TRIM_BUDGET)
+                policy.budget = n * tc->object_size / 4;
+        else if (mode == TRIM_IDLE)
+                policy.idle_ns = 2 * tick_ms * 1000000UL;
+        thunk_trim_policy_set(&policy);
+
+        snprintf(name, sizeof(name), "trim/%s", trim_mode_names[mode]);
+        start = bench_now_ns();
+        for (b = 0; b < bursts; b++) {
+                for (i = 0; i < n; i++) {
+                        objs[i] = thunk_malloc(tc);
+                        if (thunk_object_unwrap(objs[i]) == NULL) {
+                                fprintf(stderr, "Failed to allocate\n");
+                                exit(1);
+                        }
+                        /* Touch the data as a real object would */
+                        memset(thunk_object_lookup_data(tc, objs[i]), 1,
+                            OBJECT_DATA_SIZE);
+                }
+                rss = rss_bytes();
+                if (rss > peak)
+                        peak = rss;
+                for (i = 0; i < n; i++)
+                        thunk_free(tc, objs[i]);
+
+                for (t = 0; t < ticks; t++) {
+                        nanosleep(&tick, NULL);
+                        if (mode == TRIM_IDLE)
+                                thunk_trim();
+                        printf("%-24s t_ms=%-8.0f burst=%-4d rss_kb=%-8zu "
+                            "arena_kb=%zu\n", name,
+                            (bench_now_ns() - start) / 1e6, b,
+                            rss_bytes() / 1024, thunk_trim_resident() / 1024);
+                }
+        }
+        printf("%-24s peak_rss_kb=%zu final_rss_kb=%zu\n", name, peak / 1024,
+            rss_bytes() / 1024);
+
+        free(objs);
+}
+
+int
+main(int argc, char *argv[])
+{
+        struct thunk_class *tc;
+        size_t n = 4096;
+        unsigned int tick_ms = 10;
+        int bursts = 3, ticks = 5;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "b:n:t:i:")) != -1) {
+                switch (opt) {
+                case 'b':
+                        bursts = atoi(optarg);
+                        break;
+                case 'n':
+                        n = strtoul(optarg, NULL, 0);
+                        break;
+                case 't':
+                        ticks = atoi(optarg);
+                        break;
+                case 'i':
+                        tick_ms = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        fprintf(stderr, "usage: %s [-b bursts] [-n objects] "
+                            "[-t ticks] [-i tick_ms]\n", argv[0]);
+                        return (1);
+                }
+        }
+
+        tc = trim_class();
+        run(tc, TRIM_OFF, bursts, n, ticks, tick_ms);
+        run(tc, TRIM_BUDGET, bursts, n, ticks, tick_ms);
+        run(tc, TRIM_IDLE, bursts, n, ticks, tick_ms);
+        thunk_level_free(tc);
+
+        return (0);
+}
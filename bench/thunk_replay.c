@@ -0,0 +1,526 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Replay a runtime operation trace recorded with THUNK_TRACE, see
+ * thunk-trace.h, and report the latency of each operation and the
+ * peak memory.
+ *
+ * Each recorded thread is replayed by its own thread. The records are
+ * first ordered by timestamp and resolved to replay class and object
+ * slots, so that a thread using an object allocated by another thread
+ * waits for the allocation, and frees wait for the invocations recorded
+ * before them. Waits are not accounted in the operation latency.
+ *
+ * Gate classes are re-created with the recorded size and flags, falling
+ * back to plain gate classes for policy classes, whose policy is not
+ * recorded. Objects of other thunk classes are replayed as gate objects
+ * of the same data size. Operations on classes or objects created
+ * before the trace started are skipped.
+ *
+ * Invocation tokens are re-derived with the recorded offset and length
+ * in the class token space, tokens that can not be mapped to the class
+ * token space are replaced by the root token.
+ *
+ * usage: thunk-replay trace
+ */
+#include <cheriintrin.h>
+#include <sched.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thunk-gate.h"
+#include "thunk-trace.h"
+#include "bench.h"
+
+enum replay_op_kind {
+        REPLAY_CREATE,
+        REPLAY_ALLOC,
+        REPLAY_INVOKE,
+        REPLAY_FREE,
+        REPLAY_OP_COUNT
+};
+
+static const char *replay_op_names[] = {
+        "replay/create",
+        "replay/alloc",
+        "replay/invoke",
+        "replay/free",
+};
+
+struct replay_class {
+        size_t size;
+        unsigned int flags;
+        uint64_t space_base;
+        thunk_gate_class_t gc;
+        int ready;
+};
+
+struct replay_slot {
+        size_t class_index;
+        thunk_gate_t gate;
+        int ready;
+        /* Invocations recorded before the free and replayed so far */
+        uint32_t invokes;
+        uint32_t done;
+};
+
+struct replay_op {
+        enum replay_op_kind kind;
+        /* Class index for creations, slot index otherwise */
+        size_t index;
+        /* Token offset and length, zero length for the root token */
+        size_t offset;
+        size_t length;
+};
+
+struct replay_thread {
+        pthread_t thread;
+        struct replay_op *ops;
+        size_t nops;
+        size_t size;
+        struct bench_samples samples[REPLAY_OP_COUNT];
+};
+
+/* Open addressing map from recorded addresses to replay indices */
+struct replay_map {
+        uint64_t *keys;
+        size_t *values;
+        size_t mask;
+};
+
+#define REPLAY_NONE ((size_t)-1)
+
+static struct replay_class *classes;
+static size_t nclasses;
+static struct replay_slot *slots;
+static size_t nslots;
+static long sink;
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+        void *p = calloc(n, size);
+
+        if (p == NULL && n != 0) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+        return (p);
+}
+
+static long
+maxrss_kb(void)
+{
+        struct rusage ru;
+
+        getrusage(RUSAGE_SELF, &ru);
+        return (ru.ru_maxrss);
+}
+
+static void
+map_init(struct replay_map *m, size_t n)
+{
+        size_t size = 16;
+
+        while (size < 2 * n)
+                size *= 2;
+        m->keys = xcalloc(size, sizeof(*m->keys));
+        m->values = xcalloc(size, sizeof(*m->values));
+        m->mask = size - 1;
+}
+
+static void
+map_fini(struct replay_map *m)
+{
+        free(m->keys);
+        free(m->values);
+}
+
+static size_t *
+map_find(struct replay_map *m, uint64_t key, bool insert)
+{
+        size_t i = (key * 0x9e3779b97f4a7c15UL >> 17) & m->mask;
+
+        while (m->keys[i] != 0) {
+                if (m->keys[i] == key)
+                        return (&m->values[i]);
+                i = (i + 1) & m->mask;
+        }
+        if (!insert)
+                return (NULL);
+        m->keys[i] = key;
+        m->values[i] = REPLAY_NONE;
+        return (&m->values[i]);
+}
+
+static size_t
+map_get(struct replay_map *m, uint64_t key)
+{
+        size_t *v = map_find(m, key, false);
+
+        return (v == NULL ? REPLAY_NONE : *v);
+}
+
+static int
+record_cmp(const void *a, const void *b)
+{
+        const struct thunk_trace_record *x = a;
+        const struct thunk_trace_record *y = b;
+
+        return ((x->timestamp > y->timestamp) -
+            (x->timestamp < y->timestamp));
+}
+
+static struct thunk_trace_record *
+trace_read(const char *path, size_t *count)
+{
+        struct thunk_trace_header hdr;
+        struct thunk_trace_record *records;
+        size_t size = 1024;
+        size_t n = 0;
+        FILE *fp;
+
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+                perror(path);
+                exit(1);
+        }
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            memcmp(hdr.magic, THUNK_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+            hdr.version != THUNK_TRACE_VERSION ||
+            hdr.record_size != sizeof(*records)) {
+                fprintf(stderr, "%s: invalid trace file\n", path);
+                exit(1);
+        }
+
+        records = xcalloc(size, sizeof(*records));
+        while (fread(&records[n], sizeof(*records), 1, fp) == 1) {
+                if (++n == size) {
+                        size *= 2;
+                        records = realloc(records, size * sizeof(*records));
+                        if (records == NULL) {
+                                fprintf(stderr, "Out of memory\n");
+                                exit(1);
+                        }
+                }
+        }
+        fclose(fp);
+        *count = n;
+
+        return (records);
+}
+
+static void
+thread_push(struct replay_thread *t, enum replay_op_kind kind, size_t index,
+    size_t offset, size_t length)
+{
+        struct replay_op *op;
+
+        if (t->nops == t->size) {
+                t->size = t->size ? t->size * 2 : 1024;
+                t->ops = realloc(t->ops, t->size * sizeof(*t->ops));
+                if (t->ops == NULL) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                }
+        }
+        op = &t->ops[t->nops++];
+        op->kind = kind;
+        op->index = index;
+        op->offset = offset;
+        op->length = length;
+}
+
+static size_t
+class_add(size_t size, unsigned int flags, uint64_t space_base)
+{
+        struct replay_class *c = &classes[nclasses];
+
+        c->size = size;
+        c->flags = flags;
+        c->space_base = space_base;
+        return (nclasses++);
+}
+
+/**
+ * Resolve the trace records to replay operations for each thread.
+ *
+ * Returns the peak number of live objects.
+ */
+static size_t
+trace_resolve(struct thunk_trace_record *records, size_t n,
+    struct replay_thread *threads)
+{
+        struct replay_map class_map, object_map;
+        struct thunk_trace_record *r;
+        struct replay_thread *t;
+        struct replay_class *c;
+        size_t index, offset, length, size;
+        size_t *v;
+        size_t live = 0, peak = 0;
+        size_t i;
+
+        map_init(&class_map, n);
+        map_init(&object_map, n);
+        for (i = 0; i < n; i++) {
+                r = &records[i];
+                t = &threads[r->thread];
+                switch (r->op) {
+                case THUNK_TRACE_GATECLASS_CREATE:
+                        index = class_add(r->arg, r->arg2, r->object);
+                        *map_find(&class_map, r->class_id, true) = index;
+                        thread_push(t, REPLAY_CREATE, index, 0, 0);
+                        break;
+                case THUNK_TRACE_MALLOC:
+                        if (r->object == 0)
+                                break;
+                        /* Stand-in gate class for generic thunk classes */
+                        size = MAX(r->arg, sizeof(uint64_t));
+                        v = map_find(&class_map, r->class_id, true);
+                        if (*v == REPLAY_NONE || classes[*v].size != size) {
+                                *v = class_add(size, 0, 0);
+                                thread_push(t, REPLAY_CREATE, *v, 0, 0);
+                        }
+                        /* FALLTHROUGH */
+                case THUNK_TRACE_GATE_ALLOC:
+                        index = map_get(&class_map, r->class_id);
+                        if (index == REPLAY_NONE || r->object == 0)
+                                break;
+                        slots[nslots].class_index = index;
+                        *map_find(&object_map, r->object, true) = nslots;
+                        thread_push(t, REPLAY_ALLOC, nslots++, 0, 0);
+                        if (++live > peak)
+                                peak = live;
+                        break;
+                case THUNK_TRACE_FREE:
+                case THUNK_TRACE_GATE_FREE:
+                        v = map_find(&object_map, r->object, false);
+                        if (v == NULL || *v == REPLAY_NONE)
+                                break;
+                        thread_push(t, REPLAY_FREE, *v, 0, 0);
+                        *v = REPLAY_NONE;
+                        live--;
+                        break;
+                case THUNK_TRACE_GATE_INVOKE:
+                        index = map_get(&object_map, r->object);
+                        if (index == REPLAY_NONE)
+                                break;
+                        c = &classes[slots[index].class_index];
+                        offset = r->arg - c->space_base;
+                        length = r->arg2;
+                        if (r->arg < c->space_base || length == 0 ||
+                            offset > c->size || length > c->size - offset) {
+                                offset = 0;
+                                length = 0;
+                        }
+                        slots[index].invokes++;
+                        thread_push(t, REPLAY_INVOKE, index, offset, length);
+                        break;
+                }
+        }
+        map_fini(&class_map);
+        map_fini(&object_map);
+
+        return (peak);
+}
+
+static void
+replay_wait(int *ready)
+{
+        while (!__atomic_load_n(ready, __ATOMIC_ACQUIRE))
+                sched_yield();
+}
+
+static thunk_token_t
+replay_token(struct replay_class *c, struct replay_slot *s,
+    struct replay_op *op)
+{
+        thunk_token_t token;
+
+        if (c->flags & THUNK_GATE_GENERATION)
+                token = thunk_gate_token(c->gc, s->gate);
+        else
+                token = thunk_gateclass_token(c->gc);
+        if (op->length != 0) {
+                token = cheri_bounds_set_exact(cheri_offset_set(token,
+                    op->offset), op->length);
+        }
+
+        return (token);
+}
+
+static void
+replay_create(struct replay_class *c)
+{
+        c->gc = thunk_gateclass_create_flags(c->size, c->flags);
+        if (c->gc.class == NULL) {
+                c->flags = 0;
+                c->gc = thunk_gateclass_create(c->size);
+        }
+        if (c->gc.class == NULL) {
+                fprintf(stderr, "Failed to create gate class of size %zu\n",
+                    c->size);
+                exit(1);
+        }
+}
+
+static void *
+replay_main(void *arg)
+{
+        struct replay_thread *t = arg;
+        struct replay_op *op;
+        struct replay_class *c;
+        struct replay_slot *s;
+        thunk_token_t token;
+        uint64_t start;
+        size_t i;
+        long sum = 0;
+
+        for (i = 0; i < t->nops; i++) {
+                op = &t->ops[i];
+                switch (op->kind) {
+                case REPLAY_CREATE:
+                        c = &classes[op->index];
+                        start = bench_now_ns();
+                        replay_create(c);
+                        bench_samples_add(&t->samples[op->kind],
+                            bench_now_ns() - start);
+                        __atomic_store_n(&c->ready, 1, __ATOMIC_RELEASE);
+                        break;
+                case REPLAY_ALLOC:
+                        s = &slots[op->index];
+                        c = &classes[s->class_index];
+                        replay_wait(&c->ready);
+                        start = bench_now_ns();
+                        s->gate = thunk_gate_alloc(c->gc);
+                        bench_samples_add(&t->samples[op->kind],
+                            bench_now_ns() - start);
+                        if (!thunk_gate_auth(s->gate)) {
+                                fprintf(stderr, "Failed to allocate gate\n");
+                                exit(1);
+                        }
+                        __atomic_store_n(&s->ready, 1, __ATOMIC_RELEASE);
+                        break;
+                case REPLAY_INVOKE:
+                        s = &slots[op->index];
+                        c = &classes[s->class_index];
+                        replay_wait(&s->ready);
+                        token = replay_token(c, s, op);
+                        start = bench_now_ns();
+                        sum += cheri_address_get(thunk_gate_invoke(s->gate,
+                            token));
+                        bench_samples_add(&t->samples[op->kind],
+                            bench_now_ns() - start);
+                        __atomic_fetch_add(&s->done, 1, __ATOMIC_RELEASE);
+                        break;
+                case REPLAY_FREE:
+                        s = &slots[op->index];
+                        c = &classes[s->class_index];
+                        replay_wait(&s->ready);
+                        while (__atomic_load_n(&s->done, __ATOMIC_ACQUIRE) !=
+                            s->invokes)
+                                sched_yield();
+                        start = bench_now_ns();
+                        thunk_gate_free(c->gc, s->gate);
+                        bench_samples_add(&t->samples[op->kind],
+                            bench_now_ns() - start);
+                        break;
+                default:
+                        break;
+                }
+        }
+        __atomic_fetch_add(&sink, sum, __ATOMIC_RELAXED);
+
+        return (NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+        struct thunk_trace_record *records;
+        struct replay_thread *threads;
+        struct bench_samples samples;
+        size_t n, i, total, peak;
+        uint64_t start, elapsed;
+        long rss;
+        int nthreads = 0;
+        int j, k;
+
+        if (argc != 2) {
+                fprintf(stderr, "usage: %s trace\n", argv[0]);
+                return (1);
+        }
+
+        records = trace_read(argv[1], &n);
+        /* A stable sort keeps the per-thread order of equal timestamps */
+        if (mergesort(records, n, sizeof(*records), record_cmp) != 0) {
+                fprintf(stderr, "Failed to sort the trace records\n");
+                return (1);
+        }
+        for (i = 0; i < n; i++) {
+                if (records[i].thread >= nthreads)
+                        nthreads = records[i].thread + 1;
+        }
+        threads = xcalloc(nthreads, sizeof(*threads));
+        classes = xcalloc(n, sizeof(*classes));
+        slots = xcalloc(n, sizeof(*slots));
+        peak = trace_resolve(records, n, threads);
+        free(records);
+
+        for (j = 0; j < nthreads; j++) {
+                /* Threads may have no operation left to replay */
+                for (k = 0; k < REPLAY_OP_COUNT; k++)
+                        bench_samples_init(&threads[j].samples[k],
+                            threads[j].nops + 1);
+        }
+
+        rss = maxrss_kb();
+        start = bench_now_ns();
+        for (j = 0; j < nthreads; j++)
+                pthread_create(&threads[j].thread, NULL, replay_main,
+                    &threads[j]);
+        for (j = 0; j < nthreads; j++)
+                pthread_join(threads[j].thread, NULL);
+        elapsed = bench_now_ns() - start;
+        rss = maxrss_kb() - rss;
+
+        printf("replay records=%zu threads=%d classes=%zu objects=%zu "
+            "peak-live=%zu elapsed-ms=%.2f maxrss-kb=%ld\n", n, nthreads,
+            nclasses, nslots, peak, elapsed / 1e6, rss);
+        for (k = 0; k < REPLAY_OP_COUNT; k++) {
+                total = 0;
+                for (j = 0; j < nthreads; j++)
+                        total += threads[j].samples[k].count;
+                bench_samples_init(&samples, total + 1);
+                for (j = 0; j < nthreads; j++) {
+                        memcpy(samples.ns + samples.count,
+                            threads[j].samples[k].ns,
+                            threads[j].samples[k].count * sizeof(uint64_t));
+                        samples.count += threads[j].samples[k].count;
+                        bench_samples_fini(&threads[j].samples[k]);
+                }
+                bench_samples_report(&samples, replay_op_names[k]);
+                bench_samples_fini(&samples);
+        }
+
+        for (j = 0; j < nthreads; j++)
+                free(threads[j].ops);
+        free(threads);
+        free(slots);
+        free(classes);
+
+        return (0);
+}
@@ -26,13 +26,25 @@ typedef const uint8_t* thunk_token_t;
             cheri_offset_set(tok, offsetof(t, m)),        \
             sizeof(((t *)0)->m))
 
+/**
+ * Given an element type, an index and a gate array root token,
+ * produce the token for the element.
+ *
+ * The element token can be further narrowed with thunk_token_for().
+ */
+#define thunk_token_for_index(t, i, tok)                  \
+        cheri_bounds_set_exact(                           \
+            cheri_offset_set(tok, (i) * sizeof(t)),       \
+            sizeof(t))
+
 /**
  * Public gate class descriptor.
  *
  * This is a wrapper of the generic thunk_class, specifically
  * for gate token types.
- * Note that the inner pointer is opaque and sealed.
- * TODO currently not sealed.
+ * Note that the inner pointer is opaque and sealed with a sealing
+ * capability held by the runtime, the gate class functions reject
+ * any other handle.
  *
  * Note that this is a sensitive structure that authorises
  * thunk_gate_alloc() and thunk_gate_free().
@@ -43,6 +55,119 @@ typedef struct {
 
 #define THUNK_NULL_GATECLASS ((thunk_gate_class_t){ .class = NULL })
 
+/**
+ * Gate class creation flags.
+ */
+enum thunk_gate_flags {
+        /* Use the instrumented gate template, see thunk_gate_stats_read() */
+        THUNK_GATE_INSTRUMENT = 0x1,
+        /* Allocate gate objects from a superpage-backed arena */
+        THUNK_GATE_SUPERPAGE = 0x2,
+        /*
+         * Pack gate code densely, apart from the gate object data.
+         * Not supported with THUNK_GATE_INSTRUMENT, THUNK_GATE_GENERATION,
+         * THUNK_GATE_REPLICATED or access policies.
+         */
+        THUNK_GATE_SPLIT = 0x4,
+        /* Start gate object code on a cache line boundary */
+        THUNK_GATE_ALIGN_CODE = 0x8,
+        /* Keep gate object data on cache lines of its own */
+        THUNK_GATE_PAD_DATA = 0x10,
+        /* Use the gate template with token generations, see thunk_gate_revoke() */
+        THUNK_GATE_GENERATION = 0x20,
+        /*
+         * Keep gate object data in shared memory, objects allocated
+         * before fork() reach the same data in the child processes.
+         * The data can not hold capabilities. Implies THUNK_GATE_SPLIT,
+         * with the same restrictions.
+         */
+        THUNK_GATE_SHARED = 0x40,
+        /*
+         * Compile the gate object code on the first invocation, making
+         * allocation cheaper for objects that may never be invoked.
+         * Not supported with THUNK_GATE_SPLIT or THUNK_GATE_SHARED.
+         */
+        THUNK_GATE_LAZY = 0x80,
+        /*
+         * Share a single copy of the gate code between all the objects
+         * of the class, objects are allocated as sealed code and data
+         * pairs with thunk_gatepair_alloc().
+         * Only supported with THUNK_GATE_SUPERPAGE and
+         * THUNK_GATE_ALIGN_CODE.
+         */
+        THUNK_GATE_SHARED_CODE = 0x100,
+        /*
+         * Keep THUNK_GATE_REPLICAS copies of the gate object data, the
+         * gate picks the replica from the thread pointer of the caller,
+         * see thunk_gate_reduce().
+         * Not supported with THUNK_GATE_INSTRUMENT, THUNK_GATE_GENERATION,
+         * THUNK_GATE_SHARED_CODE or access policies.
+         */
+        THUNK_GATE_REPLICATED = 0x200,
+};
+
+/**
+ * Number of token generations available to each gate object.
+ */
+#define THUNK_GATE_GENERATIONS 256
+
+/**
+ * Number of data replicas in objects of THUNK_GATE_REPLICATED classes.
+ */
+#define THUNK_GATE_REPLICAS 16
+
+/**
+ * Access policy flags, see struct thunk_gate_policy.
+ */
+enum thunk_gate_policy_flags {
+        /* Reject untagged tokens and tokens out of the class token space */
+        THUNK_GATE_POLICY_CHECK_SPACE = 0x1,
+        /* Grant [offset, offset + length) regardless of the token bounds */
+        THUNK_GATE_POLICY_FIXED_BOUNDS = 0x2,
+        /* Grant the policy perms regardless of the token permissions */
+        THUNK_GATE_POLICY_FIXED_PERMS = 0x4,
+        /* Never grant store permissions */
+        THUNK_GATE_POLICY_READ_ONLY = 0x8,
+        /* Never grant load permissions */
+        THUNK_GATE_POLICY_WRITE_ONLY = 0x10,
+};
+
+/**
+ * Access policy descriptor for generated gate templates.
+ *
+ * The gate template is generated for the policy when the class is
+ * created, so that the policy constants are folded in the code instead
+ * of being computed on each invocation.
+ * Token-derived bounds or permissions require
+ * THUNK_GATE_POLICY_CHECK_SPACE.
+ */
+struct thunk_gate_policy {
+        /* See enum thunk_gate_policy_flags */
+        unsigned int flags;
+        /* Permission mask, intersected with the token permissions */
+        size_t perms;
+        /* Fixed bounds within the gate object data */
+        size_t offset;
+        size_t length;
+};
+
+/**
+ * Number of token offset histogram buckets in instrumented gates.
+ */
+#define THUNK_GATE_STATS_BUCKETS 16
+
+/**
+ * Invocation counters kept by instrumented gate objects.
+ *
+ * The histogram bucket for a token is the offset of the token within
+ * the token space, divided by the class bucket width; offsets past the
+ * last bucket are accounted in the last bucket.
+ */
+struct thunk_gate_stats {
+        uint64_t invocations;
+        uint64_t histogram[THUNK_GATE_STATS_BUCKETS];
+};
+
 /**
  * Public gate descriptor.
  *
@@ -53,11 +178,49 @@ typedef struct {
        thunk_object_t obj;
 } thunk_gate_t;
 
+/**
+ * Public gate pair descriptor.
+ *
+ * Objects of THUNK_GATE_SHARED_CODE classes are a pair of the class
+ * gate code and the object data capabilities, sealed with an otype
+ * private to the class. Invoking the pair unseals both, with the data
+ * capability passed to the code in a register.
+ */
+typedef struct {
+        void *code;
+        void *data;
+} thunk_gatepair_t;
+
+#define THUNK_NULL_GATEPAIR ((thunk_gatepair_t){ .code = NULL, .data = NULL })
+
 /**
  * Safe API to invoke a thunk gate with the given token.
  */
 void *thunk_gate_invoke(thunk_gate_t gate, thunk_token_t tok);
 
+/**
+ * Invoke a thunk gate through the memo cache of the calling thread.
+ *
+ * The cache is keyed on the gate and the token, a hit returns the data
+ * capability derived by an earlier invocation without entering the gate.
+ * Each gate class has an epoch that moves whenever one of its objects
+ * is freed or revoked, or the class is destroyed; results cached under
+ * an earlier epoch are never returned.
+ * Note that hits are not accounted by THUNK_GATE_INSTRUMENT gates and
+ * that, as for thunk_gate_invoke(), a result obtained concurrently with
+ * thunk_gate_free() may outlive the object.
+ * Returns NULL if the gate is not an object of the class.
+ */
+void *thunk_gate_invoke_cached(thunk_gate_class_t gc, thunk_gate_t gate,
+    thunk_token_t tok);
+
+/**
+ * Drop all the results in the memo cache of the calling thread.
+ *
+ * Stale results are otherwise only dropped when they are looked up.
+ */
+void thunk_gate_memo_flush(void);
+
 /**
  * Authenticate thunk gate.
  *
@@ -91,11 +254,56 @@ bool thunk_gate_auth(thunk_gate_t gate);
  */
 thunk_gate_class_t thunk_gateclass_create(size_t size);
 
+/**
+ * Create a new gate thunk class with a given object size and
+ * a set of thunk_gate_flags.
+ */
+thunk_gate_class_t thunk_gateclass_create_flags(size_t size,
+    unsigned int flags);
+
+/**
+ * Create a new gate thunk class with a template generated for
+ * the given access policy.
+ *
+ * The flags are thunk_gate_flags, except for THUNK_GATE_INSTRUMENT and
+ * THUNK_GATE_GENERATION that select a different template.
+ */
+thunk_gate_class_t thunk_gateclass_create_policy(size_t size,
+    const struct thunk_gate_policy *policy, unsigned int flags);
+
+/**
+ * Size of the gate code in objects of the given gate class.
+ */
+size_t thunk_gateclass_code_size(thunk_gate_class_t gc);
+
+/**
+ * Create a new gate array class.
+ *
+ * Objects of a gate array class hold nelems elements of elem_size bytes
+ * behind a single copy of the gate code. The root token grants access to
+ * the whole array, thunk_token_for_index() and thunk_gatearray_token()
+ * derive per-element tokens.
+ * Note that the root token of large arrays may extend past the last
+ * element, to keep its bounds representable.
+ */
+thunk_gate_class_t thunk_gatearray_create(size_t elem_size, size_t nelems,
+    unsigned int flags);
+
+/**
+ * Fetch the token for an element of a gate array class.
+ *
+ * Returns NULL if the class is not a gate array or the index is out
+ * of range.
+ */
+thunk_token_t thunk_gatearray_token(thunk_gate_class_t gc, size_t index);
+
 /**
  * Destroy a thunk gate class.
  *
  * This requires special care. If the gate class is destroyed,
  * any thunk allocated via the gate will be impossible to free.
+ * The class can not allocate objects afterwards, pre-allocated objects
+ * and the generated template of policy classes are released.
  * XXX-AM: In debug mode, keep a reference count to check
  */
 void thunk_gateclass_destroy(thunk_gate_class_t gc);
@@ -105,6 +313,83 @@ void thunk_gateclass_destroy(thunk_gate_class_t gc);
  */
 thunk_token_t thunk_gateclass_token(thunk_gate_class_t gc);
 
+/**
+ * Pre-allocate gate objects for a given gate class.
+ * See thunk_class_reserve().
+ */
+int thunk_gateclass_reserve(thunk_gate_class_t gc, size_t n);
+
+/**
+ * Configure the pre-allocated gate object pool for a given gate class.
+ * See thunk_class_reserve_config().
+ */
+int thunk_gateclass_reserve_config(thunk_gate_class_t gc,
+    const struct thunk_pool_config *config);
+
+/**
+ * Release pre-allocated gate objects, keeping at most keep of them.
+ */
+void thunk_gateclass_reserve_trim(thunk_gate_class_t gc, size_t keep);
+
+/**
+ * Fetch the root token for the current generation of a gate object.
+ *
+ * For gate classes without THUNK_GATE_GENERATION, this is the same as
+ * thunk_gateclass_token().
+ * Returns NULL if the gate is not a live object of the class.
+ */
+thunk_token_t thunk_gate_token(thunk_gate_class_t gc, thunk_gate_t gate);
+
+/**
+ * Revoke all the tokens handed out for a gate object.
+ *
+ * The gate class must have been created with THUNK_GATE_GENERATION.
+ * This bumps the object generation, the gate then rejects any token
+ * derived from an earlier thunk_gate_token().
+ * Note that tokens are shared by the objects of a class, tokens for
+ * the new generation may have been handed out for other objects.
+ * Freed gate objects restart from the first generation.
+ * Returns 0 on success, -1 if the class has no generations, the gate
+ * is not a live object of the class or it ran out of generations.
+ */
+int thunk_gate_revoke(thunk_gate_class_t gc, thunk_gate_t gate);
+
+/**
+ * Compact encoding of a gate token, see thunk_token_handle().
+ */
+typedef uint64_t thunk_token_handle_t;
+
+#define THUNK_NULL_TOKEN_HANDLE ((thunk_token_handle_t)0)
+
+/**
+ * Number of distinct token lengths that a class can encode in handles.
+ */
+#define THUNK_TOKEN_LENGTH_CLASSES 64
+
+/**
+ * Encode a token of a gate class as a 64-bit handle.
+ *
+ * The handle packs the class index, the token offset in the class
+ * token space, the token length class and the token permissions, so
+ * that tables of delegated tokens take half the memory.
+ * The token address must be the token base, and each class encodes at
+ * most THUNK_TOKEN_LENGTH_CLASSES distinct token lengths.
+ * Returns THUNK_NULL_TOKEN_HANDLE if the token can not be encoded.
+ */
+thunk_token_handle_t thunk_token_handle(thunk_gate_class_t gc,
+    thunk_token_t tok);
+
+/**
+ * Rebuild the token encoded in a handle from the class root token.
+ *
+ * Handles are plain data, the gate class handle is the authority to
+ * turn them back into tokens.
+ * Returns NULL if the handle was not encoded for this class or reaches
+ * past the object data.
+ */
+thunk_token_t thunk_token_rehydrate(thunk_gate_class_t gc,
+    thunk_token_handle_t handle);
+
 /**
  * Allocate a thunk object for a given gate.
  */
@@ -113,10 +398,73 @@ thunk_gate_t thunk_gate_alloc(thunk_gate_class_t gc);
 /**
  * Free a thunk object.
  *
+ * The gate object memory is zeroed and returned to the gate class arena.
  * Note that we need a good way to authorise this.
+ *
+ * XXX-AM: Gate objects are not revoked. The arena holds the freed memory
+ * back for the next 1024 frees in the arena, invoking a stale gate
+ * faults meanwhile. Afterwards the memory may hold a gate of any class
+ * sharing the arena, and a stale gate runs that gate code instead.
  */
 void thunk_gate_free(thunk_gate_class_t gc, thunk_gate_t obj);
 
+/**
+ * Allocate a gate pair for a shared code gate class.
+ *
+ * The object data is zeroed. Returns a pair of NULL capabilities if
+ * the class was not created with THUNK_GATE_SHARED_CODE or was
+ * destroyed.
+ */
+thunk_gatepair_t thunk_gatepair_alloc(thunk_gate_class_t gc);
+
+/**
+ * Free a gate pair.
+ *
+ * The object data is zeroed and released, the pair is cleared.
+ * Returns -1 if the pair does not belong to the class or was already
+ * freed through this descriptor, copies of the pair are not cleared.
+ */
+int thunk_gatepair_free(thunk_gate_class_t gc, thunk_gatepair_t *pair);
+
+/**
+ * Safe API to invoke a gate pair with the given token.
+ */
+void *thunk_gatepair_invoke(thunk_gatepair_t pair, thunk_token_t tok);
+
+/**
+ * Authenticate a gate pair.
+ *
+ * This guarantees that both capabilities in the pair have been sealed
+ * by the thunk runtime for the same gate class.
+ */
+bool thunk_gatepair_auth(thunk_gatepair_t pair);
+
+/**
+ * Read the invocation counters of a gate object.
+ *
+ * The gate class must have been created with THUNK_GATE_INSTRUMENT.
+ * The counters are read from the object data, the read is not
+ * accounted in the stats.
+ * Returns 0 on success, -1 if the class is not instrumented or the gate
+ * does not belong to it.
+ */
+int thunk_gate_stats_read(thunk_gate_class_t gc, thunk_gate_t gate,
+    struct thunk_gate_stats *stats);
+
+/**
+ * Walk the data replicas of a gate object.
+ *
+ * The gate class must have been created with THUNK_GATE_REPLICATED.
+ * The function is called on each replica with the pointer that the gate
+ * would return for the token on a thread mapped to that replica.
+ * Threads are mapped to replicas by hashing their thread pointer,
+ * threads may share a replica, so replicas must be updated atomically.
+ * Returns 0 on success, -1 if the class is not replicated, the gate
+ * is not an object of the class or the token is invalid.
+ */
+int thunk_gate_reduce(thunk_gate_class_t gc, thunk_gate_t gate,
+    thunk_token_t tok, void (*fn)(void *replica, void *arg), void *arg);
+
 /* ============= Internal functions ============== */
 
 /**
@@ -139,3 +487,65 @@ void thunk_arch_gate_reloc_token_space(struct thunk_class *gate,
  */
 void thunk_arch_gate_reloc_data_offset(struct thunk_class *gate,
                                        ptraddr_t offset);
+
+/**
+ * Set the data size relocations for a split thunk gate class.
+ * Tokens reaching past the data size are rejected.
+ */
+void thunk_arch_gate_reloc_data_size(struct thunk_class *gate, size_t size);
+
+/**
+ * Set the stats block relocations for an instrumented thunk gate class.
+ * The offset is relative to the start of the object, as data_offset.
+ */
+void thunk_arch_gate_reloc_stats(struct thunk_class *gate, ptraddr_t offset,
+                                 unsigned int hist_shift);
+
+/**
+ * Generate the gate template and metaclass for an access policy.
+ *
+ * Returns NULL on failure.
+ */
+struct thunk_metaclass *thunk_arch_gate_policy_emit(
+    const struct thunk_gate_policy *policy, size_t size);
+
+/**
+ * Release a metaclass from thunk_arch_gate_policy_emit().
+ */
+void thunk_arch_gate_policy_free(struct thunk_metaclass *mc);
+
+/**
+ * Set the relocations for a policy gate class.
+ * The data offset includes the offset of fixed policy bounds.
+ */
+void thunk_arch_gate_reloc_policy(struct thunk_class *gate,
+                                  thunk_token_t token_space,
+                                  ptraddr_t data_offset);
+
+/**
+ * Set the generation relocations for a thunk gate class with generations.
+ * The offset is relative to the start of the object, as data_offset.
+ * The size is the object data size that tokens may reach in a window.
+ */
+void thunk_arch_gate_reloc_generation(struct thunk_class *gate,
+                                      ptraddr_t offset,
+                                      unsigned int gen_shift,
+                                      size_t size);
+
+/**
+ * Set the replica relocations for a replicated thunk gate class.
+ * Replicas are (1 << replica_shift) bytes apart in the object data.
+ */
+void thunk_arch_gate_reloc_replica(struct thunk_class *gate,
+                                   unsigned int replica_shift);
+
+/**
+ * Set the token space relocations for a shared code gate class.
+ */
+void thunk_arch_gate_reloc_pair(struct thunk_class *gate,
+                                thunk_token_t token_space);
+
+/**
+ * Branch to a sealed gate pair.
+ */
+void *thunk_arch_gatepair_invoke(thunk_token_t tok, void *code, void *data);
@@ -0,0 +1,91 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include "thunk-gate.h"
+
+/**
+ * Zero-copy ring buffer of fixed size slots.
+ *
+ * The slots live in a single object of a gate array class. Producers
+ * and consumers are handed the token for one slot at a time and reach
+ * the slot data through the ring gate, records are filled and read in
+ * place instead of being copied in and out of the ring.
+ * Slot ownership moves from producer to consumer and back through
+ * per-slot sequence numbers, any number of threads can produce and
+ * consume concurrently without locks.
+ *
+ * Slot tokens are tied to the owner role and to the lap of the ring,
+ * modulo a few laps, stale tokens are rejected by thunk_ring_publish()
+ * and thunk_ring_release().
+ * XXX-AM: Slot tokens are not revoked at the gate when the slot changes
+ * hands, a stage that holds on to a token past thunk_ring_publish() or
+ * thunk_ring_release() can still reach the slot.
+ */
+struct thunk_ring;
+
+/**
+ * Create a ring buffer of nslots slots of slot_size bytes.
+ *
+ * The number of slots must be a power of two, the flags are passed to
+ * the gate array class, see enum thunk_gate_flags.
+ * The slot tokens of each lap and role differ by their offset in the
+ * slot, slots must be at least 8 bytes to tell them apart.
+ * Returns NULL on failure.
+ */
+struct thunk_ring *thunk_ring_create(size_t slot_size, size_t nslots,
+    unsigned int flags);
+
+/**
+ * Destroy a ring buffer.
+ *
+ * No stage may be using the ring.
+ */
+void thunk_ring_destroy(struct thunk_ring *ring);
+
+/**
+ * Fetch the gate that grants access to the ring slots.
+ *
+ * Invoking the gate with a slot token returns the slot data.
+ */
+thunk_gate_t thunk_ring_gate(const struct thunk_ring *ring);
+
+/**
+ * Acquire the next free slot for a producer.
+ *
+ * Returns the slot token or NULL if the ring is full.
+ */
+thunk_token_t thunk_ring_produce(struct thunk_ring *ring);
+
+/**
+ * Hand a produced slot over to the consumers.
+ *
+ * Returns 0 on success, -1 if the token is not the token of a slot
+ * produced in the current lap.
+ */
+int thunk_ring_publish(struct thunk_ring *ring, thunk_token_t slot);
+
+/**
+ * Acquire the oldest published slot for a consumer.
+ *
+ * Returns the slot token or NULL if the ring is empty.
+ */
+thunk_token_t thunk_ring_consume(struct thunk_ring *ring);
+
+/**
+ * Return a consumed slot to the producers.
+ *
+ * Returns 0 on success, -1 if the token is not the token of a slot
+ * consumed in the current lap.
+ */
+int thunk_ring_release(struct thunk_ring *ring, thunk_token_t slot);
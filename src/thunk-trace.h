@@ -0,0 +1,86 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "thunk.h"
+
+/**
+ * Runtime operation traces.
+ *
+ * When the runtime is built with the TRACE option and the THUNK_TRACE
+ * environment variable names a file, the runtime operations are logged
+ * to it. The trace is a struct thunk_trace_header followed by records.
+ * Each thread buffers its records, so records are only ordered by
+ * timestamp within each thread.
+ */
+#define THUNK_TRACE_MAGIC "THNKTRC"
+#define THUNK_TRACE_VERSION 1
+
+/**
+ * Traced operations.
+ */
+enum thunk_trace_op {
+        /* thunk_malloc(), arg is the data size, arg2 the class flags */
+        THUNK_TRACE_MALLOC = 1,
+        /* thunk_free() */
+        THUNK_TRACE_FREE,
+        /*
+         * Gate class creation, object is the token space base,
+         * arg the object size and arg2 the gate flags.
+         */
+        THUNK_TRACE_GATECLASS_CREATE,
+        /* thunk_gate_alloc() */
+        THUNK_TRACE_GATE_ALLOC,
+        /* thunk_gate_free() */
+        THUNK_TRACE_GATE_FREE,
+        /*
+         * thunk_gate_invoke(), the class is not known, arg is the
+         * token address and arg2 the token length.
+         */
+        THUNK_TRACE_GATE_INVOKE,
+};
+
+struct thunk_trace_header {
+        char magic[8];
+        uint32_t version;
+        /* Size of struct thunk_trace_record */
+        uint32_t record_size;
+};
+
+struct thunk_trace_record {
+        /* Nanoseconds since the trace started */
+        uint64_t timestamp;
+        /* Address of the thunk or gate class */
+        uint64_t class_id;
+        /* Object address */
+        uint64_t object;
+        /* See enum thunk_trace_op */
+        uint64_t arg;
+        uint32_t arg2;
+        /* Runtime-assigned thread number, in order of first record */
+        uint16_t thread;
+        uint8_t op;
+        uint8_t reserved;
+};
+
+/* ============= Internal functions ============== */
+
+/**
+ * Log a runtime operation, if tracing is enabled.
+ */
+#ifdef THUNK_TRACE
+void thunk_trace_record(enum thunk_trace_op op, const void *class_id,
+    ptraddr_t object, uint64_t arg, uint32_t arg2);
+#else
+#define thunk_trace_record(op, class_id, object, arg, arg2) do { } while (0)
+#endif
@@ -10,12 +10,16 @@
  */
 
 #include <cheriintrin.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <machine/param.h>
 
 #include "thunk.h"
+#include "thunk-trace.h"
 
 /**
  * Executable memory allocation hook
@@ -39,47 +43,490 @@ thunk_xfree(void *ptr)
         abort();
 }
 
-thunk_object_t
-thunk_malloc(struct thunk_class *tc)
+/* Serialises the compilation of lazy objects */
+static pthread_mutex_t lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef THUNK_LOCK_STATS
+static struct thunk_lock_stats lock_stats;
+
+static uint64_t
+lock_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec);
+}
+
+void
+thunk_mutex_lock(pthread_mutex_t *mtx)
+{
+        uint64_t start;
+
+        __atomic_fetch_add(&lock_stats.acquisitions, 1, __ATOMIC_RELAXED);
+        if (pthread_mutex_trylock(mtx) != EBUSY)
+                return;
+
+        start = lock_now_ns();
+        pthread_mutex_lock(mtx);
+        __atomic_fetch_add(&lock_stats.contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&lock_stats.wait_ns, lock_now_ns() - start,
+            __ATOMIC_RELAXED);
+}
+#endif
+
+int
+thunk_lock_stats_read(struct thunk_lock_stats *stats)
+{
+#ifdef THUNK_LOCK_STATS
+        stats->acquisitions = __atomic_load_n(&lock_stats.acquisitions,
+            __ATOMIC_RELAXED);
+        stats->contended = __atomic_load_n(&lock_stats.contended,
+            __ATOMIC_RELAXED);
+        stats->wait_ns = __atomic_load_n(&lock_stats.wait_ns,
+            __ATOMIC_RELAXED);
+        return (0);
+#else
+        return (-1);
+#endif
+}
+
+void
+thunk_lock_stats_reset(void)
+{
+#ifdef THUNK_LOCK_STATS
+        __atomic_store_n(&lock_stats.acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&lock_stats.contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&lock_stats.wait_ns, 0, __ATOMIC_RELAXED);
+#endif
+}
+
+/**
+ * Compile the object code, or copy the pre-compiled code from a
+ * class image. The pre-compiled code assumes that the data follows
+ * the code, as in thunk_compile().
+ */
+static int
+object_compile(struct thunk_class *tc, thunk_jit_t obj_code, void *obj_data)
+{
+        const size_t code_size = thunk_code_size(tc->mc);
+
+        if (tc->image_code == NULL || cheri_address_get(obj_data) !=
+            cheri_address_get(obj_code) + tc->data_offset)
+                return (thunk_compile_at(obj_code,
+                    cheri_address_get(obj_data), tc));
+
+        memcpy(obj_code, tc->image_code, code_size);
+        __builtin___clear_cache((char *)obj_code,
+            (char *)obj_code + code_size);
+
+        return (0);
+}
+
+void *
+thunk_object_build(struct thunk_class *tc)
 {
         struct thunk_metaclass *mc = tc->mc;
         const size_t code_size = thunk_code_size(mc);
-        thunk_object_t obj = THUNK_NULLOBJ;
         uintptr_t thunk_buf;
-        uintptr_t obj_data;
+        void *obj_data = NULL;
         thunk_jit_t obj_code;
 
-        // XXX tc should be sealed and should be authorised here
-
         assert(tc->object_size > code_size &&
             "Invalid thunk class, code size > object size");
+        if (tc->arena == NULL &&
+            (tc->flags & (THUNK_CLASS_ARENA_LAYOUT | THUNK_CLASS_LAZY)))
+                return (NULL);
         /* object_size must already include any representability padding */
-        thunk_buf = (uintptr_t)thunk_xmalloc(tc->object_size);
+        if (tc->arena != NULL && thunk_arena_is_split(tc->arena)) {
+                thunk_buf = (uintptr_t)thunk_arena_alloc_split(tc->arena,
+                    tc, &obj_data);
+        } else {
+                if (tc->arena != NULL)
+                        thunk_buf = (uintptr_t)thunk_arena_alloc(tc->arena,
+                            tc, tc->object_size);
+                else
+                        thunk_buf = (uintptr_t)thunk_xmalloc(tc->object_size);
+                if (thunk_buf != 0)
+                        obj_data = thunk_object_data(tc, (void *)thunk_buf);
+        }
+        if (thunk_buf == 0)
+                return (NULL);
 
-        obj_code = (thunk_jit_t)cheri_bounds_set(thunk_buf, code_size);
-        obj_data = thunk_buf + cheri_representable_length(code_size);
-        obj_data = cheri_bounds_set_exact(obj_data,
-            thunk_buf + cheri_length_get(thunk_buf) - obj_data);
-        if (thunk_compile(obj_code, tc)) {
-                thunk_xfree((void *)thunk_buf);
-                goto out;
+        if (tc->flags & THUNK_CLASS_LAZY) {
+                obj_code = (thunk_jit_t)cheri_bounds_set(thunk_buf,
+                    tc->data_offset);
+                thunk_arch_lazy_install(tc, obj_code);
+        } else {
+                obj_code = (thunk_jit_t)cheri_bounds_set(thunk_buf,
+                    code_size);
+                if (object_compile(tc, obj_code, obj_data)) {
+                        thunk_object_destroy(tc, (void *)thunk_buf);
+                        return (NULL);
+                }
         }
 
         if (tc->ctor)
-                tc->ctor((void *)obj_data);
+                tc->ctor(obj_data);
+
+        return ((void *)thunk_buf);
+}
+
+void
+thunk_lazy_resolve(struct thunk_class *tc, ptraddr_t addr)
+{
+        const size_t code_size = thunk_code_size(tc->mc);
+        thunk_jit_t code;
+        void *obj;
+
+        /*
+         * The stub only holds the object code capability, recover the
+         * writable object from the arena. Invoking a freed object is
+         * fatal, as any other error.
+         */
+        obj = thunk_arena_lookup(tc->arena, tc, addr, tc->object_size);
+        if (obj == NULL)
+                abort();
+        obj = cheri_bounds_set(obj, tc->data_offset);
+
+        thunk_mutex_lock(&lazy_mutex);
+        if (!thunk_arch_lazy_pending(tc, obj)) {
+                thunk_mutex_unlock(&lazy_mutex);
+                return;
+        }
+
+        /*
+         * Compile aside and copy the code over the stub, data follows
+         * the code in lazy objects, so relocations resolve to the same
+         * displacements. The caller can not be handed an error.
+         */
+        code = malloc(cheri_representable_length(code_size));
+        if (code == NULL)
+                abort();
+        if (tc->image_code != NULL)
+                memcpy(code, tc->image_code, code_size);
+        else if (thunk_compile(code, tc))
+                abort();
+        thunk_arch_lazy_commit(tc, obj, code);
+        thunk_mutex_unlock(&lazy_mutex);
+        free(code);
+}
+
+void *
+thunk_object_data(struct thunk_class *tc, void *obj)
+{
+        uintptr_t data;
+
+        if (tc->arena != NULL && thunk_arena_is_split(tc->arena))
+                return (thunk_arena_data(tc->arena, tc,
+                    cheri_address_get(obj)));
+
+        data = (uintptr_t)obj + tc->data_offset;
+        return ((void *)cheri_bounds_set_exact(data,
+            cheri_length_get(obj) - tc->data_offset));
+}
+
+void *
+thunk_object_lookup_data(struct thunk_class *tc, thunk_object_t obj)
+{
+        ptraddr_t addr = thunk_arch_object_addr(thunk_object_unwrap(obj));
+        void *buf;
+
+        if (tc->arena == NULL)
+                return (NULL);
+        if (thunk_arena_is_split(tc->arena))
+                return (thunk_arena_data(tc->arena, tc, addr));
+
+        buf = thunk_arena_lookup(tc->arena, tc, addr, tc->object_size);
+        if (buf == NULL)
+                return (NULL);
+        return (thunk_object_data(tc, buf));
+}
+
+void
+thunk_object_destroy(struct thunk_class *tc, void *obj)
+{
+        if (tc->arena != NULL)
+                thunk_arena_free(tc->arena, tc, cheri_address_get(obj));
+        else
+                thunk_xfree(obj);
+}
+
+/**
+ * Compute the object size and data offset for objects of a metaclass
+ * with the given data size and layout flags.
+ */
+static size_t
+object_layout(const struct thunk_metaclass *mc, size_t data_size,
+    unsigned int flags, size_t *data_offset)
+{
+        size_t data_align;
+        size_t code_size;
+        size_t size;
+
+        if (flags & THUNK_CLASS_PAD_DATA)
+                data_size = cheri_align_up(data_size, THUNK_CACHE_LINE_SIZE);
+        data_align = ~cheri_representable_alignment_mask(data_size) + 1;
+        if ((flags & THUNK_CLASS_PAD_DATA) &&
+            data_align < THUNK_CACHE_LINE_SIZE)
+                data_align = THUNK_CACHE_LINE_SIZE;
+
+        if (flags & THUNK_CLASS_LAZY)
+                code_size = thunk_arch_lazy_code_size(mc);
+        else
+                code_size = thunk_code_size(mc);
+
+        *data_offset = cheri_align_up(code_size, data_align);
+        size = *data_offset + data_size;
+        /*
+         * Objects are packed back to back in arenas, a cache line
+         * multiple size keeps every object code line aligned and stops
+         * the data from sharing a line with the next object.
+         */
+        if (flags & (THUNK_CLASS_ALIGN_CODE | THUNK_CLASS_PAD_DATA))
+                size = cheri_align_up(size, THUNK_CACHE_LINE_SIZE);
+
+        return (cheri_representable_length(size));
+}
+
+void
+thunk_class_layout(struct thunk_class *tc, size_t data_size,
+    unsigned int flags)
+{
+        tc->flags = flags;
+        tc->data_size = data_size;
+        tc->object_size = object_layout(tc->mc, data_size, flags,
+            &tc->data_offset);
+}
+
+size_t
+thunk_class_object_size(const struct thunk_class *tc, size_t data_size)
+{
+        size_t data_offset;
+
+        return (object_layout(tc->mc, data_size, tc->flags, &data_offset));
+}
+
+int
+thunk_class_use_arena(struct thunk_class *tc, unsigned int flags)
+{
+        size_t code_size;
+
+        if (flags & THUNK_ARENA_SPLIT) {
+                /* The lazy stub is reached through the object capability */
+                if (tc->flags & THUNK_CLASS_LAZY)
+                        return (-1);
+                code_size = cheri_representable_length(
+                    thunk_code_size(tc->mc));
+                if (tc->flags & THUNK_CLASS_ALIGN_CODE)
+                        code_size = cheri_align_up(code_size,
+                            THUNK_CACHE_LINE_SIZE);
+                tc->arena = thunk_arena_get_split(code_size,
+                    tc->object_size - tc->data_offset, flags);
+        } else {
+                tc->arena = thunk_arena_get(tc->object_size, flags);
+        }
+
+        return (tc->arena == NULL ? -1 : 0);
+}
+
+/**
+ * Get an object buffer from the class pool or build a new one.
+ */
+static void *
+object_alloc(struct thunk_class *tc)
+{
+        void *thunk_buf = NULL;
+
+        if (tc->pool != NULL)
+                thunk_buf = thunk_pool_pop(tc->pool);
+        if (thunk_buf == NULL)
+                thunk_buf = thunk_object_build(tc);
+
+        return (thunk_buf);
+}
+
+thunk_object_t
+thunk_object_new(struct thunk_class *tc)
+{
+        void *thunk_buf;
+
+        // XXX tc should be sealed and should be authorised here
+
+        thunk_buf = object_alloc(tc);
+        if (thunk_buf == NULL)
+                return (THUNK_NULLOBJ);
+
+        return (thunk_object_wrap(
+            thunk_arch_seal_object((uintptr_t)thunk_buf)));
+}
+
+thunk_object_t
+thunk_malloc(struct thunk_class *tc)
+{
+        thunk_object_t obj;
+
+        obj = thunk_object_new(tc);
+        thunk_trace_record(THUNK_TRACE_MALLOC, tc,
+            thunk_arch_object_addr(thunk_object_unwrap(obj)),
+            tc->object_size - tc->data_offset, tc->flags);
 
-        obj = thunk_object_wrap(thunk_arch_seal_object(thunk_buf));
-out:
         return (obj);
 }
 
+thunk_object_t
+thunk_malloc_size(struct thunk_class *tc, size_t data_size,
+    const void *init)
+{
+        const size_t code_size = thunk_code_size(tc->mc);
+        size_t data_offset, size;
+        uintptr_t thunk_buf;
+        void *obj_data;
+
+        /*
+         * XXX-AM: Arena slots and pooled objects have the class object
+         * size, sized objects would need an arena per size class.
+         */
+        if (data_size == 0 || tc->arena != NULL ||
+            (tc->flags & (THUNK_CLASS_LAZY | THUNK_CLASS_ARENA_LAYOUT)))
+                return (THUNK_NULLOBJ);
+
+        size = object_layout(tc->mc, data_size, tc->flags, &data_offset);
+        thunk_buf = (uintptr_t)thunk_xmalloc(size);
+        if (thunk_buf == 0)
+                return (THUNK_NULLOBJ);
+        obj_data = (void *)cheri_bounds_set_exact(thunk_buf + data_offset,
+            size - data_offset);
+        memset(obj_data, 0, size - data_offset);
+        if (init != NULL)
+                memcpy(obj_data, init, data_size);
+
+        /* Relocations are rebased on the data, the code is shared */
+        if (object_compile(tc, (thunk_jit_t)cheri_bounds_set(thunk_buf,
+            code_size), obj_data)) {
+                thunk_xfree((void *)thunk_buf);
+                return (THUNK_NULLOBJ);
+        }
+        thunk_trace_record(THUNK_TRACE_MALLOC, tc, cheri_address_get(thunk_buf),
+            data_size, tc->flags);
+
+        return (thunk_object_wrap(thunk_arch_seal_object(thunk_buf)));
+}
+
+thunk_object_t
+thunk_clone(struct thunk_class *tc, thunk_object_t proto)
+{
+        void *proto_buf = thunk_object_unwrap(proto);
+        ptraddr_t addr = thunk_arch_object_addr(proto_buf);
+        const size_t data_size = tc->object_size - tc->data_offset;
+        void *src, *obj_data;
+        uintptr_t thunk_buf;
+
+        /* Only arena objects can be found again from the sealed object */
+        if (tc->arena == NULL || !thunk_arch_object_sealed(proto_buf))
+                return (THUNK_NULLOBJ);
+
+        /*
+         * The arena lookups fail unless the prototype is a live object
+         * of this class.
+         */
+        if (thunk_arena_is_split(tc->arena)) {
+                /* Code and data are apart, recompile at the new data */
+                src = thunk_arena_data(tc->arena, tc, addr);
+                if (src == NULL)
+                        return (THUNK_NULLOBJ);
+                thunk_buf = (uintptr_t)thunk_arena_alloc_split(tc->arena,
+                    tc, &obj_data);
+                if (thunk_buf == 0)
+                        return (THUNK_NULLOBJ);
+                memcpy(obj_data, src, data_size);
+                if (object_compile(tc, (thunk_jit_t)cheri_bounds_set(
+                    thunk_buf, thunk_code_size(tc->mc)), obj_data)) {
+                        thunk_object_destroy(tc, (void *)thunk_buf);
+                        return (THUNK_NULLOBJ);
+                }
+        } else {
+                src = thunk_arena_lookup(tc->arena, tc, addr,
+                    tc->object_size);
+                if (src == NULL)
+                        return (THUNK_NULLOBJ);
+                thunk_buf = (uintptr_t)thunk_arena_alloc(tc->arena, tc,
+                    tc->object_size);
+                if (thunk_buf == 0)
+                        return (THUNK_NULLOBJ);
+                /* Code reaches the data PC-relative, copy both as is */
+                memcpy((void *)thunk_buf, src, tc->object_size);
+                if (tc->flags & THUNK_CLASS_LAZY) {
+                        /* The stub literals refer to the prototype */
+                        thunk_arch_lazy_install(tc, (void *)cheri_bounds_set(
+                            thunk_buf, tc->data_offset));
+                } else {
+                        __builtin___clear_cache((char *)thunk_buf,
+                            (char *)thunk_buf + thunk_code_size(tc->mc));
+                }
+        }
+        thunk_trace_record(THUNK_TRACE_MALLOC, tc, cheri_address_get(thunk_buf),
+            data_size, tc->flags);
+
+        return (thunk_object_wrap(thunk_arch_seal_object(thunk_buf)));
+}
+
+int
+thunk_malloc_entries(struct thunk_class *tc, thunk_object_t *objs,
+    unsigned int n)
+{
+        const struct thunk_metaclass *mc = tc->mc;
+        uintptr_t thunk_buf;
+        ptraddr_t offset;
+        unsigned int i;
+
+        if (n != thunk_entries_count(mc))
+                return (-1);
+        if (n > 1 && (tc->flags & THUNK_CLASS_LAZY))
+                return (-1);
+        assert((mc->entries_count == 0 ||
+            mc->entries[0] == (ptraddr_t)mc->template) &&
+            "First entry point must be the template start");
+
+        thunk_buf = (uintptr_t)object_alloc(tc);
+        if (thunk_buf == 0)
+                return (-1);
+        thunk_trace_record(THUNK_TRACE_MALLOC, tc, cheri_address_get(thunk_buf),
+            tc->object_size - tc->data_offset, tc->flags);
+
+        /* Entries keep the object bounds to reach the data */
+        for (i = 0; i < n; i++) {
+                offset = 0;
+                if (mc->entries_count != 0)
+                        offset = mc->entries[i] - (ptraddr_t)mc->template;
+                assert(offset < thunk_code_size(mc) &&
+                    "Entry point out of the template");
+                objs[i] = thunk_object_wrap(thunk_arch_seal_object(
+                    cheri_offset_set(thunk_buf, offset)));
+        }
+
+        return (0);
+}
 
 void
-thunk_free(struct thunk_class *tc, thunk_object_t obj)
+thunk_object_delete(struct thunk_class *tc, thunk_object_t obj)
 {
+        if (tc->arena != NULL) {
+                thunk_arena_free(tc->arena, tc,
+                    thunk_arch_object_addr(thunk_object_unwrap(obj)));
+                return;
+        }
         thunk_xfree(obj.__inner);
 }
 
+void
+thunk_free(struct thunk_class *tc, thunk_object_t obj)
+{
+        thunk_trace_record(THUNK_TRACE_FREE, tc,
+            thunk_arch_object_addr(thunk_object_unwrap(obj)), 0, 0);
+        thunk_object_delete(tc, obj);
+}
+
 void *
 thunk_level_malloc(size_t size, thunk_level_t level)
 {
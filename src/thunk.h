@@ -11,6 +11,8 @@
 #pragma once
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -40,7 +42,8 @@ _thunk_object_wrap(void *ptr)
         thunk_object_t obj = { .__inner = ptr };
 
         assert(cheri_is_valid(ptr) && "thunk_object_wrap: invalid pointer");
-        assert(cheri_is_sealed(ptr) && "thunk_object_wrap: unsealed pointer");
+        assert(thunk_arch_object_sealed(ptr) &&
+            "thunk_object_wrap: unsealed pointer");
         // assert(cheri_get_mode);
 
         return (obj);
@@ -67,6 +70,10 @@ typedef enum thunk_level thunk_level_t;
         thunk_template_t template;                            \
         /* Template code end, not runnable XXX DEBUG ONLY */  \
         thunk_template_t template_end;                        \
+        /* Entry points, see thunk_malloc_entries() */        \
+        const ptraddr_t *entries;                             \
+        /* Number of entry points, 0 for the template start */\
+        unsigned int entries_count;                           \
         /* Number of thunk relocations */                     \
         unsigned int relocs_count
 
@@ -87,12 +94,73 @@ static inline size_t
 thunk_code_size(const struct thunk_metaclass *mc)
 {
         size_t size = (uintptr_t)mc->template_end - (uintptr_t)mc->template;
+#ifndef THUNK_ARCH_HOST
+        /* Host templates are not bounded, see arch/host */
         assert(cheri_length_get(mc->template) == size &&
             "Unexpected code size");
+#endif
 
         return (size);
 }
 
+/**
+ * Number of entry points of objects of a metaclass.
+ */
+static inline unsigned int
+thunk_entries_count(const struct thunk_metaclass *mc)
+{
+        return (mc->entries_count == 0 ? 1 : mc->entries_count);
+}
+
+struct thunk_arena;
+struct thunk_pool;
+
+/**
+ * Thunk class layout flags.
+ */
+enum thunk_class_flags {
+        /*
+         * Start object code on a cache line boundary.
+         * Only supported for classes allocated from an arena.
+         */
+        THUNK_CLASS_ALIGN_CODE = 0x1,
+        /*
+         * Align and pad the object data to cache lines, so that data is
+         * never on the same line as another object code or data.
+         * Only supported for classes allocated from an arena.
+         */
+        THUNK_CLASS_PAD_DATA = 0x2,
+        /*
+         * Compile the object code on the first invocation, objects are
+         * allocated with a resolver stub instead.
+         * Only supported for classes allocated from an arena, except
+         * split arenas.
+         */
+        THUNK_CLASS_LAZY = 0x4,
+};
+
+/* Layout flags that only apply to objects packed in arenas */
+#define THUNK_CLASS_ARENA_LAYOUT                                \
+        (THUNK_CLASS_ALIGN_CODE | THUNK_CLASS_PAD_DATA)
+
+/**
+ * Executable memory arena flags.
+ */
+enum thunk_arena_flags {
+        /* Back the arena with superpages, if the system supports them */
+        THUNK_ARENA_SUPERPAGE = 0x1,
+        /*
+         * Pack object code densely, apart from the object data.
+         * Only for templates that do not derive data bounds from PCC.
+         */
+        THUNK_ARENA_SPLIT = 0x2,
+        /*
+         * Back the object data of a split arena with shared memory,
+         * so that forked processes see the same data.
+         */
+        THUNK_ARENA_SHARED = 0x4,
+};
+
 /**
  * A thunk class binds a specific metaclass to a type of data.
  *
@@ -102,14 +170,26 @@ thunk_code_size(const struct thunk_metaclass *mc)
 struct thunk_class {
         /* Metaclass describing the template */
         struct thunk_metaclass *mc;
+        /* Requested data size */
+        size_t data_size;
         /* Total size */
         size_t object_size;
+        /* Offset of the data from the start of the object */
+        size_t data_offset;
+        /* Layout flags, see enum thunk_class_flags */
+        unsigned int flags;
         /* Constructor (runs in the thunk compartment) */
         void (*ctor)(void *);
         /* Destructor (runs in the thunk compartment) */
         void (*dtor)(void *);
         /* Thunk token space for this class */
         void *token_space;
+        /* Pool of pre-built objects, see thunk_class_reserve() */
+        struct thunk_pool *pool;
+        /* Arena for object memory, NULL to use thunk_xmalloc() */
+        struct thunk_arena *arena;
+        /* Pre-compiled object code from a class image, NULL to compile */
+        thunk_template_t image_code;
         /* Resolved values for the thunk patch descriptors, matching order */
         thunk_reloc_data_t reloc_data[];
 };
@@ -129,6 +209,49 @@ void thunk_level_free(void *);
  */
 thunk_object_t thunk_malloc(struct thunk_class *tc);
 
+/**
+ * Create an instance of a thunk class with a per-object data size.
+ *
+ * The object shares the class metaclass and relocations, its data
+ * relocations are rebased on the object data, laid out as with
+ * thunk_class_layout() for data_size. The data is copied from init,
+ * or zeroed if init is NULL; the class constructor is not run as it
+ * assumes the class data size.
+ * Only classes that allocate with thunk_xmalloc() and are not lazy are
+ * supported. Returns THUNK_NULLOBJ on failure.
+ */
+thunk_object_t thunk_malloc_size(struct thunk_class *tc, size_t data_size,
+    const void *init);
+
+/**
+ * Create an instance of a thunk class as a copy of a prototype object.
+ *
+ * The prototype code and data are copied into a fresh object, without
+ * compiling the code or running the class constructor. The prototype
+ * must be a live object of the class and its data must not change
+ * during the copy. Capabilities in the data are copied as they are,
+ * they still point to wherever the prototype data pointed.
+ * Only arena-backed classes are supported, objects of split arenas
+ * compile their code for the new data. Multi-entry objects are cloned
+ * through their first entry, which is returned.
+ * Returns THUNK_NULLOBJ on failure.
+ */
+thunk_object_t thunk_clone(struct thunk_class *tc, thunk_object_t proto);
+
+/**
+ * Create an instance of a thunk class with several entry points.
+ *
+ * This fills objs with one sealed object per metaclass entry point,
+ * in the metaclass entries order. All the entries share the object
+ * data. The first entry must be the template start, the object is
+ * freed through it.
+ * Returns 0 on success, -1 if n does not match the number of entry
+ * points, the allocation fails or the class is lazy, as lazy objects
+ * can only be resolved through the first entry.
+ */
+int thunk_malloc_entries(struct thunk_class *tc, thunk_object_t *objs,
+    unsigned int n);
+
 /**
  * Destroy an instance of a thunk class.
  *
@@ -136,6 +259,72 @@ thunk_object_t thunk_malloc(struct thunk_class *tc);
  */
 void thunk_free(struct thunk_class *tc, thunk_object_t t_obj);
 
+/**
+ * Compute the object layout for a thunk class with the given data size.
+ *
+ * This sets the data offset and the object size, including the
+ * representability padding, according to the thunk_class_flags.
+ * The class metaclass must be set.
+ */
+void thunk_class_layout(struct thunk_class *tc, size_t data_size,
+    unsigned int flags);
+
+/**
+ * Size of an object of the class with the given data size,
+ * see thunk_malloc_size().
+ */
+size_t thunk_class_object_size(const struct thunk_class *tc,
+    size_t data_size);
+
+/**
+ * Allocate objects of a thunk class from a runtime executable memory arena
+ * instead of the thunk_xmalloc() hook.
+ *
+ * Arenas pack objects into large executable chunks, optionally backed by
+ * superpages, see enum thunk_arena_flags.
+ * This must be called before any object of the class is allocated.
+ */
+int thunk_class_use_arena(struct thunk_class *tc, unsigned int flags);
+
+/**
+ * Configuration of the pre-built object pool of a thunk class.
+ */
+struct thunk_pool_config {
+        /* Refill the pool when it drops below this many objects */
+        size_t low_watermark;
+        /* Never keep more than this many objects in the pool */
+        size_t high_watermark;
+        /* Refill from a background thread, instead of on demand */
+        bool background;
+};
+
+/**
+ * Pre-allocate and pre-compile n objects for the given thunk class.
+ *
+ * Subsequent thunk_malloc() calls pop objects from the pool, falling back
+ * to the allocation and compilation path when the pool is empty.
+ * The pool is bounded to n objects and is refilled only by further
+ * thunk_class_reserve() calls, unless configured otherwise with
+ * thunk_class_reserve_config().
+ */
+int thunk_class_reserve(struct thunk_class *tc, size_t n);
+
+/**
+ * Configure the object pool watermarks and refill mode for a class and
+ * fill the pool up to the high watermark.
+ */
+int thunk_class_reserve_config(struct thunk_class *tc,
+    const struct thunk_pool_config *config);
+
+/**
+ * Release pooled objects until at most keep objects remain.
+ *
+ * This gives memory back to the executable memory allocator,
+ * e.g. under memory pressure. Releasing all objects also stops the
+ * background refill thread.
+ */
+void thunk_class_reserve_trim(struct thunk_class *tc, size_t keep);
+
 /**
  * Compile a thunk class into the code buffer of a thunk object.
  *
@@ -143,9 +332,290 @@ void thunk_free(struct thunk_class *tc, thunk_object_t t_obj);
  */
 int thunk_compile(thunk_jit_t code_buf, const struct thunk_class *tc);
 
+/**
+ * Compile a thunk class into the code buffer of a thunk object whose
+ * data does not immediately follow the code, but starts at data_addr.
+ *
+ * Data relocations are resolved against data_addr instead of
+ * code_buf + data_offset.
+ */
+int thunk_compile_at(thunk_jit_t code_buf, ptraddr_t data_addr,
+    const struct thunk_class *tc);
+
+/**
+ * Class image file version.
+ * Bump on any change to the image layout or to the class layout rules.
+ */
+#define THUNK_IMAGE_VERSION 2
+
+/**
+ * Opaque handle for a mapped class image file.
+ */
+struct thunk_image;
+
+/**
+ * Write fully resolved classes to a class image file.
+ *
+ * Each class is identified by the corresponding entry in names.
+ * Only classes with position-independent relocations can be saved,
+ * e.g. not gate classes, as their relocations point to the token space.
+ * Returns 0 on success, -1 on failure.
+ */
+int thunk_image_save(const char *path, const char *const *names,
+    struct thunk_class *const *classes, size_t n);
+
+/**
+ * Map and validate a class image file.
+ *
+ * Returns NULL if the image is missing or was written by an
+ * incompatible runtime.
+ */
+struct thunk_image *thunk_image_open(const char *path);
+
+/**
+ * Load the resolved layout, relocations and pre-compiled code for
+ * a class from a class image.
+ *
+ * The class metaclass must be set, data_size and flags are the
+ * thunk_class_layout() arguments the class would be built with.
+ * Returns -1 if the image is NULL, the class is not in the image, or
+ * its template, layout arguments or the program build changed, in which
+ * case the class must be built at runtime.
+ * The image must stay open as long as the class allocates objects.
+ */
+int thunk_image_load_class(struct thunk_image *img, const char *name,
+    struct thunk_class *tc, size_t data_size, unsigned int flags);
+
+/**
+ * Unmap a class image.
+ */
+void thunk_image_close(struct thunk_image *img);
+
+/**
+ * Class image named by the THUNK_IMAGE environment variable, if any.
+ */
+struct thunk_image *thunk_image_default(void);
+
 /**
  * Executable memory allocation hooks.
  * These must be defined at link-time, the default weak symbols will abort();
  */
 void *thunk_xmalloc(size_t size);
 void thunk_xfree(void *ptr);
+
+/**
+ * Runtime lock contention counters.
+ *
+ * These are only maintained when the runtime is built with
+ * THUNK_LOCK_STATS.
+ */
+struct thunk_lock_stats {
+        /* Number of runtime lock acquisitions */
+        uint64_t acquisitions;
+        /* Number of acquisitions that had to wait */
+        uint64_t contended;
+        /* Total time spent waiting for runtime locks */
+        uint64_t wait_ns;
+};
+
+/**
+ * Read the runtime lock contention counters.
+ *
+ * Returns 0 on success, -1 if the runtime was built without
+ * THUNK_LOCK_STATS.
+ */
+int thunk_lock_stats_read(struct thunk_lock_stats *stats);
+
+/**
+ * Reset the runtime lock contention counters.
+ */
+void thunk_lock_stats_reset(void);
+
+/**
+ * Policy for returning the memory of empty arena chunks to the system.
+ *
+ * Trimmed chunks keep their address range, they are mapped again on
+ * demand when the arena grows. All zero disables automatic trimming.
+ */
+struct thunk_trim_policy {
+        /* Trim chunks that have been empty for this long */
+        uint64_t idle_ns;
+        /* Trim chunks as they empty while arenas hold more than this */
+        size_t budget;
+};
+
+/**
+ * Set the automatic trimming policy, applied when arena objects are freed.
+ */
+void thunk_trim_policy_set(const struct thunk_trim_policy *policy);
+
+/**
+ * Trim the empty arena chunks that have been idle for at least the
+ * policy idle time, or all of them if the policy has no idle time.
+ * Meant to be called periodically or when memory runs short.
+ *
+ * Returns the number of bytes released.
+ */
+size_t thunk_trim(void);
+
+/**
+ * Bytes of arena chunk memory that has not been trimmed.
+ */
+size_t thunk_trim_resident(void);
+
+/* ============= Internal functions ============== */
+
+/**
+ * Acquire a runtime lock.
+ *
+ * With THUNK_LOCK_STATS, this accounts the time spent waiting
+ * for contended locks.
+ */
+#ifdef THUNK_LOCK_STATS
+void thunk_mutex_lock(pthread_mutex_t *mtx);
+#else
+#define thunk_mutex_lock(mtx) pthread_mutex_lock(mtx)
+#endif
+
+/**
+ * Release a runtime lock taken with thunk_mutex_lock().
+ */
+#define thunk_mutex_unlock(mtx) pthread_mutex_unlock(mtx)
+
+/**
+ * Allocate a sealed object, as thunk_malloc() but without tracing.
+ *
+ * This is used by runtime layers that trace their own operations.
+ */
+thunk_object_t thunk_object_new(struct thunk_class *tc);
+
+/**
+ * Free a sealed object, as thunk_free() but without tracing.
+ */
+void thunk_object_delete(struct thunk_class *tc, thunk_object_t obj);
+
+/**
+ * Allocate, compile and initialise an unsealed object buffer.
+ *
+ * Returns NULL on failure.
+ */
+void *thunk_object_build(struct thunk_class *tc);
+
+/**
+ * Derive the data capability for an unsealed object buffer.
+ */
+void *thunk_object_data(struct thunk_class *tc, void *obj);
+
+/**
+ * Re-derive the data capability for a live sealed object.
+ *
+ * This is only supported for arena-backed classes, returns NULL
+ * otherwise or if the object is not a live object of the class.
+ */
+void *thunk_object_lookup_data(struct thunk_class *tc, thunk_object_t obj);
+
+/**
+ * Compile the code of a lazy object on its first invocation.
+ *
+ * This is called by the lazy stub with the object address, concurrent
+ * callers wait for the first one to compile the code.
+ */
+void thunk_lazy_resolve(struct thunk_class *tc, ptraddr_t addr);
+
+/**
+ * Size of the code area of lazy objects, including the resolver stub.
+ */
+size_t thunk_arch_lazy_code_size(const struct thunk_metaclass *mc);
+
+/**
+ * Install the resolver stub in the code area of a lazy object.
+ */
+void thunk_arch_lazy_install(struct thunk_class *tc, void *obj);
+
+/**
+ * Check whether a lazy object still enters the resolver stub.
+ */
+bool thunk_arch_lazy_pending(const struct thunk_class *tc, const void *obj);
+
+/**
+ * Replace the resolver stub entry of a lazy object with the compiled
+ * object code, the first instruction is written last.
+ * The stub literals are cleared afterwards.
+ */
+void thunk_arch_lazy_commit(const struct thunk_class *tc, void *obj,
+    thunk_template_t compiled);
+
+/**
+ * Release an unsealed object buffer built by thunk_object_build().
+ */
+void thunk_object_destroy(struct thunk_class *tc, void *obj);
+
+/**
+ * Get the arena for objects of a given size with the given flags.
+ *
+ * Arenas are shared between thunk classes.
+ */
+struct thunk_arena *thunk_arena_get(size_t size, unsigned int flags);
+
+/**
+ * Get the split arena for objects with the given code and data sizes.
+ */
+struct thunk_arena *thunk_arena_get_split(size_t code_size,
+    size_t data_size, unsigned int flags);
+
+/**
+ * Check whether objects in the arena have split code and data.
+ */
+bool thunk_arena_is_split(struct thunk_arena *arena);
+
+/**
+ * Allocate a slot of the given size from an arena.
+ * The size must not exceed the arena object size.
+ * The slot is recorded as owned by owner, usually the thunk class,
+ * until it is released.
+ */
+void *thunk_arena_alloc(struct thunk_arena *arena, const void *owner,
+    size_t size);
+
+/**
+ * Allocate a slot from a split arena, as thunk_arena_alloc().
+ *
+ * Returns the object capability, starting at the code slot, and the
+ * data slot capability in data.
+ */
+void *thunk_arena_alloc_split(struct thunk_arena *arena, const void *owner,
+    void **data);
+
+/**
+ * Release the arena slot at the given address.
+ *
+ * Returns -1 if the address is not a slot allocated to owner.
+ */
+int thunk_arena_free(struct thunk_arena *arena, const void *owner,
+    ptraddr_t addr);
+
+/**
+ * Re-derive the unsealed capability for the arena slot at the given address.
+ *
+ * Returns NULL if the address is not the start of a slot allocated
+ * to owner.
+ */
+void *thunk_arena_lookup(struct thunk_arena *arena, const void *owner,
+    ptraddr_t addr, size_t size);
+
+/**
+ * Re-derive the data capability for the split arena slot at the given
+ * code address.
+ *
+ * Returns NULL if the address is not the start of a slot allocated
+ * to owner.
+ */
+void *thunk_arena_data(struct thunk_arena *arena, const void *owner,
+    ptraddr_t addr);
+
+/**
+ * Pop a pre-built unsealed object buffer from a class pool.
+ *
+ * Returns NULL if the pool is empty.
+ */
+void *thunk_pool_pop(struct thunk_pool *pool);
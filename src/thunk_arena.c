@@ -0,0 +1,910 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Executable memory arenas for thunk objects.
+ *
+ * An arena hands out fixed-size slots carved from large executable
+ * chunks, so that the code of many thunk objects shares a few pages
+ * (and iTLB entries) instead of one mapping per object.
+ * Arenas are shared by all classes with the same slot size and flags.
+ *
+ * The arena keeps the root capability of each chunk, so that the
+ * runtime can re-derive the unsealed object from the address of
+ * a sealed thunk object. The owner of each allocated slot is recorded,
+ * usually the thunk class, lookups and frees only succeed for the owner
+ * of a live slot.
+ *
+ * Split arenas place object code and data in separate slots: chunks are
+ * divided in groups of at most THUNK_ARENA_SPLIT_SPAN bytes, each group
+ * packs the code slots densely in its first pages and the matching data
+ * slots in the following pages. The group span keeps the data within
+ * reach of the PC-relative adr used by templates. The object capability
+ * spans from the code slot to the end of the data slot, so it also covers
+ * neighbouring slots; this is only suitable for templates that check the
+ * data bounds they derive, like the split gate, rather than relying on
+ * the PCC bounds.
+ *
+ * Shared arenas are split arenas whose data pages are backed by an
+ * anonymous shared memory object instead of private memory. Forked
+ * processes inherit the mappings at the same addresses, together with
+ * the object code and the token spaces, so objects allocated before the
+ * fork give access to the same data in all processes without copies.
+ * In the child, chunks inherited from the parent are frozen: they do not
+ * serve new allocations and freeing an inherited object does not scrub
+ * the shared data, which is still owned by the parent.
+ * Shared data pages can not hold capabilities.
+ *
+ * Freed slots are zeroed and held in a quarantine of the arena before
+ * they are reused, zeroed code traps, so a stale sealed object faults
+ * until its slot leaves the quarantine. Once released, the slot may be
+ * handed out to any class that shares the arena.
+ *
+ * Chunks without live objects can be trimmed: the chunk pages are
+ * replaced with fresh anonymous memory at the same address, which
+ * returns the old pages to the system and keeps the range reserved.
+ * A trimmed chunk serves allocations again from its first slot.
+ * Shared arenas and inherited chunks are never trimmed.
+ */
+#include <assert.h>
+#include <cheriintrin.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <machine/param.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <cheri/cherireg.h>
+#include <unistd.h>
+
+#include "thunk.h"
+
+/* Default chunk size for arenas backed by base pages */
+#define THUNK_ARENA_CHUNK_SIZE (64 * 1024)
+/* Minimum slot alignment */
+#define THUNK_ARENA_SLOT_ALIGN 16
+/* Maximum distance between code and data in split arenas, adr range */
+#define THUNK_ARENA_SPLIT_SPAN (1024 * 1024)
+/* Number of freed slots held back from reuse in each arena */
+#define THUNK_ARENA_QUARANTINE 1024
+/* Protection of the chunk mappings */
+#define THUNK_ARENA_PROT (PROT_READ | PROT_WRITE | PROT_EXEC | PROT_CAP)
+
+struct thunk_arena_chunk {
+        TAILQ_ENTRY(thunk_arena_chunk) chunk_link;
+        /* Root capability for the chunk mapping */
+        void *root;
+        /* Bump allocation index */
+        size_t next_slot;
+        /* Number of slots in the chunk */
+        size_t nslots;
+        /* Number of slots currently allocated */
+        size_t nused;
+        /* Free list of released slots, linked through the slots */
+        void *free_list;
+        /* Address of the owner of each allocated slot, 0 if free */
+        ptraddr_t *owners;
+        /* Shared chunk mapped by the parent process before fork */
+        bool inherited;
+        /* The chunk pages have been released since the chunk emptied */
+        bool trimmed;
+        /* Time at which the last object in the chunk was freed */
+        uint64_t idle_since;
+};
+
+struct thunk_arena {
+        TAILQ_ENTRY(thunk_arena) arena_link;
+        pthread_mutex_t lock;
+        /*
+         * Distance between slots, meets the representable alignment.
+         * For split arenas, this is the distance between code slots.
+         */
+        size_t slot_size;
+        /* Distance between data slots of split arenas, 0 otherwise */
+        size_t data_slot_size;
+        /* Offset of the first data slot in a group */
+        size_t data_start;
+        /* Size of a slot group, the chunk size unless split */
+        size_t group_size;
+        /* Number of slots in a group */
+        size_t group_slots;
+        /* Size of each chunk mapping */
+        size_t chunk_size;
+        /* See enum thunk_arena_flags */
+        unsigned int flags;
+        TAILQ_HEAD(, thunk_arena_chunk) chunks;
+        /* Ring of freed slot addresses, 0 for slots trimmed meanwhile */
+        ptraddr_t *quarantine;
+        size_t quarantine_head;
+        size_t quarantine_count;
+};
+
+/* Global arena list, arenas are never destroyed */
+static pthread_mutex_t arena_head_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(thunk_arena_head, thunk_arena) arena_head =
+    TAILQ_HEAD_INITIALIZER(arena_head);
+/* Install the fork handlers for shared arenas once */
+static pthread_once_t arena_atfork_once = PTHREAD_ONCE_INIT;
+/* Automatic trimming policy, all zero disables it */
+static struct thunk_trim_policy trim_policy;
+/* Bytes of chunk memory that has not been trimmed, in all arenas */
+static size_t arena_resident;
+
+static uint64_t
+arena_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec);
+}
+
+static void
+arena_atfork_prepare(void)
+{
+        struct thunk_arena *arena;
+
+        thunk_mutex_lock(&arena_head_mutex);
+        TAILQ_FOREACH(arena, &arena_head, arena_link)
+                thunk_mutex_lock(&arena->lock);
+}
+
+static void
+arena_atfork_parent(void)
+{
+        struct thunk_arena *arena;
+
+        TAILQ_FOREACH(arena, &arena_head, arena_link)
+                thunk_mutex_unlock(&arena->lock);
+        thunk_mutex_unlock(&arena_head_mutex);
+}
+
+static void
+arena_atfork_child(void)
+{
+        struct thunk_arena *arena;
+        struct thunk_arena_chunk *chunk;
+
+        TAILQ_FOREACH(arena, &arena_head, arena_link) {
+                if (arena->flags & THUNK_ARENA_SHARED) {
+                        TAILQ_FOREACH(chunk, &arena->chunks, chunk_link)
+                                chunk->inherited = true;
+                }
+                thunk_mutex_unlock(&arena->lock);
+        }
+        thunk_mutex_unlock(&arena_head_mutex);
+}
+
+static void
+arena_atfork_init(void)
+{
+        pthread_atfork(arena_atfork_prepare, arena_atfork_parent,
+            arena_atfork_child);
+}
+
+/**
+ * Find the smallest supported superpage size, if any.
+ */
+static size_t
+arena_superpage_size(void)
+{
+        size_t sizes[MAXPAGESIZES];
+        int n;
+
+        n = getpagesizes(sizes, MAXPAGESIZES);
+        if (n <= 1)
+                return (0);
+
+        return (sizes[1]);
+}
+
+/**
+ * Replace the data pages of each slot group in a new chunk with
+ * a shared memory object.
+ */
+static int
+arena_chunk_share(struct thunk_arena *arena, char *mem)
+{
+        size_t ngroups = arena->chunk_size / arena->group_size;
+        size_t data_size = arena->group_size - arena->data_start;
+        size_t i;
+        void *data;
+        int fd;
+
+        fd = shm_open(SHM_ANON, O_RDWR, 0600);
+        if (fd < 0)
+                return (-1);
+        if (ftruncate(fd, ngroups * data_size) != 0) {
+                close(fd);
+                return (-1);
+        }
+        for (i = 0; i < ngroups; i++) {
+                data = mmap(mem + i * arena->group_size + arena->data_start,
+                    data_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, i * data_size);
+                if (data == MAP_FAILED) {
+                        close(fd);
+                        return (-1);
+                }
+        }
+        /* The mappings keep the shared memory object alive */
+        close(fd);
+
+        return (0);
+}
+
+static struct thunk_arena_chunk *
+arena_chunk_create(struct thunk_arena *arena)
+{
+        struct thunk_arena_chunk *chunk;
+        size_t align, nslots;
+        void *mem = MAP_FAILED;
+        int align_flags = 0;
+
+        nslots = (arena->chunk_size / arena->group_size) * arena->group_slots;
+        chunk = malloc(sizeof(*chunk));
+        if (chunk == NULL)
+                return (NULL);
+        chunk->owners = calloc(nslots, sizeof(*chunk->owners));
+        if (chunk->owners == NULL) {
+                free(chunk);
+                return (NULL);
+        }
+
+        align = ~cheri_representable_alignment_mask(arena->slot_size) + 1;
+        if (align > PAGE_SIZE)
+                align_flags = MAP_ALIGNED(flsl(align) - 1);
+
+        if (arena->flags & THUNK_ARENA_SUPERPAGE) {
+                mem = mmap(NULL, arena->chunk_size, THUNK_ARENA_PROT,
+                    MAP_ANON | MAP_PRIVATE | MAP_ALIGNED_SUPER, -1, 0);
+        }
+        /* Superpages may not be available, fall back to base pages */
+        if (mem == MAP_FAILED) {
+                mem = mmap(NULL, arena->chunk_size, THUNK_ARENA_PROT,
+                    MAP_ANON | MAP_PRIVATE | align_flags, -1, 0);
+        }
+        if (mem == MAP_FAILED)
+                goto fail;
+        if ((arena->flags & THUNK_ARENA_SHARED) &&
+            arena_chunk_share(arena, mem) != 0) {
+                munmap(mem, arena->chunk_size);
+                goto fail;
+        }
+
+        chunk->root = mem;
+        chunk->next_slot = 0;
+        chunk->nslots = nslots;
+        chunk->nused = 0;
+        chunk->free_list = NULL;
+        chunk->inherited = false;
+        chunk->trimmed = false;
+        chunk->idle_since = 0;
+        TAILQ_INSERT_HEAD(&arena->chunks, chunk, chunk_link);
+        __atomic_fetch_add(&arena_resident, arena->chunk_size,
+            __ATOMIC_RELAXED);
+
+        return (chunk);
+fail:
+        free(chunk->owners);
+        free(chunk);
+        return (NULL);
+}
+
+/**
+ * Drop the quarantined slots of a chunk.
+ * Must be called with the arena lock held.
+ */
+static void
+arena_quarantine_purge(struct thunk_arena *arena,
+    struct thunk_arena_chunk *chunk)
+{
+        ptraddr_t base = cheri_address_get(chunk->root);
+        ptraddr_t *entry;
+        size_t i;
+
+        for (i = 0; i < arena->quarantine_count; i++) {
+                entry = &arena->quarantine[(arena->quarantine_head + i) %
+                    THUNK_ARENA_QUARANTINE];
+                if (*entry >= base && *entry < base + arena->chunk_size)
+                        *entry = 0;
+        }
+}
+
+/**
+ * Release the pages of an empty chunk, keeping the address range.
+ * Must be called with the arena lock held.
+ *
+ * Returns the number of bytes released.
+ */
+static size_t
+arena_chunk_trim(struct thunk_arena *arena, struct thunk_arena_chunk *chunk)
+{
+        void *mem;
+
+        if (chunk->nused != 0 || chunk->trimmed || chunk->inherited ||
+            (arena->flags & THUNK_ARENA_SHARED))
+                return (0);
+
+        /*
+         * Map fresh pages over the chunk rather than madvise(), so that
+         * the next allocations find zeroed slots on every system.
+         */
+        mem = mmap(chunk->root, arena->chunk_size, THUNK_ARENA_PROT,
+            MAP_ANON | MAP_PRIVATE | MAP_FIXED, -1, 0);
+        if (mem == MAP_FAILED)
+                return (0);
+
+        chunk->root = mem;
+        chunk->next_slot = 0;
+        chunk->free_list = NULL;
+        chunk->trimmed = true;
+        /* The chunk serves allocations from the first slot again */
+        arena_quarantine_purge(arena, chunk);
+        __atomic_fetch_sub(&arena_resident, arena->chunk_size,
+            __ATOMIC_RELAXED);
+
+        return (arena->chunk_size);
+}
+
+/**
+ * Apply the trimming policy after a chunk became empty.
+ * Must be called with the arena lock held.
+ */
+static void
+arena_trim_policy(struct thunk_arena *arena, struct thunk_arena_chunk *empty)
+{
+        struct thunk_arena_chunk *chunk;
+        uint64_t idle_ns = __atomic_load_n(&trim_policy.idle_ns,
+            __ATOMIC_RELAXED);
+        size_t budget = __atomic_load_n(&trim_policy.budget,
+            __ATOMIC_RELAXED);
+
+        if (budget != 0 &&
+            __atomic_load_n(&arena_resident, __ATOMIC_RELAXED) > budget) {
+                arena_chunk_trim(arena, empty);
+                return;
+        }
+        if (idle_ns == 0)
+                return;
+
+        /*
+         * XXX-AM: There is no background thread, chunks that went idle
+         * are only trimmed on the next free in the same arena or by
+         * a thunk_trim() call from the application.
+         */
+        TAILQ_FOREACH(chunk, &arena->chunks, chunk_link) {
+                if (chunk->nused == 0 &&
+                    empty->idle_since - chunk->idle_since >= idle_ns)
+                        arena_chunk_trim(arena, chunk);
+        }
+}
+
+/**
+ * Find the chunk that contains a given address.
+ * Must be called with the arena lock held.
+ */
+static struct thunk_arena_chunk *
+arena_chunk_find(struct thunk_arena *arena, ptraddr_t addr)
+{
+        struct thunk_arena_chunk *chunk;
+        ptraddr_t base;
+
+        TAILQ_FOREACH(chunk, &arena->chunks, chunk_link) {
+                base = cheri_address_get(chunk->root);
+                if (addr >= base && addr < base + arena->chunk_size)
+                        return (chunk);
+        }
+
+        return (NULL);
+}
+
+static size_t
+arena_code_offset(struct thunk_arena *arena, size_t index)
+{
+        return ((index / arena->group_slots) * arena->group_size +
+            (index % arena->group_slots) * arena->slot_size);
+}
+
+static size_t
+arena_data_offset(struct thunk_arena *arena, size_t index)
+{
+        return ((index / arena->group_slots) * arena->group_size +
+            arena->data_start +
+            (index % arena->group_slots) * arena->data_slot_size);
+}
+
+/**
+ * Derive the capability for a slot from the chunk root capability.
+ * For split arenas, this is the code slot.
+ */
+static void *
+arena_slot_cap(struct thunk_arena *arena, struct thunk_arena_chunk *chunk,
+    size_t index, size_t size)
+{
+        char *slot;
+
+        slot = (char *)chunk->root + arena_code_offset(arena, index);
+        slot = cheri_perms_clear(slot, CHERI_PERM_SW_VMEM);
+
+        return (cheri_bounds_set_exact(slot, size));
+}
+
+/**
+ * Derive the object capability for a split arena slot.
+ * This spans from the code slot to the end of the data slot.
+ */
+static void *
+arena_span_cap(struct thunk_arena *arena, struct thunk_arena_chunk *chunk,
+    size_t index)
+{
+        size_t code_offset = arena_code_offset(arena, index);
+        size_t data_end = arena_data_offset(arena, index) +
+            arena->data_slot_size;
+        char *slot;
+
+        slot = (char *)chunk->root + code_offset;
+        slot = cheri_perms_clear(slot, CHERI_PERM_SW_VMEM);
+
+        return (cheri_bounds_set(slot, data_end - code_offset));
+}
+
+/**
+ * Derive the data capability for a split arena slot.
+ */
+static void *
+arena_data_cap(struct thunk_arena *arena, struct thunk_arena_chunk *chunk,
+    size_t index)
+{
+        char *data;
+
+        data = (char *)chunk->root + arena_data_offset(arena, index);
+        data = cheri_perms_clear(data, CHERI_PERM_SW_VMEM);
+
+        return (cheri_bounds_set_exact(data, arena->data_slot_size));
+}
+
+/**
+ * Find the slot index for an address, or -1 if the address is not
+ * the start of a (code) slot in the chunk.
+ */
+static ssize_t
+arena_slot_index(struct thunk_arena *arena, struct thunk_arena_chunk *chunk,
+    ptraddr_t addr)
+{
+        ptraddr_t offset = addr - cheri_address_get(chunk->root);
+        size_t group = offset / arena->group_size;
+        size_t group_offset = offset % arena->group_size;
+        size_t index;
+
+        if (group_offset % arena->slot_size != 0)
+                return (-1);
+        if (group_offset / arena->slot_size >= arena->group_slots)
+                return (-1);
+        index = group * arena->group_slots + group_offset / arena->slot_size;
+        if (index >= chunk->next_slot)
+                return (-1);
+
+        return (index);
+}
+
+/**
+ * Find the slot index for an address, or -1 if the address is not
+ * the start of a slot allocated to the given owner.
+ * Must be called with the arena lock held.
+ */
+static ssize_t
+arena_owned_index(struct thunk_arena *arena, ptraddr_t addr,
+    const void *owner, struct thunk_arena_chunk **chunkp)
+{
+        struct thunk_arena_chunk *chunk;
+        ssize_t index;
+
+        chunk = arena_chunk_find(arena, addr);
+        if (chunk == NULL)
+                return (-1);
+        index = arena_slot_index(arena, chunk, addr);
+        if (index < 0 || owner == NULL ||
+            chunk->owners[index] != cheri_address_get(owner))
+                return (-1);
+        *chunkp = chunk;
+
+        return (index);
+}
+
+static size_t
+arena_slot_align(size_t size)
+{
+        size_t align;
+
+        align = ~cheri_representable_alignment_mask(size) + 1;
+        if (align < THUNK_ARENA_SLOT_ALIGN)
+                align = THUNK_ARENA_SLOT_ALIGN;
+
+        return (cheri_align_up(size, align));
+}
+
+/**
+ * Size the slot groups of a split arena.
+ *
+ * Returns false if no slot fits in a group.
+ */
+static bool
+arena_split_layout(struct thunk_arena *arena)
+{
+        size_t min_size;
+        size_t n;
+
+        if (~cheri_representable_alignment_mask(arena->data_slot_size) + 1 >
+            PAGE_SIZE)
+                return (false);
+
+        /* Grow the chunk to fit at least one slot, as contiguous arenas */
+        min_size = cheri_align_up(arena->slot_size, PAGE_SIZE) +
+            arena->data_slot_size;
+        if (arena->chunk_size < min_size &&
+            min_size <= THUNK_ARENA_SPLIT_SPAN)
+                arena->chunk_size = cheri_align_up(min_size, PAGE_SIZE);
+
+        arena->group_size = arena->chunk_size;
+        if (arena->group_size > THUNK_ARENA_SPLIT_SPAN)
+                arena->group_size = THUNK_ARENA_SPLIT_SPAN;
+
+        n = arena->group_size / (arena->slot_size + arena->data_slot_size);
+        while (n > 0 && cheri_align_up(n * arena->slot_size, PAGE_SIZE) +
+            n * arena->data_slot_size > arena->group_size)
+                n--;
+        if (n == 0)
+                return (false);
+
+        arena->group_slots = n;
+        arena->data_start = cheri_align_up(n * arena->slot_size, PAGE_SIZE);
+
+        return (true);
+}
+
+/**
+ * Find or create an arena with the given slot geometry.
+ * A zero data_slot_size makes a contiguous arena.
+ */
+static struct thunk_arena *
+arena_get(size_t slot_size, size_t data_slot_size, unsigned int flags)
+{
+        struct thunk_arena *arena;
+        size_t superpage;
+
+        if (flags & THUNK_ARENA_SHARED)
+                pthread_once(&arena_atfork_once, arena_atfork_init);
+
+        thunk_mutex_lock(&arena_head_mutex);
+        TAILQ_FOREACH(arena, &arena_head, arena_link) {
+                if (arena->slot_size == slot_size &&
+                    arena->data_slot_size == data_slot_size &&
+                    arena->flags == flags)
+                        goto out;
+        }
+
+        arena = malloc(sizeof(*arena));
+        if (arena == NULL)
+                goto out;
+        arena->quarantine = malloc(THUNK_ARENA_QUARANTINE *
+            sizeof(*arena->quarantine));
+        if (arena->quarantine == NULL) {
+                free(arena);
+                arena = NULL;
+                goto out;
+        }
+        arena->quarantine_head = 0;
+        arena->quarantine_count = 0;
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->slot_size = slot_size;
+        arena->data_slot_size = data_slot_size;
+        arena->flags = flags;
+        arena->chunk_size = THUNK_ARENA_CHUNK_SIZE;
+        if (flags & THUNK_ARENA_SUPERPAGE) {
+                superpage = arena_superpage_size();
+                if (superpage != 0)
+                        arena->chunk_size = superpage;
+        }
+        if (flags & THUNK_ARENA_SPLIT) {
+                if (!arena_split_layout(arena)) {
+                        free(arena->quarantine);
+                        free(arena);
+                        arena = NULL;
+                        goto out;
+                }
+        } else {
+                if (arena->chunk_size < slot_size)
+                        arena->chunk_size = cheri_align_up(slot_size,
+                            PAGE_SIZE);
+                arena->group_size = arena->chunk_size;
+                arena->group_slots = arena->chunk_size / slot_size;
+                arena->data_start = 0;
+        }
+        TAILQ_INIT(&arena->chunks);
+        TAILQ_INSERT_HEAD(&arena_head, arena, arena_link);
+out:
+        thunk_mutex_unlock(&arena_head_mutex);
+
+        return (arena);
+}
+
+/**
+ * Allocate a slot index for the given owner.
+ * Must be called with the arena lock held.
+ */
+static ssize_t
+arena_alloc_index(struct thunk_arena *arena, const void *owner,
+    struct thunk_arena_chunk **chunkp)
+{
+        struct thunk_arena_chunk *chunk;
+        void **slot;
+        ssize_t index;
+
+        TAILQ_FOREACH(chunk, &arena->chunks, chunk_link) {
+                if (chunk->inherited)
+                        continue;
+                if (chunk->free_list != NULL ||
+                    chunk->next_slot < chunk->nslots)
+                        break;
+        }
+        if (chunk == NULL)
+                chunk = arena_chunk_create(arena);
+        if (chunk == NULL)
+                return (-1);
+
+        if (chunk->trimmed) {
+                chunk->trimmed = false;
+                __atomic_fetch_add(&arena_resident, arena->chunk_size,
+                    __ATOMIC_RELAXED);
+        }
+        if (chunk->free_list != NULL) {
+                slot = chunk->free_list;
+                chunk->free_list = *slot;
+                *slot = NULL;
+                index = arena_slot_index(arena, chunk,
+                    cheri_address_get(slot));
+        } else {
+                index = chunk->next_slot++;
+        }
+        chunk->owners[index] = cheri_address_get(owner);
+        chunk->nused++;
+        *chunkp = chunk;
+
+        return (index);
+}
+
+struct thunk_arena *
+thunk_arena_get(size_t size, unsigned int flags)
+{
+        assert((flags & (THUNK_ARENA_SPLIT | THUNK_ARENA_SHARED)) == 0 &&
+            "Split arenas need thunk_arena_get_split()");
+
+        return (arena_get(arena_slot_align(size), 0, flags));
+}
+
+struct thunk_arena *
+thunk_arena_get_split(size_t code_size, size_t data_size, unsigned int flags)
+{
+        return (arena_get(arena_slot_align(code_size),
+            arena_slot_align(data_size), flags | THUNK_ARENA_SPLIT));
+}
+
+bool
+thunk_arena_is_split(struct thunk_arena *arena)
+{
+        return ((arena->flags & THUNK_ARENA_SPLIT) != 0);
+}
+
+void *
+thunk_arena_alloc(struct thunk_arena *arena, const void *owner, size_t size)
+{
+        struct thunk_arena_chunk *chunk;
+        ssize_t index;
+        void *slot = NULL;
+
+        assert(!thunk_arena_is_split(arena) &&
+            "Split arenas need thunk_arena_alloc_split()");
+        assert(size <= arena->slot_size && "Arena slot too small");
+        assert(owner != NULL && "Arena slot without owner");
+
+        thunk_mutex_lock(&arena->lock);
+        index = arena_alloc_index(arena, owner, &chunk);
+        if (index >= 0)
+                slot = arena_slot_cap(arena, chunk, index, size);
+        thunk_mutex_unlock(&arena->lock);
+
+        return (slot);
+}
+
+void *
+thunk_arena_alloc_split(struct thunk_arena *arena, const void *owner,
+    void **data)
+{
+        struct thunk_arena_chunk *chunk;
+        ssize_t index;
+        void *slot = NULL;
+
+        assert(thunk_arena_is_split(arena) && "Not a split arena");
+        assert(owner != NULL && "Arena slot without owner");
+
+        thunk_mutex_lock(&arena->lock);
+        index = arena_alloc_index(arena, owner, &chunk);
+        if (index >= 0) {
+                slot = arena_span_cap(arena, chunk, index);
+                *data = arena_data_cap(arena, chunk, index);
+        }
+        thunk_mutex_unlock(&arena->lock);
+
+        return (slot);
+}
+
+/**
+ * Put a freed slot in quarantine, the oldest quarantined slot goes back
+ * to the free list of its chunk.
+ * Must be called with the arena lock held.
+ */
+static void
+arena_quarantine(struct thunk_arena *arena, ptraddr_t addr)
+{
+        struct thunk_arena_chunk *chunk;
+        ptraddr_t oldest;
+        ssize_t index;
+        void **slot;
+
+        if (arena->quarantine_count == THUNK_ARENA_QUARANTINE) {
+                oldest = arena->quarantine[arena->quarantine_head];
+                arena->quarantine_head = (arena->quarantine_head + 1) %
+                    THUNK_ARENA_QUARANTINE;
+                arena->quarantine_count--;
+                chunk = (oldest == 0) ? NULL : arena_chunk_find(arena, oldest);
+                if (chunk != NULL) {
+                        index = arena_slot_index(arena, chunk, oldest);
+                        assert(index >= 0 && "Invalid quarantined slot");
+                        slot = arena_slot_cap(arena, chunk, index,
+                            arena->slot_size);
+                        *slot = chunk->free_list;
+                        chunk->free_list = slot;
+                }
+        }
+        arena->quarantine[(arena->quarantine_head +
+            arena->quarantine_count) % THUNK_ARENA_QUARANTINE] = addr;
+        arena->quarantine_count++;
+}
+
+int
+thunk_arena_free(struct thunk_arena *arena, const void *owner, ptraddr_t addr)
+{
+        struct thunk_arena_chunk *chunk;
+        ssize_t index;
+
+        thunk_mutex_lock(&arena->lock);
+        /* Reject misaligned slots, double frees and foreign slots */
+        index = arena_owned_index(arena, addr, owner, &chunk);
+        if (index < 0)
+                goto fail;
+        chunk->owners[index] = 0;
+
+        /* The data belongs to the parent, the slot is never reused */
+        if (chunk->inherited) {
+                chunk->nused--;
+                thunk_mutex_unlock(&arena->lock);
+                return (0);
+        }
+
+        /* Do not leak the previous object data to the next owner */
+        if (thunk_arena_is_split(arena)) {
+                memset(arena_data_cap(arena, chunk, index), 0,
+                    arena->data_slot_size);
+        }
+        /* Zeroed code traps while the slot is in quarantine */
+        memset(arena_slot_cap(arena, chunk, index, arena->slot_size), 0,
+            arena->slot_size);
+        arena_quarantine(arena, addr);
+        chunk->nused--;
+        if (chunk->nused == 0) {
+                chunk->idle_since = arena_now_ns();
+                arena_trim_policy(arena, chunk);
+        }
+        thunk_mutex_unlock(&arena->lock);
+
+        return (0);
+fail:
+        thunk_mutex_unlock(&arena->lock);
+        return (-1);
+}
+
+void *
+thunk_arena_lookup(struct thunk_arena *arena, const void *owner,
+    ptraddr_t addr, size_t size)
+{
+        struct thunk_arena_chunk *chunk;
+        ssize_t index;
+        void *slot = NULL;
+
+        thunk_mutex_lock(&arena->lock);
+        index = arena_owned_index(arena, addr, owner, &chunk);
+        if (index < 0)
+                goto out;
+        if (thunk_arena_is_split(arena))
+                slot = arena_span_cap(arena, chunk, index);
+        else
+                slot = arena_slot_cap(arena, chunk, index, size);
+out:
+        thunk_mutex_unlock(&arena->lock);
+
+        return (slot);
+}
+
+void *
+thunk_arena_data(struct thunk_arena *arena, const void *owner,
+    ptraddr_t addr)
+{
+        struct thunk_arena_chunk *chunk;
+        ssize_t index;
+        void *data = NULL;
+
+        assert(thunk_arena_is_split(arena) && "Not a split arena");
+
+        thunk_mutex_lock(&arena->lock);
+        index = arena_owned_index(arena, addr, owner, &chunk);
+        if (index < 0)
+                goto out;
+        data = arena_data_cap(arena, chunk, index);
+out:
+        thunk_mutex_unlock(&arena->lock);
+
+        return (data);
+}
+
+void
+thunk_trim_policy_set(const struct thunk_trim_policy *policy)
+{
+        __atomic_store_n(&trim_policy.idle_ns, policy->idle_ns,
+            __ATOMIC_RELAXED);
+        __atomic_store_n(&trim_policy.budget, policy->budget,
+            __ATOMIC_RELAXED);
+}
+
+size_t
+thunk_trim(void)
+{
+        struct thunk_arena *arena;
+        struct thunk_arena_chunk *chunk;
+        uint64_t idle_ns = __atomic_load_n(&trim_policy.idle_ns,
+            __ATOMIC_RELAXED);
+        uint64_t now = arena_now_ns();
+        size_t released = 0;
+
+        thunk_mutex_lock(&arena_head_mutex);
+        TAILQ_FOREACH(arena, &arena_head, arena_link) {
+                thunk_mutex_lock(&arena->lock);
+                TAILQ_FOREACH(chunk, &arena->chunks, chunk_link) {
+                        if (now - chunk->idle_since >= idle_ns)
+                                released += arena_chunk_trim(arena, chunk);
+                }
+                thunk_mutex_unlock(&arena->lock);
+        }
+        thunk_mutex_unlock(&arena_head_mutex);
+
+        return (released);
+}
+
+size_t
+thunk_trim_resident(void)
+{
+        return (__atomic_load_n(&arena_resident, __ATOMIC_RELAXED));
+}
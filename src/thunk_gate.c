@@ -10,13 +10,18 @@
  */
 #include <cheriintrin.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <pthread.h>
 
+#include <machine/param.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
+#include <sys/sysctl.h>
 #include <cheri/cherireg.h>
 
 #include "thunk-gate.h"
+#include "thunk-trace.h"
 
 /**
  * Private data associated to gate classes.
@@ -34,18 +39,120 @@ struct thunk_gate_class {
         thunk_token_t token_space;
         /* Requested object size */
         size_t requested_size;
+        /* Creation flags, see enum thunk_gate_flags */
+        unsigned int flags;
+        /* Generated policy metaclass, released with the class */
+        struct thunk_metaclass *policy_mc;
+        /* The class was destroyed, no more objects can be allocated */
+        bool destroyed;
+        /* Memo cache epoch, see gate_memo_invalidate() */
+        uint64_t memo_epoch;
+        /* Offset of the stats block in the data area and token space */
+        size_t stats_offset;
+        /* Token offset to histogram bucket shift */
+        unsigned int hist_shift;
+        /* Offset of the generation word in the data area */
+        size_t gen_offset;
+        /* Token space offset to generation shift */
+        unsigned int gen_shift;
+        /* Distance between data replicas, log2, for replicated classes */
+        unsigned int replica_shift;
+        /* Sealing capability for the gate pairs of shared code classes */
+        void *pair_sealcap;
+        /* Sealed shared gate code for shared code classes */
+        void *pair_code;
+        /* Element size for gate array classes, 0 otherwise */
+        size_t elem_size;
+        /* Number of elements for gate array classes */
+        size_t nelems;
+        /* Class index in token handles, 0 if the class has none */
+        unsigned int handle_index;
+        /* Number of token length classes in use */
+        unsigned int nlengths;
+        /* Token lengths by length class, see thunk_token_handle() */
+        size_t lengths[THUNK_TOKEN_LENGTH_CLASSES];
         /* Thunk class associated to a specific gate type */
         struct thunk_class thunk_class;
 };
 
 /* Global thunk gate metaclass */
 extern struct thunk_metaclass *thunk_gate_meta;
+/* Global split thunk gate metaclass */
+extern struct thunk_metaclass *thunk_gate_split_meta;
+/* Global instrumented thunk gate metaclass */
+extern struct thunk_metaclass *thunk_gate_instr_meta;
+/* Global thunk gate with generations metaclass */
+extern struct thunk_metaclass *thunk_gate_gen_meta;
+/* Global shared code thunk gate metaclass */
+extern struct thunk_metaclass *thunk_gate_pair_meta;
+/* Global replicated thunk gate metaclass */
+extern struct thunk_metaclass *thunk_gate_replica_meta;
+
+/*
+ * Sealing capabilities for gate class handles and gate pairs.
+ * The first otype seals class handles, each shared code class takes
+ * the next free otype for its gate pairs.
+ * XXX-AM: The kernel hands out the sealing root to anybody asking through
+ * sysctl, a compartmentalised runtime must hold it exclusively.
+ */
+static pthread_once_t gate_sealcap_once = PTHREAD_ONCE_INIT;
+static void *gate_sealroot;
+static void *gate_sealcap;
+static ptraddr_t gate_pair_otype_next;
 
 /* Global gate thunk class list */
 static pthread_mutex_t gate_head_mutex = PTHREAD_MUTEX_INITIALIZER;
 static TAILQ_HEAD(thunk_gate_head, thunk_gate_class) gate_head =
     TAILQ_HEAD_INITIALIZER(gate_head);
 
+/*
+ * Token handle layout, from the most significant bits: class index,
+ * length class, permission bits and offset in the token space.
+ */
+#define TOKEN_HANDLE_CLASS_SHIFT 52
+#define TOKEN_HANDLE_LENGTH_SHIFT 46
+#define TOKEN_HANDLE_PERMS_SHIFT 39
+#define TOKEN_HANDLE_CLASSES (1U << (64 - TOKEN_HANDLE_CLASS_SHIFT))
+#define TOKEN_HANDLE_PERMS_MASK 0x7fUL
+#define TOKEN_HANDLE_OFFSET_MASK ((1UL << TOKEN_HANDLE_PERMS_SHIFT) - 1)
+
+static_assert(THUNK_TOKEN_LENGTH_CLASSES ==
+    1 << (TOKEN_HANDLE_CLASS_SHIFT - TOKEN_HANDLE_LENGTH_SHIFT),
+    "Token handle length class field out of sync");
+
+/* Token permissions in handle bit order, see THUNK_TOKEN_MAX_PERMS */
+#define TOKEN_HANDLE_NPERMS 7
+static const size_t token_handle_perms[TOKEN_HANDLE_NPERMS] = {
+        CHERI_PERM_GLOBAL, CHERI_PERM_STORE_LOCAL_CAP, CHERI_PERM_LOAD,
+        CHERI_PERM_STORE, CHERI_PERM_LOAD_CAP, CHERI_PERM_STORE_CAP,
+        CHERI_PERM_MUTABLE_LOAD,
+};
+
+/* Next class index for token handles, 0 is never used */
+static unsigned int gate_handle_index_next = 1;
+/* Serialise the length class updates of all classes */
+static pthread_mutex_t gate_lengths_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of entries in the per-thread gate memo cache, log2 */
+#define GATE_MEMO_SHIFT 6
+#define GATE_MEMO_ENTRIES (1 << GATE_MEMO_SHIFT)
+
+/**
+ * Gate memo cache entry.
+ *
+ * The entry is valid as long as the memo epoch of the class matches.
+ */
+struct gate_memo_entry {
+        ptraddr_t class_addr;
+        uint64_t epoch;
+        void *gate;
+        thunk_token_t token;
+        void *result;
+};
+
+/* Direct-mapped memo cache for thunk_gate_invoke_cached() */
+static _Thread_local struct gate_memo_entry gate_memo[GATE_MEMO_ENTRIES];
+
 /**
  * Validate and unwrap the gate entrypoint.
  *
@@ -58,7 +165,7 @@ thunk_gate_unwrap(thunk_gate_t gate)
 #ifdef THUNK_AUTH_MODE_PERMS
         void *entry = thunk_object_unwrap(gate.obj);
 
-        if (cheri_is_sealed(entry) &&
+        if (thunk_arch_object_sealed(entry) &&
             (cheri_perms_get(entry) & CHERI_PERM_SW_THUNK)) {
                 return (entry);
         }
@@ -69,6 +176,83 @@ thunk_gate_unwrap(thunk_gate_t gate)
 #endif
 }
 
+static void
+gate_sealcap_init(void)
+{
+        void *sealroot;
+        size_t len = sizeof(sealroot);
+
+        if (sysctlbyname("security.cheri.sealcap", &sealroot, &len,
+            NULL, 0) != 0)
+                return;
+        gate_sealroot = sealroot;
+        gate_pair_otype_next = cheri_address_get(sealroot) + 1;
+        /* Keep a single otype for gate classes */
+        gate_sealcap = cheri_bounds_set_exact(sealroot, 1);
+}
+
+/**
+ * Allocate a sealing capability for the gate pairs of a class,
+ * otypes are never reused.
+ */
+static void *
+gate_pair_sealcap_alloc(void)
+{
+        ptraddr_t otype;
+
+        otype = __atomic_fetch_add(&gate_pair_otype_next, 1,
+            __ATOMIC_RELAXED);
+        if (otype >= cheri_base_get(gate_sealroot) +
+            cheri_length_get(gate_sealroot))
+                return (NULL);
+
+        return (cheri_bounds_set_exact(
+            cheri_address_set(gate_sealroot, otype), 1));
+}
+
+/**
+ * Seal a gate class handle.
+ */
+static thunk_gate_class_t
+gateclass_seal(struct thunk_gate_class *gate_class)
+{
+        return ((thunk_gate_class_t){
+            .class = cheri_seal(gate_class, gate_sealcap) });
+}
+
+/**
+ * Authenticate and unseal a gate class handle.
+ *
+ * If authentication fails, NULL is returned.
+ */
+static inline struct thunk_gate_class *
+gateclass_unseal(thunk_gate_class_t gc)
+{
+        void *class = gc.class;
+
+        /* Handles are only ever sealed after the sealcap is set */
+        if (!cheri_tag_get(class) || !cheri_is_sealed(class) ||
+            cheri_type_get(class) != (long)cheri_address_get(gate_sealcap))
+                return (NULL);
+
+        return (cheri_unseal(class, gate_sealcap));
+}
+
+/**
+ * Drop the memo cache results of the gates of a class, on every thread.
+ *
+ * This must follow the object or generation change, a concurrent miss
+ * that observed the old state then records its result under a dead
+ * epoch.
+ * Entries are recorded with the class address, so memory of a freed
+ * gate reused by another class never hits the entries of the old class.
+ */
+static inline void
+gate_memo_invalidate(struct thunk_gate_class *gate_class)
+{
+        __atomic_fetch_add(&gate_class->memo_epoch, 1, __ATOMIC_RELEASE);
+}
+
 /**
  * Allocate a new chunk of token space.
  *
@@ -82,10 +266,17 @@ static thunk_token_t
 token_space_alloc(size_t size)
 {
         thunk_token_t space;
+        size_t align = ~cheri_representable_alignment_mask(size) + 1;
+        int flags = MAP_GUARD;
+
+        /* Large token spaces need aligned bounds for the root token */
+        size = cheri_representable_length(size);
+        if (align > PAGE_SIZE)
+                flags |= MAP_ALIGNED(flsl(align) - 1);
 
         space = mmap(NULL, size, PROT_NONE |
             PROT_MAX(PROT_READ | PROT_WRITE | PROT_EXEC | PROT_CAP),
-            MAP_GUARD, -1, 0);
+            flags, -1, 0);
         if (space == MAP_FAILED)
                 return (NULL);
 
@@ -99,62 +290,427 @@ token_space_free(thunk_token_t token)
 }
 
 
+/**
+ * Build the single gate object of a shared code class and seal its code
+ * for the class gate pairs.
+ */
+static int
+gate_pair_class_init(struct thunk_gate_class *gate_class)
+{
+        struct thunk_class *tclass = &gate_class->thunk_class;
+        void *code;
+
+        gate_class->pair_sealcap = gate_pair_sealcap_alloc();
+        if (gate_class->pair_sealcap == NULL)
+                return (-1);
+
+        code = thunk_object_build(tclass);
+        if (code == NULL)
+                return (-1);
+        code = cheri_perms_clear(code, CHERI_PERM_STORE |
+            CHERI_PERM_STORE_CAP | CHERI_PERM_STORE_LOCAL_CAP);
+        code = cheri_bounds_set(code, thunk_code_size(tclass->mc));
+        gate_class->pair_code = thunk_arch_seal_code((uintptr_t)code,
+            gate_class->pair_sealcap);
+
+        return (0);
+}
+
+/**
+ * Pick the histogram shift so that the token offsets of an object
+ * of the given size spread over all the stats buckets.
+ */
+static unsigned int
+gate_stats_hist_shift(size_t size)
+{
+        unsigned int shift = 0;
+
+        while (size > 0 && ((size - 1) >> shift) >= THUNK_GATE_STATS_BUCKETS)
+                shift++;
+
+        return (shift);
+}
+
+/**
+ * Pick the generation window shift, windows must be large enough
+ * to hold the root token with representable bounds.
+ */
+static unsigned int
+gate_gen_shift(size_t size)
+{
+        unsigned int shift = 0;
+
+        while (((size_t)1 << shift) < size)
+                shift++;
+
+        return (shift);
+}
+
+/**
+ * Pick the replica shift, replicas are kept on separate cache lines.
+ */
+static unsigned int
+gate_replica_shift(size_t size)
+{
+        unsigned int shift = gate_gen_shift(size);
+
+        while (((size_t)1 << shift) < THUNK_CACHE_LINE_SIZE)
+                shift++;
+
+        return (shift);
+}
+
+static unsigned int
+gate_arena_flags(unsigned int flags)
+{
+        unsigned int arena_flags = 0;
+
+        if (flags & THUNK_GATE_SUPERPAGE)
+                arena_flags |= THUNK_ARENA_SUPERPAGE;
+        /* The split gate checks the data bounds, see gateclass_create() */
+        if (flags & THUNK_GATE_SPLIT)
+                arena_flags |= THUNK_ARENA_SPLIT;
+        if (flags & THUNK_GATE_SHARED)
+                arena_flags |= THUNK_ARENA_SPLIT | THUNK_ARENA_SHARED;
+
+        return (arena_flags);
+}
+
 thunk_gate_class_t
 thunk_gateclass_create(size_t size)
 {
-        const size_t data_align = ~cheri_representable_alignment_mask(size) + 1;
-        size_t data_offset;
+        return (thunk_gateclass_create_flags(size, 0));
+}
+
+/**
+ * Check that a policy descriptor can be compiled for objects of the
+ * given size.
+ */
+static bool
+gate_policy_valid(const struct thunk_gate_policy *policy, size_t size)
+{
+        const unsigned int fixed = THUNK_GATE_POLICY_FIXED_BOUNDS |
+            THUNK_GATE_POLICY_FIXED_PERMS;
+
+        /* Token-derived bounds or permissions need a checked token */
+        if ((policy->flags & THUNK_GATE_POLICY_CHECK_SPACE) == 0 &&
+            (policy->flags & fixed) != fixed)
+                return (false);
+        if ((policy->flags & THUNK_GATE_POLICY_READ_ONLY) &&
+            (policy->flags & THUNK_GATE_POLICY_WRITE_ONLY))
+                return (false);
+        if (policy->flags & THUNK_GATE_POLICY_FIXED_BOUNDS) {
+                if (policy->length == 0 || policy->offset > size ||
+                    policy->length > size - policy->offset)
+                        return (false);
+                if (cheri_representable_length(policy->length) !=
+                    policy->length)
+                        return (false);
+        }
+
+        return (true);
+}
+
+/**
+ * Create a gate class, optionally with a template generated
+ * for the given access policy.
+ */
+static thunk_gate_class_t
+gateclass_create(size_t size, unsigned int flags,
+    const struct thunk_gate_policy *policy)
+{
+        struct thunk_metaclass *mc = thunk_gate_meta;
+        size_t data_size = size;
+        size_t space_size;
+        ptraddr_t offset;
+        unsigned int class_flags = 0;
         struct thunk_gate_class *gate_class;
         struct thunk_class *tclass;
+        thunk_gate_class_t gc;
+
+        pthread_once(&gate_sealcap_once, gate_sealcap_init);
+        if (gate_sealcap == NULL)
+                return (THUNK_NULL_GATECLASS);
 
-        data_offset = cheri_align_up(thunk_code_size(thunk_gate_meta),
-            data_align);
+        /*
+         * Instrumented gates keep the stats block at the end of the
+         * data area. The stats are also mapped in the token space, but
+         * out of the root token bounds, so that only the runtime can
+         * reach them.
+         */
+        if (flags & THUNK_GATE_INSTRUMENT) {
+                mc = thunk_gate_instr_meta;
+                data_size = cheri_align_up(size, sizeof(uint64_t)) +
+                    sizeof(struct thunk_gate_stats);
+        }
+        /*
+         * Gates with generations keep the generation word at the end of
+         * the data area, it is not mapped in the token space.
+         * XXX-AM: Could support the instrumented template as well.
+         */
+        if (flags & THUNK_GATE_GENERATION) {
+                if (flags & THUNK_GATE_INSTRUMENT)
+                        return (THUNK_NULL_GATECLASS);
+                mc = thunk_gate_gen_meta;
+                data_size = cheri_align_up(size, sizeof(uint64_t)) +
+                    sizeof(uint64_t);
+        }
+        /*
+         * Shared code gates keep the object data apart from the code,
+         * the class has a single gate object holding the code.
+         */
+        if (flags & THUNK_GATE_SHARED_CODE) {
+                if ((flags & ~(THUNK_GATE_SHARED_CODE |
+                    THUNK_GATE_SUPERPAGE | THUNK_GATE_ALIGN_CODE)) != 0 ||
+                    policy != NULL)
+                        return (THUNK_NULL_GATECLASS);
+                mc = thunk_gate_pair_meta;
+        }
+        /*
+         * Replicated gates keep the replicas back to back in the data
+         * area, the token space only maps a single replica.
+         */
+        if (flags & THUNK_GATE_REPLICATED) {
+                if (flags & (THUNK_GATE_INSTRUMENT | THUNK_GATE_GENERATION |
+                    THUNK_GATE_SHARED_CODE) || policy != NULL)
+                        return (THUNK_NULL_GATECLASS);
+                mc = thunk_gate_replica_meta;
+                data_size = ((size_t)1 << gate_replica_shift(size)) *
+                    THUNK_GATE_REPLICAS;
+                class_flags |= THUNK_CLASS_PAD_DATA;
+        }
+        /*
+         * The object bounds of split arena slots also cover neighbouring
+         * slots, the split gate checks the token range against the data
+         * size instead. The other templates rely on the object bounds.
+         */
+        if (gate_arena_flags(flags) & THUNK_ARENA_SPLIT) {
+                if (mc != thunk_gate_meta || policy != NULL)
+                        return (THUNK_NULL_GATECLASS);
+                mc = thunk_gate_split_meta;
+        }
+        /* Policy gates replace the gate template altogether */
+        if (policy != NULL) {
+                if (flags & (THUNK_GATE_INSTRUMENT | THUNK_GATE_GENERATION))
+                        return (THUNK_NULL_GATECLASS);
+                if (!gate_policy_valid(policy, size))
+                        return (THUNK_NULL_GATECLASS);
+                mc = thunk_arch_gate_policy_emit(policy, size);
+                if (mc == NULL)
+                        return (THUNK_NULL_GATECLASS);
+        }
+        if (flags & THUNK_GATE_ALIGN_CODE)
+                class_flags |= THUNK_CLASS_ALIGN_CODE;
+        if (flags & THUNK_GATE_PAD_DATA)
+                class_flags |= THUNK_CLASS_PAD_DATA;
+        if (flags & THUNK_GATE_LAZY)
+                class_flags |= THUNK_CLASS_LAZY;
 
         // XXX really local?
         gate_class = thunk_level_malloc(sizeof(*gate_class) +
-            thunk_gate_meta->relocs_count * sizeof(thunk_reloc_data_t),
+            mc->relocs_count * sizeof(thunk_reloc_data_t),
             THUNK_LEVEL_PRIVATE);
         if (gate_class == NULL)
-                return (THUNK_NULL_GATECLASS);
+                goto fail_mc;
 
         gate_class->requested_size = size;
-        gate_class->token_space = token_space_alloc(size);
-        if (gate_class->token_space == NULL) {
-                thunk_level_free(gate_class);
-                return (THUNK_NULL_GATECLASS);
+        gate_class->flags = flags;
+        gate_class->policy_mc = (policy != NULL) ? mc : NULL;
+        gate_class->destroyed = false;
+        gate_class->memo_epoch = 1;
+        gate_class->elem_size = 0;
+        gate_class->nelems = 0;
+        gate_class->handle_index = 0;
+        gate_class->nlengths = 0;
+        gate_class->stats_offset = data_size - sizeof(struct thunk_gate_stats);
+        gate_class->hist_shift = gate_stats_hist_shift(size);
+        gate_class->gen_offset = data_size - sizeof(uint64_t);
+        gate_class->gen_shift = gate_gen_shift(size);
+        gate_class->replica_shift = gate_replica_shift(size);
+        space_size = data_size;
+        if (flags & THUNK_GATE_REPLICATED)
+                space_size = size;
+        if (flags & THUNK_GATE_GENERATION) {
+                assert(gate_class->gen_shift + flsl(THUNK_GATE_GENERATIONS) <
+                    48 && "Generation token space too large");
+                space_size = ((size_t)1 << gate_class->gen_shift) *
+                    THUNK_GATE_GENERATIONS;
         }
+        gate_class->token_space = token_space_alloc(space_size);
+        if (gate_class->token_space == NULL)
+                goto fail_class;
 
         tclass = &gate_class->thunk_class;
-        tclass->mc = thunk_gate_meta;
-        tclass->object_size = cheri_representable_length(data_offset + size);
+        tclass->mc = mc;
+        /* The shared code object data is never used */
+        if (flags & THUNK_GATE_SHARED_CODE)
+                thunk_class_layout(tclass, sizeof(uint64_t), class_flags);
+        else
+                thunk_class_layout(tclass, data_size, class_flags);
         tclass->ctor = NULL;
         tclass->dtor = NULL;
+        tclass->pool = NULL;
+        tclass->image_code = NULL;
+        /* Gate objects are always allocated from a runtime arena */
+        if (thunk_class_use_arena(tclass, gate_arena_flags(flags))) {
+                token_space_free(gate_class->token_space);
+                goto fail_class;
+        }
+
+        if (policy != NULL) {
+                offset = tclass->data_offset;
+                if (policy->flags & THUNK_GATE_POLICY_FIXED_BOUNDS)
+                        offset += policy->offset;
+                thunk_arch_gate_reloc_policy(tclass, gate_class->token_space,
+                    offset);
+        } else if (flags & THUNK_GATE_SHARED_CODE) {
+                thunk_arch_gate_reloc_pair(tclass, gate_class->token_space);
+        } else {
+                thunk_arch_gate_reloc_data_offset(tclass, tclass->data_offset);
+                thunk_arch_gate_reloc_token_space(tclass,
+                    gate_class->token_space);
+        }
+        if (mc == thunk_gate_split_meta)
+                thunk_arch_gate_reloc_data_size(tclass, data_size);
+        if (flags & THUNK_GATE_INSTRUMENT) {
+                thunk_arch_gate_reloc_stats(tclass,
+                    tclass->data_offset + gate_class->stats_offset,
+                    gate_class->hist_shift);
+        }
+        if (flags & THUNK_GATE_GENERATION) {
+                thunk_arch_gate_reloc_generation(tclass,
+                    tclass->data_offset + gate_class->gen_offset,
+                    gate_class->gen_shift, gate_class->requested_size);
+        }
+        if (flags & THUNK_GATE_REPLICATED) {
+                thunk_arch_gate_reloc_replica(tclass,
+                    gate_class->replica_shift);
+        }
 
-        thunk_arch_gate_reloc_data_offset(tclass, data_offset);
-        thunk_arch_gate_reloc_token_space(tclass, gate_class->token_space);
+        if ((flags & THUNK_GATE_SHARED_CODE) &&
+            gate_pair_class_init(gate_class)) {
+                token_space_free(gate_class->token_space);
+                goto fail_class;
+        }
+        gc = gateclass_seal(gate_class);
+        thunk_trace_record(THUNK_TRACE_GATECLASS_CREATE, gate_class,
+            cheri_base_get(gate_class->token_space), size, flags);
 
-        pthread_mutex_lock(&gate_head_mutex);
+        thunk_mutex_lock(&gate_head_mutex);
         TAILQ_INSERT_HEAD(&gate_head, gate_class, gate_list);
-        pthread_mutex_unlock(&gate_head_mutex);
+        /* Classes past the index space can not encode token handles */
+        if (gate_handle_index_next < TOKEN_HANDLE_CLASSES)
+                gate_class->handle_index = gate_handle_index_next++;
+        thunk_mutex_unlock(&gate_head_mutex);
+
+        return (gc);
 
-        // XXX we can wrap the gate class into another gate thunk
-        // which can be unsealed using a special token we keep for ourselves.
-        return ((thunk_gate_class_t){ .class = gate_class });
+fail_class:
+        thunk_level_free(gate_class);
+fail_mc:
+        if (policy != NULL)
+                thunk_arch_gate_policy_free(mc);
+        return (THUNK_NULL_GATECLASS);
+}
+
+thunk_gate_class_t
+thunk_gateclass_create_flags(size_t size, unsigned int flags)
+{
+        return (gateclass_create(size, flags, NULL));
+}
+
+thunk_gate_class_t
+thunk_gateclass_create_policy(size_t size,
+    const struct thunk_gate_policy *policy, unsigned int flags)
+{
+        return (gateclass_create(size, flags, policy));
+}
+
+size_t
+thunk_gateclass_code_size(thunk_gate_class_t gc)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+
+        if (gate_class == NULL || gate_class->destroyed)
+                return (0);
+        return (thunk_code_size(gate_class->thunk_class.mc));
+}
+
+thunk_gate_class_t
+thunk_gatearray_create(size_t elem_size, size_t nelems, unsigned int flags)
+{
+        thunk_gate_class_t gc;
+        struct thunk_gate_class *gate_class;
+        size_t size;
+
+        if (elem_size == 0 || nelems == 0 ||
+            nelems > SIZE_MAX / elem_size)
+                return (THUNK_NULL_GATECLASS);
+
+        /*
+         * The root token must have representable bounds, large arrays
+         * get some tail padding past the last element.
+         */
+        size = cheri_representable_length(elem_size * nelems);
+        gc = thunk_gateclass_create_flags(size, flags);
+        if (gc.class == NULL)
+                return (gc);
+
+        gate_class = gateclass_unseal(gc);
+        gate_class->elem_size = elem_size;
+        gate_class->nelems = nelems;
+
+        return (gc);
+}
+
+thunk_token_t
+thunk_gatearray_token(thunk_gate_class_t gc, size_t index)
+{
+        const struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        thunk_token_t token;
+
+        if (gate_class == NULL)
+                return (NULL);
+        if (gate_class->elem_size == 0 || index >= gate_class->nelems)
+                return (NULL);
+
+        token = thunk_gateclass_token(gc);
+        token = cheri_offset_set(token, index * gate_class->elem_size);
+        return (cheri_bounds_set_exact(token, gate_class->elem_size));
 }
 
 void
 thunk_gateclass_destroy(thunk_gate_class_t gc)
 {
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        struct thunk_pool_config drain = { 0, 0, false };
 
+        /*
+         * XXX-AM: The class is not released yet, outstanding handles
+         * and objects still refer to it.
+         */
+        if (gate_class == NULL ||
+            __atomic_exchange_n(&gate_class->destroyed, true,
+            __ATOMIC_ACQ_REL))
+                return;
+        gate_memo_invalidate(gate_class);
+        /* Stop the pool refill before the template goes away */
+        if (gate_class->thunk_class.pool != NULL)
+                thunk_class_reserve_config(&gate_class->thunk_class, &drain);
+        /* Lazy objects may still compile from the template */
+        if (gate_class->policy_mc != NULL &&
+            (gate_class->flags & THUNK_GATE_LAZY) == 0)
+                thunk_arch_gate_policy_free(gate_class->policy_mc);
 }
 
 thunk_token_t
 thunk_gateclass_token(thunk_gate_class_t gc)
 {
-        // XXX auth gateclass
-        const struct thunk_gate_class *gate_class = gc.class;
+        const struct thunk_gate_class *gate_class = gateclass_unseal(gc);
         thunk_token_t root_token;
 
+        if (gate_class == NULL)
+                return (NULL);
         root_token = cheri_perms_and(gate_class->token_space,
             THUNK_TOKEN_MAX_PERMS);
         root_token = cheri_bounds_set_exact(root_token,
@@ -166,26 +722,264 @@ thunk_gateclass_token(thunk_gate_class_t gc)
 /**
  * XXX-AM: Note that this is currently boring but we will
  * incrementally do more things.
- * In particular, we need to authorise the malloc and the
- * class pointer needs to be sealed.
  *
  * We may want to deal with initialisation as well.
  */
 thunk_gate_t
 thunk_gate_alloc(thunk_gate_class_t gc)
 {
-        // XXX auth gateclass
-        struct thunk_gate_class *gate_class = gc.class;
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
         thunk_gate_t gate;
 
-        gate.obj = thunk_malloc(&gate_class->thunk_class);
+        if (gate_class == NULL || gate_class->destroyed ||
+            (gate_class->flags & THUNK_GATE_SHARED_CODE))
+                return ((thunk_gate_t){ .obj = THUNK_NULLOBJ });
+        gate.obj = thunk_object_new(&gate_class->thunk_class);
+        thunk_trace_record(THUNK_TRACE_GATE_ALLOC, gate_class,
+            thunk_arch_object_addr(thunk_object_unwrap(gate.obj)),
+            gate_class->requested_size, gate_class->flags);
         return (gate);
 }
 
+/**
+ * Fetch the generation word of a gate object with generations.
+ *
+ * Returns NULL if the gate is not a live object of the class.
+ */
+static uint64_t *
+gate_gen_word(struct thunk_gate_class *gate_class, thunk_gate_t gate)
+{
+        uint8_t *data;
+
+        data = thunk_object_lookup_data(&gate_class->thunk_class, gate.obj);
+        if (data == NULL)
+                return (NULL);
+
+        return ((uint64_t *)(data + gate_class->gen_offset));
+}
+
+thunk_token_t
+thunk_gate_token(thunk_gate_class_t gc, thunk_gate_t gate)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        thunk_token_t token;
+        uint64_t *gen_word;
+        uint64_t gen;
+
+        if (gate_class == NULL)
+                return (NULL);
+        if ((gate_class->flags & THUNK_GATE_GENERATION) == 0)
+                return (thunk_gateclass_token(gc));
+
+        gen_word = gate_gen_word(gate_class, gate);
+        if (gen_word == NULL)
+                return (NULL);
+        gen = __atomic_load_n(gen_word, __ATOMIC_ACQUIRE);
+        token = cheri_perms_and(gate_class->token_space,
+            THUNK_TOKEN_MAX_PERMS);
+        token = cheri_offset_set(token, gen << gate_class->gen_shift);
+        token = cheri_bounds_set_exact(token, gate_class->requested_size);
+
+        return (token);
+}
+
+/**
+ * Check that a token space range is within the object data of one
+ * generation. The token space of generation and instrumented classes
+ * also covers the generation word and the stats block.
+ */
+static bool
+token_range_valid(const struct thunk_gate_class *gate_class, size_t offset,
+    size_t length)
+{
+        if (gate_class->flags & THUNK_GATE_GENERATION) {
+                if ((offset >> gate_class->gen_shift) >=
+                    THUNK_GATE_GENERATIONS)
+                        return (false);
+                offset &= ((size_t)1 << gate_class->gen_shift) - 1;
+        }
+
+        return (offset <= gate_class->requested_size &&
+            length <= gate_class->requested_size - offset);
+}
+
+/**
+ * Find or assign the length class for a token length.
+ *
+ * Returns THUNK_TOKEN_LENGTH_CLASSES if the class ran out of length
+ * classes.
+ */
+static unsigned int
+token_length_class(struct thunk_gate_class *gate_class, size_t length)
+{
+        unsigned int n = __atomic_load_n(&gate_class->nlengths,
+            __ATOMIC_ACQUIRE);
+        unsigned int i;
+
+        for (i = 0; i < n; i++) {
+                if (gate_class->lengths[i] == length)
+                        return (i);
+        }
+
+        thunk_mutex_lock(&gate_lengths_mutex);
+        /* Check the lengths added since the unlocked scan */
+        n = gate_class->nlengths;
+        for (; i < n; i++) {
+                if (gate_class->lengths[i] == length)
+                        break;
+        }
+        if (i == n && n < THUNK_TOKEN_LENGTH_CLASSES) {
+                gate_class->lengths[n] = length;
+                __atomic_store_n(&gate_class->nlengths, n + 1,
+                    __ATOMIC_RELEASE);
+        }
+        thunk_mutex_unlock(&gate_lengths_mutex);
+
+        return (i);
+}
+
+thunk_token_handle_t
+thunk_token_handle(thunk_gate_class_t gc, thunk_token_t tok)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        ptraddr_t base, offset;
+        size_t length, perms;
+        uint64_t perm_bits = 0;
+        unsigned int length_class, i;
+
+        if (gate_class == NULL || gate_class->handle_index == 0 ||
+            !cheri_tag_get(tok))
+                return (THUNK_NULL_TOKEN_HANDLE);
+
+        base = cheri_base_get(gate_class->token_space);
+        offset = cheri_address_get(tok) - base;
+        if (cheri_address_get(tok) < base || offset > TOKEN_HANDLE_OFFSET_MASK)
+                return (THUNK_NULL_TOKEN_HANDLE);
+        if (cheri_is_sealed(tok) ||
+            cheri_base_get(tok) != cheri_address_get(tok) ||
+            !token_range_valid(gate_class, offset, cheri_length_get(tok)))
+                return (THUNK_NULL_TOKEN_HANDLE);
+        length = cheri_length_get(tok);
+        perms = cheri_perms_get(tok);
+        if ((perms & ~THUNK_TOKEN_MAX_PERMS) != 0)
+                return (THUNK_NULL_TOKEN_HANDLE);
+        for (i = 0; i < TOKEN_HANDLE_NPERMS; i++) {
+                if (perms & token_handle_perms[i])
+                        perm_bits |= 1UL << i;
+        }
+        length_class = token_length_class(gate_class, length);
+        if (length_class >= THUNK_TOKEN_LENGTH_CLASSES)
+                return (THUNK_NULL_TOKEN_HANDLE);
+
+        return ((uint64_t)gate_class->handle_index <<
+            TOKEN_HANDLE_CLASS_SHIFT |
+            (uint64_t)length_class << TOKEN_HANDLE_LENGTH_SHIFT |
+            perm_bits << TOKEN_HANDLE_PERMS_SHIFT | offset);
+}
+
+thunk_token_t
+thunk_token_rehydrate(thunk_gate_class_t gc, thunk_token_handle_t handle)
+{
+        const struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        uint64_t perm_bits = (handle >> TOKEN_HANDLE_PERMS_SHIFT) &
+            TOKEN_HANDLE_PERMS_MASK;
+        unsigned int length_class = (handle >> TOKEN_HANDLE_LENGTH_SHIFT) &
+            (THUNK_TOKEN_LENGTH_CLASSES - 1);
+        size_t offset = handle & TOKEN_HANDLE_OFFSET_MASK;
+        size_t perms = 0;
+        thunk_token_t token;
+        unsigned int i;
+
+        if (gate_class == NULL || gate_class->handle_index == 0 ||
+            handle >> TOKEN_HANDLE_CLASS_SHIFT != gate_class->handle_index)
+                return (NULL);
+        if (length_class >= __atomic_load_n(&gate_class->nlengths,
+            __ATOMIC_ACQUIRE))
+                return (NULL);
+        /* Forged handles must not reach past the object data */
+        if (!token_range_valid(gate_class, offset,
+            gate_class->lengths[length_class]))
+                return (NULL);
+
+        for (i = 0; i < TOKEN_HANDLE_NPERMS; i++) {
+                if (perm_bits & (1UL << i))
+                        perms |= token_handle_perms[i];
+        }
+        token = cheri_perms_and(gate_class->token_space, perms);
+        token = cheri_offset_set(token, offset);
+
+        return (cheri_bounds_set_exact(token,
+            gate_class->lengths[length_class]));
+}
+
+int
+thunk_gate_revoke(thunk_gate_class_t gc, thunk_gate_t gate)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        uint64_t *gen_word;
+        uint64_t gen;
+
+        if (gate_class == NULL ||
+            (gate_class->flags & THUNK_GATE_GENERATION) == 0)
+                return (-1);
+
+        gen_word = gate_gen_word(gate_class, gate);
+        if (gen_word == NULL)
+                return (-1);
+        /* Concurrent revocations must each retire a generation */
+        gen = __atomic_load_n(gen_word, __ATOMIC_RELAXED);
+        do {
+                if (gen + 1 >= THUNK_GATE_GENERATIONS)
+                        return (-1);
+        } while (!__atomic_compare_exchange_n(gen_word, &gen, gen + 1,
+            false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        gate_memo_invalidate(gate_class);
+
+        return (0);
+}
+
+int
+thunk_gateclass_reserve(thunk_gate_class_t gc, size_t n)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+
+        if (gate_class == NULL || gate_class->destroyed)
+                return (-1);
+        return (thunk_class_reserve(&gate_class->thunk_class, n));
+}
+
+int
+thunk_gateclass_reserve_config(thunk_gate_class_t gc,
+    const struct thunk_pool_config *config)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+
+        if (gate_class == NULL || gate_class->destroyed)
+                return (-1);
+        return (thunk_class_reserve_config(&gate_class->thunk_class, config));
+}
+
+void
+thunk_gateclass_reserve_trim(thunk_gate_class_t gc, size_t keep)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+
+        if (gate_class == NULL)
+                return;
+        thunk_class_reserve_trim(&gate_class->thunk_class, keep);
+}
+
 void
 thunk_gate_free(thunk_gate_class_t gc, thunk_gate_t gate)
 {
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
 
+        if (gate_class == NULL || thunk_object_unwrap(gate.obj) == NULL)
+                return;
+        thunk_trace_record(THUNK_TRACE_GATE_FREE, gate_class,
+            thunk_arch_object_addr(thunk_object_unwrap(gate.obj)), 0, 0);
+        thunk_object_delete(&gate_class->thunk_class, gate.obj);
+        gate_memo_invalidate(gate_class);
 }
 
 void *
@@ -194,11 +988,215 @@ thunk_gate_invoke(thunk_gate_t gate, thunk_token_t tok)
         thunk_gate_fn_t gate_entry = thunk_gate_unwrap(gate);
 
         assert(gate_entry != NULL && "Invalid thunk gate");
+        thunk_trace_record(THUNK_TRACE_GATE_INVOKE, NULL,
+            thunk_arch_object_addr(gate_entry), cheri_address_get(tok),
+            cheri_length_get(tok));
         return (gate_entry(tok));
 }
 
+/**
+ * Hash a gate and token pair to a memo cache entry.
+ */
+static inline struct gate_memo_entry *
+gate_memo_slot(void *obj, thunk_token_t tok)
+{
+        uint64_t key;
+
+        key = thunk_arch_object_addr(obj) ^
+            ((uint64_t)cheri_address_get(tok) << 17);
+        key *= 0x9e3779b97f4a7c15UL;
+
+        return (&gate_memo[key >> (64 - GATE_MEMO_SHIFT)]);
+}
+
+void *
+thunk_gate_invoke_cached(thunk_gate_class_t gc, thunk_gate_t gate,
+    thunk_token_t tok)
+{
+        struct thunk_gate_class *gate_class;
+        void *obj = thunk_object_unwrap(gate.obj);
+        struct gate_memo_entry *entry;
+        uint64_t epoch;
+        void *result;
+
+        gate_class = gateclass_unseal(gc);
+        if (gate_class == NULL)
+                return (NULL);
+        /*
+         * Hits do not look up the gate, the entry was recorded after
+         * checking the gate against the class.
+         */
+        epoch = __atomic_load_n(&gate_class->memo_epoch, __ATOMIC_ACQUIRE);
+        entry = gate_memo_slot(obj, tok);
+        if (entry->epoch == epoch &&
+            entry->class_addr == cheri_address_get(gate_class) &&
+            cheri_is_equal_exact(entry->gate, obj) &&
+            cheri_is_equal_exact(entry->token, tok))
+                return (entry->result);
+
+        /* The class must own a live gate object */
+        if (thunk_object_lookup_data(&gate_class->thunk_class,
+            gate.obj) == NULL)
+                return (NULL);
+        result = thunk_gate_invoke(gate, tok);
+        /* Rejected tokens are not worth an entry */
+        if (!cheri_tag_get(result))
+                return (result);
+        entry->class_addr = cheri_address_get(gate_class);
+        entry->epoch = epoch;
+        entry->gate = obj;
+        entry->token = tok;
+        entry->result = result;
+
+        return (result);
+}
+
+void
+thunk_gate_memo_flush(void)
+{
+        memset(gate_memo, 0, sizeof(gate_memo));
+}
+
+thunk_gatepair_t
+thunk_gatepair_alloc(thunk_gate_class_t gc)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        void *data;
+
+        if (gate_class == NULL || gate_class->destroyed ||
+            (gate_class->flags & THUNK_GATE_SHARED_CODE) == 0)
+                return (THUNK_NULL_GATEPAIR);
+
+        data = calloc(1, cheri_representable_length(
+            gate_class->requested_size));
+        if (data == NULL)
+                return (THUNK_NULL_GATEPAIR);
+
+        return ((thunk_gatepair_t){
+            .code = gate_class->pair_code,
+            .data = cheri_seal(data, gate_class->pair_sealcap) });
+}
+
+int
+thunk_gatepair_free(thunk_gate_class_t gc, thunk_gatepair_t *pair)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        void *data;
+
+        if (gate_class == NULL ||
+            (gate_class->flags & THUNK_GATE_SHARED_CODE) == 0)
+                return (-1);
+        /* Freed pairs are cleared, their data is untagged */
+        if (!cheri_tag_get(pair->data) || cheri_type_get(pair->data) !=
+            (long)cheri_address_get(gate_class->pair_sealcap))
+                return (-1);
+
+        data = cheri_unseal(pair->data, gate_class->pair_sealcap);
+        *pair = THUNK_NULL_GATEPAIR;
+        memset(data, 0, cheri_representable_length(
+            gate_class->requested_size));
+        free(data);
+
+        return (0);
+}
+
+bool
+thunk_gatepair_auth(thunk_gatepair_t pair)
+{
+        long otype = cheri_type_get(pair.code);
+
+        if (!cheri_tag_get(pair.code) || !cheri_tag_get(pair.data) ||
+            !cheri_is_sealed(pair.code) || cheri_type_get(pair.data) != otype)
+                return (false);
+
+        /* Gate pair otypes follow the gate class otype */
+        return (gate_sealcap != NULL &&
+            otype > (long)cheri_address_get(gate_sealcap) &&
+            otype < (long)__atomic_load_n(&gate_pair_otype_next,
+            __ATOMIC_RELAXED));
+}
+
+void *
+thunk_gatepair_invoke(thunk_gatepair_t pair, thunk_token_t tok)
+{
+        assert(thunk_gatepair_auth(pair) && "Invalid gate pair");
+        return (thunk_arch_gatepair_invoke(tok, pair.code, pair.data));
+}
+
+int
+thunk_gate_stats_read(thunk_gate_class_t gc, thunk_gate_t gate,
+    struct thunk_gate_stats *stats)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        const struct thunk_gate_stats *gate_stats;
+        uint8_t *data;
+        int i;
+
+        if (gate_class == NULL ||
+            (gate_class->flags & THUNK_GATE_INSTRUMENT) == 0)
+                return (-1);
+
+        /*
+         * Read the stats block from the object data, an invocation
+         * through the gate would count itself.
+         */
+        data = thunk_object_lookup_data(&gate_class->thunk_class, gate.obj);
+        if (data == NULL)
+                return (-1);
+        gate_stats = (const struct thunk_gate_stats *)(data +
+            gate_class->stats_offset);
+        stats->invocations = __atomic_load_n(&gate_stats->invocations,
+            __ATOMIC_RELAXED);
+        for (i = 0; i < THUNK_GATE_STATS_BUCKETS; i++) {
+                stats->histogram[i] = __atomic_load_n(
+                    &gate_stats->histogram[i], __ATOMIC_RELAXED);
+        }
+
+        return (0);
+}
+
 bool
 thunk_gate_auth(thunk_gate_t gate)
 {
         return (thunk_gate_unwrap(gate) != NULL);
 }
+
+int
+thunk_gate_reduce(thunk_gate_class_t gc, thunk_gate_t gate,
+    thunk_token_t tok, void (*fn)(void *replica, void *arg), void *arg)
+{
+        struct thunk_gate_class *gate_class = gateclass_unseal(gc);
+        size_t offset, length;
+        uint8_t *data;
+        void *replica;
+        int i;
+
+        if (gate_class == NULL ||
+            (gate_class->flags & THUNK_GATE_REPLICATED) == 0)
+                return (-1);
+        if (!cheri_tag_get(tok))
+                return (-1);
+
+        /* Same checks as the gate, the token must be in the token space */
+        offset = cheri_base_get(tok) - cheri_base_get(gate_class->token_space);
+        length = cheri_length_get(tok);
+        if (cheri_base_get(tok) < cheri_base_get(gate_class->token_space) ||
+            offset >= gate_class->requested_size)
+                return (-1);
+        if (length > gate_class->requested_size - offset)
+                return (-1);
+
+        /* The lookup fails for gates of other classes sharing the arena */
+        data = thunk_object_lookup_data(&gate_class->thunk_class, gate.obj);
+        if (data == NULL)
+                return (-1);
+        for (i = 0; i < THUNK_GATE_REPLICAS; i++) {
+                replica = data + ((size_t)i << gate_class->replica_shift) +
+                    offset;
+                replica = cheri_bounds_set_exact(replica, length);
+                replica = cheri_perms_and(replica, cheri_perms_get(tok));
+                fn(replica, arg);
+        }
+
+        return (0);
+}
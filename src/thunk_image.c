@@ -0,0 +1,440 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Class image files.
+ *
+ * A class image holds fully resolved thunk classes: the object layout,
+ * the relocation values and the pre-compiled object code. The image is
+ * mapped read-only and the classes are loaded by name, this skips the
+ * layout computation and the template compilation at startup.
+ *
+ * Each class record carries a hash of its metaclass template and patch
+ * points, the build ID of the program that wrote it and the requested
+ * data size and layout flags. Classes whose template, program or layout
+ * request changed since the image was written are rejected and must be
+ * built at runtime.
+ *
+ * The pre-compiled code is only position independent for contiguous
+ * objects, objects in split arenas are still compiled on allocation.
+ * Classes whose relocations depend on per-process addresses, such as
+ * the gate token space, must not be saved in an image.
+ *
+ * Layout:
+ *   struct image_header
+ *   struct image_class[nclasses]
+ *   class reloc data and code, referenced by offset from the file start
+ */
+#include <assert.h>
+#include <cheriintrin.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "thunk.h"
+
+#define THUNK_IMAGE_MAGIC "THNKIMG"
+#define THUNK_IMAGE_NAME_MAX 32
+
+struct image_header {
+        char magic[8];
+        uint32_t version;
+        /* Runtime ABI fingerprint */
+        uint32_t reloc_data_size;
+        uint32_t class_size;
+        uint32_t nclasses;
+        uint64_t file_size;
+};
+
+struct image_class {
+        char name[THUNK_IMAGE_NAME_MAX];
+        /* See image_template_hash() */
+        uint64_t template_hash;
+        /* See image_build_id() */
+        uint64_t build_id;
+        /* Requested data size and layout flags */
+        uint64_t data_size;
+        uint64_t object_size;
+        uint64_t data_offset;
+        uint32_t flags;
+        uint32_t relocs_count;
+        uint64_t reloc_data_offset;
+        uint64_t code_offset;
+        uint64_t code_size;
+};
+
+struct thunk_image {
+        /* Read-only file mapping */
+        const char *base;
+        size_t size;
+        const struct image_header *header;
+        const struct image_class *classes;
+};
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325UL
+
+static pthread_once_t image_default_once = PTHREAD_ONCE_INIT;
+static struct thunk_image *image_default;
+static pthread_once_t image_build_id_once = PTHREAD_ONCE_INIT;
+static uint64_t image_build_id_value;
+
+/**
+ * FNV-1a hash step over a byte buffer.
+ */
+static uint64_t
+image_hash(uint64_t hash, const void *buf, size_t size)
+{
+        const uint8_t *p = buf;
+        size_t n;
+
+        for (n = 0; n < size; n++) {
+                hash ^= p[n];
+                hash *= 0x100000001b3UL;
+        }
+
+        return (hash);
+}
+
+/**
+ * FNV-1a hash of the metaclass template and relocation descriptors.
+ */
+static uint64_t
+image_template_hash(const struct thunk_metaclass *mc)
+{
+        uint64_t hash;
+        uint64_t v;
+        unsigned int i;
+
+        hash = image_hash(FNV_OFFSET_BASIS, (const void *)mc->template,
+            thunk_code_size(mc));
+        for (i = 0; i < mc->relocs_count; i++) {
+                v = ((uint64_t)mc->relocs[i].type << 32) |
+                    (mc->relocs[i].addr - (ptraddr_t)mc->template);
+                hash = image_hash(hash, &v, sizeof(v));
+        }
+
+        return (hash);
+}
+
+/**
+ * Hash the GNU build ID note of the object that contains the runtime.
+ */
+static int
+image_build_id_phdr(struct dl_phdr_info *info, size_t size, void *arg)
+{
+        const ptraddr_t self = (ptraddr_t)image_build_id_phdr;
+        const ElfW(Phdr) *phdr;
+        const ElfW(Nhdr) *note;
+        const char *p, *end;
+        bool found = false;
+        int i;
+
+        for (i = 0; i < info->dlpi_phnum; i++) {
+                phdr = &info->dlpi_phdr[i];
+                if (phdr->p_type == PT_LOAD &&
+                    self - (ptraddr_t)info->dlpi_addr >= phdr->p_vaddr &&
+                    self - (ptraddr_t)info->dlpi_addr <
+                    phdr->p_vaddr + phdr->p_memsz)
+                        found = true;
+        }
+        if (!found)
+                return (0);
+
+        for (i = 0; i < info->dlpi_phnum; i++) {
+                phdr = &info->dlpi_phdr[i];
+                if (phdr->p_type != PT_NOTE)
+                        continue;
+                p = (const char *)(info->dlpi_addr + phdr->p_vaddr);
+                end = p + phdr->p_memsz;
+                while (p + sizeof(*note) <= end) {
+                        note = (const ElfW(Nhdr) *)p;
+                        p += sizeof(*note) + cheri_align_up(note->n_namesz, 4);
+                        if (note->n_type == NT_GNU_BUILD_ID &&
+                            note->n_namesz == sizeof("GNU") &&
+                            p + note->n_descsz <= end) {
+                                *(uint64_t *)arg = image_hash(
+                                    FNV_OFFSET_BASIS, p, note->n_descsz);
+                                return (1);
+                        }
+                        p += cheri_align_up(note->n_descsz, 4);
+                }
+        }
+
+        return (1);
+}
+
+static void
+image_build_id_init(void)
+{
+        const char stamp[] = __DATE__ " " __TIME__;
+
+        /* Without a build ID note, fall back to the runtime build time */
+        image_build_id_value = image_hash(FNV_OFFSET_BASIS, stamp,
+            sizeof(stamp));
+        dl_iterate_phdr(image_build_id_phdr, &image_build_id_value);
+}
+
+/**
+ * Identify the program build, images are only valid for the build that
+ * wrote them as the class layout rules may change without a version bump.
+ */
+static uint64_t
+image_build_id(void)
+{
+        pthread_once(&image_build_id_once, image_build_id_init);
+
+        return (image_build_id_value);
+}
+
+static void
+image_header_init(struct image_header *hdr, uint32_t nclasses,
+    uint64_t file_size)
+{
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, THUNK_IMAGE_MAGIC, sizeof(hdr->magic));
+        hdr->version = THUNK_IMAGE_VERSION;
+        hdr->reloc_data_size = sizeof(thunk_reloc_data_t);
+        hdr->class_size = sizeof(struct image_class);
+        hdr->nclasses = nclasses;
+        hdr->file_size = file_size;
+}
+
+int
+thunk_image_save(const char *path, const char *const *names,
+    struct thunk_class *const *classes, size_t n)
+{
+        struct image_header hdr;
+        struct image_class *records;
+        thunk_jit_t code_buf;
+        size_t offset, code_size;
+        size_t i;
+        char tmp_path[PATH_MAX];
+        FILE *fp;
+        int error = -1;
+        int fd;
+
+        records = calloc(n, sizeof(*records));
+        if (records == NULL)
+                return (-1);
+
+        offset = sizeof(hdr) + n * sizeof(*records);
+        for (i = 0; i < n; i++) {
+                if (strlen(names[i]) >= THUNK_IMAGE_NAME_MAX)
+                        goto out;
+                strcpy(records[i].name, names[i]);
+                records[i].template_hash = image_template_hash(classes[i]->mc);
+                records[i].build_id = image_build_id();
+                records[i].data_size = classes[i]->data_size;
+                records[i].object_size = classes[i]->object_size;
+                records[i].data_offset = classes[i]->data_offset;
+                records[i].flags = classes[i]->flags;
+                records[i].relocs_count = classes[i]->mc->relocs_count;
+                records[i].reloc_data_offset = offset;
+                offset += records[i].relocs_count * sizeof(thunk_reloc_data_t);
+                offset = cheri_align_up(offset, sizeof(uint32_t));
+                records[i].code_offset = offset;
+                records[i].code_size = thunk_code_size(classes[i]->mc);
+                offset += records[i].code_size;
+        }
+        image_header_init(&hdr, n, offset);
+
+        /* Write to a temporary file, readers never see a partial image */
+        snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+        fd = mkstemp(tmp_path);
+        if (fd < 0)
+                goto out;
+        fp = fdopen(fd, "w");
+        if (fp == NULL) {
+                close(fd);
+                unlink(tmp_path);
+                goto out;
+        }
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        fwrite(records, sizeof(*records), n, fp);
+        for (i = 0; i < n; i++) {
+                fseek(fp, records[i].reloc_data_offset, SEEK_SET);
+                fwrite(classes[i]->reloc_data, sizeof(thunk_reloc_data_t),
+                    records[i].relocs_count, fp);
+
+                /* Compile as a contiguous object, see thunk_compile() */
+                code_size = cheri_representable_length(records[i].code_size);
+                code_buf = calloc(1, code_size);
+                if (code_buf == NULL ||
+                    thunk_compile(code_buf, classes[i])) {
+                        free(code_buf);
+                        fclose(fp);
+                        unlink(tmp_path);
+                        goto out;
+                }
+                fseek(fp, records[i].code_offset, SEEK_SET);
+                fwrite(code_buf, records[i].code_size, 1, fp);
+                free(code_buf);
+        }
+        if (ferror(fp) | fclose(fp)) {
+                unlink(tmp_path);
+                goto out;
+        }
+        if (rename(tmp_path, path) != 0) {
+                unlink(tmp_path);
+                goto out;
+        }
+        error = 0;
+out:
+        free(records);
+
+        return (error);
+}
+
+/**
+ * Check the image header and that every class record lies within
+ * the file.
+ */
+static bool
+image_validate(const struct thunk_image *img)
+{
+        const struct image_header *hdr = img->header;
+        const struct image_class *c;
+        uint32_t i;
+
+        if (img->size < sizeof(*hdr))
+                return (false);
+        if (memcmp(hdr->magic, THUNK_IMAGE_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->version != THUNK_IMAGE_VERSION ||
+            hdr->reloc_data_size != sizeof(thunk_reloc_data_t) ||
+            hdr->class_size != sizeof(struct image_class) ||
+            hdr->file_size != img->size)
+                return (false);
+        if (hdr->nclasses > (img->size - sizeof(*hdr)) / sizeof(*c))
+                return (false);
+
+        for (i = 0; i < hdr->nclasses; i++) {
+                c = &img->classes[i];
+                if (memchr(c->name, '\0', sizeof(c->name)) == NULL)
+                        return (false);
+                if (c->reloc_data_offset > img->size ||
+                    c->relocs_count > (img->size - c->reloc_data_offset) /
+                    sizeof(thunk_reloc_data_t))
+                        return (false);
+                if (c->code_offset > img->size ||
+                    c->code_size > img->size - c->code_offset ||
+                    c->code_offset % sizeof(uint32_t) != 0)
+                        return (false);
+        }
+
+        return (true);
+}
+
+struct thunk_image *
+thunk_image_open(const char *path)
+{
+        struct thunk_image *img;
+        struct stat st;
+        void *base;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return (NULL);
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                close(fd);
+                return (NULL);
+        }
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+                return (NULL);
+
+        img = thunk_level_malloc(sizeof(*img), THUNK_LEVEL_PRIVATE);
+        if (img == NULL) {
+                munmap(base, st.st_size);
+                return (NULL);
+        }
+        img->base = base;
+        img->size = st.st_size;
+        img->header = base;
+        img->classes = (const struct image_class *)(img->header + 1);
+        if (!image_validate(img)) {
+                thunk_image_close(img);
+                return (NULL);
+        }
+
+        return (img);
+}
+
+int
+thunk_image_load_class(struct thunk_image *img, const char *name,
+    struct thunk_class *tc, size_t data_size, unsigned int flags)
+{
+        const struct image_class *c = NULL;
+        uint32_t i;
+
+        if (img == NULL)
+                return (-1);
+        for (i = 0; i < img->header->nclasses; i++) {
+                if (strcmp(img->classes[i].name, name) == 0) {
+                        c = &img->classes[i];
+                        break;
+                }
+        }
+        if (c == NULL)
+                return (-1);
+        if (c->relocs_count != tc->mc->relocs_count ||
+            c->code_size != thunk_code_size(tc->mc) ||
+            c->template_hash != image_template_hash(tc->mc) ||
+            c->build_id != image_build_id() ||
+            c->data_size != data_size || c->flags != flags)
+                return (-1);
+
+        tc->data_size = c->data_size;
+        tc->object_size = c->object_size;
+        tc->data_offset = c->data_offset;
+        tc->flags = c->flags;
+        memcpy(tc->reloc_data, img->base + c->reloc_data_offset,
+            c->relocs_count * sizeof(thunk_reloc_data_t));
+        tc->image_code = (thunk_template_t)cheri_bounds_set_exact(
+            img->base + c->code_offset, c->code_size);
+
+        return (0);
+}
+
+void
+thunk_image_close(struct thunk_image *img)
+{
+        if (img == NULL)
+                return;
+        munmap((void *)img->base, img->size);
+        thunk_level_free(img);
+}
+
+static void
+image_default_open(void)
+{
+        const char *path = getenv("THUNK_IMAGE");
+
+        if (path != NULL)
+                image_default = thunk_image_open(path);
+}
+
+struct thunk_image *
+thunk_image_default(void)
+{
+        pthread_once(&image_default_once, image_default_open);
+
+        return (image_default);
+}
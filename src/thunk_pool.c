@@ -0,0 +1,306 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Pools of pre-built thunk objects.
+ *
+ * The pool keeps unsealed object buffers that have already been
+ * allocated, compiled and initialised, so that thunk_malloc() only
+ * needs to pop and seal an object.
+ * The pool buffers never leave the runtime until they are sealed.
+ */
+#include <cheriintrin.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "thunk.h"
+
+struct thunk_pool {
+        pthread_mutex_t lock;
+        /* Wakes up the refill thread */
+        pthread_cond_t refill_cv;
+        pthread_t refill_thread;
+        bool refill_running;
+        bool refill_stop;
+        /* Owner class */
+        struct thunk_class *tc;
+        size_t low_watermark;
+        size_t high_watermark;
+        /* Stack of unsealed object buffers, up to high_watermark */
+        size_t count;
+        void **objects;
+};
+
+/* Serialises pool creation and reconfiguration */
+static pthread_mutex_t pool_create_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct thunk_pool *
+pool_create(struct thunk_class *tc)
+{
+        struct thunk_pool *pool;
+
+        pool = thunk_level_malloc(sizeof(*pool), THUNK_LEVEL_PRIVATE);
+        if (pool == NULL)
+                return (NULL);
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->refill_cv, NULL);
+        pool->refill_running = false;
+        pool->refill_stop = false;
+        pool->tc = tc;
+        pool->low_watermark = 0;
+        pool->high_watermark = 0;
+        pool->count = 0;
+        pool->objects = NULL;
+
+        return (pool);
+}
+
+/**
+ * Resize the object stack to hold up to high objects.
+ * Excess objects are moved to the release array, which must be
+ * freed by the caller without the pool lock held.
+ * On failure the pool is left unchanged and nothing is released.
+ * Must be called with the pool lock held.
+ */
+static int
+pool_resize(struct thunk_pool *pool, size_t high, void ***release,
+    size_t *nrelease)
+{
+        void **objects;
+        size_t i;
+
+        *release = NULL;
+        *nrelease = 0;
+        if (pool->count > high) {
+                *nrelease = pool->count - high;
+                *release = malloc(*nrelease * sizeof(void *));
+                if (*release == NULL)
+                        goto fail;
+                /* Copy them out before the array shrinks */
+                for (i = 0; i < *nrelease; i++)
+                        (*release)[i] = pool->objects[high + i];
+        }
+
+        if (high == 0) {
+                free(pool->objects);
+                objects = NULL;
+        } else {
+                objects = realloc(pool->objects, high * sizeof(void *));
+                if (objects == NULL)
+                        goto fail;
+        }
+        if (pool->count > high)
+                pool->count = high;
+        pool->objects = objects;
+        pool->high_watermark = high;
+
+        return (0);
+
+fail:
+        free(*release);
+        *release = NULL;
+        *nrelease = 0;
+        return (ENOMEM);
+}
+
+static void
+pool_release(struct thunk_pool *pool, void **release, size_t nrelease)
+{
+        size_t i;
+
+        for (i = 0; i < nrelease; i++)
+                thunk_object_destroy(pool->tc, release[i]);
+        free(release);
+}
+
+/**
+ * Build objects until the pool reaches the high watermark.
+ * Objects are built without holding the pool lock, so that
+ * concurrent thunk_malloc() calls can keep popping objects.
+ */
+static int
+pool_fill(struct thunk_pool *pool)
+{
+        void *obj;
+
+        for (;;) {
+                thunk_mutex_lock(&pool->lock);
+                if (pool->count >= pool->high_watermark ||
+                    pool->refill_stop) {
+                        thunk_mutex_unlock(&pool->lock);
+                        break;
+                }
+                thunk_mutex_unlock(&pool->lock);
+
+                obj = thunk_object_build(pool->tc);
+                if (obj == NULL)
+                        return (ENOMEM);
+
+                thunk_mutex_lock(&pool->lock);
+                if (pool->count < pool->high_watermark) {
+                        pool->objects[pool->count++] = obj;
+                        obj = NULL;
+                }
+                thunk_mutex_unlock(&pool->lock);
+                /* Lost a race with a trim or another filler */
+                if (obj != NULL) {
+                        thunk_object_destroy(pool->tc, obj);
+                        break;
+                }
+        }
+
+        return (0);
+}
+
+static void *
+pool_refill_main(void *arg)
+{
+        struct thunk_pool *pool = arg;
+        int error;
+
+        thunk_mutex_lock(&pool->lock);
+        while (!pool->refill_stop) {
+                if (pool->count >= pool->low_watermark) {
+                        pthread_cond_wait(&pool->refill_cv, &pool->lock);
+                        continue;
+                }
+                thunk_mutex_unlock(&pool->lock);
+                error = pool_fill(pool);
+                thunk_mutex_lock(&pool->lock);
+                /* Out of memory, back off until the next pop */
+                if (error != 0 && !pool->refill_stop)
+                        pthread_cond_wait(&pool->refill_cv, &pool->lock);
+        }
+        thunk_mutex_unlock(&pool->lock);
+
+        return (NULL);
+}
+
+static void
+pool_refill_stop(struct thunk_pool *pool)
+{
+        thunk_mutex_lock(&pool->lock);
+        if (!pool->refill_running) {
+                thunk_mutex_unlock(&pool->lock);
+                return;
+        }
+        pool->refill_stop = true;
+        pthread_cond_signal(&pool->refill_cv);
+        thunk_mutex_unlock(&pool->lock);
+
+        pthread_join(pool->refill_thread, NULL);
+
+        thunk_mutex_lock(&pool->lock);
+        pool->refill_running = false;
+        pool->refill_stop = false;
+        thunk_mutex_unlock(&pool->lock);
+}
+
+void *
+thunk_pool_pop(struct thunk_pool *pool)
+{
+        void *obj = NULL;
+
+        thunk_mutex_lock(&pool->lock);
+        if (pool->count > 0)
+                obj = pool->objects[--pool->count];
+        if (pool->refill_running && pool->count < pool->low_watermark)
+                pthread_cond_signal(&pool->refill_cv);
+        thunk_mutex_unlock(&pool->lock);
+
+        return (obj);
+}
+
+int
+thunk_class_reserve(struct thunk_class *tc, size_t n)
+{
+        struct thunk_pool_config config = {
+                .low_watermark = 0,
+                .high_watermark = n,
+                .background = false,
+        };
+
+        return (thunk_class_reserve_config(tc, &config));
+}
+
+int
+thunk_class_reserve_config(struct thunk_class *tc,
+    const struct thunk_pool_config *config)
+{
+        struct thunk_pool *pool;
+        void **release;
+        size_t nrelease;
+        int error;
+
+        if (config->low_watermark > config->high_watermark)
+                return (EINVAL);
+
+        thunk_mutex_lock(&pool_create_mutex);
+        if (tc->pool == NULL) {
+                tc->pool = pool_create(tc);
+                if (tc->pool == NULL) {
+                        thunk_mutex_unlock(&pool_create_mutex);
+                        return (ENOMEM);
+                }
+        }
+        pool = tc->pool;
+        if (!config->background)
+                pool_refill_stop(pool);
+
+        thunk_mutex_lock(&pool->lock);
+        error = pool_resize(pool, config->high_watermark, &release,
+            &nrelease);
+        if (error == 0)
+                pool->low_watermark = config->low_watermark;
+        if (error == 0 && config->background && !pool->refill_running &&
+            config->high_watermark > 0) {
+                error = pthread_create(&pool->refill_thread, NULL,
+                    pool_refill_main, pool);
+                pool->refill_running = (error == 0);
+        }
+        thunk_mutex_unlock(&pool->lock);
+        thunk_mutex_unlock(&pool_create_mutex);
+
+        pool_release(pool, release, nrelease);
+        if (error)
+                return (error);
+
+        return (pool_fill(pool));
+}
+
+void
+thunk_class_reserve_trim(struct thunk_class *tc, size_t keep)
+{
+        struct thunk_pool *pool;
+        void **release = NULL;
+        size_t nrelease = 0;
+
+        thunk_mutex_lock(&pool_create_mutex);
+        pool = tc->pool;
+        if (pool == NULL) {
+                thunk_mutex_unlock(&pool_create_mutex);
+                return;
+        }
+        if (keep == 0)
+                pool_refill_stop(pool);
+
+        thunk_mutex_lock(&pool->lock);
+        if (pool->low_watermark > keep)
+                pool->low_watermark = keep;
+        if (pool->high_watermark > keep)
+                pool_resize(pool, keep, &release, &nrelease);
+        thunk_mutex_unlock(&pool->lock);
+        thunk_mutex_unlock(&pool_create_mutex);
+
+        pool_release(pool, release, nrelease);
+}
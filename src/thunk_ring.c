@@ -0,0 +1,261 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+#include <cheriintrin.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "thunk-ring.h"
+
+/*
+ * Number of laps told apart by the slot tokens, a token held for this
+ * many laps matches again.
+ */
+#define RING_LAPS 4
+
+/* Slot owner roles, see ring_slot_token() */
+enum ring_role {
+        RING_PRODUCER = 0,
+        RING_CONSUMER = 1,
+};
+
+/**
+ * Slot state.
+ *
+ * The sequence number follows the position of the slot in the ring:
+ * a slot at position pos is free for the producer of pos when
+ * seq == pos, and published for the consumer of pos when seq == pos + 1.
+ */
+struct ring_slot {
+        uint64_t seq;
+        /* Tokens for the slot by lap and role, see ring_slot_token() */
+        thunk_token_t tokens[RING_LAPS * 2];
+};
+
+/**
+ * Ring buffer private data.
+ *
+ * The head and tail positions are kept on separate cache lines, they
+ * are written by consumers and producers respectively.
+ */
+struct thunk_ring {
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        /* Root token of the slot array */
+        thunk_token_t root;
+        size_t slot_size;
+        /* Number of slots - 1 */
+        uint64_t mask;
+        struct ring_slot *slots;
+        char pad0[THUNK_CACHE_LINE_SIZE];
+        /* Next position to produce */
+        uint64_t tail;
+        char pad1[THUNK_CACHE_LINE_SIZE];
+        /* Next position to consume */
+        uint64_t head;
+        char pad2[THUNK_CACHE_LINE_SIZE];
+};
+
+struct thunk_ring *
+thunk_ring_create(size_t slot_size, size_t nslots, unsigned int flags)
+{
+        struct thunk_ring *ring;
+        thunk_token_t token;
+        size_t i, j;
+
+        /* Each lap and role needs a distinct token offset in the slot */
+        if (slot_size < RING_LAPS * 2 || nslots == 0 ||
+            (nslots & (nslots - 1)) != 0)
+                return (NULL);
+
+        ring = thunk_level_malloc(sizeof(*ring), THUNK_LEVEL_PRIVATE);
+        if (ring == NULL)
+                return (NULL);
+        ring->slots = thunk_level_malloc(nslots * sizeof(*ring->slots),
+            THUNK_LEVEL_PRIVATE);
+        if (ring->slots == NULL)
+                goto fail_ring;
+        ring->gc = thunk_gatearray_create(slot_size, nslots, flags);
+        if (ring->gc.class == NULL)
+                goto fail_slots;
+        ring->gate = thunk_gate_alloc(ring->gc);
+        if (thunk_object_unwrap(ring->gate.obj) == NULL)
+                goto fail_class;
+
+        ring->root = thunk_gateclass_token(ring->gc);
+        ring->slot_size = slot_size;
+        ring->mask = nslots - 1;
+        ring->tail = 0;
+        ring->head = 0;
+        for (i = 0; i < nslots; i++) {
+                ring->slots[i].seq = i;
+                token = thunk_gatearray_token(ring->gc, i);
+                if (!cheri_tag_get(token))
+                        goto fail_gate;
+                for (j = 0; j < RING_LAPS * 2; j++)
+                        ring->slots[i].tokens[j] = cheri_offset_set(token, j);
+        }
+
+        return (ring);
+
+fail_gate:
+        thunk_gate_free(ring->gc, ring->gate);
+fail_class:
+        thunk_gateclass_destroy(ring->gc);
+fail_slots:
+        thunk_level_free(ring->slots);
+fail_ring:
+        thunk_level_free(ring);
+        return (NULL);
+}
+
+void
+thunk_ring_destroy(struct thunk_ring *ring)
+{
+        if (ring == NULL)
+                return;
+        thunk_gate_free(ring->gc, ring->gate);
+        thunk_gateclass_destroy(ring->gc);
+        thunk_level_free(ring->slots);
+        thunk_level_free(ring);
+}
+
+thunk_gate_t
+thunk_ring_gate(const struct thunk_ring *ring)
+{
+        return (ring->gate);
+}
+
+/**
+ * Token handed out to the owner of the slot at position pos.
+ *
+ * Gates derive the data from the token bounds, the token address is
+ * free to tell the lap and owner role apart, modulo RING_LAPS. Tokens
+ * of earlier laps or of the other role do not match.
+ */
+static inline thunk_token_t
+ring_slot_token(const struct thunk_ring *ring, const struct ring_slot *slot,
+    uint64_t pos, enum ring_role role)
+{
+        uint64_t lap = pos / (ring->mask + 1) % RING_LAPS;
+
+        return (slot->tokens[lap * 2 + role]);
+}
+
+/**
+ * Find the slot state for a slot token.
+ *
+ * Only the exact tokens handed out by the ring for the current lap
+ * are accepted, pos is the slot position at the token lap.
+ */
+static struct ring_slot *
+ring_slot_lookup(struct thunk_ring *ring, thunk_token_t token,
+    enum ring_role role, uint64_t *pos)
+{
+        struct ring_slot *slot;
+        uint64_t index;
+
+        if (!cheri_tag_get(token))
+                return (NULL);
+        index = (cheri_address_get(token) - cheri_address_get(ring->root)) /
+            ring->slot_size;
+        if (index > ring->mask)
+                return (NULL);
+        slot = &ring->slots[index];
+        *pos = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - role;
+        if ((*pos & ring->mask) != index ||
+            !cheri_is_equal_exact(ring_slot_token(ring, slot, *pos, role),
+            token))
+                return (NULL);
+
+        return (slot);
+}
+
+/**
+ * Claim the slot at the position *pos when its sequence number reaches
+ * the position plus the role, producers claim free slots and consumers
+ * published slots.
+ */
+static thunk_token_t
+ring_claim(struct thunk_ring *ring, uint64_t *pos, enum ring_role role)
+{
+        struct ring_slot *slot;
+        uint64_t cur, seq;
+
+        cur = __atomic_load_n(pos, __ATOMIC_RELAXED);
+        for (;;) {
+                slot = &ring->slots[cur & ring->mask];
+                seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+                if (seq == cur + role) {
+                        if (__atomic_compare_exchange_n(pos, &cur, cur + 1,
+                            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                                return (ring_slot_token(ring, slot, cur,
+                                    role));
+                        /* cur was reloaded by the failed exchange */
+                } else if ((int64_t)(seq - (cur + role)) < 0) {
+                        /* The slot has not come around yet */
+                        return (NULL);
+                } else {
+                        cur = __atomic_load_n(pos, __ATOMIC_RELAXED);
+                }
+        }
+}
+
+thunk_token_t
+thunk_ring_produce(struct thunk_ring *ring)
+{
+        return (ring_claim(ring, &ring->tail, RING_PRODUCER));
+}
+
+thunk_token_t
+thunk_ring_consume(struct thunk_ring *ring)
+{
+        return (ring_claim(ring, &ring->head, RING_CONSUMER));
+}
+
+/**
+ * Hand the slot of a token over to the next role.
+ *
+ * The slot must have been claimed by the token owner, its position is
+ * behind the claim position of the role. Publishing and releasing
+ * advance the sequence number past the owner position, only one of
+ * concurrent hand-offs with the same token succeeds.
+ */
+static int
+ring_handoff(struct thunk_ring *ring, thunk_token_t token,
+    enum ring_role role, uint64_t *claim, uint64_t next)
+{
+        struct ring_slot *slot;
+        uint64_t pos, seq;
+
+        slot = ring_slot_lookup(ring, token, role, &pos);
+        if (slot == NULL ||
+            (int64_t)(__atomic_load_n(claim, __ATOMIC_RELAXED) - pos) <= 0)
+                return (-1);
+        seq = pos + role;
+        if (!__atomic_compare_exchange_n(&slot->seq, &seq, pos + next, false,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                return (-1);
+
+        return (0);
+}
+
+int
+thunk_ring_publish(struct thunk_ring *ring, thunk_token_t token)
+{
+        return (ring_handoff(ring, token, RING_PRODUCER, &ring->tail, 1));
+}
+
+int
+thunk_ring_release(struct thunk_ring *ring, thunk_token_t token)
+{
+        return (ring_handoff(ring, token, RING_CONSUMER, &ring->head,
+            ring->mask + 1));
+}
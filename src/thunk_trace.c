@@ -0,0 +1,160 @@
+/*-
+ * Copyright (c) 2025 Alfredo Mazzinghi
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * This software was developed by SRI International, the University of
+ * Cambridge Computer Laboratory (Department of Computer Science and
+ * Technology), and Capabilities Limited under Defense Advanced Research
+ * Projects Agency (DARPA) Contract No. FA8750-24-C-B047 ("DEC").
+ */
+
+/*
+ * Runtime operation trace recorder, see thunk-trace.h.
+ *
+ * Records are buffered per thread and appended to the trace file when
+ * the buffer fills up, when the thread exits and at process exit.
+ * XXX-AM: Records buffered by threads still running at exit are lost.
+ */
+#include <cheriintrin.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thunk-trace.h"
+
+#define TRACE_BUFFER_RECORDS 4096
+
+struct trace_buffer {
+        uint16_t thread;
+        size_t count;
+        struct thunk_trace_record records[TRACE_BUFFER_RECORDS];
+};
+
+static int trace_fd = -1;
+static uint64_t trace_start_ns;
+static uint16_t trace_next_thread;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+trace_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec);
+}
+
+static void
+trace_flush(struct trace_buffer *buf)
+{
+        size_t size = buf->count * sizeof(buf->records[0]);
+        const char *p = (const char *)buf->records;
+        ssize_t done;
+
+        thunk_mutex_lock(&trace_mutex);
+        while (size > 0) {
+                done = write(trace_fd, p, size);
+                if (done <= 0)
+                        break;
+                p += done;
+                size -= done;
+        }
+        thunk_mutex_unlock(&trace_mutex);
+        buf->count = 0;
+}
+
+static void
+trace_thread_exit(void *arg)
+{
+        struct trace_buffer *buf = arg;
+
+        trace_flush(buf);
+        free(buf);
+}
+
+static void
+trace_exit(void)
+{
+        struct trace_buffer *buf = pthread_getspecific(trace_key);
+
+        if (buf != NULL)
+                trace_flush(buf);
+}
+
+__attribute__((constructor))
+static void
+trace_init(void)
+{
+        struct thunk_trace_header hdr;
+        const char *path = getenv("THUNK_TRACE");
+
+        if (path == NULL)
+                return;
+        if (pthread_key_create(&trace_key, trace_thread_exit) != 0)
+                return;
+        trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+        if (trace_fd < 0)
+                return;
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, THUNK_TRACE_MAGIC, sizeof(hdr.magic));
+        hdr.version = THUNK_TRACE_VERSION;
+        hdr.record_size = sizeof(struct thunk_trace_record);
+        if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+                close(trace_fd);
+                trace_fd = -1;
+                return;
+        }
+        trace_start_ns = trace_now_ns();
+        atexit(trace_exit);
+}
+
+static struct trace_buffer *
+trace_buffer_get(void)
+{
+        struct trace_buffer *buf = pthread_getspecific(trace_key);
+
+        if (buf != NULL)
+                return (buf);
+        buf = malloc(sizeof(*buf));
+        if (buf == NULL)
+                return (NULL);
+        buf->thread = __atomic_fetch_add(&trace_next_thread, 1,
+            __ATOMIC_RELAXED);
+        buf->count = 0;
+        pthread_setspecific(trace_key, buf);
+
+        return (buf);
+}
+
+void
+thunk_trace_record(enum thunk_trace_op op, const void *class_id,
+    ptraddr_t object, uint64_t arg, uint32_t arg2)
+{
+        struct thunk_trace_record *r;
+        struct trace_buffer *buf;
+
+        if (trace_fd < 0)
+                return;
+        buf = trace_buffer_get();
+        if (buf == NULL)
+                return;
+
+        r = &buf->records[buf->count++];
+        r->timestamp = trace_now_ns() - trace_start_ns;
+        r->class_id = cheri_address_get(class_id);
+        r->object = object;
+        r->arg = arg;
+        r->arg2 = arg2;
+        r->thread = buf->thread;
+        r->op = op;
+        r->reserved = 0;
+        if (buf->count == TRACE_BUFFER_RECORDS)
+                trace_flush(buf);
+}
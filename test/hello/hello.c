@@ -16,15 +16,22 @@
 #include "hello.h"
 #include "arch/thunk-patch.h"
 
-#if !defined(__riscv__) && !defined(__aarch64__)
+#if !defined(__riscv__) && !defined(__aarch64__) && !defined(THUNK_ARCH_HOST)
 #error "Unsupported architecture"
 #endif
 
 #define HELLO_NRELOCS 1
+#define HELLO_VIEWS_NRELOCS 2
+#define HELLO_VIEWS_NENTRIES 2
 
 THUNK_DECL_TEMPLATE(hello_thunk);
 THUNK_DECL_PATCH_POINT(hello_thunk, data_offset);
 
+THUNK_DECL_TEMPLATE(hello_views_thunk);
+THUNK_DECL_PATCH_POINT(hello_views_thunk, ro_data_offset);
+THUNK_DECL_PATCH_POINT(hello_views_thunk, rw_entry);
+THUNK_DECL_PATCH_POINT(hello_views_thunk, rw_data_offset);
+
 /**
  * The Hello Thunk is a demo thunk class that embeds
  * a fixed-size string buffer.
@@ -35,6 +42,14 @@ THUNK_DECL_PATCH_POINT(hello_thunk, data_offset);
 struct thunk_metaclass *hello_meta;
 struct thunk_class *hello_class;
 
+/**
+ * The Hello Views class has two entry points over the same buffer,
+ * a read-only view and a read-write view.
+ */
+struct thunk_metaclass *hello_views_meta;
+struct thunk_class *hello_views_class;
+static ptraddr_t hello_views_entries[HELLO_VIEWS_NENTRIES];
+
 struct hello_data {
         char message[256];
 };
@@ -58,36 +73,79 @@ __attribute__((constructor))
 static void
 hello_init()
 {
-        const size_t data_align = ~cheri_representable_alignment_mask(
-            sizeof(struct hello_data)) + 1;
-        size_t data_offset;
-
         hello_meta = thunk_level_malloc(sizeof(*hello_meta) +
             HELLO_NRELOCS * sizeof(thunk_reloc_t), THUNK_LEVEL_PRIVATE);
         hello_meta->template = THUNK_TEMPLATE(hello_thunk);
         hello_meta->template_end = THUNK_TEMPLATE_END(hello_thunk);
+        hello_meta->entries = NULL;
+        hello_meta->entries_count = 0;
         hello_meta->relocs_count = HELLO_NRELOCS;
         // Init thunk relocation descriptors
-#if defined(__aarch64__)
+#if defined(__aarch64__) || defined(THUNK_ARCH_HOST)
         hello_meta->relocs[0].type = THUNK_REL_ADR;
         hello_meta->relocs[0].addr = THUNK_PP(hello_thunk, data_offset);
 #endif
 
-        data_offset = cheri_align_up(thunk_code_size(hello_meta), data_align);
-
         hello_class = thunk_level_malloc(sizeof(*hello_class) +
             HELLO_NRELOCS * sizeof(thunk_reloc_data_t), THUNK_LEVEL_PRIVATE);
         hello_class->mc = hello_meta;
-        hello_class->object_size = cheri_representable_length(
-            data_offset + sizeof(struct hello_data));
-
         hello_class->ctor = hello_ctor;
         hello_class->dtor = NULL;
+        hello_class->pool = NULL;
+        hello_class->arena = NULL;
+        hello_class->image_code = NULL;
+
+        // Skip layout and compilation if the class is in the image.
+        if (thunk_image_load_class(thunk_image_default(), "hello",
+            hello_class, sizeof(struct hello_data), 0) == 0)
+                return;
+
+        thunk_class_layout(hello_class, sizeof(struct hello_data), 0);
         // Bind relocations to the actual values for this class.
-#if defined(__aarch64__)
-        hello_class->reloc_data[0].u32 = data_offset;
+#if defined(__aarch64__) || defined(THUNK_ARCH_HOST)
+        hello_class->reloc_data[0].u32 = hello_class->data_offset;
+#endif
+}
+
+__attribute__((constructor))
+static void
+hello_views_init()
+{
+        hello_views_meta = thunk_level_malloc(sizeof(*hello_views_meta) +
+            HELLO_VIEWS_NRELOCS * sizeof(thunk_reloc_t), THUNK_LEVEL_PRIVATE);
+        hello_views_meta->template = THUNK_TEMPLATE(hello_views_thunk);
+        hello_views_meta->template_end =
+            THUNK_TEMPLATE_END(hello_views_thunk);
+        hello_views_entries[0] = (ptraddr_t)THUNK_TEMPLATE(hello_views_thunk);
+        hello_views_entries[1] = THUNK_PP(hello_views_thunk, rw_entry);
+        hello_views_meta->entries = hello_views_entries;
+        hello_views_meta->entries_count = HELLO_VIEWS_NENTRIES;
+        hello_views_meta->relocs_count = HELLO_VIEWS_NRELOCS;
+#if defined(__aarch64__) || defined(THUNK_ARCH_HOST)
+        hello_views_meta->relocs[0].type = THUNK_REL_ADR;
+        hello_views_meta->relocs[0].addr =
+            THUNK_PP(hello_views_thunk, ro_data_offset);
+        hello_views_meta->relocs[1].type = THUNK_REL_ADR;
+        hello_views_meta->relocs[1].addr =
+            THUNK_PP(hello_views_thunk, rw_data_offset);
 #endif
 
+        hello_views_class = thunk_level_malloc(sizeof(*hello_views_class) +
+            HELLO_VIEWS_NRELOCS * sizeof(thunk_reloc_data_t),
+            THUNK_LEVEL_PRIVATE);
+        hello_views_class->mc = hello_views_meta;
+        hello_views_class->ctor = hello_ctor;
+        hello_views_class->dtor = NULL;
+        hello_views_class->pool = NULL;
+        hello_views_class->arena = NULL;
+        hello_views_class->image_code = NULL;
+
+        thunk_class_layout(hello_views_class, sizeof(struct hello_data), 0);
+        // Both views point to the same data.
+#if defined(__aarch64__) || defined(THUNK_ARCH_HOST)
+        hello_views_class->reloc_data[0].u32 = hello_views_class->data_offset;
+        hello_views_class->reloc_data[1].u32 = hello_views_class->data_offset;
+#endif
 }
 
 hello_object_t
@@ -98,8 +156,37 @@ hello_create()
         return ((hello_object_t)hello_obj);
 }
 
+hello_object_t
+hello_create_message(const char *message)
+{
+        thunk_object_t hello_obj = thunk_malloc_size(hello_class,
+            strlen(message) + 1, message);
+
+        return ((hello_object_t)hello_obj);
+}
+
 void
 hello_destroy(hello_object_t obj)
 {
         thunk_free(hello_class, obj._o);
 }
+
+int
+hello_views_create(hello_object_t *ro, hello_rw_object_t *rw)
+{
+        thunk_object_t views[HELLO_VIEWS_NENTRIES];
+
+        if (thunk_malloc_entries(hello_views_class, views,
+            HELLO_VIEWS_NENTRIES))
+                return (-1);
+        ro->_o = views[0];
+        rw->_o = views[1];
+
+        return (0);
+}
+
+void
+hello_views_destroy(hello_object_t ro)
+{
+        thunk_free(hello_views_class, ro._o);
+}
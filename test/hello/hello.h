@@ -19,12 +19,41 @@ typedef union {
         const char* (*_invoke)(void);
 } hello_object_t;
 
+/**
+ * Sealed read-write view of a hello object.
+ */
+typedef union {
+        thunk_object_t _o;
+        char* (*_invoke)(void);
+} hello_rw_object_t;
+
+/* Hello thunk class, exposed to save it in class images */
+extern struct thunk_class *hello_class;
+
 hello_object_t hello_create();
 void hello_destroy(hello_object_t obj);
 
+/**
+ * Create a hello object with the data sized for the given message,
+ * instead of the full message buffer.
+ */
+hello_object_t hello_create_message(const char *message);
+
+/**
+ * Create a hello object with a read-only and a read-write view.
+ * The object is destroyed through the read-only view.
+ */
+int hello_views_create(hello_object_t *ro, hello_rw_object_t *rw);
+void hello_views_destroy(hello_object_t ro);
+
 static inline const char *
 hello_invoke(hello_object_t obj)
 {
         return ((obj._invoke)());
 }
 
+static inline char *
+hello_rw_invoke(hello_rw_object_t obj)
+{
+        return ((obj._invoke)());
+}
@@ -16,6 +16,13 @@
 // BSD specific
 #include <machine/cherireg.h>
 
+/* The alternate form prints the capability metadata on CheriBSD */
+#ifdef THUNK_ARCH_HOST
+#define TEST_PRIcap "%p"
+#else
+#define TEST_PRIcap "%#p"
+#endif
+
 #define assert_true(cond, msg) do {             \
         if (!(cond)) {                          \
                 fprintf(stderr, "%s\n", (msg)); \
@@ -25,7 +32,7 @@
 
 #define assert_cap(cond, cap, msg) do {                                 \
         if (!(cond)) {                                                  \
-                fprintf(stderr, "%s: %#p\n", (msg), (cap));             \
+                fprintf(stderr, "%s: " TEST_PRIcap "\n", (msg), (cap)); \
                 abort();                                                \
         }                                                               \
 } while (0)
@@ -38,14 +45,16 @@
 
 #define assert_cap_len(cap, expect, msg) do {                           \
         if (cheri_length_get((cap)) != expect) {                        \
-                fprintf(stderr, "%s: expected %#lx, %#p\n", msg, expect, cap); \
+                fprintf(stderr, "%s: expected %#lx, " TEST_PRIcap "\n", \
+                    msg, expect, cap);                                  \
                 abort();                                                \
         }                                                               \
 } while (0)
 
 #define assert_cap_exact_perms(cap, expect, msg) do {               \
         if (cheri_perms_get((cap)) != (expect)) {                   \
-                fprintf(stderr, "%s: %#p perms:\n", (msg), (cap));  \
+                fprintf(stderr, "%s: " TEST_PRIcap " perms:\n",     \
+                    (msg), (cap));                                  \
                 test_dump_perms(cap);                               \
                 abort();                                            \
         }                                                           \
@@ -53,7 +62,8 @@
 
 #define assert_cap_perms_clear(cap, perms, msg) do {                    \
         if (cheri_perms_get((cap)) & (perms)) {                         \
-                fprintf(stderr, "%s: %#p has permissions %s:\n",        \
+                fprintf(stderr,                                         \
+                    "%s: " TEST_PRIcap " has permissions %s:\n",        \
                     (msg), (cap), (#perms));                            \
                 test_dump_perms(cap);                                   \
                 abort();                                                \
@@ -62,7 +72,8 @@
 
 #define assert_cap_perms_set(cap, perms, msg) do {                      \
         if ((cheri_perms_get((cap)) & (perms)) != (perms)) {            \
-                fprintf(stderr, "%s: %#p lacks permissions %s:\n",      \
+                fprintf(stderr,                                         \
+                    "%s: " TEST_PRIcap " lacks permissions %s:\n",      \
                     (msg), (cap), (#perms));                            \
                 test_dump_perms(cap);                                   \
                 abort();                                                \
@@ -75,7 +86,7 @@ test_dump_perms(void *cap)
         int perms = cheri_perms_get(cap);
 
         fprintf(stderr, "Found perms:\n");
-#if defined(__aarch64__)
+#if defined(__aarch64__) || defined(THUNK_ARCH_HOST)
         if (perms & CHERI_PERM_GLOBAL)
                 fprintf(stderr, "\tPERM_GLOBAL\n");
         if (perms & CHERI_PERM_EXECUTIVE)
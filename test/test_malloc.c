@@ -22,6 +22,7 @@
 struct block {
         TAILQ_ENTRY(block) blk_link;
         void *blk_root_cap;
+        size_t blk_size;
 };
 
 pthread_mutex_t block_list_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -50,6 +51,7 @@ thunk_xmalloc(size_t size)
                 free(blk);
                 return (NULL);
         }
+        blk->blk_size = size;
         pthread_mutex_lock(&block_list_mutex);
         TAILQ_INSERT_HEAD(&block_list, blk, blk_link);
         pthread_mutex_unlock(&block_list_mutex);
@@ -83,7 +85,7 @@ thunk_xfree(void *ptr)
         TAILQ_REMOVE(&block_list, blk, blk_link);
         pthread_mutex_unlock(&block_list_mutex);
 
-        rv = munmap(blk->blk_root_cap, cheri_length_get(blk->blk_root_cap));
+        rv = munmap(blk->blk_root_cap, blk->blk_size);
         assert(rv == 0 && "Failed to munmap memory");
         free(blk);
 }
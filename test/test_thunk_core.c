@@ -12,19 +12,324 @@
 #include <assert.h>
 #include <cheriintrin.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "hello/hello.h"
 
 #define DATA_PERMS_MASK                                                 \
         (CHERI_PERM_EXECUTE | CHERI_PERM_STORE | CHERI_PERM_STORE_CAP)
 
+/**
+ * Private copy of the hello class, without an arena or pre-compiled
+ * code. Release with free().
+ */
+static struct thunk_class *
+hello_class_copy()
+{
+        const size_t size = sizeof(*hello_class) +
+            hello_class->mc->relocs_count * sizeof(thunk_reloc_data_t);
+        struct thunk_class *tc;
+
+        tc = malloc(size);
+        assert(tc != NULL && "Failed to allocate class");
+        memcpy(tc, hello_class, size);
+        tc->arena = NULL;
+        tc->image_code = NULL;
+
+        return (tc);
+}
+
+/**
+ * Round-trip the hello class through a class image.
+ */
+static void
+check_class_image()
+{
+        const char *names[] = { "hello" };
+        char path[] = "/tmp/test_thunk_image.XXXXXX";
+        struct thunk_metaclass *mc;
+        struct thunk_class *tc;
+        struct thunk_image *img;
+        hello_object_t h;
+        const char *data;
+        FILE *fp;
+        size_t mc_size;
+        int fd;
+
+        fd = mkstemp(path);
+        assert(fd >= 0 && "Failed to create image file");
+        close(fd);
+        assert(thunk_image_save(path, names, &hello_class, 1) == 0 &&
+            "Failed to save class image");
+
+        img = thunk_image_open(path);
+        assert(img != NULL && "Failed to open class image");
+        tc = malloc(sizeof(*tc) + sizeof(thunk_reloc_data_t));
+        memset(tc, 0, sizeof(*tc) + sizeof(thunk_reloc_data_t));
+        tc->mc = hello_class->mc;
+        tc->ctor = hello_class->ctor;
+        assert(thunk_image_load_class(img, "hello", tc,
+            hello_class->data_size, 0) == 0 &&
+            "Failed to load class from image");
+        assert(thunk_image_load_class(img, "missing", tc,
+            hello_class->data_size, 0) != 0 &&
+            "Loaded missing class from image");
+        /* The layout request must match the saved class */
+        assert(thunk_image_load_class(img, "hello", tc,
+            hello_class->data_size + 1, 0) != 0 &&
+            "Loaded class with a different data size");
+        assert(thunk_image_load_class(img, "hello", tc,
+            hello_class->data_size, THUNK_CLASS_ALIGN_CODE) != 0 &&
+            "Loaded class with different layout flags");
+        assert(tc->object_size == hello_class->object_size &&
+            tc->data_offset == hello_class->data_offset &&
+            tc->reloc_data[0].u32 == hello_class->reloc_data[0].u32 &&
+            "Class image layout mismatch");
+        assert(tc->image_code != NULL && "Missing pre-compiled code");
+
+        h = (hello_object_t)thunk_malloc(tc);
+        data = hello_invoke(h);
+        assert(cheri_is_valid(data) && "Invalid image thunk result");
+        assert(strcmp(data, "Hello World!") == 0 && "Invalid image thunk data");
+        thunk_free(tc, h._o);
+
+        /* A different template must not match */
+        mc_size = sizeof(*mc) + sizeof(thunk_reloc_t);
+        mc = malloc(mc_size);
+        memcpy(mc, hello_class->mc, mc_size);
+#ifdef THUNK_ARCH_HOST
+        mc->relocs[0].type = THUNK_REL_IMM;
+#else
+        mc->relocs[0].type = THUNK_REL_MOV_IMM;
+#endif
+        tc->mc = mc;
+        assert(thunk_image_load_class(img, "hello", tc,
+            hello_class->data_size, 0) != 0 &&
+            "Loaded class with a different template");
+        thunk_image_close(img);
+        free(mc);
+        free(tc);
+
+        /* Truncated images are rejected */
+        fp = fopen(path, "r+");
+        assert(fp != NULL && "Failed to reopen class image");
+        assert(ftruncate(fileno(fp), 16) == 0 && "Failed to truncate image");
+        fclose(fp);
+        assert(thunk_image_open(path) == NULL && "Opened truncated image");
+        unlink(path);
+}
+
+/**
+ * Check the read-only and read-write views of a multi-entry object.
+ */
+static void
+check_views()
+{
+        hello_object_t ro;
+        hello_rw_object_t rw;
+        const char *ro_data;
+        char *rw_data;
+
+        assert(hello_views_create(&ro, &rw) == 0 &&
+            "Failed to create hello views");
+        assert(thunk_arch_object_sealed(thunk_object_unwrap(ro._o)) &&
+            thunk_arch_object_sealed(thunk_object_unwrap(rw._o)) &&
+            "Hello views are unsealed");
+        assert(cheri_base_get(thunk_object_unwrap(ro._o)) ==
+            cheri_base_get(thunk_object_unwrap(rw._o)) &&
+            "Hello views are separate objects");
+
+        /* Host views of the same address share their permissions */
+        ro_data = hello_invoke(ro);
+        assert((cheri_perms_get(ro_data) & DATA_PERMS_MASK) == 0 &&
+            "Read-only view enforced wrong permission");
+        rw_data = hello_rw_invoke(rw);
+        assert((cheri_perms_get(rw_data) & CHERI_PERM_STORE) &&
+            (cheri_perms_get(rw_data) & CHERI_PERM_EXECUTE) == 0 &&
+            "Read-write view enforced wrong permission");
+        assert(cheri_address_get(ro_data) == cheri_address_get(rw_data) &&
+            "Hello views do not share the data");
+
+        strcpy(rw_data, "Hello Views!");
+        assert(strcmp(ro_data, "Hello Views!") == 0 &&
+            "Write through the read-write view not visible");
+
+        hello_views_destroy(ro);
+}
+
+/**
+ * Check objects with a per-object data size.
+ */
+static void
+check_sized()
+{
+        const char *messages[] = { "Hi", "Hello Sized World!" };
+        const char *data;
+        hello_object_t h;
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                h = hello_create_message(messages[i]);
+                assert(thunk_arch_object_sealed(thunk_object_unwrap(h)) &&
+                    "Sized thunk is unsealed");
+                assert(cheri_length_get(thunk_object_unwrap(h)) ==
+                    thunk_class_object_size(hello_class,
+                    strlen(messages[i]) + 1) && "Invalid sized object length");
+                assert(cheri_length_get(thunk_object_unwrap(h)) <
+                    hello_class->object_size && "Sized object not smaller");
+
+                data = hello_invoke(h);
+                assert(cheri_length_get(data) < 256 &&
+                    "Sized object data not narrowed");
+                assert((cheri_perms_get(data) & DATA_PERMS_MASK) == 0 &&
+                    "Sized thunk enforced wrong permission");
+                assert(strcmp(data, messages[i]) == 0 &&
+                    "Invalid sized thunk data");
+                hello_destroy(h);
+        }
+}
+
+/**
+ * Check that layout and lazy flags are only accepted for arena classes.
+ */
+static void
+check_layout()
+{
+        struct thunk_class *tc;
+        hello_object_t h;
+
+        tc = hello_class_copy();
+        thunk_class_layout(tc, hello_class->data_size, THUNK_CLASS_LAZY);
+        tc->reloc_data[0].u32 = tc->data_offset;
+        h._o = thunk_malloc(tc);
+        assert(thunk_object_unwrap(h) == NULL &&
+            "Lazy object allocated out of an arena");
+
+        thunk_class_layout(tc, hello_class->data_size,
+            THUNK_CLASS_ALIGN_CODE | THUNK_CLASS_PAD_DATA);
+        tc->reloc_data[0].u32 = tc->data_offset;
+
+        h._o = thunk_malloc(tc);
+        assert(thunk_object_unwrap(h) == NULL &&
+            "Padded object allocated out of an arena");
+        h._o = thunk_malloc_size(tc, 4, "Hi");
+        assert(thunk_object_unwrap(h) == NULL &&
+            "Padded sized object allocated out of an arena");
+
+        assert(thunk_class_use_arena(tc, 0) == 0 &&
+            "Failed to set up the arena");
+        h._o = thunk_malloc(tc);
+        assert(cheri_address_get(thunk_object_unwrap(h)) %
+            THUNK_CACHE_LINE_SIZE == 0 && "Unaligned padded object");
+        assert(strcmp(hello_invoke(h), "Hello World!") == 0 &&
+            "Invalid padded thunk data");
+        thunk_free(tc, h._o);
+        free(tc);
+}
+
+/**
+ * Clone hello objects in plain and split arenas.
+ */
+static void
+check_clone()
+{
+        const unsigned int flags[] = { 0, THUNK_ARENA_SPLIT };
+        struct thunk_class *tc, *other;
+        hello_object_t h, clone;
+        char *data;
+        int i;
+
+        for (i = 0; i < 2; i++) {
+                tc = hello_class_copy();
+                other = hello_class_copy();
+                assert(thunk_class_use_arena(tc, flags[i]) == 0 &&
+                    thunk_class_use_arena(other, flags[i]) == 0 &&
+                    "Failed to set up the arena");
+
+                h._o = thunk_malloc(tc);
+                data = thunk_object_lookup_data(tc, h._o);
+                assert(data != NULL && "Prototype not in the arena");
+                strcpy(data, "Hello Prototype!");
+                clone._o = thunk_clone(tc, h._o);
+                assert(thunk_arch_object_sealed(thunk_object_unwrap(clone)) &&
+                    "Cloned thunk is unsealed");
+
+                assert(hello_invoke(clone) != hello_invoke(h) &&
+                    "Clone shares the prototype data");
+                assert(strcmp(hello_invoke(clone), "Hello Prototype!") == 0 &&
+                    "Invalid cloned thunk data");
+                strcpy(data, "Hello Again!");
+                assert(strcmp(hello_invoke(clone), "Hello Prototype!") == 0 &&
+                    "Clone aliases the prototype");
+                thunk_free(tc, clone._o);
+
+                clone._o = thunk_clone(other, h._o);
+                assert(thunk_object_unwrap(clone) == NULL &&
+                    "Cloned a prototype of another class");
+
+                thunk_free(tc, h._o);
+                clone._o = thunk_clone(tc, h._o);
+                assert(thunk_object_unwrap(clone) == NULL &&
+                    "Cloned a freed prototype");
+                free(other);
+                free(tc);
+        }
+}
+
+/**
+ * Trim an emptied arena and allocate from it again.
+ */
+static void
+check_trim()
+{
+        struct thunk_trim_policy policy = { 0, 0 };
+        struct thunk_class *tc;
+        hello_object_t h[64];
+        size_t resident;
+        int i;
+
+        tc = hello_class_copy();
+        assert(thunk_class_use_arena(tc, 0) == 0 &&
+            "Failed to set up the arena");
+        thunk_trim_policy_set(&policy);
+
+        for (i = 0; i < 64; i++)
+                h[i]._o = thunk_malloc(tc);
+        thunk_trim();
+        resident = thunk_trim_resident();
+        assert(resident > 0 && "Trimmed arena with live objects");
+        for (i = 0; i < 64; i++)
+                thunk_free(tc, h[i]._o);
+        assert(thunk_trim() > 0 && "Failed to trim empty arena");
+        assert(thunk_trim_resident() < resident &&
+            "Trimmed arena still resident");
+
+        h[0]._o = thunk_malloc(tc);
+        assert(strcmp(hello_invoke(h[0]), "Hello World!") == 0 &&
+            "Invalid thunk data after trim");
+        thunk_free(tc, h[0]._o);
+
+        /* A double free must not put the slot on the free list twice */
+        thunk_free(tc, h[0]._o);
+        h[0]._o = thunk_malloc(tc);
+        h[1]._o = thunk_malloc(tc);
+        assert(thunk_arch_object_addr(thunk_object_unwrap(h[0])) !=
+            thunk_arch_object_addr(thunk_object_unwrap(h[1])) &&
+            "Double free handed out the same slot twice");
+        thunk_free(tc, h[1]._o);
+        thunk_free(tc, h[0]._o);
+        free(tc);
+}
+
 int
 main(int argc, char *argv[])
 {
         hello_object_t h = hello_create();
 
-        assert(cheri_is_sealed(thunk_object_unwrap(h)) && "Thunk is unsealed");
+        assert(thunk_arch_object_sealed(thunk_object_unwrap(h)) &&
+            "Thunk is unsealed");
 
         const char *data = hello_invoke(h);
 
@@ -35,5 +340,12 @@ main(int argc, char *argv[])
 
         hello_destroy(h);
 
+        check_class_image();
+        check_views();
+        check_sized();
+        check_layout();
+        check_clone();
+        check_trim();
+
         return (0);
 }
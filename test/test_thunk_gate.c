@@ -11,12 +11,16 @@
 
 #include <assert.h>
 #include <cheriintrin.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <machine/cherireg.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "thunk-gate.h"
+#include "thunk-ring.h"
 #include "test.h"
 
 struct test_data {
@@ -24,14 +28,18 @@ struct test_data {
         long public_value;
 };
 
-#ifdef __aarch64__
+#if defined(__aarch64__) || defined(THUNK_ARCH_HOST)
 #define DEFAULT_PERMS_MASK                                          \
         (CHERI_PERM_LOAD | CHERI_PERM_STORE | CHERI_PERM_LOAD_CAP | \
          CHERI_PERM_STORE_CAP | CHERI_PERM_GLOBAL |                 \
          CHERI_PERM_STORE_LOCAL_CAP | CHERI_PERM_MUTABLE_LOAD)
 #endif
 
-#ifdef THUNK_AUTH_MODE_PERMS
+/* Token space limit check of policy gates: mov, add and two ccmp */
+#define POLICY_LIMIT_CHECK_INSNS 4
+
+/* The host backend does not preload the malloc hooks */
+#if defined(THUNK_AUTH_MODE_PERMS) && !defined(THUNK_ARCH_HOST)
 static void
 check_system_malloc()
 {
@@ -48,6 +56,1038 @@ check_system_malloc()
 }
 #endif
 
+/**
+ * Test the invocation counters of instrumented gates.
+ */
+static void
+check_gate_stats()
+{
+        struct thunk_gate_stats stats;
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        thunk_token_t root_token, public_token;
+        size_t public_bucket;
+        int i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_INSTRUMENT);
+        root_token = thunk_gateclass_token(gc);
+        assert_cap_len(root_token, sizeof(struct test_data),
+            "Invalid instrumented root token length");
+        public_token = thunk_token_for(struct test_data, public_value,
+            root_token);
+
+        gate = thunk_gate_alloc(gc);
+        assert_true(thunk_gate_auth(gate),
+            "Instrumented gate authentication failed");
+        assert_true(thunk_gate_stats_read(gc, gate, &stats) == 0,
+            "Failed to read instrumented gate stats");
+        assert_true(stats.invocations == 0, "Unexpected initial invocations");
+
+        for (i = 0; i < 3; i++) {
+                struct test_data *p = thunk_gate_invoke(gate, root_token);
+                assert_cap_len(p, sizeof(struct test_data),
+                    "Invalid instrumented full object length");
+        }
+        for (i = 0; i < 2; i++) {
+                long *value = thunk_gate_invoke(gate, public_token);
+                assert_cap_len(value, sizeof(long),
+                    "Invalid instrumented public_value ptr length");
+        }
+
+        // The test_data token offsets map 1:1 to histogram buckets
+        public_bucket = offsetof(struct test_data, public_value);
+        assert_true(thunk_gate_stats_read(gc, gate, &stats) == 0,
+            "Failed to read instrumented gate stats");
+        assert_true(stats.invocations == 5, "Invalid invocation count");
+        assert_true(stats.histogram[0] == 3, "Invalid root token bucket");
+        assert_true(stats.histogram[public_bucket] == 2,
+            "Invalid public_value token bucket");
+        assert_true(thunk_gate_stats_read(gc, gate, &stats) == 0 &&
+            stats.invocations == 5 &&
+            stats.histogram[THUNK_GATE_STATS_BUCKETS - 1] == 0,
+            "Stats read was counted");
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+/**
+ * Test gate allocation from a reserved object pool.
+ */
+static void
+check_gate_reserve()
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t gates[8];
+        thunk_token_t root_token;
+        int i;
+
+        gc = thunk_gateclass_create(sizeof(struct test_data));
+        root_token = thunk_gateclass_token(gc);
+        assert_true(thunk_gateclass_reserve(gc, 4) == 0,
+            "Failed to reserve gate objects");
+
+        // Drain the pool and fall through to the normal allocation path
+        for (i = 0; i < 8; i++) {
+                gates[i] = thunk_gate_alloc(gc);
+                assert_true(thunk_gate_auth(gates[i]),
+                    "Reserved gate authentication failed");
+                struct test_data *p = thunk_gate_invoke(gates[i], root_token);
+                assert_cap_len(p, sizeof(struct test_data),
+                    "Invalid reserved gate object length");
+        }
+
+        thunk_gateclass_reserve_trim(gc, 0);
+        for (i = 0; i < 8; i++)
+                thunk_gate_free(gc, gates[i]);
+        thunk_gateclass_destroy(gc);
+}
+
+/**
+ * Test gates allocated with split code and data.
+ */
+static void
+check_gate_split()
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t gates[4];
+        thunk_token_t root_token, public_token, tok;
+        struct test_data *p;
+        ptrdiff_t stride;
+        long *value;
+        int i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_SPLIT);
+        assert_true(gc.class != NULL, "Failed to create split gate class");
+        root_token = thunk_gateclass_token(gc);
+        public_token = thunk_token_for(struct test_data, public_value,
+            root_token);
+
+        for (i = 0; i < 4; i++) {
+                gates[i] = thunk_gate_alloc(gc);
+                assert_true(thunk_gate_auth(gates[i]),
+                    "Split gate authentication failed");
+                p = thunk_gate_invoke(gates[i], root_token);
+                assert_cap_valid(p, "Invalid split full object pointer");
+                assert_cap_len(p, sizeof(struct test_data),
+                    "Invalid split full object length");
+                assert_cap_exact_perms(p, DEFAULT_PERMS_MASK,
+                    "Invalid split full object perms");
+                p->public_value = i;
+        }
+
+        // Each gate must reach its own data
+        for (i = 0; i < 4; i++) {
+                value = thunk_gate_invoke(gates[i], public_token);
+                assert_cap_len(value, sizeof(long),
+                    "Invalid split public_value ptr length");
+                assert_true(*value == i, "Split gates share data");
+        }
+
+        // Tokens out of the token space must not reach neighbouring slots
+        p = thunk_gate_invoke(gates[0], root_token);
+        stride = (char *)thunk_gate_invoke(gates[1], root_token) - (char *)p;
+        tok = cheri_address_set(root_token,
+            cheri_base_get(root_token) - stride);
+        tok = cheri_bounds_set(tok, sizeof(long));
+        value = thunk_gate_invoke(gates[1], tok);
+        assert_true(!cheri_tag_get(value),
+            "Split gate reached the data of another slot");
+
+        for (i = 0; i < 4; i++)
+                thunk_gate_free(gc, gates[i]);
+        thunk_gateclass_destroy(gc);
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_SPLIT | THUNK_GATE_INSTRUMENT);
+        assert_true(gc.class == NULL, "Created instrumented split gate class");
+}
+
+/**
+ * Test gate objects with cache line aligned code and padded data.
+ */
+static void
+check_gate_padding()
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t gates[2];
+        thunk_token_t root_token;
+        struct test_data *p[2];
+        int i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_ALIGN_CODE | THUNK_GATE_PAD_DATA);
+        root_token = thunk_gateclass_token(gc);
+
+        for (i = 0; i < 2; i++) {
+                gates[i] = thunk_gate_alloc(gc);
+                assert_true(thunk_arch_object_addr(
+                    thunk_object_unwrap(gates[i].obj)) %
+                    THUNK_CACHE_LINE_SIZE == 0, "Misaligned gate code");
+                p[i] = thunk_gate_invoke(gates[i], root_token);
+                assert_cap_len(p[i], sizeof(struct test_data),
+                    "Invalid padded full object length");
+                assert_true(cheri_address_get(p[i]) %
+                    THUNK_CACHE_LINE_SIZE == 0, "Misaligned gate data");
+        }
+        assert_true(cheri_address_get(p[0]) / THUNK_CACHE_LINE_SIZE !=
+            cheri_address_get(p[1]) / THUNK_CACHE_LINE_SIZE,
+            "Gate data shares a cache line");
+
+        for (i = 0; i < 2; i++)
+                thunk_gate_free(gc, gates[i]);
+        thunk_gateclass_destroy(gc);
+}
+
+/**
+ * Test gate array element and field tokens.
+ */
+static void
+check_gate_array()
+{
+        const size_t nelems = 8;
+        thunk_gate_class_t gc;
+        thunk_gate_t gate;
+        thunk_token_t root_token, elem_token, field_token;
+        struct test_data *array, *elem;
+        long *value;
+        size_t i;
+
+        gc = thunk_gatearray_create(sizeof(struct test_data), nelems, 0);
+        assert_true(gc.class != NULL, "Failed to create gate array class");
+        root_token = thunk_gateclass_token(gc);
+        assert_cap_len(root_token, nelems * sizeof(struct test_data),
+            "Invalid gate array root token length");
+
+        gate = thunk_gate_alloc(gc);
+        for (i = 0; i < nelems; i++) {
+                elem_token = thunk_token_for_index(struct test_data, i,
+                    root_token);
+                assert_true(cheri_is_equal_exact(elem_token,
+                    thunk_gatearray_token(gc, i)),
+                    "Mismatching gate array element tokens");
+                elem = thunk_gate_invoke(gate, elem_token);
+                assert_cap_len(elem, sizeof(struct test_data),
+                    "Invalid gate array element length");
+
+                field_token = thunk_token_for(struct test_data, public_value,
+                    elem_token);
+                value = thunk_gate_invoke(gate, field_token);
+                assert_cap_len(value, sizeof(long),
+                    "Invalid gate array field length");
+                *value = i;
+        }
+        assert_true(thunk_gatearray_token(gc, nelems) == NULL,
+            "Out of range gate array token");
+
+        array = thunk_gate_invoke(gate, root_token);
+        assert_cap_len(array, nelems * sizeof(struct test_data),
+            "Invalid gate array length");
+        for (i = 0; i < nelems; i++)
+                assert_true(array[i].public_value == i,
+                    "Gate array element token reached the wrong element");
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+/**
+ * Test token revocation through gate object generations.
+ */
+static void
+check_gate_generation()
+{
+        thunk_gate_class_t gc, other_gc;
+        thunk_gate_t gates[2];
+        thunk_token_t old_token, new_token, public_token;
+        struct test_data *p;
+        int i, n;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_GENERATION);
+        assert_true(gc.class != NULL, "Failed to create generation gate class");
+        for (i = 0; i < 2; i++)
+                gates[i] = thunk_gate_alloc(gc);
+
+        old_token = thunk_gate_token(gc, gates[0]);
+        assert_cap_len(old_token, sizeof(struct test_data),
+            "Invalid generation root token length");
+        assert_true(cheri_is_equal_exact(old_token, thunk_gateclass_token(gc)),
+            "Gate objects do not start at the first generation");
+        p = thunk_gate_invoke(gates[0], old_token);
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid generation gate object length");
+        p->public_value = 42;
+
+        assert_true(thunk_gate_revoke(gc, gates[0]) == 0,
+            "Failed to revoke gate tokens");
+        p = thunk_gate_invoke(gates[0], old_token);
+        assert_true(!cheri_tag_get(p), "Revoked token still valid");
+        public_token = thunk_token_for(struct test_data, public_value,
+            old_token);
+        p = thunk_gate_invoke(gates[0], public_token);
+        assert_true(!cheri_tag_get(p), "Revoked field token still valid");
+
+        new_token = thunk_gate_token(gc, gates[0]);
+        p = thunk_gate_invoke(gates[0], new_token);
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid revoked gate object length");
+        assert_true(p->public_value == 42, "Revocation lost the object data");
+        /* Tokens of the current generation can not reach past the data */
+        p = thunk_gate_invoke(gates[0], cheri_bounds_set(new_token,
+            sizeof(struct test_data) + sizeof(uint64_t)));
+        assert_true(!cheri_tag_get(p), "Token past the object data accepted");
+
+        /* Other objects are not affected */
+        p = thunk_gate_invoke(gates[1], old_token);
+        assert_true(cheri_tag_get(p), "Revocation leaked to another object");
+        p = thunk_gate_invoke(gates[1], new_token);
+        assert_true(!cheri_tag_get(p), "Future generation token accepted");
+
+        for (n = 1; thunk_gate_revoke(gc, gates[0]) == 0; n++)
+                ;
+        assert_true(n == THUNK_GATE_GENERATIONS - 1,
+            "Unexpected number of generations");
+
+        /* A class sharing the arena does not own the objects */
+        other_gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_GENERATION);
+        assert_true(thunk_gate_token(other_gc, gates[1]) == NULL,
+            "Fetched a token for a gate of another class");
+        assert_true(thunk_gate_revoke(other_gc, gates[1]) != 0,
+            "Revoked a gate of another class");
+        thunk_gateclass_destroy(other_gc);
+
+        for (i = 0; i < 2; i++)
+                thunk_gate_free(gc, gates[i]);
+        assert_true(thunk_gate_revoke(gc, gates[1]) != 0,
+            "Revoked a freed gate");
+        thunk_gateclass_destroy(gc);
+
+        gc = thunk_gateclass_create(sizeof(struct test_data));
+        gates[0] = thunk_gate_alloc(gc);
+        assert_true(thunk_gate_revoke(gc, gates[0]) != 0,
+            "Revoked tokens without generations");
+        thunk_gate_free(gc, gates[0]);
+}
+
+/**
+ * Test gate classes with templates generated from access policies.
+ */
+static void
+check_gate_policy()
+{
+        struct thunk_gate_policy policy;
+        thunk_gate_class_t gc, other_gc;
+#ifndef THUNK_ARCH_HOST
+        thunk_gate_class_t generic_gc;
+#endif
+        thunk_gate_t gate;
+        thunk_token_t root_token, token;
+        struct test_data *p;
+        long *value;
+
+        policy = (struct thunk_gate_policy){
+                .flags = THUNK_GATE_POLICY_CHECK_SPACE,
+                .perms = THUNK_TOKEN_MAX_PERMS,
+        };
+        gc = thunk_gateclass_create_policy(sizeof(struct test_data), &policy,
+            0);
+        assert_true(gc.class != NULL, "Failed to create policy gate class");
+#ifndef THUNK_ARCH_HOST
+        /*
+         * The generic policy is the gate template with the token space
+         * limit check. Host policy templates carry extra literals.
+         */
+        generic_gc = thunk_gateclass_create(sizeof(struct test_data));
+        assert_true(thunk_gateclass_code_size(gc) ==
+            thunk_gateclass_code_size(generic_gc) +
+            POLICY_LIMIT_CHECK_INSNS * sizeof(uint32_t),
+            "Generic policy does not match the gate template");
+        thunk_gateclass_destroy(generic_gc);
+#endif
+        gate = thunk_gate_alloc(gc);
+        root_token = thunk_gateclass_token(gc);
+        p = thunk_gate_invoke(gate, root_token);
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid policy gate object length");
+        assert_cap_exact_perms(p, DEFAULT_PERMS_MASK,
+            "Invalid policy gate object perms");
+        token = thunk_token_for(struct test_data, public_value, root_token);
+        value = thunk_gate_invoke(gate, token);
+        assert_cap_len(value, sizeof(long), "Invalid policy gate field length");
+
+        /* Tokens beyond the token space limit are rejected */
+        other_gc = thunk_gateclass_create(sizeof(struct test_data));
+        p = thunk_gate_invoke(gate, thunk_gateclass_token(other_gc));
+        assert_true(!cheri_tag_get(p), "Foreign token accepted");
+        thunk_gateclass_destroy(other_gc);
+        thunk_gate_free(gc, gate);
+
+        /* Destroyed classes no longer allocate gates */
+        thunk_gateclass_destroy(gc);
+        gate = thunk_gate_alloc(gc);
+        assert_true(thunk_object_unwrap(gate.obj) == NULL,
+            "Allocated a gate from a destroyed class");
+
+        /* Read-only views */
+        policy.flags |= THUNK_GATE_POLICY_READ_ONLY;
+        gc = thunk_gateclass_create_policy(sizeof(struct test_data), &policy,
+            0);
+        gate = thunk_gate_alloc(gc);
+        p = thunk_gate_invoke(gate, thunk_gateclass_token(gc));
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid read-only gate object length");
+        assert_cap_perms_clear(p, CHERI_PERM_STORE | CHERI_PERM_STORE_CAP,
+            "Read-only gate grants store permissions");
+        assert_cap_perms_set(p, CHERI_PERM_LOAD,
+            "Read-only gate does not grant load permission");
+        thunk_gate_free(gc, gate);
+
+        /* Fixed bounds and permissions, any token in the space is valid */
+        policy = (struct thunk_gate_policy){
+                .flags = THUNK_GATE_POLICY_CHECK_SPACE |
+                    THUNK_GATE_POLICY_FIXED_BOUNDS |
+                    THUNK_GATE_POLICY_FIXED_PERMS,
+                .perms = CHERI_PERM_GLOBAL | CHERI_PERM_LOAD,
+                .offset = offsetof(struct test_data, public_value),
+                .length = sizeof(long),
+        };
+        gc = thunk_gateclass_create_policy(sizeof(struct test_data), &policy,
+            0);
+        assert_true(gc.class != NULL, "Failed to create fixed policy class");
+        gate = thunk_gate_alloc(gc);
+        root_token = thunk_gateclass_token(gc);
+        token = thunk_token_for(struct test_data, private_value, root_token);
+        value = thunk_gate_invoke(gate, token);
+        assert_cap_len(value, sizeof(long), "Invalid fixed bounds length");
+        assert_cap_exact_perms(value, CHERI_PERM_GLOBAL | CHERI_PERM_LOAD,
+            "Invalid fixed permissions");
+        assert_true(cheri_address_get(value) ==
+            cheri_address_get(thunk_gate_invoke(gate, root_token)),
+            "Fixed bounds depend on the token");
+
+        /* Tokens from other token spaces are still rejected */
+        other_gc = thunk_gateclass_create(sizeof(struct test_data));
+        value = thunk_gate_invoke(gate, thunk_gateclass_token(other_gc));
+        assert_true(!cheri_tag_get(value), "Foreign token accepted");
+        thunk_gate_free(gc, gate);
+
+        /* Token-derived bounds need the token space check */
+        policy.flags = THUNK_GATE_POLICY_FIXED_PERMS;
+        gc = thunk_gateclass_create_policy(sizeof(struct test_data), &policy,
+            0);
+        assert_true(gc.class == NULL, "Created unchecked policy class");
+}
+
+/**
+ * Test gate objects with data shared with forked processes.
+ */
+static void
+check_gate_shared()
+{
+        thunk_gate_class_t gc;
+        thunk_gate_t gate, child_gate;
+        thunk_token_t root_token, token;
+        struct test_data *p;
+        long *value;
+        pid_t pid;
+        int status;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_SHARED);
+        assert_true(gc.class != NULL, "Failed to create shared gate class");
+        root_token = thunk_gateclass_token(gc);
+        token = thunk_token_for(struct test_data, public_value, root_token);
+
+        gate = thunk_gate_alloc(gc);
+        p = thunk_gate_invoke(gate, root_token);
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid shared gate object length");
+        p->private_value = 1;
+        p->public_value = 10;
+
+        pid = fork();
+        assert_true(pid >= 0, "Failed to fork");
+        if (pid == 0) {
+                value = thunk_gate_invoke(gate, token);
+                if (*value != 10)
+                        _exit(1);
+                *value = 20;
+                /* Objects allocated in the child are private */
+                child_gate = thunk_gate_alloc(gc);
+                if (cheri_address_get(thunk_object_unwrap(child_gate.obj)) ==
+                    cheri_address_get(thunk_object_unwrap(gate.obj)))
+                        _exit(2);
+                p = thunk_gate_invoke(child_gate, root_token);
+                if (p->public_value != 0)
+                        _exit(3);
+                thunk_gate_free(gc, child_gate);
+                /* Freeing an inherited object leaves the data alone */
+                thunk_gate_free(gc, gate);
+                _exit(0);
+        }
+
+        assert_true(waitpid(pid, &status, 0) == pid,
+            "Failed to wait for the child");
+        assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+            "Shared gate object check failed in the child");
+        value = thunk_gate_invoke(gate, token);
+        assert_true(*value == 20, "Child store not visible in the parent");
+        assert_true(p->private_value == 1, "Shared data scrubbed by the child");
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+#define LAZY_THREADS 4
+
+struct lazy_worker {
+        thunk_gate_t gate;
+        thunk_token_t token;
+        pthread_barrier_t *barrier;
+        struct test_data *result;
+};
+
+static void *
+lazy_worker_main(void *arg)
+{
+        struct lazy_worker *w = arg;
+
+        pthread_barrier_wait(w->barrier);
+        w->result = thunk_gate_invoke(w->gate, w->token);
+
+        return (NULL);
+}
+
+/**
+ * Test gate objects compiled on the first invocation.
+ */
+static void
+check_gate_lazy()
+{
+        struct lazy_worker workers[LAZY_THREADS];
+        pthread_t threads[LAZY_THREADS];
+        pthread_barrier_t barrier;
+        thunk_gate_class_t gc;
+        thunk_gate_t gates[2];
+        thunk_token_t root_token;
+        struct test_data *p;
+        int i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_LAZY);
+        assert_true(gc.class != NULL, "Failed to create lazy gate class");
+        root_token = thunk_gateclass_token(gc);
+        for (i = 0; i < 2; i++) {
+                gates[i] = thunk_gate_alloc(gc);
+                assert_true(thunk_gate_auth(gates[i]),
+                    "Invalid lazy gate object");
+        }
+
+        /* Concurrent first invocations must all see the compiled gate */
+        pthread_barrier_init(&barrier, NULL, LAZY_THREADS);
+        for (i = 0; i < LAZY_THREADS; i++) {
+                workers[i].gate = gates[0];
+                workers[i].token = root_token;
+                workers[i].barrier = &barrier;
+                pthread_create(&threads[i], NULL, lazy_worker_main,
+                    &workers[i]);
+        }
+        for (i = 0; i < LAZY_THREADS; i++) {
+                pthread_join(threads[i], NULL);
+                assert_cap_len(workers[i].result, sizeof(struct test_data),
+                    "Invalid lazy gate object length");
+                assert_true(cheri_is_equal_exact(workers[i].result,
+                    workers[0].result), "Lazy gate results differ");
+        }
+        pthread_barrier_destroy(&barrier);
+
+        p = thunk_gate_invoke(gates[0], root_token);
+        p->public_value = 42;
+        p = thunk_gate_invoke(gates[0], thunk_token_for(struct test_data,
+            public_value, root_token));
+        assert_cap_len(p, sizeof(long), "Invalid lazy gate field length");
+        assert_true(*(long *)p == 42, "Lazy gate lost the object data");
+
+        /* Untouched objects resolve independently */
+        p = thunk_gate_invoke(gates[1], root_token);
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid second lazy gate object length");
+        assert_true(p->public_value == 0, "Lazy gate objects share data");
+
+        for (i = 0; i < 2; i++)
+                thunk_gate_free(gc, gates[i]);
+        thunk_gateclass_destroy(gc);
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_LAZY | THUNK_GATE_SPLIT);
+        assert_true(gc.class == NULL, "Created lazy split gate class");
+}
+
+/**
+ * Test that gate class handles are sealed and forged handles are rejected.
+ */
+static void
+check_gate_class_auth()
+{
+        thunk_gate_class_t gc, forged[3];
+        struct test_data fake;
+        thunk_gate_t gate, forged_gate;
+        int i;
+
+        gc = thunk_gateclass_create(sizeof(struct test_data));
+        assert_true(gc.class != NULL, "Failed to create gate class");
+        assert_true(cheri_is_sealed(gc.class), "Gate class handle unsealed");
+
+        gate = thunk_gate_alloc(gc);
+        forged[0].class = &fake;
+        forged[1].class = cheri_tag_clear(gc.class);
+        /* Sealed, but with the wrong otype */
+        forged[2].class = thunk_object_unwrap(gate.obj);
+        for (i = 0; i < 3; i++) {
+                forged_gate = thunk_gate_alloc(forged[i]);
+                assert_true(thunk_object_unwrap(forged_gate.obj) == NULL,
+                    "Allocated from a forged gate class");
+                assert_true(thunk_gateclass_token(forged[i]) == NULL,
+                    "Got a root token from a forged gate class");
+                assert_true(thunk_gateclass_reserve(forged[i], 1) != 0,
+                    "Reserved objects for a forged gate class");
+        }
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+#ifndef THUNK_ARCH_HOST
+/**
+ * Branch to a sealed gate pair without thunk_arch_gatepair_invoke()
+ * and return c29 as the gate left it.
+ */
+static void *
+gatepair_branch_c29(thunk_gatepair_t pair, thunk_token_t tok)
+{
+        register thunk_token_t c0 __asm__("c0") = tok;
+        register void *c1 __asm__("c1") = pair.code;
+        register void *c2 __asm__("c2") = pair.data;
+        void *c29;
+
+        __asm__ volatile(
+            "stp c29, c30, [csp, #-32]!\n\t"
+            "blrs c29, c1, c2\n\t"
+            "mov %0, c29\n\t"
+            "ldp c29, c30, [csp], #32"
+            : "=&C" (c29), "+C" (c0), "+C" (c1), "+C" (c2)
+            :
+            : "c10", "c11", "c12", "c13", "c14", "c15", "c16", "c17",
+              "memory");
+
+        return (c29);
+}
+#endif
+
+/**
+ * Test shared code gate classes and gate pairs.
+ */
+static void
+check_gate_pair()
+{
+        thunk_gate_class_t gc, other_gc;
+        thunk_gatepair_t pairs[2], other, forged;
+        thunk_token_t root_token;
+        thunk_gate_t gate;
+        struct test_data *p;
+        long *value;
+        int i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_SHARED_CODE);
+        assert_true(gc.class != NULL, "Failed to create shared code class");
+        root_token = thunk_gateclass_token(gc);
+        for (i = 0; i < 2; i++) {
+                pairs[i] = thunk_gatepair_alloc(gc);
+                assert_true(thunk_gatepair_auth(pairs[i]),
+                    "Invalid gate pair");
+        }
+        assert_true(cheri_is_equal_exact(pairs[0].code, pairs[1].code),
+            "Gate pairs do not share the code");
+
+        p = thunk_gatepair_invoke(pairs[0], root_token);
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid gate pair object length");
+        assert_true((cheri_perms_get(p) & CHERI_PERM_EXECUTE) == 0,
+            "Gate pair data is executable");
+        p->public_value = 42;
+        value = thunk_gatepair_invoke(pairs[0], thunk_token_for(
+            struct test_data, public_value, root_token));
+        assert_cap_len(value, sizeof(long), "Invalid gate pair field length");
+        assert_true(*value == 42, "Gate pair lost the object data");
+        p = thunk_gatepair_invoke(pairs[1], root_token);
+        assert_true(p->public_value == 0, "Gate pairs share data");
+#ifndef THUNK_ARCH_HOST
+        assert_true(!cheri_tag_get(gatepair_branch_c29(pairs[0], root_token)),
+            "Gate pair leaked the object data in c29");
+#endif
+
+        /* Pairs of different classes can not be mixed */
+        other_gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_SHARED_CODE);
+        other = thunk_gatepair_alloc(other_gc);
+        forged.code = pairs[0].code;
+        forged.data = other.data;
+        assert_true(!thunk_gatepair_auth(forged), "Mixed gate pair accepted");
+        p = thunk_gatepair_invoke(other, root_token);
+        assert_true(!cheri_tag_get(p), "Foreign token accepted by gate pair");
+        assert_true(thunk_gatepair_free(gc, &other) != 0,
+            "Freed a gate pair through another class");
+        assert_true(thunk_gatepair_free(other_gc, &other) == 0,
+            "Failed to free gate pair");
+        assert_true(other.code == NULL && other.data == NULL,
+            "Freed gate pair not cleared");
+        assert_true(thunk_gatepair_free(other_gc, &other) != 0,
+            "Freed a gate pair twice");
+        thunk_gateclass_destroy(other_gc);
+
+        gate = thunk_gate_alloc(gc);
+        assert_true(thunk_object_unwrap(gate.obj) == NULL,
+            "Allocated a gate object from a shared code class");
+        for (i = 0; i < 2; i++)
+                thunk_gatepair_free(gc, &pairs[i]);
+        thunk_gateclass_destroy(gc);
+        pairs[0] = thunk_gatepair_alloc(gc);
+        assert_true(pairs[0].code == NULL && pairs[0].data == NULL,
+            "Allocated a gate pair from a destroyed class");
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_SHARED_CODE | THUNK_GATE_SPLIT);
+        assert_true(gc.class == NULL, "Created shared code split class");
+}
+
+/**
+ * Test memoised gate invocations and their invalidation.
+ */
+static void
+check_gate_memo()
+{
+        struct thunk_gate_stats stats;
+        thunk_gate_class_t gc, other_gc, stats_gc;
+        thunk_gate_t gate, other, reused, counted;
+        thunk_token_t token;
+        struct test_data *p, *q;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_GENERATION);
+        assert_true(gc.class != NULL, "Failed to create generation gate class");
+        gate = thunk_gate_alloc(gc);
+        token = thunk_gate_token(gc, gate);
+
+        p = thunk_gate_invoke_cached(gc, gate, token);
+        assert_true(cheri_is_equal_exact(p, thunk_gate_invoke(gate, token)),
+            "Memoised result differs from the gate result");
+        q = thunk_gate_invoke_cached(gc, gate, token);
+        assert_true(cheri_is_equal_exact(p, q), "Memoised result changed");
+
+        /* Revocation must not be bypassed by the memo cache */
+        assert_true(thunk_gate_revoke(gc, gate) == 0,
+            "Failed to revoke gate tokens");
+        p = thunk_gate_invoke_cached(gc, gate, token);
+        assert_true(!cheri_tag_get(p), "Memoised revoked token still valid");
+
+        /* Gates of other classes are rejected */
+        other_gc = thunk_gateclass_create(sizeof(struct test_data));
+        other = thunk_gate_alloc(other_gc);
+        p = thunk_gate_invoke_cached(gc, other, token);
+        assert_true(p == NULL, "Memoised a gate of another class");
+
+        token = thunk_gateclass_token(other_gc);
+        p = thunk_gate_invoke_cached(other_gc, other, token);
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid memoised object length");
+        thunk_gate_free(other_gc, other);
+        /* The freed object memory may be handed out again */
+        other = thunk_gate_alloc(other_gc);
+        q = thunk_gate_invoke_cached(other_gc, other, token);
+        assert_true(cheri_is_equal_exact(q, thunk_gate_invoke(other, token)),
+            "Memoised result outlived the gate object");
+
+        /* Also when another class reuses the object memory */
+        thunk_gate_free(other_gc, other);
+        reused = thunk_gate_alloc(gc);
+        p = thunk_gate_invoke_cached(gc, reused, token);
+        assert_true(!cheri_tag_get(p),
+            "Memoised result outlived the gate object class");
+        p = thunk_gate_invoke_cached(other_gc, reused, token);
+        assert_true(p == NULL, "Memoised a freed gate object");
+        thunk_gate_free(gc, reused);
+        other = thunk_gate_alloc(other_gc);
+        thunk_gate_memo_flush();
+
+        /* Frees in another class keep the entries, hits are not counted */
+        stats_gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_INSTRUMENT);
+        counted = thunk_gate_alloc(stats_gc);
+        token = thunk_gateclass_token(stats_gc);
+        p = thunk_gate_invoke_cached(stats_gc, counted, token);
+        reused = thunk_gate_alloc(other_gc);
+        thunk_gate_free(other_gc, reused);
+        q = thunk_gate_invoke_cached(stats_gc, counted, token);
+        assert_true(cheri_is_equal_exact(p, q), "Memoised result changed");
+        assert_true(thunk_gate_stats_read(stats_gc, counted, &stats) == 0 &&
+            stats.invocations == 1,
+            "Memo entries dropped by a free in another class");
+        thunk_gate_free(stats_gc, counted);
+        q = thunk_gate_invoke_cached(stats_gc, counted, token);
+        assert_true(q == NULL, "Memoised a freed gate object");
+        thunk_gateclass_destroy(stats_gc);
+
+        thunk_gate_free(other_gc, other);
+        thunk_gateclass_destroy(other_gc);
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
+/**
+ * Test slot ownership in gate ring buffers.
+ */
+static void
+check_gate_ring()
+{
+        struct thunk_ring *ring;
+        thunk_token_t slots[4], token;
+        struct test_data *p;
+        thunk_gate_t gate;
+        int i;
+
+        ring = thunk_ring_create(sizeof(struct test_data), 4, 0);
+        assert_true(ring != NULL, "Failed to create ring");
+        assert_true(thunk_ring_consume(ring) == NULL, "Consumed empty ring");
+        gate = thunk_ring_gate(ring);
+        for (i = 0; i < 4; i++) {
+                slots[i] = thunk_ring_produce(ring);
+                assert_cap_len(slots[i], sizeof(struct test_data),
+                    "Invalid ring slot token length");
+                p = thunk_gate_invoke(gate, slots[i]);
+                assert_cap_len(p, sizeof(struct test_data),
+                    "Invalid ring slot length");
+                p->public_value = i;
+        }
+        assert_true(thunk_ring_produce(ring) == NULL, "Produced to full ring");
+        assert_true(thunk_ring_consume(ring) == NULL,
+            "Consumed unpublished slot");
+
+        token = cheri_bounds_set(slots[0], sizeof(int));
+        assert_true(thunk_ring_publish(ring, token) != 0,
+            "Published a narrowed slot token");
+        for (i = 0; i < 4; i++)
+                assert_true(thunk_ring_publish(ring, slots[i]) == 0,
+                    "Failed to publish ring slot");
+        assert_true(thunk_ring_publish(ring, slots[0]) != 0,
+            "Published a ring slot twice");
+        assert_true(thunk_ring_release(ring, slots[0]) != 0,
+            "Released a slot with the producer token");
+        for (i = 0; i < 4; i++) {
+                token = thunk_ring_consume(ring);
+                assert_true(cheri_base_get(token) == cheri_base_get(slots[i]),
+                    "Ring slots consumed out of order");
+                assert_true(!cheri_is_equal_exact(token, slots[i]),
+                    "Consumer token matches the producer token");
+                assert_true(thunk_ring_publish(ring, token) != 0,
+                    "Published a slot with the consumer token");
+                p = thunk_gate_invoke(gate, token);
+                assert_true(p->public_value == i, "Ring slot lost its data");
+                assert_true(thunk_ring_release(ring, token) == 0,
+                    "Failed to release ring slot");
+                assert_true(thunk_ring_release(ring, token) != 0,
+                    "Released a ring slot twice");
+        }
+        token = thunk_ring_produce(ring);
+        assert_true(cheri_base_get(token) == cheri_base_get(slots[0]),
+            "Ring did not wrap around");
+        assert_true(!cheri_is_equal_exact(token, slots[0]),
+            "Slot token reused across laps");
+        assert_true(thunk_ring_publish(ring, slots[0]) != 0,
+            "Published a slot with a stale token");
+        assert_true(thunk_ring_publish(ring, token) == 0,
+            "Failed to publish wrapped ring slot");
+        thunk_ring_destroy(ring);
+
+        ring = thunk_ring_create(sizeof(struct test_data), 3, 0);
+        assert_true(ring == NULL, "Created ring with non power of two slots");
+        ring = thunk_ring_create(1, 4, 0);
+        assert_true(ring == NULL, "Created ring with indistinct slot tokens");
+}
+
+static void *
+replica_worker_main(void *arg)
+{
+        struct lazy_worker *w = arg;
+
+        w->result = thunk_gate_invoke(w->gate, w->token);
+        __atomic_fetch_add(&w->result->public_value, 1, __ATOMIC_RELAXED);
+
+        return (NULL);
+}
+
+static void
+replica_sum(void *replica, void *arg)
+{
+        long *value = replica;
+
+        assert_cap_len(value, sizeof(long), "Invalid replica length");
+        *(long *)arg += *value;
+}
+
+/**
+ * Test replicated gate objects and the replica reduction.
+ */
+static void
+check_gate_replica()
+{
+        struct lazy_worker workers[LAZY_THREADS];
+        pthread_t threads[LAZY_THREADS];
+        thunk_gate_class_t gc, other_gc;
+        thunk_token_t root_token, token;
+        thunk_gate_t gate;
+        struct test_data *p;
+        long total = 0;
+        int i;
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_REPLICATED);
+        assert_true(gc.class != NULL, "Failed to create replicated class");
+        gate = thunk_gate_alloc(gc);
+        root_token = thunk_gateclass_token(gc);
+        p = thunk_gate_invoke(gate, root_token);
+        assert_cap_len(p, sizeof(struct test_data),
+            "Invalid replica object length");
+        assert_true(cheri_is_equal_exact(p,
+            thunk_gate_invoke(gate, root_token)),
+            "Replica changed within a thread");
+
+        for (i = 0; i < LAZY_THREADS; i++) {
+                workers[i].gate = gate;
+                workers[i].token = root_token;
+                pthread_create(&threads[i], NULL, replica_worker_main,
+                    &workers[i]);
+        }
+        for (i = 0; i < LAZY_THREADS; i++)
+                pthread_join(threads[i], NULL);
+
+        token = thunk_token_for(struct test_data, public_value, root_token);
+        assert_true(thunk_gate_reduce(gc, gate, token, replica_sum,
+            &total) == 0, "Failed to reduce replicas");
+        assert_true(total == LAZY_THREADS, "Lost replica updates");
+        assert_true(thunk_gate_reduce(gc, gate, cheri_tag_clear(token),
+            replica_sum, &total) != 0, "Reduced with an untagged token");
+
+        other_gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_REPLICATED);
+        assert_true(other_gc.class != NULL,
+            "Failed to create replicated class");
+        assert_true(thunk_gate_reduce(other_gc, gate,
+            thunk_gateclass_token(other_gc), replica_sum, &total) != 0,
+            "Reduced a gate through another class");
+        thunk_gateclass_destroy(other_gc);
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+
+        gc = thunk_gateclass_create(sizeof(struct test_data));
+        gate = thunk_gate_alloc(gc);
+        assert_true(thunk_gate_reduce(gc, gate, thunk_gateclass_token(gc),
+            replica_sum, &total) != 0, "Reduced a non-replicated gate");
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_REPLICATED | THUNK_GATE_GENERATION);
+        assert_true(gc.class == NULL, "Created replicated generation class");
+}
+
+/**
+ * Test the round trip of gate array tokens through token handles.
+ */
+static void
+check_token_handle()
+{
+        const size_t nelems = 8;
+        thunk_gate_class_t gc, other_gc;
+        thunk_gate_t gate;
+        thunk_token_t root_token, elem_token, field_token, token;
+        thunk_token_handle_t handle;
+        long *value;
+        size_t i;
+
+        gc = thunk_gatearray_create(sizeof(struct test_data), nelems, 0);
+        other_gc = thunk_gateclass_create(sizeof(struct test_data));
+        root_token = thunk_gateclass_token(gc);
+        gate = thunk_gate_alloc(gc);
+
+        for (i = 0; i < nelems; i++) {
+                elem_token = thunk_gatearray_token(gc, i);
+                handle = thunk_token_handle(gc, elem_token);
+                assert_true(handle != THUNK_NULL_TOKEN_HANDLE,
+                    "Failed to encode element token handle");
+                assert_true(cheri_is_equal_exact(elem_token,
+                    thunk_token_rehydrate(gc, handle)),
+                    "Mismatching rehydrated element token");
+                assert_true(thunk_token_rehydrate(other_gc, handle) == NULL,
+                    "Rehydrated token handle of another class");
+
+                field_token = cheri_perms_clear(thunk_token_for(
+                    struct test_data, public_value, elem_token),
+                    CHERI_PERM_STORE);
+                handle = thunk_token_handle(gc, field_token);
+                token = thunk_token_rehydrate(gc, handle);
+                assert_true(cheri_is_equal_exact(field_token, token),
+                    "Mismatching rehydrated field token");
+                value = thunk_gate_invoke(gate, token);
+                assert_cap_len(value, sizeof(long),
+                    "Invalid rehydrated field length");
+                assert_cap_perms_clear(value, CHERI_PERM_STORE,
+                    "Rehydrated field token gained STORE permission");
+        }
+        assert_true(thunk_token_handle(other_gc, root_token) ==
+            THUNK_NULL_TOKEN_HANDLE,
+            "Encoded token handle for another class");
+        assert_true(thunk_token_handle(gc,
+            cheri_offset_set(root_token, sizeof(struct test_data))) ==
+            THUNK_NULL_TOKEN_HANDLE,
+            "Encoded token handle with an offset");
+
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(other_gc);
+        thunk_gateclass_destroy(gc);
+
+        /* Forged handles stay within the object data of a generation */
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_INSTRUMENT);
+        handle = thunk_token_handle(gc, thunk_gateclass_token(gc));
+        assert_true(handle != THUNK_NULL_TOKEN_HANDLE,
+            "Failed to encode root token handle");
+        assert_true(thunk_token_rehydrate(gc,
+            handle + sizeof(struct test_data)) == NULL,
+            "Rehydrated a token past the object data");
+        thunk_gateclass_destroy(gc);
+
+        gc = thunk_gateclass_create_flags(sizeof(struct test_data),
+            THUNK_GATE_GENERATION);
+        gate = thunk_gate_alloc(gc);
+        assert_true(thunk_gate_revoke(gc, gate) == 0,
+            "Failed to revoke gate tokens");
+        token = thunk_gate_token(gc, gate);
+        handle = thunk_token_handle(gc, token);
+        assert_true(cheri_is_equal_exact(token,
+            thunk_token_rehydrate(gc, handle)),
+            "Mismatching rehydrated generation token");
+        assert_true(thunk_token_rehydrate(gc,
+            handle + offsetof(struct test_data, public_value)) == NULL,
+            "Rehydrated a token across generations");
+        thunk_gate_free(gc, gate);
+        thunk_gateclass_destroy(gc);
+}
+
 /**
  * Test the basic operation of the thunk gate library.
  */
@@ -55,7 +1095,7 @@ int
 main(int argc, char *argv[])
 {
 
-#ifdef THUNK_AUTH_MODE_PERMS
+#if defined(THUNK_AUTH_MODE_PERMS) && !defined(THUNK_ARCH_HOST)
         check_system_malloc();
 #endif
 
@@ -101,7 +1141,29 @@ main(int argc, char *argv[])
             "Invalid public_value ptr perms");
 
         thunk_gate_free(test_gate_type, test_gate);
+        // Freed gate memory is quarantined rather than handed out again
+        thunk_gate_t next_gate = thunk_gate_alloc(test_gate_type);
+        assert_true(cheri_address_get(thunk_object_unwrap(next_gate.obj)) !=
+            cheri_address_get(thunk_object_unwrap(test_gate.obj)),
+            "Freed gate memory reused right away");
+        thunk_gate_free(test_gate_type, next_gate);
         thunk_gateclass_destroy(test_gate_type);
 
+        check_gate_stats();
+        check_gate_reserve();
+        check_gate_split();
+        check_gate_padding();
+        check_gate_array();
+        check_gate_generation();
+        check_gate_policy();
+        check_gate_shared();
+        check_gate_lazy();
+        check_gate_class_auth();
+        check_gate_pair();
+        check_gate_memo();
+        check_gate_ring();
+        check_gate_replica();
+        check_token_handle();
+
         return (0);
 }